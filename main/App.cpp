@@ -1,39 +1,104 @@
 #include "App.hpp"
 #include "Log.hpp"
 #include "Cloud.hpp"
-#include "Param.hpp"
+#include "Wifi.hpp"
+#include "Mqtt.hpp"
+#include "Params.hpp"
+#include "Mem.hpp"
 #include "Ush.hpp"
 #include "Bosun.hpp"
 #include "Scales.hpp"
+#include "Detector.hpp"
+#include "Sampler.hpp"
+#include "Rollup.hpp"
+#include "Jitter.hpp"
+#include "Bench.hpp"
+#include "Tasks.hpp"
+#include "Telemetry.hpp"
+#include "Web.hpp"
+#include "Co.hpp"
+#include "Ota.hpp"
+#include "Mailbox.hpp"
+#include "Factory.hpp"
+#include "Link.hpp"
+#include "Hive.hpp"
+#include "Clock.hpp"
+#include "Journal.hpp"
+#include "Boot.hpp"
+#include "Indicator.hpp"
+#include "Rsh.hpp"
+#include "Backfill.hpp"
 #include "driver/Gpio.hpp"
+#include "driver/GpioBank.hpp"
 #include "driver/Hx711.hpp"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_system.h"
 #include <cassert>
+#include <cstdio>
+#include <cinttypes>
 
 namespace beegram {
 
-Cloud cloud;
-
 static constexpr Gpio::Pin PIN_RED = 0;
 static constexpr Gpio::Pin PIN_GREEN = 2;
 static constexpr Gpio::Pin PIN_BLUE = 4;
 static constexpr Gpio::Pin PIN_BUTTON = 18;
 static constexpr Gpio::Pin PIN_LOADSENSOR_DOUT = 22;
 static constexpr Gpio::Pin PIN_LOADSENSOR_SCK = 19;
+/// Free pin, interrupts from its own output for benchmarks
+static constexpr Gpio::Pin PIN_BENCH_LOOP = 23;
+
+/// Retry of batches from hive nodes the uplink had no room for
+static constexpr TickType_t HIVE_RETRY = pdMS_TO_TICKS(10 * 1000);
+
+/// Journal records of a crashed boot sent at the next, the rest of the
+/// uplink queue is left for live data
+static constexpr size_t CRASH_RECORDS = 4;
+
+/// @return True if the reset was not asked for
+static bool isCrash(esp_reset_reason_t reason) {
+    switch (reason) {
+        case ESP_RST_PANIC:
+        case ESP_RST_INT_WDT:
+        case ESP_RST_TASK_WDT:
+        case ESP_RST_WDT:
+        case ESP_RST_BROWNOUT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/// Carries out calls to subsystems on their executor
+static Co::Task serveMailbox(Mailbox& mailbox, Co::Flags& wake) {
+    while (true) {
+        co_await wake.wait(1);
+        mailbox.drain();
+    }
+}
+
+/// Hands batches of the hive nodes to the uplink
+static Co::Task forwardHives(Hive::Gateway& gateway, Co::Flags& wake) {
+    while (true) {
+        co_await wake.wait(1, HIVE_RETRY);
+        gateway.forward();
+    }
+}
 
 void App::run() {
-    unsigned int i = 0;
-    auto ledRed = Gpio::create(PIN_RED, Gpio::Way::OUT, Gpio::OutMode::PUSH_PULL, Gpio::Pull::NONE);
-    assert(ledRed);
-    auto ledGreen = Gpio::create(PIN_GREEN, Gpio::Way::OUT, Gpio::OutMode::PUSH_PULL, Gpio::Pull::NONE);
-    assert(ledGreen);
-    auto ledBlue = Gpio::create(PIN_BLUE, Gpio::Way::OUT, Gpio::OutMode::PUSH_PULL, Gpio::Pull::NONE);
-    assert(ledBlue);
+    // Main task runs the acquisition loop
+    Tasks::adopt(Tasks::APP);
+    // Objects created during boot are charged to their subsystem
+    Mem::setSys(Mem::Sys::SYSTEM);
+    // Red, green and blue LED, in the order the indicator takes them
+    auto leds = GpioBank::create({ PIN_RED, PIN_GREEN, PIN_BLUE });
+    assert(leds);
     auto btn = Gpio::create(PIN_BUTTON, Gpio::Way::IN, Gpio::OutMode::PUSH_PULL, Gpio::Pull::UP);
     assert(btn);
-    // auto onEdge = [&]() { ledBlue->toggle(); }; // Not thread safe. No debouncing.
+    // auto onEdge = [&]() { ... }; // Not thread safe. No debouncing.
     // if (!btn->addIsr(onEdge, Gpio::IntrTrig::ANY_EDGE)) {
     //     err("Fail add ISR to button");
     // }
@@ -41,50 +106,285 @@ void App::run() {
     auto param = Param::create("nvs", "params");
     assert(param);
     
-    uint32_t bootCount = param->getU32("bootCount").value_or(0);
+    uint32_t bootCount = param->get(Params::BOOT_COUNT);
     info("Boot count: %lu", bootCount);
-    bool ret = param->setU32("bootCount", bootCount + 1);
+    bool ret = param->set(Params::BOOT_COUNT, bootCount + 1);
     assert(ret);
 
-    auto loadSensor = Hx711::create();
-    assert(loadSensor);
-    if (!loadSensor->init(PIN_LOADSENSOR_DOUT, PIN_LOADSENSOR_SCK, Hx711::Mode::CH_A_GN64)) {
-        err("Fail init load sensor");
-    }
-
+    Mem::setSys(Mem::Sys::SHELL);
     auto bosun = Bosun::create();
     assert(bosun);
     if (!bosun->init()) {
         err("Fail init Bosun");
     }
 
-    auto ush = Ush::create(*bosun);
+    // Objects are created here, they only keep references. Subsystems are
+    // brought up below, in the order of their dependencies.
+    Mem::setSys(Mem::Sys::SYSTEM);
+    auto boot = Boot::create(*bosun);
+    assert(boot);
+    auto indicator = Indicator::create(*leds, *bosun);
+    assert(indicator);
+    auto journal = Journal::create(*bosun, bootCount);
+    assert(journal);
+    // Identity, certificates and calibration are used in place in flash
+    auto factory = Factory::create(*bosun);
+    assert(factory);
+
+    // Commands of acquisition and DSP are carried out by this task
+    auto appBox = Mailbox::create("app", [appTask = xTaskGetCurrentTaskHandle()]() { xTaskNotifyGive(appTask); });
+    assert(appBox);
+
+    Mem::setSys(Mem::Sys::ACQ);
+    auto loadSensor = Hx711::create();
+    assert(loadSensor);
+    auto scales = Scales::create(*param, *bosun, *loadSensor, *factory);
+    assert(scales);
+    auto sampler = Sampler::create(*param, *bosun, *loadSensor, *scales);
+    assert(sampler);
+
+    Mem::setSys(Mem::Sys::SHELL);
+    auto ush = Ush::create(*bosun, *loadSensor);
     assert(ush);
-    if (!ush->start(UART_NUM_0)) {
-        err("Fail start ush");
+    bool ushStarted = false;
+    auto jitter = Jitter::create(*bosun, *loadSensor);
+    assert(jitter);
+    auto benchLoop = Gpio::create(PIN_BENCH_LOOP, static_cast<Gpio::Way>(Gpio::Way::IN | Gpio::Way::OUT));
+    assert(benchLoop);
+    auto bench = Bench::create(*bosun);
+    assert(bench);
+
+    Mem::setSys(Mem::Sys::NET);
+    // Dashboard and hives share one task
+    auto netExecutor = Co::Executor::create(Tasks::NET);
+    assert(netExecutor);
+    Co::Flags netWake(*netExecutor);
+    auto netBox = Mailbox::create("net", [&netWake]() { netWake.set(1); });
+    assert(netBox);
+    // Flushes block for seconds, so the uplink has a task of its own
+    auto uplinkExecutor = Co::Executor::create(Tasks::UPLINK);
+    assert(uplinkExecutor);
+    Co::Flags uplinkWake(*uplinkExecutor);
+    auto uplinkBox = Mailbox::create("uplink", [&uplinkWake]() { uplinkWake.set(1); });
+    assert(uplinkBox);
+    auto wifi = Wifi::create(*param, *bosun);
+    assert(wifi);
+    auto ota = Ota::create(*param, *bosun, *wifi);
+    assert(ota);
+    auto mqtt = Mqtt::create(*param, *bosun, *factory);
+    assert(mqtt);
+    auto clock = Clock::create(*param, *bosun);
+    assert(clock);
+    // Refuses messages until it's up
+    auto cloud = Cloud::create(*wifi, *mqtt, *clock, *uplinkExecutor);
+    assert(cloud);
+    auto web = Web::create(*param, *bosun, *wifi, *netExecutor, *scales, *appBox);
+    assert(web);
+    auto rsh = Rsh::create(*param, *bosun, *wifi);
+    assert(rsh);
+
+    // Hives of an apiary report through one gateway
+    const auto hiveRole = static_cast<Hive::Role>(param->get(Params::HIVE_ROLE));
+    Link::Hnd hiveLink;
+    Hive::Node::Hnd hiveNode;
+    Hive::Gateway::Hnd hiveGateway;
+    Co::Flags hiveWake(*netExecutor);
+    if (Hive::Role::NONE != hiveRole) {
+        hiveLink = Link::createEspNow(*wifi, param->get(Params::HIVE_CHANNEL));
+        assert(hiveLink);
+    }
+    if (Hive::Role::NODE == hiveRole) {
+        const std::string gw = param->get(Params::HIVE_GATEWAY);
+        const auto gwAddr = gw.empty() ? Link::BROADCAST : Link::parseAddr(gw).value_or(Link::BROADCAST);
+        hiveNode = Hive::Node::create(*hiveLink, gwAddr, param->get(Params::HIVE_PERIOD));
+        assert(hiveNode);
+    } else if (Hive::Role::GATEWAY == hiveRole) {
+        auto publish = [&cloud](const Cloud::Fill& fill) { return cloud->publish("hives", fill, Cloud::Priority::NORMAL); };
+        hiveGateway = Hive::Gateway::create(*hiveLink, publish, [&hiveWake]() { hiveWake.set(1); }, *clock);
+        assert(hiveGateway);
     }
 
-    auto scales = Scales::create(*param, *bosun, *loadSensor);
-    assert(scales);
-    if (!scales->init()) {
-        err("Fail init Scales");
+    Mem::setSys(Mem::Sys::DSP);
+    auto detector = Detector::create(*param, *bosun);
+    assert(detector);
+    auto rollup = Rollup::create(*param, *bosun, *cloud, *clock, bootCount);
+    assert(rollup);
+    Mem::setSys(Mem::Sys::NET);
+    auto backfill = Backfill::create(*param, *bosun, *mqtt, *rollup, *clock, bootCount);
+    assert(backfill);
+
+    using Run = Boot::Run;
+    using Sys = Mem::Sys;
+    // Warnings and errors from here on are kept in flash
+    boot->add("journal", {}, Sys::SYSTEM, Run::ANY, [&]() { return journal->init(); });
+    boot->add("led", {}, Sys::SYSTEM, Run::ANY, [&]() { return indicator->init(); });
+    // The GPIO ISR service allocates the interrupt on the calling core
+    boot->add("hx711", {}, Sys::ACQ, Run::MAIN, [&]() {
+        return loadSensor->init(PIN_LOADSENSOR_DOUT, PIN_LOADSENSOR_SCK, Hx711::Mode::CH_A_GN64);
+    });
+    boot->add("shell", { "hx711" }, Sys::SHELL, Run::ANY, [&]() {
+        Params::addCmds(*param, *bosun);
+        Mem::addCmds(*bosun);
+        Co::addCmds(*bosun);
+        Mailbox::addCmds(*bosun);
+        ushStarted = ush->start(UART_NUM_0);
+        return ushStarted;
+    });
+    boot->add("factory", {}, Sys::SYSTEM, Run::ANY, [&]() {
+        if (!factory->init()) {
+            warn("Running without factory data");
+        }
+        return true;
+    });
+    boot->add("scales", { "hx711", "factory", "led" }, Sys::ACQ, Run::ANY, [&]() {
+        bosun->setOwner(appBox.get());
+        scales->setOnBusy([&indicator](bool busy) { indicator->set(Indicator::State::CALIBRATING, busy); });
+        return scales->init();
+    });
+    // Synced by the uplink, so it's run on the uplink's task
+    boot->add("clock", {}, Sys::NET, Run::ANY, [&]() {
+        bosun->setOwner(uplinkBox.get());
+        return clock->init();
+    });
+    boot->add("detector", { "clock", "led" }, Sys::DSP, Run::ANY, [&]() {
+        bosun->setOwner(appBox.get());
+        auto onEvent = [&cloud, &web, &boot, &clock, &indicator](const Detector::Event& ev) {
+            indicator->set(Indicator::State::EVENT, true);
+            if (boot->isDone()) {
+                web->onEvent(ev);
+            }
+            auto encode = [&ev, &clock](std::span<uint8_t> buf) { return Telemetry::encodeEvent(buf, ev, *clock); };
+            cloud->publish("events", encode, Cloud::Priority::URGENT);
+        };
+        return detector->init(onEvent);
+    });
+    boot->add("rollup", { "clock" }, Sys::DSP, Run::ANY, [&]() {
+        bosun->setOwner(appBox.get());
+        return rollup->init();
+    });
+    boot->add("sampler", { "scales" }, Sys::ACQ, Run::ANY, [&]() {
+        bosun->setOwner(appBox.get());
+        return sampler->init();
+    });
+
+    // Networking comes up while samples are taken
+    boot->add("net", {}, Sys::NET, Run::BACKGROUND, [&]() {
+        return netExecutor->init() && netExecutor->spawn("mailbox", serveMailbox(*netBox, netWake));
+    });
+    boot->add("uplink", {}, Sys::NET, Run::BACKGROUND, [&]() {
+        return uplinkExecutor->init() && uplinkExecutor->spawn("mailbox", serveMailbox(*uplinkBox, uplinkWake));
+    });
+    boot->add("wifi", {}, Sys::NET, Run::BACKGROUND, [&]() {
+        bosun->setOwner(netBox.get());
+        return wifi->init();
+    });
+    // Updates take long, they run on the shell
+    boot->add("ota", { "wifi" }, Sys::NET, Run::BACKGROUND, [&]() { return ota->init(); });
+    boot->add("mqtt", { "factory" }, Sys::NET, Run::BACKGROUND, [&]() {
+        bosun->setOwner(uplinkBox.get());
+        return mqtt->init();
+    });
+    // Serves the backend from the rollups, on the uplink's task
+    boot->add("backfill", { "mqtt", "rollup" }, Sys::NET, Run::BACKGROUND, [&]() {
+        bosun->setOwner(uplinkBox.get());
+        return backfill->init();
+    });
+    boot->add("cloud", { "uplink", "wifi", "mqtt", "clock", "journal", "backfill" }, Sys::NET, Run::BACKGROUND, [&]() {
+        cloud->setExchange([&backfill]() { backfill->exchange(); });
+        if (!cloud->init()) {
+            return false;
+        }
+        journal->setUplink([&cloud](const Cloud::Fill& fill) { return cloud->publish("log", fill, Cloud::Priority::NORMAL); });
+        if (isCrash(esp_reset_reason())) {
+            // What led up to it goes out with the first flush
+            info("Sent %u records of the crashed boot", static_cast<unsigned>(journal->send(bootCount - 1, CRASH_RECORDS)));
+        }
+        return true;
+    });
+    boot->add("web", { "net", "wifi" }, Sys::NET, Run::BACKGROUND, [&]() {
+        bosun->setOwner(netBox.get());
+        return web->init();
+    });
+    boot->add("rsh", { "wifi", "shell" }, Sys::SHELL, Run::BACKGROUND, [&]() { return rsh->init(); });
+    boot->add("hive", { "net", "wifi", "cloud" }, Sys::NET, Run::BACKGROUND, [&]() {
+        bool ok = true;
+        if (hiveNode) {
+            ok = hiveNode->init();
+        } else if (hiveGateway) {
+            ok = hiveGateway->init() && netExecutor->spawn("hives", forwardHives(*hiveGateway, hiveWake));
+        }
+        Hive::addCmds(*bosun, hiveNode.get(), hiveGateway.get(), *clock);
+        return ok;
+    });
+    boot->add("tools", { "hx711" }, Sys::SHELL, Run::BACKGROUND, [&]() {
+        const bool ok = jitter->init() && bench->init();
+        BenchCases::add(*bench, *bosun, *param, *loadSensor, *scales, *benchLoop);
+        return ok;
+    });
+    // An updated image is kept only if the basics work. Waits for the load
+    // sensor to settle, so it's left to the background.
+    boot->add("selftest", { "ota", "hx711", "shell" }, Sys::SYSTEM, Run::BACKGROUND, [&]() {
+        ota->confirm([&]() {
+            if (!loadSensor->readSettled(1).has_value()) {
+                err("Self test: no load sensor");
+                return false;
+            }
+            if (param->get(Params::BOOT_COUNT) != bootCount + 1) {
+                err("Self test: parameters not stored");
+                return false;
+            }
+            if (!ushStarted) {
+                err("Self test: no shell");
+                return false;
+            }
+            return true;
+        });
+        return true;
+    });
+
+    if (!boot->run()) {
+        err("Fail bring up acquisition");
     }
+
+    Mem::setSys(Tasks::APP.sys);
+    // Sealed once the background steps are done allocating too
+    bool up = false;
+    bool sampled = false;
+    int64_t lastTickUs = 0;
     while (true) {
-        vTaskDelay(pdMS_TO_TICKS(1000));
-        cloud.cloudStuff();
-        int sample = loadSensor->read();
-        float weight = scales->weigh();
-        info("Weight: %0.3f, load: 0x%06X (%d)", weight, sample, sample);
-
-        switch ((i % 4) / 2) {
-        case 0:
-            ledRed->toggle();
-            break;
-        case 1:
-            ledGreen->toggle();
-            break;
+        if (!up && boot->isDone()) {
+            Mem::seal();
+            up = true;
+        }
+        appBox->drain();
+        Sampler::Reading reading;
+        if (!sampler->next(reading)) {
+            if (!appBox->pending()) {
+                ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+            }
+            continue;
+        }
+        if (!sampled) {
+            boot->mark("sample");
+            sampled = true;
+        }
+        detector->feed(reading.timeUs, reading.weightKg);
+        rollup->feed(reading.timeUs, reading.weightKg);
+        // Nodes send over the radio, which is brought up in the background
+        if (hiveNode && up) {
+            hiveNode->feed(reading.timeUs, reading.weightKg);
+        }
+        web->feed(reading.timeUs, reading.weightKg);
+
+        // Log at most once per second, whatever the sample rate
+        if (reading.timeUs - lastTickUs < 1000 * 1000) {
+            continue;
         }
-        i++;
+        lastTickUs = reading.timeUs;
+        info("Weight: %0.3f, load: 0x%06X (%d) %s at %" PRId64 " ms UTC", reading.weightKg, reading.raw, reading.raw,
+            Sampler::modeName(reading.mode), clock->toUtcMs(reading.timeUs));
+        // Reprograms the LED only if it changed
+        indicator->set(Indicator::State::NO_UPLINK, up && !cloud->hasUplink());
     }
 }
 
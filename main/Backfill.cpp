@@ -0,0 +1,240 @@
+#include "Backfill.hpp"
+#include "Log.hpp"
+#include "Param.hpp"
+#include "Params.hpp"
+#include "Bosun.hpp"
+#include "Mqtt.hpp"
+#include "Rollup.hpp"
+#include "Cloud.hpp"
+#include "Telemetry.hpp"
+
+#include "esp_timer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <span>
+#include <string_view>
+
+using namespace std;
+
+namespace beegram {
+
+class BackfillImpl : public Backfill {
+public:
+    BackfillImpl(Param& param, Bosun& bosun, Mqtt& mqtt, const Rollup& rollup, const Clock& clock, uint32_t boot)
+    : _param(param), _bosun(bosun), _mqtt(mqtt), _rollup(rollup), _clock(clock), _boot(boot)
+    {}
+    virtual bool init() override;
+    virtual void exchange() override;
+    virtual Stats getStats() const override { return _stats; }
+private:
+    static constexpr size_t MAX_RANGES = 8;
+    static constexpr size_t ACK_HEADER_LEN = 13;
+    static constexpr size_t RANGE_LEN = 8;
+    /// Buckets of a message, a shorter run is sent if they don't fit
+    static constexpr size_t RUN_MAX_LEN = 8;
+    static constexpr uint32_t ACK_TIMEOUT_MS = 3000;
+    /// Batches not acked before waiting only every RETRY_EVERY batches, so
+    /// the link isn't held up without a backend
+    static constexpr uint32_t MISSES_MAX = 3;
+    static constexpr uint32_t RETRY_EVERY = 10;
+    /// Most budget saved up while the uplink is idle or down
+    static constexpr uint32_t BURST_S = 600;
+
+    /// @brief Sequence numbers [first, end)
+    struct Range {
+        uint32_t first;
+        uint32_t end;
+    };
+
+    /// @return True if it's the ack of the latest batch
+    bool onAck(span<const uint8_t> payload, Rollup::Tier tier, uint32_t oldest, uint32_t next);
+    void refill();
+    void serve(Rollup::Tier tier);
+    void print() const;
+
+    Param& _param;
+    Bosun& _bosun;
+    Mqtt& _mqtt;
+    const Rollup& _rollup;
+    const Clock& _clock;
+    const uint32_t _boot;
+    uint32_t _rateBps = 0;
+    uint32_t _budgetB = 0;
+    int64_t _refillUs = 0;
+    uint32_t _misses = 0;
+    Rollup::Tier _wantTier = Rollup::Tier::MIN_1;
+    Range _wants[MAX_RANGES] = {};
+    size_t _wantCount = 0;
+    Stats _stats = {};
+};
+
+template <typename T>
+static T get(const uint8_t*& p) {
+    T val;
+    memcpy(&val, p, sizeof(val));
+    p += sizeof(val);
+    return val;
+}
+
+bool BackfillImpl::init() {
+    _rateBps = _param.get(Params::BF_RATE);
+    _refillUs = esp_timer_get_time();
+    _bosun.addCmd(
+        "backfill", Cmd(
+            "\tShow the batches acked by the backend and the buckets resent from history",
+            [this](const vector<string>& args) { print(); }
+        )
+    );
+    return true;
+}
+
+bool BackfillImpl::onAck(span<const uint8_t> payload, Rollup::Tier tier, uint32_t oldest, uint32_t next) {
+    if (payload.size() < ACK_HEADER_LEN || 0 != (payload.size() - ACK_HEADER_LEN) % RANGE_LEN) {
+        warn("Invalid ack of %u B", static_cast<unsigned>(payload.size()));
+        return false;
+    }
+    const uint8_t* p = payload.data();
+    const uint32_t boot = get<uint32_t>(p);
+    const uint32_t batch = get<uint32_t>(p);
+    const uint32_t acked = get<uint32_t>(p);
+    const uint8_t ackTier = get<uint8_t>(p);
+    // Late ack of an earlier batch, the one of this batch may follow
+    if (boot != _boot || batch != _stats.batches || ackTier != static_cast<uint8_t>(tier)) {
+        return false;
+    }
+    _stats.acked = acked;
+    _wantTier = tier;
+    _wantCount = 0;
+    while (p < payload.data() + payload.size() && _wantCount < MAX_RANGES) {
+        Range r;
+        r.first = get<uint32_t>(p);
+        r.end = get<uint32_t>(p);
+        // Only what's held can be served
+        if (r.first < oldest) {
+            _stats.lost += min(r.end, oldest) - min(r.first, oldest);
+            r.first = oldest;
+        }
+        r.end = min(r.end, next);
+        if (r.first < r.end) {
+            _stats.requested += r.end - r.first;
+            _wants[_wantCount++] = r;
+        }
+    }
+    return true;
+}
+
+void BackfillImpl::refill() {
+    const int64_t nowUs = esp_timer_get_time();
+    const uint64_t gainB = static_cast<uint64_t>(nowUs - _refillUs) * _rateBps / (1000 * 1000);
+    _budgetB = static_cast<uint32_t>(min<uint64_t>(_budgetB + gainB, static_cast<uint64_t>(_rateBps) * BURST_S));
+    _refillUs = nowUs;
+}
+
+void BackfillImpl::serve(Rollup::Tier tier) {
+    refill();
+    if (tier != _wantTier) {
+        // Upload tier changed since the ack, the backend asks again
+        _wantCount = 0;
+        return;
+    }
+    uint8_t buf[Cloud::PAYLOAD_MAX_LEN];
+    for (size_t i = 0; i < _wantCount; i++) {
+        Range& r = _wants[i];
+        while (r.first < r.end) {
+            if (_budgetB < sizeof(buf)) {
+                _stats.deferred++;
+                return;
+            }
+            // A run of consecutive buckets, as far as they are still held
+            Rollup::Stats run[RUN_MAX_LEN];
+            size_t n = 0;
+            while (n < RUN_MAX_LEN && r.first + n < r.end && _rollup.find(tier, r.first + n, run[n])) {
+                n++;
+            }
+            if (0 == n) {
+                // Overwritten since the ack
+                _stats.lost++;
+                r.first++;
+                continue;
+            }
+            size_t len = 0;
+            while (n > 0 && 0 == (len = Telemetry::encodeBackfill(buf, _boot, tier, span(run, n), _clock))) {
+                n--;
+            }
+            if (!_mqtt.publish("backfill", string_view(reinterpret_cast<const char*>(buf), len))) {
+                // Connection lost, the rest goes with the next batch
+                return;
+            }
+            r.first += n;
+            _budgetB -= len;
+            _stats.served += n;
+            _stats.servedB += len;
+        }
+    }
+    _wantCount = 0;
+}
+
+void BackfillImpl::exchange() {
+    if (0 == _rateBps) {
+        return;
+    }
+    const Rollup::Tier tier = _rollup.getUploadTier();
+    const uint32_t next = _rollup.nextSeq(tier);
+    const uint32_t oldest = next - static_cast<uint32_t>(min<size_t>(next, _rollup.count(tier)));
+    uint8_t buf[Cloud::PAYLOAD_MAX_LEN];
+    const size_t len = Telemetry::encodeSync(buf, _boot, tier, oldest, next, _stats.batches + 1);
+    // Subscriptions last as long as the connection, which is one flush
+    if (!_mqtt.subscribe("ack") || !_mqtt.publish("sync", string_view(reinterpret_cast<const char*>(buf), len))) {
+        return;
+    }
+    _stats.batches++;
+    if (_misses < MISSES_MAX || 0 == _stats.batches % RETRY_EVERY) {
+        bool acked = false;
+        auto onMsg = [&](string_view topic, span<const uint8_t> payload) {
+            acked = "ack" == topic && onAck(payload, tier, oldest, next);
+            return !acked;
+        };
+        if (!_mqtt.receive(onMsg, ACK_TIMEOUT_MS)) {
+            return;
+        }
+        if (acked) {
+            _stats.acks++;
+            _misses = 0;
+        } else {
+            _stats.timeouts++;
+            _misses++;
+            debug("Batch %lu not acked", static_cast<unsigned long>(_stats.batches));
+        }
+    }
+    // Requests of the latest ack still open are served also without a new one
+    serve(tier);
+}
+
+void BackfillImpl::print() const {
+    const Rollup::Tier tier = _rollup.getUploadTier();
+    const uint32_t next = _rollup.nextSeq(tier);
+    printf("rate %lu B/s budget %lu B, boot %lu tier %s seq %lu..%lu\n", static_cast<unsigned long>(_rateBps),
+        static_cast<unsigned long>(_budgetB), static_cast<unsigned long>(_boot), Rollup::tierName(tier),
+        static_cast<unsigned long>(next - min<size_t>(next, _rollup.count(tier))), static_cast<unsigned long>(next));
+    printf("batches %lu acked %lu timeouts %lu, backend has all below %lu\n", static_cast<unsigned long>(_stats.batches),
+        static_cast<unsigned long>(_stats.acks), static_cast<unsigned long>(_stats.timeouts),
+        static_cast<unsigned long>(_stats.acked));
+    printf("requested %lu served %lu (%lu B) lost %lu deferred %lu\n", static_cast<unsigned long>(_stats.requested),
+        static_cast<unsigned long>(_stats.served), static_cast<unsigned long>(_stats.servedB),
+        static_cast<unsigned long>(_stats.lost), static_cast<unsigned long>(_stats.deferred));
+    for (size_t i = 0; i < _wantCount; i++) {
+        if (_wants[i].first < _wants[i].end) {
+            printf("wanted %lu..%lu\n", static_cast<unsigned long>(_wants[i].first),
+                static_cast<unsigned long>(_wants[i].end));
+        }
+    }
+}
+
+Backfill::Hnd Backfill::create(Param& param, Bosun& bosun, Mqtt& mqtt, const Rollup& rollup, const Clock& clock,
+    uint32_t boot) {
+    return make_unique<BackfillImpl>(param, bosun, mqtt, rollup, clock, boot);
+}
+
+} // namespace
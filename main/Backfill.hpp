@@ -0,0 +1,74 @@
+/**
+ * @brief Resending what the backend missed, from the rollup history
+*/
+
+#pragma once
+
+#include <memory>
+#include <cinttypes>
+
+namespace beegram {
+
+class Param; class Bosun; class Mqtt; class Rollup; class Clock;
+
+/**
+ * Lets the backend ask for the buckets of the upload tier it is missing,
+ * after an outage or lost messages, instead of the device resending all it
+ * holds. Buckets are numbered per tier from 0 at boot, see Rollup, so the
+ * stream of a device is its boot count and tier.
+ *
+ * Each flush of the uplink is a batch. After its live messages the device
+ * sends SYNC with the sequence numbers it holds and the batch number, then
+ * waits briefly for the backend's ack on the topic "ack", little endian:
+ *
+ *     boot u32, batch u32, acked u32, tier u8, up to 8 x (first u32, end u32)
+ *
+ * The backend has every bucket below acked, and is missing those in the
+ * ranges [first, end). The device streams the missing buckets it still
+ * holds as BACKFILL messages of consecutive buckets. The budget refills at
+ * bf_rate bytes per s; what it doesn't cover goes with the next batch. Live
+ * messages are sent first and don't share buffers with backfills, so a
+ * backfill never holds up live data. support/backfill/server.py stands in
+ * for the backend.
+*/
+class Backfill {
+public:
+    using Hnd = std::unique_ptr<Backfill>;
+    struct Stats {
+        uint32_t batches;       ///< Syncs sent
+        uint32_t acks;          ///< Batches acked
+        uint32_t timeouts;      ///< Batches not acked in time
+        uint32_t acked;         ///< Backend has every bucket below this one
+        uint32_t requested;     ///< Buckets requested and held, over all acks
+        uint32_t served;        ///< Buckets sent from history
+        uint32_t servedB;       ///< Bytes of backfill messages sent
+        uint32_t lost;          ///< Buckets requested which were no longer held
+        uint32_t deferred;      ///< Batches which ran out of budget
+    };
+    virtual ~Backfill() = default;
+
+    /**
+     * Read the rate and register the command backfill
+     * @return True on success; false on failure
+    */
+    virtual bool init() = 0;
+
+    /// @brief Sync, take the ack and serve what's missing. Called on the
+    /// connected uplink after the live messages, see Cloud::setExchange().
+    virtual void exchange() = 0;
+
+    virtual Stats getStats() const = 0;
+
+    /**
+     * Create the backfill
+     * @param param Rate of backfills
+     * @param bosun Takes the command
+     * @param mqtt Transport, connected during exchange()
+     * @param rollup History of the buckets
+     * @param clock Maps bucket times to UTC
+     * @param boot Boot count, the stream the sequence numbers belong to
+    */
+    static Hnd create(Param& param, Bosun& bosun, Mqtt& mqtt, const Rollup& rollup, const Clock& clock, uint32_t boot);
+};
+
+} // namespace
@@ -0,0 +1,248 @@
+#include "Bench.hpp"
+#include "Log.hpp"
+#include "Bosun.hpp"
+#include "Params.hpp"
+#include "Scales.hpp"
+#include "driver/Gpio.hpp"
+#include "driver/Hx711.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace beegram {
+
+class BenchImpl : public Bench {
+public:
+    BenchImpl(Bosun& bosun)
+    : _bosun(bosun)
+    {}
+    virtual bool init() override;
+    virtual void add(string_view name, unsigned runs, const Case& fn) override;
+private:
+    struct Entry {
+        string_view name;
+        unsigned runs;
+        Case fn;
+    };
+    struct Result {
+        uint32_t min;
+        uint32_t median;
+        uint32_t p99;
+    };
+    static constexpr unsigned MAX_RUNS = 10000;
+    /// Runs of the empty case which finds the cost of timing itself
+    static constexpr unsigned OVERHEAD_RUNS = 100;
+
+    uint32_t overhead();
+    bool run(const Entry& e, unsigned runs, bool json, uint32_t overhead);
+
+    Bosun& _bosun;
+    vector<Entry> _cases;
+};
+
+bool BenchImpl::init() {
+    _bosun.addCmd(
+        "bench", Cmd(
+            "[list | all | case] [runs] [json]\n\tRun benchmarks, report cycles of min, median and p99",
+            [this](const vector<string>& args) {
+                const bool json = "json" == args.back();
+                const size_t argc = args.size() - (json ? 1 : 0);
+                if (argc < 2 || "list" == args[1]) {
+                    for (const auto& e: _cases) {
+                        printf("%-12.*s %u runs\n", static_cast<int>(e.name.size()), e.name.data(), e.runs);
+                    }
+                    return;
+                }
+                uint32_t runs = 0;
+                if (argc > 2 && !Params::parse(args[2], runs)) {
+                    err("Invalid runs [%s]", args[2].c_str());
+                    return;
+                }
+                if (runs > MAX_RUNS) {
+                    err("At most %u runs", MAX_RUNS);
+                    return;
+                }
+                const uint32_t over = overhead();
+                if (!json) {
+                    printf("%-12s %6s %9s %9s %9s %9s\n", "case", "runs", "min", "median", "p99", "p99 us");
+                }
+                bool found = false;
+                for (const auto& e: _cases) {
+                    if ("all" == args[1] || e.name == args[1]) {
+                        found = true;
+                        run(e, runs ? runs : e.runs, json, over);
+                    }
+                }
+                if (!found) {
+                    err("No case %s", args[1].c_str());
+                } else if (!json) {
+                    printf("%lu cycles per us, %lu cycles of timing subtracted\n",
+                        static_cast<unsigned long>(cyclesPerUs()), static_cast<unsigned long>(over));
+                }
+            }
+        )
+    );
+    return true;
+}
+
+void BenchImpl::add(string_view name, unsigned runs, const Case& fn) {
+    _cases.push_back({ name, runs, fn });
+}
+
+uint32_t BenchImpl::overhead() {
+    uint32_t cycles[OVERHEAD_RUNS];
+    timed([]() {})(cycles);
+    return *min_element(begin(cycles), end(cycles));
+}
+
+bool BenchImpl::run(const Entry& e, unsigned runs, bool json, uint32_t overhead) {
+    vector<uint32_t> cycles(runs);
+    if (!e.fn(cycles)) {
+        err("Fail run %.*s", static_cast<int>(e.name.size()), e.name.data());
+        return false;
+    }
+    for (auto& c: cycles) {
+        c = (c > overhead) ? c - overhead : 0;
+    }
+    // Partial sorts are enough for three order statistics
+    const size_t p99 = (runs * 99 + 99) / 100 - 1;
+    nth_element(cycles.begin(), cycles.begin() + p99, cycles.end());
+    nth_element(cycles.begin(), cycles.begin() + runs / 2, cycles.begin() + p99);
+    const Result r = { *min_element(cycles.begin(), cycles.end()), cycles[runs / 2], cycles[p99] };
+    if (json) {
+        printf("{\"case\":\"%.*s\",\"runs\":%u,\"min\":%lu,\"median\":%lu,\"p99\":%lu,\"mhz\":%lu}\n",
+            static_cast<int>(e.name.size()), e.name.data(), runs, static_cast<unsigned long>(r.min),
+            static_cast<unsigned long>(r.median), static_cast<unsigned long>(r.p99),
+            static_cast<unsigned long>(cyclesPerUs()));
+    } else {
+        printf("%-12.*s %6u %9lu %9lu %9lu %9.2f\n", static_cast<int>(e.name.size()), e.name.data(), runs,
+            static_cast<unsigned long>(r.min), static_cast<unsigned long>(r.median),
+            static_cast<unsigned long>(r.p99), static_cast<double>(r.p99) / cyclesPerUs());
+    }
+    return true;
+}
+
+Bench::Case Bench::timed(const function<void()>& fn) {
+    return [fn](span<uint32_t> cycles) {
+        for (auto& c: cycles) {
+            const uint32_t start = Bench::cycles();
+            fn();
+            c = Bench::cycles() - start;
+        }
+        return true;
+    };
+}
+
+uint32_t Bench::cycles() {
+    return esp_cpu_get_cycle_count();
+}
+
+uint32_t Bench::cyclesPerUs() {
+    return esp_rom_get_cpu_ticks_per_us();
+}
+
+Bench::Hnd Bench::create(Bosun& bosun) {
+    return make_unique<BenchImpl>(bosun);
+}
+
+//---------------------------------------------------------------------
+// BenchCases
+//---------------------------------------------------------------------
+
+/// Time to wait per conversion of the frame case, the slowest rate is 10 SPS
+static constexpr uint32_t FRAME_TIMEOUT_MS = 200;
+/// Time to wait for the interrupt of the wake case
+static constexpr TickType_t WAKE_TIMEOUT = pdMS_TO_TICKS(100);
+
+/// Task waiting for a wake from the loopback interrupt
+static TaskHandle_t waker = nullptr;
+
+void BenchCases::add(Bench& bench, Bosun& bosun, Param& param, Hx711& loadSensor, Scales& scales, Gpio& loop) {
+    bench.add("gpio_toggle", 1000, Bench::timed([&loop]() { loop.toggle(); }));
+
+    // Clocking out a frame happens on the driver task, which times it
+    bench.add("hx711_frame", 50, [&loadSensor](span<uint32_t> cycles) {
+        atomic<size_t> got = 0;
+        const TaskHandle_t caller = xTaskGetCurrentTaskHandle();
+        auto tap = [&](const Hx711::Sample& s) {
+            const size_t i = got;
+            if (i < cycles.size()) {
+                cycles[i] = s.readCycles;
+                if (++got == cycles.size()) {
+                    xTaskNotifyGive(caller);
+                }
+            }
+        };
+        ulTaskNotifyTake(pdTRUE, 0);
+        if (!loadSensor.setTap(tap)) {
+            return false;
+        }
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS((cycles.size() + 2) * FRAME_TIMEOUT_MS));
+        loadSensor.setTap(nullptr);
+        return got == cycles.size();
+    });
+
+    // From the edge to the waiting task, both ends timed by the waiting
+    // task so the cycle counters of the cores don't mix
+    auto onEdge = []() {
+        BaseType_t highTask = 0;
+        if (waker) {
+            vTaskNotifyGiveFromISR(waker, &highTask);
+            portYIELD_FROM_ISR(highTask);
+        }
+    };
+    auto intr = loop.addIsr(onEdge, Gpio::IntrTrig::ANY_EDGE);
+    if (!intr) {
+        err("Fail add ISR to loopback pin");
+    } else {
+        bench.add("isr_wake", 200, [&loop, intr](span<uint32_t> cycles) {
+            waker = xTaskGetCurrentTaskHandle();
+            ulTaskNotifyTake(pdTRUE, 0);
+            bool ok = intr->enable();
+            for (auto& c: cycles) {
+                if (!ok) {
+                    break;
+                }
+                const uint32_t start = Bench::cycles();
+                loop.toggle();
+                ok = 0 != ulTaskNotifyTake(pdTRUE, WAKE_TIMEOUT);
+                c = Bench::cycles() - start;
+            }
+            intr->disable();
+            waker = nullptr;
+            return ok;
+        });
+    }
+
+    bench.add("nvs_get", 200, Bench::timed([&param]() { param.get(Params::BOOT_COUNT); }));
+    // Writing back the stored value, which NVS compares and doesn't rewrite,
+    // so the case doesn't wear the flash
+    bench.add("nvs_set", 50, [&param](span<uint32_t> cycles) {
+        const uint32_t count = param.get(Params::BOOT_COUNT);
+        return Bench::timed([&param, count]() { param.set(Params::BOOT_COUNT, count); })(cycles);
+    });
+
+    bench.add("weigh", 1000, Bench::timed([&scales, &loadSensor]() {
+        volatile float kg = scales.weigh(loadSensor.read());
+        (void)kg;
+    }));
+
+    bosun.addCmd("nop", Cmd("\n\tDo nothing, times command dispatch", [](const vector<string>& args) {}));
+    bench.add("dispatch", 1000, [&bosun](span<uint32_t> cycles) {
+        const vector<string> words = { "nop" };
+        return Bench::timed([&bosun, &words]() { bosun.runCmd(words); })(cycles);
+    });
+}
+
+} // namespace
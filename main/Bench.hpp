@@ -0,0 +1,71 @@
+/**
+ * @brief Registry of micro-benchmarks run from the shell
+*/
+
+#pragma once
+
+#include <memory>
+#include <cinttypes>
+#include <functional>
+#include <span>
+#include <string_view>
+
+namespace beegram {
+
+class Bosun; class Param; class Hx711; class Scales; class Gpio;
+
+/**
+ * Runs registered cases a number of times, timed with the CPU cycle
+ * counter, and reports min, median and 99th percentile through the shell
+ * command bench, as a table or as JSON lines. A case either times one call
+ * per run with timed() or fills in the cycles of each run itself, for what
+ * happens in another task or an interrupt. Runs on the target only.
+*/
+class Bench {
+public:
+    using Hnd = std::unique_ptr<Bench>;
+    /// @brief Measures runs, one count of cycles per element; false on failure
+    using Case = std::function<bool(std::span<uint32_t> cycles)>;
+    virtual ~Bench() = default;
+
+    /**
+     * Register the command
+     * @return True on success; false on failure
+    */
+    virtual bool init() = 0;
+
+    /**
+     * Register a case
+     * @param name Name of the case, a literal
+     * @param runs Default number of runs
+     * @param fn Measures the runs
+    */
+    virtual void add(std::string_view name, unsigned runs, const Case& fn) = 0;
+
+    /// @return Case which times one call of fn per run
+    static Case timed(const std::function<void()>& fn);
+
+    /// @return Current value of the cycle counter of the calling core
+    static uint32_t cycles();
+
+    /// @return Cycles per microsecond
+    static uint32_t cyclesPerUs();
+
+    static Hnd create(Bosun& bosun);
+};
+
+/**
+ * The cases of this firmware: GPIO toggle, Hx711 frame readout, interrupt
+ * to task wake, NVS get and set, weigh and command dispatch
+*/
+class BenchCases {
+public:
+    /**
+     * Register the cases
+     * @param loop Free pin configured as input and output, its own edges
+     *             raise the interrupt timed by the wake case
+    */
+    static void add(Bench& bench, Bosun& bosun, Param& param, Hx711& loadSensor, Scales& scales, Gpio& loop);
+};
+
+} // namespace
@@ -0,0 +1,293 @@
+#include "Boot.hpp"
+#include "Log.hpp"
+#include "Bosun.hpp"
+#include "Tasks.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace beegram {
+
+/// @return Bit per kind of step
+static constexpr uint8_t bit(Boot::Run run) {
+    return 1 << static_cast<uint8_t>(run);
+}
+
+class BootImpl : public Boot {
+public:
+    BootImpl(Bosun& bosun)
+    : _bosun(bosun)
+    {}
+    virtual bool add(const char* name, initializer_list<const char*> needs, Mem::Sys sys, Run run, const Step& step) override;
+    virtual bool run() override;
+    virtual bool isDone() const override { return _done.load(memory_order_acquire); }
+    virtual void mark(const char* name) override;
+    virtual void print() const override;
+private:
+    static constexpr size_t MAX_STEPS = 24;
+    static constexpr size_t MAX_MARKS = 4;
+    /// Bits of _wake, one per task running steps
+    static constexpr EventBits_t WAKE_MAIN = 1 << 0;
+    static constexpr EventBits_t WAKE_WORKER = 1 << 1;
+    enum class State : uint8_t {
+        WAITING,
+        RUNNING,
+        DONE,
+    };
+    struct Entry {
+        const char* name;
+        uint32_t needs;         ///< Bit per step
+        Mem::Sys sys;
+        Run run;
+        State state;
+        bool ok;
+        const char* task;       ///< Name of the task which ran it
+        Step step;
+        int64_t readyUs;        ///< When its needs were done
+        int64_t startUs;
+        int64_t endUs;
+    };
+    struct Mark {
+        const char* name;
+        int64_t timeUs;
+    };
+
+    static constexpr uint8_t MAIN_RUNS = bit(Run::MAIN) | bit(Run::ANY);
+    static constexpr uint8_t WORKER_RUNS = bit(Run::ANY) | bit(Run::BACKGROUND);
+    static constexpr uint8_t ALL_RUNS = MAIN_RUNS | WORKER_RUNS;
+
+    int find(const char* name) const;
+    bool isReady(const Entry& e) const;
+    /// @return Step the caller runs next, marked as running; null if none is ready
+    Entry* take(uint8_t runs);
+    /// @return True if steps of the given kinds aren't done
+    bool isPending(uint8_t runs) const;
+    /// Run steps of the given kinds until they are all done
+    void work(uint8_t runs, EventBits_t wake);
+    void finish(Entry& e, bool ok);
+
+    Bosun& _bosun;
+    Entry _steps[MAX_STEPS] = {};
+    size_t _count = 0;
+    size_t _left = 0;               ///< Steps not done
+    Mark _marks[MAX_MARKS] = {};
+    size_t _markCount = 0;
+    bool _started = false;
+    bool _failed = false;
+    int64_t _runUs = 0;
+    int64_t _foregroundUs = 0;      ///< When the steps run() waits for were done
+    int64_t _doneUs = 0;
+    atomic<bool> _done = false;
+    /// Steps are taken and finished by two tasks
+    SemaphoreHandle_t _lock = nullptr;
+    /// Wakes the tasks waiting for the needs of their next step
+    EventGroupHandle_t _wake = nullptr;
+};
+
+int BootImpl::find(const char* name) const {
+    for (size_t i = 0; i < _count; i++) {
+        if (0 == strcmp(name, _steps[i].name)) {
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+bool BootImpl::add(const char* name, initializer_list<const char*> needs, Mem::Sys sys, Run run, const Step& step) {
+    if (_started || _count >= MAX_STEPS || find(name) >= 0) {
+        err("Can't add boot step %s", name);
+        return false;
+    }
+    uint32_t mask = 0;
+    for (const char* need: needs) {
+        // Needs are added first, so there are no cycles
+        const int i = find(need);
+        if (i < 0) {
+            err("Boot step %s needs unknown %s", name, need);
+            return false;
+        }
+        if (Run::BACKGROUND != run && Run::BACKGROUND == _steps[i].run) {
+            err("Boot step %s would wait for background %s", name, need);
+            return false;
+        }
+        mask |= 1UL << i;
+    }
+    _steps[_count++] = Entry{ name, mask, sys, run, State::WAITING, false, nullptr, step, 0, 0, 0 };
+    return true;
+}
+
+bool BootImpl::isReady(const Entry& e) const {
+    for (size_t i = 0; i < _count; i++) {
+        if ((e.needs & (1UL << i)) && State::DONE != _steps[i].state) {
+            return false;
+        }
+    }
+    return true;
+}
+
+BootImpl::Entry* BootImpl::take(uint8_t runs) {
+    // Steps only this task may run come first, then the foreground
+    const uint8_t order[] = {
+        static_cast<uint8_t>(runs & bit(Run::MAIN)),
+        static_cast<uint8_t>(runs & bit(Run::ANY)),
+        static_cast<uint8_t>(runs & bit(Run::BACKGROUND)),
+    };
+    for (const uint8_t kind: order) {
+        for (size_t i = 0; i < _count; i++) {
+            Entry& e = _steps[i];
+            if (!(kind & bit(e.run)) || State::WAITING != e.state || !isReady(e)) {
+                continue;
+            }
+            e.readyUs = _runUs;
+            for (size_t n = 0; n < _count; n++) {
+                if ((e.needs & (1UL << n)) && _steps[n].endUs > e.readyUs) {
+                    e.readyUs = _steps[n].endUs;
+                }
+            }
+            e.state = State::RUNNING;
+            e.task = pcTaskGetName(nullptr);
+            e.startUs = esp_timer_get_time();
+            return &e;
+        }
+    }
+    return nullptr;
+}
+
+bool BootImpl::isPending(uint8_t runs) const {
+    for (size_t i = 0; i < _count; i++) {
+        if ((runs & bit(_steps[i].run)) && State::DONE != _steps[i].state) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void BootImpl::finish(Entry& e, bool ok) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    e.endUs = esp_timer_get_time();
+    e.ok = ok;
+    e.state = State::DONE;
+    _failed = _failed || !ok;
+    if (0 == _foregroundUs && !isPending(MAIN_RUNS)) {
+        _foregroundUs = e.endUs;
+    }
+    const bool last = 0 == --_left;
+    if (last) {
+        _doneUs = e.endUs;
+    }
+    xSemaphoreGive(_lock);
+    if (!ok) {
+        err("Fail boot step %s", e.name);
+    }
+    if (last) {
+        _done.store(true, memory_order_release);
+        info("Boot done in %" PRId64 " ms, acquisition up in %" PRId64 " ms", _doneUs / 1000, _foregroundUs / 1000);
+    }
+    xEventGroupSetBits(_wake, WAKE_MAIN | WAKE_WORKER);
+}
+
+void BootImpl::work(uint8_t runs, EventBits_t wake) {
+    while (true) {
+        xSemaphoreTake(_lock, portMAX_DELAY);
+        Entry* e = take(runs);
+        const bool pending = isPending(runs);
+        xSemaphoreGive(_lock);
+        if (e) {
+            Mem::Scope scope(e->sys);
+            // Commands run on the calling task unless the step says otherwise
+            _bosun.setOwner(nullptr);
+            const bool ok = e->step();
+            _bosun.setOwner(nullptr);
+            finish(*e, ok);
+        } else if (pending) {
+            // Bits set since the check stay set, no finish is missed
+            xEventGroupWaitBits(_wake, wake, pdTRUE, pdFALSE, portMAX_DELAY);
+        } else {
+            return;
+        }
+    }
+}
+
+bool BootImpl::run() {
+    _runUs = esp_timer_get_time();
+    _lock = Mem::mutex();
+    _wake = Mem::eventGroup();
+    if (!_lock || !_wake || _started) {
+        err("Fail start boot");
+        return false;
+    }
+    _started = true;
+    _left = _count;
+    _done.store(0 == _count, memory_order_release);
+    _bosun.addCmd(
+        "boot", Cmd(
+            "\n\tShow when each subsystem came up, in ms since start-up",
+            [this](const vector<string>& args) { print(); }
+        )
+    );
+    auto runWorker = [](void* arg) {
+        static_cast<BootImpl*>(arg)->work(WORKER_RUNS, WAKE_WORKER);
+    };
+    if (!isPending(WORKER_RUNS & ~MAIN_RUNS)) {
+        work(ALL_RUNS, WAKE_MAIN);
+    } else if (Tasks::spawnTransient(Tasks::BOOT, runWorker, this)) {
+        work(MAIN_RUNS, WAKE_MAIN);
+    } else {
+        warn("Boot steps run one by one");
+        work(ALL_RUNS, WAKE_MAIN);
+    }
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    if (0 == _foregroundUs) {
+        _foregroundUs = esp_timer_get_time();
+    }
+    const bool failed = _failed;
+    xSemaphoreGive(_lock);
+    return !failed;
+}
+
+void BootImpl::mark(const char* name) {
+    if (!_started) {
+        return;
+    }
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    if (_markCount < MAX_MARKS) {
+        _marks[_markCount++] = Mark{ name, esp_timer_get_time() };
+    }
+    xSemaphoreGive(_lock);
+}
+
+void BootImpl::print() const {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    printf("%-10s %-6s %8s %8s %8s %7s\n", "step", "task", "ready", "start", "end", "took");
+    for (size_t i = 0; i < _count; i++) {
+        const Entry& e = _steps[i];
+        if (State::WAITING == e.state) {
+            printf("%-10s waiting\n", e.name);
+        } else if (State::RUNNING == e.state) {
+            printf("%-10s %-6s %8.1f %8.1f  running\n", e.name, e.task, e.readyUs / 1000.0, e.startUs / 1000.0);
+        } else {
+            printf("%-10s %-6s %8.1f %8.1f %8.1f %7.1f%s\n", e.name, e.task, e.readyUs / 1000.0,
+                e.startUs / 1000.0, e.endUs / 1000.0, (e.endUs - e.startUs) / 1000.0, e.ok ? "" : " failed");
+        }
+    }
+    for (size_t i = 0; i < _markCount; i++) {
+        printf("%-10s %-6s %8s %8s %8.1f\n", _marks[i].name, "", "", "", _marks[i].timeUs / 1000.0);
+    }
+    printf("started %.1f acquisition %.1f done %.1f\n", _runUs / 1000.0, _foregroundUs / 1000.0, _doneUs / 1000.0);
+    xSemaphoreGive(_lock);
+}
+
+Boot::Hnd Boot::create(Bosun& bosun) {
+    return make_unique<BootImpl>(bosun);
+}
+
+} // namespace
@@ -0,0 +1,75 @@
+/**
+ * @brief Brings the subsystems up in the order of their dependencies
+*/
+
+#pragma once
+
+#include "Mem.hpp"
+
+#include <memory>
+#include <functional>
+#include <initializer_list>
+#include <cinttypes>
+
+namespace beegram {
+
+class Bosun;
+
+/**
+ * Each subsystem is brought up by a step which names the steps it needs.
+ * Steps whose needs are done run at once, on the main task and on a worker
+ * task on the network core. run() returns as soon as the steps acquisition
+ * needs are done, slow ones such as Wi-Fi or the self test of an update
+ * finish on the worker while samples are taken. Every step is timestamped
+ * from start-up: when its needs were done, when it started and ended.
+*/
+class Boot {
+public:
+    using Hnd = std::unique_ptr<Boot>;
+    /// @brief Brings a subsystem up
+    /// @return True on success; false on failure, steps needing it still run
+    using Step = std::function<bool()>;
+    /// @brief Where a step runs and whether run() waits for it
+    enum class Run : uint8_t {
+        MAIN,           ///< On the task calling run(), e.g. for interrupts of the acquisition core
+        ANY,            ///< On whichever task is free, run() waits for it
+        BACKGROUND,     ///< On the worker, run() doesn't wait for it
+    };
+    virtual ~Boot() = default;
+
+    /**
+     * Declare a step, after the steps it needs
+     * @param name Name of the step, a literal
+     * @param needs Names of the steps which must be done before it
+     * @param sys Charged for the step's allocations
+     * @param run Where it runs
+     * @param step Brings the subsystem up
+     * @return True on success; false if a need is unknown, is a background
+     * step needed by a foreground one, or there's no room for the step
+    */
+    virtual bool add(const char* name, std::initializer_list<const char*> needs, Mem::Sys sys, Run run, const Step& step) = 0;
+
+    /**
+     * Run the steps and register the command boot. Call once, after adding
+     * all steps.
+     * @return True once the foreground steps are done, if all succeeded;
+     * false otherwise
+    */
+    virtual bool run() = 0;
+
+    /// @return True once all steps are done, the background ones too
+    virtual bool isDone() const = 0;
+
+    /**
+     * Timestamp a milestone once run() returned, e.g. the first sample
+     * @param name Name of the milestone, a literal
+    */
+    virtual void mark(const char* name) = 0;
+
+    /// Print the timeline, in ms since start-up
+    virtual void print() const = 0;
+
+    static Hnd create(Bosun& bosun);
+};
+
+} // namespace
@@ -1,5 +1,7 @@
 #include "Bosun.hpp"
 #include "Log.hpp"
+#include "Mailbox.hpp"
+#include "Mem.hpp"
 
 #include <map>
 
@@ -12,12 +14,29 @@ public:
     virtual void addCmd(const std::string_view& name, const Cmd& cmd) override;
     virtual void runCmd(const vector<string>& words) const override;
     virtual bool init() override;
+    virtual void setOwner(Mailbox* owner) override;
 private:
-    map<string, Cmd> _cmds;
+    struct Entry {
+        Cmd cmd;
+        Mailbox* owner;     ///< Null to run on the calling task
+    };
+    /// Of the commands added by each task
+    static thread_local Mailbox* _owner;
+    map<string, Entry> _cmds;
+    /// Commands are added during boot by several tasks
+    SemaphoreHandle_t _lock = nullptr;
 };
 
+thread_local Mailbox* BosunImpl::_owner = nullptr;
+
 void BosunImpl::addCmd(const std::string_view& name, const Cmd& cmd) {
-    _cmds.emplace(name, cmd);
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _cmds.emplace(name, Entry{ cmd, _owner });
+    xSemaphoreGive(_lock);
+}
+
+void BosunImpl::setOwner(Mailbox* owner) {
+    _owner = owner;
 }
 
 void BosunImpl::runCmd(const vector<string>& words) const {
@@ -25,21 +44,49 @@ void BosunImpl::runCmd(const vector<string>& words) const {
         err("No command words");
         return;
     }
-    if (_cmds.find(words[0]) == _cmds.end()) {
+    // Entries are never removed, so they stay valid after the lookup
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    const auto it = _cmds.find(words[0]);
+    const bool found = it != _cmds.end();
+    xSemaphoreGive(_lock);
+    if (!found) {
         err("Unknown command [%s]", words[0].c_str());
         return;
     }
-    _cmds.at(words[0]).run(words);
+    const Entry& e = it->second;
+    if (!e.owner) {
+        e.cmd.run(words);
+        return;
+    }
+    // Output goes where the caller's does, e.g. a remote shell session
+    FILE* const out = stdout;
+    const bool called = e.owner->call([&e, &words, out]() {
+        FILE* const prev = stdout;
+        stdout = out;
+        e.cmd.run(words);
+        fflush(stdout);
+        stdout = prev;
+    });
+    if (!called) {
+        err("Busy, try [%s] again", words[0].c_str());
+    }
 }
 
 bool BosunImpl::init() {
+    _lock = Mem::mutex();
+    if (!_lock) {
+        err("Fail create mutex");
+        return false;
+    }
     addCmd(
         "help", Cmd(
             "\tPrint all commands and their help messages", 
             [this](const vector<string>& args) { 
+                xSemaphoreTake(_lock, portMAX_DELAY);
                 for (auto& [key, val]: _cmds) {
-                    printf("%s %s\n", key.c_str(), val.getHelp().data());
+                    printf("%s %s\n", key.c_str(), val.cmd.getHelp().data());
                 }
+                xSemaphoreGive(_lock);
             }
         )
     );
@@ -11,6 +11,8 @@
 
 namespace beegram {
 
+class Mailbox;
+
 class Cmd {
 public:
     using Command = std::function<void(const std::vector<std::string>&)>;
@@ -28,8 +30,18 @@ class Bosun {
 public:
     using Hnd = std::unique_ptr<Bosun>;
     virtual void addCmd(const std::string_view& name, const Cmd& cmd) = 0;
+    /// Commands run on the task of their owner, see setOwner(), printing to
+    /// the stdout of the calling task
     virtual void runCmd(const std::vector<std::string>& words) const = 0;
     virtual bool init() = 0;
+    /**
+     * Commands the calling task adds from now on are sent to owner and run on
+     * the task which drains it, so they don't race with that task's use of
+     * their subsystem. Subsystems may be brought up by several tasks at once,
+     * each sets the owner of its own commands.
+     * @param owner Mailbox of the task; null to run on the calling task
+    */
+    virtual void setOwner(Mailbox* owner) = 0;
     static Hnd create();
 };
 
@@ -0,0 +1,151 @@
+/**
+ * @brief Minimal CBOR (RFC 8949) encoder
+*/
+
+#pragma once
+
+#include <span>
+#include <string_view>
+#include <cinttypes>
+#include <cstring>
+
+namespace beegram {
+
+/**
+ * Writes CBOR items straight into a caller's buffer, no allocation. Calls
+ * chain; on overflow further items are ignored and the result is invalid,
+ * so check ok() or size() once at the end.
+*/
+class Cbor {
+public:
+    Cbor(std::span<uint8_t> buf)
+    : _buf(buf)
+    {}
+
+    Cbor& putUint(uint64_t val) {
+        head(MAJOR_UINT, val);
+        return *this;
+    }
+
+    Cbor& putInt(int64_t val) {
+        if (val < 0) {
+            // Negative integers are encoded as -1 - n
+            head(MAJOR_NINT, static_cast<uint64_t>(-1 - val));
+        } else {
+            head(MAJOR_UINT, static_cast<uint64_t>(val));
+        }
+        return *this;
+    }
+
+    Cbor& putFloat(float val) {
+        uint32_t bits;
+        memcpy(&bits, &val, sizeof(bits));
+        if (room(5)) {
+            _buf[_pos++] = FLOAT32;
+            putBigEndian(bits, 4);
+        }
+        return *this;
+    }
+
+    Cbor& putBool(bool val) {
+        if (room(1)) {
+            _buf[_pos++] = val ? TRUE : FALSE;
+        }
+        return *this;
+    }
+
+    Cbor& putText(const std::string_view& text) {
+        head(MAJOR_TEXT, text.size());
+        put(text.data(), text.size());
+        return *this;
+    }
+
+    Cbor& putBytes(std::span<const uint8_t> data) {
+        head(MAJOR_BYTES, data.size());
+        put(data.data(), data.size());
+        return *this;
+    }
+
+    /// @brief Start an array, the next n items are its elements
+    Cbor& beginArray(size_t n) {
+        head(MAJOR_ARRAY, n);
+        return *this;
+    }
+
+    /// @brief Start a map, the next 2n items are its keys and values
+    Cbor& beginMap(size_t n) {
+        head(MAJOR_MAP, n);
+        return *this;
+    }
+
+    /// @return True if everything fit in the buffer
+    bool ok() const { return !_overflow; }
+
+    /// @return Number of bytes written; 0 on overflow
+    size_t size() const { return _overflow ? 0 : _pos; }
+
+private:
+    static constexpr uint8_t MAJOR_UINT = 0 << 5;
+    static constexpr uint8_t MAJOR_NINT = 1 << 5;
+    static constexpr uint8_t MAJOR_BYTES = 2 << 5;
+    static constexpr uint8_t MAJOR_TEXT = 3 << 5;
+    static constexpr uint8_t MAJOR_ARRAY = 4 << 5;
+    static constexpr uint8_t MAJOR_MAP = 5 << 5;
+    static constexpr uint8_t FALSE = 0xF4;
+    static constexpr uint8_t TRUE = 0xF5;
+    static constexpr uint8_t FLOAT32 = 0xFA;
+
+    bool room(size_t len) {
+        if (_overflow || _pos + len > _buf.size()) {
+            _overflow = true;
+            return false;
+        }
+        return true;
+    }
+
+    void putBigEndian(uint64_t val, size_t len) {
+        for (size_t i = len; i > 0; i--) {
+            _buf[_pos++] = static_cast<uint8_t>(val >> (8 * (i - 1)));
+        }
+    }
+
+    /// @brief Major type with its argument in the shortest form
+    void head(uint8_t major, uint64_t val) {
+        if (val < 24) {
+            if (room(1)) {
+                _buf[_pos++] = major | static_cast<uint8_t>(val);
+            }
+        } else if (val <= 0xFF) {
+            if (room(2)) {
+                _buf[_pos++] = major | 24;
+                putBigEndian(val, 1);
+            }
+        } else if (val <= 0xFFFF) {
+            if (room(3)) {
+                _buf[_pos++] = major | 25;
+                putBigEndian(val, 2);
+            }
+        } else if (val <= 0xFFFFFFFF) {
+            if (room(5)) {
+                _buf[_pos++] = major | 26;
+                putBigEndian(val, 4);
+            }
+        } else if (room(9)) {
+            _buf[_pos++] = major | 27;
+            putBigEndian(val, 8);
+        }
+    }
+
+    void put(const void* data, size_t len) {
+        if (room(len)) {
+            memcpy(&_buf[_pos], data, len);
+            _pos += len;
+        }
+    }
+
+    std::span<uint8_t> _buf;
+    size_t _pos = 0;
+    bool _overflow = false;
+};
+
+} // namespace
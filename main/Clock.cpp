@@ -0,0 +1,279 @@
+#include "Clock.hpp"
+#include "Log.hpp"
+#include "Bosun.hpp"
+#include "Param.hpp"
+#include "Params.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
+#include "esp_rom_crc.h"
+#include "esp_attr.h"
+#include "esp_cpu.h"
+#include "esp_netif_sntp.h"
+
+#include <sys/time.h>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace beegram {
+
+/// @brief Estimates and the latest sync, kept across sleep
+struct ClockCache {
+    uint32_t magic;
+    int64_t syncUtcUs;      ///< UTC of the latest sync; 0 if none
+    float ratePpm;
+    float rtcPpm;
+    uint32_t rateCount;     ///< Measurements averaged into ratePpm
+    uint32_t rtcCount;      ///< Measurements averaged into rtcPpm
+    uint32_t crc;           ///< Of everything above
+};
+
+/// Survives deep sleep and software resets, like the RTC time it corrects
+static RTC_NOINIT_ATTR ClockCache rtcCache;
+
+class ClockImpl : public Clock {
+public:
+    ClockImpl(Param& param, Bosun& bosun)
+    : _param(param), _bosun(bosun)
+    {}
+    virtual bool init() override;
+    virtual int64_t toUtcMs(int64_t timeUs) const override;
+    virtual bool sync() override;
+    virtual Stats getStats() const override;
+private:
+    static constexpr uint32_t CACHE_MAGIC = 0x4B4C4342;  // "BCLK"
+    static constexpr TickType_t SYNC_TIMEOUT = pdMS_TO_TICKS(5000);
+    /// Anything earlier is a clock that was never set, 2025-01-01
+    static constexpr int64_t MIN_UTC_US = 1735689600LL * 1000 * 1000;
+    /// Shorter spans don't resolve a rate against the jitter of SNTP
+    static constexpr int64_t MIN_SPAN_US = 10LL * 60 * 1000 * 1000;
+    /// Crystals are within tens of ppm, anything beyond is a bad sync
+    static constexpr float RATE_MAX_PPM = 500.0F;
+    /// The RC oscillator of the RTC is within a few percent
+    static constexpr float RTC_MAX_PPM = 50000.0F;
+    /// Weight of a new measurement in the running estimates
+    static constexpr float GAIN = 0.5F;
+    /// @brief Time since boot to UTC, linear between syncs
+    struct Anchor {
+        int64_t timeUs;
+        int64_t utcUs;
+        float ratePpm;
+    };
+
+    static uint32_t cacheCrc();
+    static void seal();
+    static bool estimate(float& est, uint32_t& count, float measured, float maxPpm, const char* what);
+    int64_t map(const Anchor& anchor, int64_t timeUs) const;
+    void discipline(int64_t timeUs, int64_t utcUs);
+    void print() const;
+
+    Param& _param;
+    Bosun& _bosun;
+    string _server;
+    int64_t _periodUs = 0;
+    Anchor _anchor = {};
+    Stats _stats = {};
+    /// Mapping is read by the tasks which encode, written by the uplink's
+    mutable portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+static const char* sourceName(Clock::Source source) {
+    switch (source) {
+        case Clock::Source::NONE:   return "none";
+        case Clock::Source::RTC:    return "rtc";
+        case Clock::Source::SNTP:   return "sntp";
+        default:                    return "unknown";
+    }
+}
+
+static int64_t wallUs() {
+    timeval tv;
+    gettimeofday(&tv, nullptr);
+    return static_cast<int64_t>(tv.tv_sec) * 1000 * 1000 + tv.tv_usec;
+}
+
+IRAM_ATTR uint32_t Clock::stamp() {
+    return esp_cpu_get_cycle_count();
+}
+
+int64_t Clock::stampToUs(uint32_t stamp) {
+    // The cycle count is far finer than the timer, read back to back they
+    // give the timer's value at the stamp
+    const uint32_t nowCycles = esp_cpu_get_cycle_count();
+    const int64_t nowUs = esp_timer_get_time();
+    return nowUs - static_cast<int64_t>((nowCycles - stamp) / esp_rom_get_cpu_ticks_per_us());
+}
+
+uint32_t ClockImpl::cacheCrc() {
+    return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(&rtcCache), offsetof(ClockCache, crc));
+}
+
+void ClockImpl::seal() {
+    rtcCache.magic = CACHE_MAGIC;
+    rtcCache.crc = cacheCrc();
+}
+
+bool ClockImpl::init() {
+    if (CACHE_MAGIC != rtcCache.magic || cacheCrc() != rtcCache.crc) {
+        // Power on or corrupted, nothing measured yet
+        memset(&rtcCache, 0, sizeof(rtcCache));
+        seal();
+    }
+    _server = _param.get(Params::TIME_SERVER);
+    _periodUs = static_cast<int64_t>(_param.get(Params::TIME_SYNC)) * 1000 * 1000;
+    _stats.ratePpm = rtcCache.ratePpm;
+    _stats.rtcPpm = rtcCache.rtcPpm;
+    const int64_t timeUs = esp_timer_get_time();
+    const int64_t rtcUs = wallUs();
+    if (rtcUs >= MIN_UTC_US) {
+        // The RTC kept time since the latest sync, take off its drift
+        const int64_t sinceUs = 0 != rtcCache.syncUtcUs ? rtcUs - rtcCache.syncUtcUs : 0;
+        _anchor.timeUs = timeUs;
+        _anchor.utcUs = rtcUs - llround(sinceUs * (rtcCache.rtcPpm * 1e-6));
+        _anchor.ratePpm = rtcCache.ratePpm;
+        _stats.source = Source::RTC;
+        debug("RTC time %" PRId64 " s after sync, corrected by %" PRId64 " ms",
+            sinceUs / (1000 * 1000), (rtcUs - _anchor.utcUs) / 1000);
+    }
+    _bosun.addCmd(
+        "clock", Cmd(
+            "\n\tShow the time, its source and the drift of the clocks",
+            [this](const vector<string>& args) { print(); }
+        )
+    );
+    return true;
+}
+
+int64_t ClockImpl::map(const Anchor& anchor, int64_t timeUs) const {
+    const int64_t spanUs = timeUs - anchor.timeUs;
+    return anchor.utcUs + spanUs + llround(spanUs * (anchor.ratePpm * 1e-6));
+}
+
+int64_t ClockImpl::toUtcMs(int64_t timeUs) const {
+    portENTER_CRITICAL(&_lock);
+    const Anchor anchor = _anchor;
+    const Source source = _stats.source;
+    portEXIT_CRITICAL(&_lock);
+    return Source::NONE == source ? 0 : map(anchor, timeUs) / 1000;
+}
+
+Clock::Stats ClockImpl::getStats() const {
+    portENTER_CRITICAL(&_lock);
+    const Stats stats = _stats;
+    portEXIT_CRITICAL(&_lock);
+    return stats;
+}
+
+bool ClockImpl::sync() {
+    if (Source::SNTP == _stats.source && esp_timer_get_time() - _stats.lastSyncUs < _periodUs) {
+        return true;
+    }
+    if (_server.empty()) {
+        return false;
+    }
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(_server.c_str());
+    // Steps the system time at once, the mapping is disciplined here
+    config.smooth_sync = false;
+    sntp_set_sync_status(SNTP_SYNC_STATUS_RESET);
+    esp_err_t ret = esp_netif_sntp_init(&config);
+    if (ESP_OK != ret) {
+        err("Fail init SNTP: %s", esp_err_to_name(ret));
+        _stats.failures++;
+        return false;
+    }
+    ret = esp_netif_sntp_sync_wait(SYNC_TIMEOUT);
+    // Both clocks read back to back, the system time was just set by SNTP
+    const int64_t utcUs = wallUs();
+    const int64_t timeUs = esp_timer_get_time();
+    esp_netif_sntp_deinit();
+    if (ESP_OK != ret) {
+        warn("Fail sync with [%s]: %s", _server.c_str(), esp_err_to_name(ret));
+        _stats.failures++;
+        return false;
+    }
+    discipline(timeUs, utcUs);
+    return Source::SNTP == _stats.source;
+}
+
+bool ClockImpl::estimate(float& est, uint32_t& count, float measured, float maxPpm, const char* what) {
+    if (fabsf(measured) > maxPpm) {
+        warn("Implausible %s %.1f ppm ignored", what, measured);
+        return false;
+    }
+    est = (0 == count) ? measured : est + GAIN * (measured - est);
+    count++;
+    return true;
+}
+
+void ClockImpl::discipline(int64_t timeUs, int64_t utcUs) {
+    if (utcUs < MIN_UTC_US) {
+        warn("Implausible time %" PRId64 " s", utcUs / (1000 * 1000));
+        _stats.failures++;
+        return;
+    }
+    const int64_t errorUs = (Source::NONE == _stats.source) ? 0 : utcUs - map(_anchor, timeUs);
+    if (Source::SNTP == _stats.source) {
+        // Crystal rate since the previous sync of this boot
+        const int64_t spanUs = timeUs - _anchor.timeUs;
+        if (spanUs >= MIN_SPAN_US) {
+            const double measured = static_cast<double>(utcUs - _anchor.utcUs - spanUs) * 1e6 / spanUs;
+            estimate(rtcCache.ratePpm, rtcCache.rateCount, measured, RATE_MAX_PPM, "rate");
+        }
+    } else if (Source::RTC == _stats.source && 0 != rtcCache.syncUtcUs) {
+        // First sync after a wake, what's left over is drift the correction
+        // at boot didn't take off
+        const int64_t sinceUs = utcUs - rtcCache.syncUtcUs;
+        if (sinceUs >= MIN_SPAN_US) {
+            const double measured = rtcCache.rtcPpm - static_cast<double>(errorUs) * 1e6 / sinceUs;
+            estimate(rtcCache.rtcPpm, rtcCache.rtcCount, measured, RTC_MAX_PPM, "RTC drift");
+        }
+    }
+    rtcCache.syncUtcUs = utcUs;
+    seal();
+    portENTER_CRITICAL(&_lock);
+    _anchor = { timeUs, utcUs, rtcCache.ratePpm };
+    _stats.source = Source::SNTP;
+    _stats.syncs++;
+    _stats.lastSyncUs = timeUs;
+    _stats.lastErrorUs = errorUs;
+    _stats.ratePpm = rtcCache.ratePpm;
+    _stats.rtcPpm = rtcCache.rtcPpm;
+    portEXIT_CRITICAL(&_lock);
+    info("Synced, error %" PRId64 " us, rate %.2f ppm, RTC drift %.0f ppm", errorUs, rtcCache.ratePpm, rtcCache.rtcPpm);
+}
+
+void ClockImpl::print() const {
+    const Stats st = getStats();
+    const int64_t utcMs = toUtcMs(esp_timer_get_time());
+    if (0 != utcMs) {
+        const time_t s = utcMs / 1000;
+        tm t;
+        gmtime_r(&s, &t);
+        char text[32];
+        strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &t);
+        printf("%s.%03d UTC\n", text, static_cast<int>(utcMs % 1000));
+    }
+    printf("source %s server [%s]\n", sourceName(st.source), _server.c_str());
+    printf("syncs %lu failures %lu", static_cast<unsigned long>(st.syncs), static_cast<unsigned long>(st.failures));
+    if (0 != st.syncs) {
+        printf(" last %" PRId64 " s ago error %" PRId64 " us",
+            (esp_timer_get_time() - st.lastSyncUs) / (1000 * 1000), st.lastErrorUs);
+    }
+    printf("\nrate %.2f ppm (%lu) RTC drift %.0f ppm (%lu)\n",
+        st.ratePpm, static_cast<unsigned long>(rtcCache.rateCount),
+        st.rtcPpm, static_cast<unsigned long>(rtcCache.rtcCount));
+}
+
+Clock::Hnd Clock::create(Param& param, Bosun& bosun) {
+    return make_unique<ClockImpl>(param, bosun);
+}
+
+} // namespace
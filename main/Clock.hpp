@@ -0,0 +1,79 @@
+/**
+ * @brief Wall clock time of samples, rollups and events
+*/
+
+#pragma once
+
+#include <memory>
+#include <cinttypes>
+
+namespace beegram {
+
+class Param; class Bosun;
+
+/**
+ * Maps time since boot, as kept by the crystal-driven esp_timer, to UTC.
+ * The mapping is anchored at the latest SNTP sync and runs at the rate of the
+ * crystal as measured between syncs. Across deep sleep and software resets
+ * only the RTC keeps time, from an RC oscillator which drifts far more. Its
+ * drift is measured by the first sync after a wake and taken off the RTC time
+ * at the next. Events are stamped with the cycle count where they happen,
+ * e.g. in an ISR, and converted later, so the latency of the task which
+ * handles them doesn't show in their time.
+*/
+class Clock {
+public:
+    using Hnd = std::unique_ptr<Clock>;
+    /// @brief What the mapping rests on
+    enum class Source : uint8_t {
+        NONE,   ///< Nothing, e.g. after power on until the first sync
+        RTC,    ///< Time kept by the RTC across sleep, corrected for its drift
+        SNTP,   ///< Sync during this boot
+    };
+    struct Stats {
+        Source source;
+        uint32_t syncs;         ///< Successful syncs this boot
+        uint32_t failures;      ///< Failed syncs this boot
+        int64_t lastSyncUs;     ///< Latest sync, us since boot; 0 if none
+        int64_t lastErrorUs;    ///< Error of the mapping found by the latest sync
+        float ratePpm;          ///< Rate error of the crystal
+        float rtcPpm;           ///< Drift of the time kept across sleep
+    };
+    virtual ~Clock() = default;
+
+    /**
+     * Take up the mapping kept across sleep and register the command clock
+     * @return True on success; false on failure
+    */
+    virtual bool init() = 0;
+
+    /**
+     * Map a time to UTC
+     * @param timeUs Time in us since boot
+     * @return UTC in ms since the epoch; 0 if unknown
+    */
+    virtual int64_t toUtcMs(int64_t timeUs) const = 0;
+
+    /**
+     * Sync with the SNTP server if due. Call while the network is up, blocks
+     * until the server answers or gives up.
+     * @return True if the mapping rests on a sync of this boot; false otherwise
+    */
+    virtual bool sync() = 0;
+
+    virtual Stats getStats() const = 0;
+
+    /// @return Cycle count as a stamp of an event, cheap enough for an ISR
+    static uint32_t stamp();
+
+    /**
+     * Convert a stamp to time since boot. Call on the core which took it,
+     * within a few seconds as the cycle count wraps.
+     * @return Time of the stamp, us since boot
+    */
+    static int64_t stampToUs(uint32_t stamp);
+
+    static Hnd create(Param& param, Bosun& bosun);
+};
+
+} // namespace
@@ -1,10 +1,244 @@
 #include "Cloud.hpp"
 #include "Log.hpp"
+#include "Mem.hpp"
+#include "Wifi.hpp"
+#include "Mqtt.hpp"
+#include "Telemetry.hpp"
+#include "Clock.hpp"
+#include "Co.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#include <atomic>
+#include <cstring>
+
+using namespace std;
 
 namespace beegram {
 
-void Cloud::cloudStuff() const {
-    //info("Here we are!");
+class CloudImpl : public Cloud {
+public:
+    CloudImpl(Wifi& wifi, Mqtt& mqtt, Clock& clock, Co::Executor& executor)
+    : _wifi(wifi), _mqtt(mqtt), _clock(clock), _executor(executor), _wake(executor)
+    {}
+    virtual bool init() override;
+    virtual bool publish(const string_view& topic, const string_view& payload, Priority prio) override;
+    virtual bool publish(const string_view& topic, const Fill& fill, Priority prio) override;
+    virtual void setExchange(const Exchange& exchange) override { _exchange = exchange; }
+    virtual bool hasUplink() const override { return _uplink.load(); }
+private:
+    static constexpr size_t TOPIC_MAX_LEN = 24;
+    static constexpr size_t URGENT_QUEUE_LEN = 4;
+    static constexpr size_t NORMAL_QUEUE_LEN = 8;
+    /// Messages are encoded in place in a pool of buffers, queues carry indices
+    static constexpr size_t POOL_LEN = URGENT_QUEUE_LEN + NORMAL_QUEUE_LEN;
+    static constexpr TickType_t FLUSH_PERIOD = pdMS_TO_TICKS(60 * 1000);
+    static constexpr uint32_t CONNECT_TIMEOUT_MS = 10 * 1000;
+    static constexpr uint32_t WAKE = 1 << 0;
+
+    struct Msg {
+        char topic[TOPIC_MAX_LEN];
+        uint8_t payload[PAYLOAD_MAX_LEN];
+        uint16_t len;
+    };
+    using Slot = uint8_t;
+
+    Co::Task run();
+    bool transmit(const Msg& msg);
+    bool drain(QueueHandle_t queue);
+    void reportLink();
+    bool connect();
+    void disconnect();
+
+    Wifi& _wifi;
+    Mqtt& _mqtt;
+    Clock& _clock;
+    Co::Executor& _executor;
+    Co::Flags _wake;
+    bool _online = false;
+    Msg _pool[POOL_LEN];
+    QueueHandle_t _free = nullptr;
+    QueueHandle_t _urgent = nullptr;
+    QueueHandle_t _normal = nullptr;
+    Exchange _exchange;
+    /// Set once the queues are, publishers may run before
+    atomic<bool> _up = false;
+    /// As found by the latest flush, taken as up before the first
+    atomic<bool> _uplink = true;
+};
+
+bool CloudImpl::init() {
+    _free = Mem::queue(POOL_LEN, sizeof(Slot));
+    _urgent = Mem::queue(URGENT_QUEUE_LEN, sizeof(Slot));
+    _normal = Mem::queue(NORMAL_QUEUE_LEN, sizeof(Slot));
+    if (!_free || !_urgent || !_normal) {
+        err("Fail create queues");
+        return false;
+    }
+    for (Slot i = 0; i < POOL_LEN; i++) {
+        xQueueSend(_free, &i, 0);
+    }
+    _up.store(true, memory_order_release);
+    return _executor.spawn("cloud", run());
+}
+
+bool CloudImpl::publish(const string_view& topic, const string_view& payload, Priority prio) {
+    if (payload.size() > PAYLOAD_MAX_LEN) {
+        err("Message too long: %u B", static_cast<unsigned>(payload.size()));
+        return false;
+    }
+    auto copy = [&payload](span<uint8_t> buf) {
+        memcpy(buf.data(), payload.data(), payload.size());
+        return payload.size();
+    };
+    return publish(topic, copy, prio);
+}
+
+bool CloudImpl::publish(const string_view& topic, const Fill& fill, Priority prio) {
+    if (!_up.load(memory_order_acquire)) {
+        // The network is brought up in the background
+        return false;
+    }
+    if (topic.size() >= TOPIC_MAX_LEN) {
+        err("Topic too long: %u B", static_cast<unsigned>(topic.size()));
+        return false;
+    }
+    Slot slot;
+    if (pdTRUE != xQueueReceive(_free, &slot, 0)) {
+        warn("Out of buffers, drop [%.*s]", static_cast<int>(topic.size()), topic.data());
+        return false;
+    }
+    Msg& msg = _pool[slot];
+    memcpy(msg.topic, topic.data(), topic.size());
+    msg.topic[topic.size()] = '\0';
+    msg.len = fill(span<uint8_t>(msg.payload, sizeof(msg.payload)));
+    if (0 == msg.len) {
+        err("Fail encode [%s]", msg.topic);
+        xQueueSend(_free, &slot, 0);
+        return false;
+    }
+    if (Priority::URGENT == prio) {
+        if (pdTRUE != xQueueSend(_urgent, &slot, 0)) {
+            warn("Urgent queue full, drop [%s]", msg.topic);
+            xQueueSend(_free, &slot, 0);
+            return false;
+        }
+        // Wake the worker at once instead of waiting for the next flush
+        _wake.set(WAKE);
+    } else if (pdTRUE != xQueueSend(_normal, &slot, 0)) {
+        warn("Queue full, drop [%s]", msg.topic);
+        xQueueSend(_free, &slot, 0);
+        return false;
+    } else if (0 == uxQueueSpacesAvailable(_normal)) {
+        // Batch is full, flush early
+        _wake.set(WAKE);
+    }
+    return true;
+}
+
+bool CloudImpl::transmit(const Msg& msg) {
+    if (!_online) {
+        // No uplink configured, just account for what would be sent
+        info("-> [%s] %u B", msg.topic, msg.len);
+        trace_dump(msg.payload, msg.len);
+        return true;
+    }
+    debug("-> [%s] %u B", msg.topic, msg.len);
+    return _mqtt.publish(msg.topic, string_view(reinterpret_cast<const char*>(msg.payload), msg.len));
+}
+
+bool CloudImpl::connect() {
+    if (!_wifi.connect(CONNECT_TIMEOUT_MS)) {
+        return false;
+    }
+    if (!_mqtt.connect()) {
+        _wifi.disconnect();
+        return false;
+    }
+    _online = true;
+    return true;
+}
+
+void CloudImpl::disconnect() {
+    _mqtt.disconnect();
+    _wifi.disconnect();
+    _online = false;
+}
+
+void CloudImpl::reportLink() {
+    // Time to connected and handshake resumption across the fleet show what
+    // the fast paths buy
+    Msg msg;
+    strcpy(msg.topic, "link");
+    msg.len = Telemetry::encodeLink(span<uint8_t>(msg.payload, sizeof(msg.payload)), _wifi.getStats(), _mqtt.getStats());
+    transmit(msg);
+}
+
+bool CloudImpl::drain(QueueHandle_t queue) {
+    Slot slot;
+    while (pdTRUE == xQueueReceive(queue, &slot, 0)) {
+        if (!transmit(_pool[slot])) {
+            // Keep it for the next flush
+            xQueueSendToFront(queue, &slot, 0);
+            return false;
+        }
+        xQueueSend(_free, &slot, 0);
+    }
+    return true;
+}
+
+Co::Task CloudImpl::run() {
+    TickType_t lastFlush = xTaskGetTickCount();
+    while (true) {
+        co_await _wake.wait(WAKE, FLUSH_PERIOD);
+        const bool flushDue = xTaskGetTickCount() - lastFlush >= FLUSH_PERIOD;
+        const bool urgent = uxQueueMessagesWaiting(_urgent) > 0;
+        if (!urgent && !flushDue && 0 != uxQueueSpacesAvailable(_normal)) {
+            continue;
+        }
+        if (0 == uxQueueMessagesWaiting(_urgent) + uxQueueMessagesWaiting(_normal)) {
+            lastFlush = xTaskGetTickCount();
+            continue;
+        }
+        // Bringing the link up allocates, it's torn down after the flush
+        Mem::Allow allow;
+        // Without an uplink configured messages are only logged
+        const bool configured = _wifi.isConfigured() && _mqtt.isConfigured();
+        _uplink.store(configured);
+        if (configured) {
+            if (!connect()) {
+                _uplink.store(false);
+                // Keep the messages for the next flush
+                warn("Offline, %u messages held", uxQueueMessagesWaiting(_urgent) + uxQueueMessagesWaiting(_normal));
+                lastFlush = xTaskGetTickCount();
+                continue;
+            }
+            reportLink();
+            // Queued messages carry their times already, the sync serves
+            // those to come
+            _clock.sync();
+        }
+        // Urgent messages always go first. The connection is up anyway, so
+        // send the batch along.
+        if (drain(_urgent)) {
+            drain(_normal);
+        }
+        if (_online && _exchange) {
+            _exchange();
+            // Events detected meanwhile don't wait for the next flush
+            drain(_urgent);
+        }
+        lastFlush = xTaskGetTickCount();
+        if (_online) {
+            disconnect();
+        }
+    }
+}
+
+Cloud::Hnd Cloud::create(Wifi& wifi, Mqtt& mqtt, Clock& clock, Co::Executor& executor) {
+    return make_unique<CloudImpl>(wifi, mqtt, clock, executor);
 }
 
 } // namespace beegram
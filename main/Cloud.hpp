@@ -1,11 +1,88 @@
+/**
+ * @brief Uplink of measurements and events to cloud
+*/
+
 #ifndef _CLOUD_HPP_
 #define _CLOUD_HPP_
 
+#include <memory>
+#include <string_view>
+#include <span>
+#include <functional>
+#include <cinttypes>
+
+#include "Co.hpp"
+
 namespace beegram {
 
+class Wifi; class Mqtt; class Clock;
+
 class Cloud {
 public:
-    void cloudStuff() const;
+    using Hnd = std::unique_ptr<Cloud>;
+    /// Longest payload of a message
+    static constexpr size_t PAYLOAD_MAX_LEN = 200;
+    /// @brief Delivery priority of a published message
+    enum class Priority {
+        NORMAL,     ///< Batched and sent on the next periodic flush
+        URGENT,     ///< Sent at once, ahead of any queued normal messages
+    };
+    /**
+     * Encodes a message in place
+     * @param buf Transport buffer to write the payload into
+     * @return Length of the payload; 0 to cancel, e.g. if it didn't fit
+    */
+    using Fill = std::function<size_t(std::span<uint8_t> buf)>;
+    /// Talks to the backend over the connected transport
+    using Exchange = std::function<void()>;
+    virtual ~Cloud() = default;
+
+    /**
+     * Start the uplink coroutine
+     * @return True on success; false on failure
+    */
+    virtual bool init() = 0;
+
+    /**
+     * Queue a message for the uplink. Does not block.
+     * @param topic Topic (channel) of the message
+     * @param payload Message content
+     * @param prio Delivery priority
+     * @return True if queued; false if not up yet, the queue was full or message too long
+    */
+    virtual bool publish(const std::string_view& topic, const std::string_view& payload, Priority prio) = 0;
+
+    /**
+     * Queue a message encoded straight into a transport buffer, without
+     * intermediate copies. Does not block.
+     * @param topic Topic (channel) of the message
+     * @param fill Called once, on the calling task, to write the payload
+     * @param prio Delivery priority
+     * @return True if queued; false if not up yet, out of buffers or fill cancelled
+    */
+    virtual bool publish(const std::string_view& topic, const Fill& fill, Priority prio) = 0;
+
+    /**
+     * Set what runs on the connected uplink after the live messages of each
+     * flush, e.g. acknowledgements and backfills. Urgent messages queued
+     * meanwhile are sent after it.
+     * @param exchange Called on the task of the uplink; set before init()
+    */
+    virtual void setExchange(const Exchange& exchange) = 0;
+
+    /// @return False if no uplink is configured or the latest flush couldn't connect
+    virtual bool hasUplink() const = 0;
+
+    /**
+     * Create the uplink
+     * @param wifi Connectivity, brought up for each flush and down after
+     * @param mqtt Transport, one connection carries the whole flush
+     * @param clock Synced while the link is up
+     * @param executor Runs the uplink, its stack must fit a TLS handshake.
+     * Connects, syncs and exchanges block it for up to seconds, so it
+     * should run nothing which can't wait that long.
+    */
+    static Hnd create(Wifi& wifi, Mqtt& mqtt, Clock& clock, Co::Executor& executor);
 };
 
 } // namespace beegram
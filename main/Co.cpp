@@ -0,0 +1,354 @@
+#include "Co.hpp"
+#include "Log.hpp"
+#include "Bosun.hpp"
+
+#include "freertos/task.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace beegram {
+
+/// Set by the frame allocation, taken by the promise made right after it
+static thread_local size_t lastFrameLen = 0;
+
+void* Co::Task::promise_type::operator new(size_t len) {
+    lastFrameLen = len;
+    return ::operator new(len);
+}
+
+void Co::Task::promise_type::operator delete(void* p, size_t len) {
+    ::operator delete(p, len);
+}
+
+Co::Task::promise_type::promise_type()
+: frameLen(lastFrameLen)
+{}
+
+Co::Task::promise_type::~promise_type() {
+    if (done) {
+        *done = true;
+    }
+}
+
+//---------------------------------------------------------------------
+// Sources
+//---------------------------------------------------------------------
+
+Co::Source::Source(Executor& executor, QueueHandle_t queue)
+: _executor(executor), _queue(queue)
+{}
+
+void Co::Source::post() {
+    if (!_posted.exchange(true) && !_executor.post(*this)) {
+        _posted = false;
+    }
+}
+
+void Co::Source::postFromIsr(BaseType_t* highTask) {
+    if (!_posted.exchange(true) && !_executor.postFromIsr(*this, highTask)) {
+        _posted = false;
+    }
+}
+
+bool Co::Source::poll(Waiter& w) {
+    if (w.item) {
+        if (pdTRUE != xQueueReceive(_queue, w.item, 0)) {
+            return false;
+        }
+        w.got = 1;
+        return true;
+    }
+    const uint32_t got = _bits & w.mask;
+    if (0 == got) {
+        return false;
+    }
+    // Only what was seen, bits set meanwhile stay for the next wait
+    _bits.fetch_and(~got);
+    w.got = got;
+    return true;
+}
+
+void Co::Flags::set(uint32_t bits) {
+    _bits.fetch_or(bits);
+    post();
+}
+
+void Co::Flags::setFromIsr(uint32_t bits, BaseType_t* highTask) {
+    _bits.fetch_or(bits);
+    postFromIsr(highTask);
+}
+
+Co::Await::Await(Source* source, uint32_t mask, void* item, TickType_t timeout)
+: _w{ {}, source, mask, item, timeout, 0, 0, nullptr, nullptr }
+{}
+
+bool Co::Await::await_ready() {
+    if (!_w.source) {
+        return 0 == _w.timeout;
+    }
+    return _w.source->poll(_w);
+}
+
+void Co::Await::await_suspend(coroutine_handle<> handle) {
+    Executor* executor = Executor::current();
+    // Only coroutines wait, and only on their own executor
+    assert(executor);
+    assert(!_w.source || &_w.source->_executor == executor);
+    _w.handle = handle;
+    executor->suspend(_w);
+}
+
+Interrupt::Hnd Co::onEdge(Gpio& pin, Gpio::IntrTrig trig, Flags& flags, uint32_t bits) {
+    auto isr = [&flags, bits]() {
+        BaseType_t highTask = 0;
+        flags.setFromIsr(bits, &highTask);
+        portYIELD_FROM_ISR(highTask);
+    };
+    return pin.addIsr(isr, trig);
+}
+
+//---------------------------------------------------------------------
+// Executor
+//---------------------------------------------------------------------
+
+class ExecutorImpl : public Co::Executor {
+public:
+    ExecutorImpl(const Tasks::Cfg& cfg)
+    : _cfg(cfg)
+    {}
+    virtual bool init() override;
+    virtual bool spawn(const char* name, Co::Task task) override;
+    virtual bool post(Co::Source& source) override;
+    virtual bool postFromIsr(Co::Source& source, BaseType_t* highTask) override;
+    virtual void suspend(Co::Waiter& w) override;
+    void print() const;
+private:
+    /// Each source and spawn has at most one post in flight
+    static constexpr size_t POST_QUEUE_LEN = 16;
+    static constexpr size_t MAX_ACTIVITIES = 8;
+
+    /// @brief Posted to the executor task
+    struct Post {
+        Co::Source* source;     ///< Has waiters to check; null for a spawn
+        coroutine_handle<> spawn;
+    };
+    /// @brief Coroutine spawned, kept for the statistics
+    struct Activity {
+        const char* name;
+        size_t frameLen;
+        atomic<bool> done;
+    };
+
+    void run();
+    void check(Co::Source& source);
+    void expire();
+    void unlinkTimer(Co::Waiter& w);
+    static void unlinkSource(Co::Waiter& w);
+
+    const Tasks::Cfg& _cfg;
+    TaskHandle_t _task = nullptr;
+    QueueHandle_t _posts = nullptr;
+    Co::Waiter* _timers = nullptr;      ///< Soonest first
+    Activity _activities[MAX_ACTIVITIES] = {};
+    atomic<size_t> _activityCount = 0;
+};
+
+/// Executors for the shell command
+static constexpr size_t MAX_EXECUTORS = 2;
+static ExecutorImpl* executors[MAX_EXECUTORS] = {};
+static thread_local Co::Executor* currentExecutor = nullptr;
+
+bool ExecutorImpl::init() {
+    _posts = Mem::queue(POST_QUEUE_LEN, sizeof(Post));
+    if (!_posts) {
+        err("Fail create post queue");
+        return false;
+    }
+    for (auto& e: executors) {
+        if (!e) {
+            e = this;
+            break;
+        }
+    }
+    auto runTask = [](void* arg) {
+        assert(arg); static_cast<ExecutorImpl*>(arg)->run();
+    };
+    return Tasks::spawn(_cfg, runTask, this, &_task);
+}
+
+bool ExecutorImpl::spawn(const char* name, Co::Task task) {
+    const size_t i = _activityCount++;
+    if (i >= MAX_ACTIVITIES) {
+        _activityCount--;
+        err("Fail spawn %s, out of activities", name);
+        return false;
+    }
+    auto handle = task.release();
+    _activities[i].name = name;
+    _activities[i].frameLen = handle.promise().frameLen;
+    handle.promise().done = &_activities[i].done;
+    const Post p = { nullptr, handle };
+    if (pdTRUE != xQueueSend(_posts, &p, portMAX_DELAY)) {
+        handle.destroy();
+        return false;
+    }
+    return true;
+}
+
+bool ExecutorImpl::post(Co::Source& source) {
+    const Post p = { &source, nullptr };
+    if (pdTRUE != xQueueSend(_posts, &p, 0)) {
+        err("Executor %s post queue full", _cfg.name);
+        return false;
+    }
+    return true;
+}
+
+bool ExecutorImpl::postFromIsr(Co::Source& source, BaseType_t* highTask) {
+    const Post p = { &source, nullptr };
+    return pdTRUE == xQueueSendFromISR(_posts, &p, highTask);
+}
+
+void ExecutorImpl::suspend(Co::Waiter& w) {
+    if (w.source) {
+        w.next = w.source->_waiters;
+        w.source->_waiters = &w;
+    }
+    if (portMAX_DELAY == w.timeout) {
+        return;
+    }
+    // Sorted by the time left, which doesn't mind the tick count wrapping
+    const TickType_t now = xTaskGetTickCount();
+    w.deadline = now + w.timeout;
+    Co::Waiter** at = &_timers;
+    while (*at && static_cast<int32_t>((*at)->deadline - now) <= static_cast<int32_t>(w.timeout)) {
+        at = &(*at)->nextTimer;
+    }
+    w.nextTimer = *at;
+    *at = &w;
+}
+
+void ExecutorImpl::unlinkTimer(Co::Waiter& w) {
+    for (Co::Waiter** at = &_timers; *at; at = &(*at)->nextTimer) {
+        if (*at == &w) {
+            *at = w.nextTimer;
+            return;
+        }
+    }
+}
+
+void ExecutorImpl::unlinkSource(Co::Waiter& w) {
+    if (!w.source) {
+        return;
+    }
+    for (Co::Waiter** at = &w.source->_waiters; *at; at = &(*at)->next) {
+        if (*at == &w) {
+            *at = w.next;
+            return;
+        }
+    }
+}
+
+void ExecutorImpl::check(Co::Source& source) {
+    // Clear first, a post arriving while checking is checked again
+    source._posted = false;
+    // A resumed coroutine may wait again on the same source, so start over
+    // after each resume
+    bool resumed = true;
+    while (resumed) {
+        resumed = false;
+        for (Co::Waiter* w = source._waiters; w; w = w->next) {
+            if (source.poll(*w)) {
+                unlinkSource(*w);
+                unlinkTimer(*w);
+                w->handle.resume();
+                resumed = true;
+                break;
+            }
+        }
+    }
+}
+
+void ExecutorImpl::expire() {
+    const TickType_t now = xTaskGetTickCount();
+    while (_timers && static_cast<int32_t>(now - _timers->deadline) >= 0) {
+        Co::Waiter& w = *_timers;
+        _timers = w.nextTimer;
+        unlinkSource(w);
+        w.got = 0;
+        w.handle.resume();
+    }
+}
+
+void ExecutorImpl::run() {
+    currentExecutor = this;
+    while (true) {
+        TickType_t wait = portMAX_DELAY;
+        if (_timers) {
+            const int32_t left = static_cast<int32_t>(_timers->deadline - xTaskGetTickCount());
+            wait = max<int32_t>(0, left);
+        }
+        Post p;
+        if (pdTRUE == xQueueReceive(_posts, &p, wait)) {
+            if (p.source) {
+                check(*p.source);
+            } else {
+                p.spawn.resume();
+            }
+        }
+        expire();
+    }
+}
+
+void ExecutorImpl::print() const {
+    const size_t tcbLen = sizeof(StaticTask_t);
+    const size_t used = _cfg.stackLenB - uxTaskGetStackHighWaterMark(_task) * sizeof(StackType_t);
+    size_t frames = 0;
+    size_t live = 0;
+    printf("executor %s: stack %lu B, peak %u B, tcb %u B, posts %u B\n", _cfg.name,
+        static_cast<unsigned long>(_cfg.stackLenB), static_cast<unsigned>(used),
+        static_cast<unsigned>(tcbLen), static_cast<unsigned>(POST_QUEUE_LEN * sizeof(Post)));
+    for (size_t i = 0; i < min<size_t>(_activityCount, MAX_ACTIVITIES); i++) {
+        const auto& a = _activities[i];
+        printf("  %-12s frame %5u B%s\n", a.name, static_cast<unsigned>(a.frameLen), a.done ? ", done" : "");
+        if (!a.done) {
+            frames += a.frameLen;
+            live++;
+        }
+    }
+    if (live > 0) {
+        // A task each would need about the peak stack seen, plus its TCB
+        const size_t shared = _cfg.stackLenB + tcbLen + POST_QUEUE_LEN * sizeof(Post) + frames;
+        printf("  %u activities: %u B shared, %u B as tasks of the peak stack\n", static_cast<unsigned>(live),
+            static_cast<unsigned>(shared), static_cast<unsigned>(live * (used + tcbLen)));
+    }
+}
+
+Co::Executor* Co::Executor::current() {
+    return currentExecutor;
+}
+
+Co::Executor::Hnd Co::Executor::create(const Tasks::Cfg& cfg) {
+    return make_unique<ExecutorImpl>(cfg);
+}
+
+void Co::addCmds(Bosun& bosun) {
+    bosun.addCmd(
+        "co", Cmd(
+            "\n\tShow memory of coroutine executors and their activities",
+            [](const vector<string>& args) {
+                for (const auto* e: executors) {
+                    if (e) {
+                        e->print();
+                    }
+                }
+            }
+        )
+    );
+}
+
+} // namespace
@@ -0,0 +1,209 @@
+/**
+ * @brief Coroutines run by executor tasks
+ *
+ * An activity written as a coroutine keeps only its frame, typically tens
+ * to a few hundred bytes, instead of a task with its own stack. Any number
+ * of them share the stack of one executor task, which resumes them when
+ * what they wait on happens: a timeout, bits of Flags, an item in a Queue or
+ * a GPIO edge. They run one at a time until they next wait, so a blocking
+ * call in one holds up the others on the same executor.
+ *
+ *     Co::Task blink(Co::Flags& flags) {
+ *         while (true) {
+ *             if (co_await flags.wait(STOP, pdMS_TO_TICKS(500))) {
+ *                 co_return;
+ *             }
+ *             led.toggle();
+ *         }
+ *     }
+ *     executor.spawn("blink", blink(flags));
+*/
+
+#pragma once
+
+#include "Tasks.hpp"
+#include "driver/Gpio.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#include <atomic>
+#include <coroutine>
+#include <cstdlib>
+#include <memory>
+#include <utility>
+#include <cinttypes>
+
+namespace beegram {
+
+class Bosun;
+
+class Co {
+public:
+    class Executor;
+    class Source;
+
+    /// @brief Coroutine which runs on an executor once given to Executor::spawn()
+    class Task {
+    public:
+        struct promise_type {
+            promise_type();
+            ~promise_type();
+            Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { abort(); }
+            // Frames are counted like other allocations, see Mem
+            static void* operator new(size_t len);
+            static void operator delete(void* p, size_t len);
+
+            size_t frameLen;                        ///< Bytes allocated for the frame
+            std::atomic<bool>* done = nullptr;      ///< Set when the coroutine returns
+        };
+        Task(Task&& other) noexcept : _handle(std::exchange(other._handle, {})) {}
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+        /// A task which was never spawned didn't start, so it's destroyed
+        ~Task() { if (_handle) { _handle.destroy(); } }
+        std::coroutine_handle<promise_type> release() { return std::exchange(_handle, {}); }
+    private:
+        explicit Task(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+        std::coroutine_handle<promise_type> _handle;
+    };
+
+    /// @brief A suspended coroutine, linked into what it waits on
+    struct Waiter {
+        std::coroutine_handle<> handle;
+        Source* source;         ///< Null for a plain timeout
+        uint32_t mask;          ///< Bits which wake it, unless it receives an item
+        void* item;             ///< Queue item to receive into; null to wait on bits
+        TickType_t timeout;     ///< portMAX_DELAY for none
+        TickType_t deadline;
+        uint32_t got;           ///< Bits that woke it, 1 for an item; 0 on timeout
+        Waiter* next;           ///< On the source
+        Waiter* nextTimer;      ///< On the executor's timers
+    };
+
+    /// @brief Awaited to suspend until a source is ready or a timeout
+    class Await {
+    public:
+        Await(Source* source, uint32_t mask, void* item, TickType_t timeout);
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> handle);
+        uint32_t await_resume() const { return _w.got; }
+    private:
+        Waiter _w;
+    };
+
+    /// @brief What coroutines wait on, bound to one executor
+    class Source {
+    public:
+        Source(Executor& executor, QueueHandle_t queue = nullptr);
+        Source(const Source&) = delete;
+        Source& operator=(const Source&) = delete;
+    protected:
+        friend class Await;
+        friend class ExecutorImpl;
+        /// Tell the executor to check the waiters, posted once until it does
+        void post();
+        void postFromIsr(BaseType_t* highTask);
+        /// Called by the executor, true if w can resume
+        bool poll(Waiter& w);
+
+        Executor& _executor;
+        QueueHandle_t _queue;
+        std::atomic<uint32_t> _bits = 0;
+        std::atomic<bool> _posted = false;
+        Waiter* _waiters = nullptr;
+    };
+
+    /// @brief Event bits, set by any task or interrupt, cleared by the waiter they wake
+    class Flags : public Source {
+    public:
+        explicit Flags(Executor& executor) : Source(executor) {}
+        void set(uint32_t bits);
+        void setFromIsr(uint32_t bits, BaseType_t* highTask);
+        /**
+         * Suspend until any of the bits is set, and clear them
+         * @param mask Bits to wait for
+         * @param timeout Ticks to wait at most
+         * @return Awaitable giving the bits which were set; 0 on timeout
+        */
+        Await wait(uint32_t mask, TickType_t timeout = portMAX_DELAY) { return Await(this, mask, nullptr, timeout); }
+    };
+
+    /// @brief Queue filled by any task, received from by coroutines
+    template<typename T>
+    class Queue : public Source {
+    public:
+        /// @param queue Queue of items of type T, e.g. from Mem::queue()
+        Queue(Executor& executor, QueueHandle_t queue) : Source(executor, queue) {}
+        bool send(const T& item, TickType_t timeout = 0) {
+            if (pdTRUE != xQueueSend(_queue, &item, timeout)) {
+                return false;
+            }
+            post();
+            return true;
+        }
+        /**
+         * Suspend until an item arrives
+         * @param item Receives the item
+         * @param timeout Ticks to wait at most
+         * @return Awaitable giving non-zero if an item was received; 0 on timeout
+        */
+        Await receive(T& item, TickType_t timeout = portMAX_DELAY) { return Await(this, 0, &item, timeout); }
+    };
+
+    /// @brief Task which resumes coroutines
+    class Executor {
+    public:
+        using Hnd = std::unique_ptr<Executor>;
+        virtual ~Executor() = default;
+
+        /**
+         * Start the executor task
+         * @return True on success; false on failure
+        */
+        virtual bool init() = 0;
+
+        /**
+         * Hand a coroutine to the executor, it starts at the next chance
+         * @param name Name of the activity, a literal
+         * @param task The coroutine
+         * @return True on success; false if out of activities
+        */
+        virtual bool spawn(const char* name, Task task) = 0;
+
+        // For sources and awaits
+        virtual bool post(Source& source) = 0;
+        virtual bool postFromIsr(Source& source, BaseType_t* highTask) = 0;
+        virtual void suspend(Waiter& w) = 0;
+
+        /// @return Executor running the calling task; null if none
+        static Executor* current();
+
+        static Hnd create(const Tasks::Cfg& cfg);
+    };
+
+    /**
+     * Suspend the calling coroutine
+     * @param ticks Time to sleep
+    */
+    static Await sleep(TickType_t ticks) { return Await(nullptr, 0, nullptr, ticks); }
+
+    /**
+     * Set bits of flags on edges of a pin
+     * @return The interrupt, disabled; null on failure
+    */
+    static Interrupt::Hnd onEdge(Gpio& pin, Gpio::IntrTrig trig, Flags& flags, uint32_t bits);
+
+    /**
+     * Add the shell command co, which shows the memory of each executor
+     * and activity
+     * @param bosun Executes the commands
+    */
+    static void addCmds(Bosun& bosun);
+};
+
+} // namespace
@@ -0,0 +1,237 @@
+#include "Detector.hpp"
+#include "Log.hpp"
+#include "Params.hpp"
+#include "Bosun.hpp"
+
+#include <string>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+namespace beegram {
+
+/**
+ * Two-sided CUSUM on the smoothed weight, normalised to time so that tuning
+ * doesn't depend on the sample rate. Sums are in kg*s. When a sum crosses the
+ * threshold the change is held for a confirmation period to tell lasting
+ * steps from excursions which return to the old level.
+*/
+class DetectorImpl : public Detector {
+public:
+    DetectorImpl(Param& param, Bosun& bosun)
+    : _param(param), _bosun(bosun)
+    {}
+    virtual bool init(const Listener& listener) override;
+    virtual void feed(int64_t timeUs, float weightKg) override;
+private:
+    struct Tuning {
+        float driftKg;
+        float threshKgS;
+        float swarmKg;
+        float harvestKg;
+        float fastS;
+        float confirmS;
+        float refTauS;
+        float filtTauS;
+    };
+    /// @brief A tunable value, persisted in Param in milli-units
+    struct Tune {
+        const char* name;
+        const Params::I32& key;
+        float Tuning::* value;
+        const char* help;
+    };
+    static constexpr Tune TUNES[] = {
+        { "k",       Params::DET_DRIFT,    &Tuning::driftKg,   "Slack in kg ignored by the sums" },
+        { "h",       Params::DET_THRESH,   &Tuning::threshKgS, "Alarm threshold in kg*s" },
+        { "swarm",   Params::DET_SWARM,    &Tuning::swarmKg,   "Minimum sudden step in kg, e.g. a swarm" },
+        { "harvest", Params::DET_HARVEST,  &Tuning::harvestKg, "Minimum sudden drop in kg for a harvest" },
+        { "fast",    Params::DET_FAST,     &Tuning::fastS,     "Duration in s of the slowest sudden step" },
+        { "confirm", Params::DET_CONFIRM,  &Tuning::confirmS,  "Hold time in s before a change is reported" },
+        { "tau",     Params::DET_REF_TAU,  &Tuning::refTauS,   "Time constant in s of the reference level" },
+        { "filt",    Params::DET_FILT_TAU, &Tuning::filtTauS,  "Time constant in s of the input filter" },
+    };
+    enum class State { IDLE, CONFIRM };
+
+    bool setTune(const string& name, float value);
+    void printTunes() const;
+    void classify(int64_t nowUs, float stepKg);
+    void raise(Type type, int64_t nowUs, float sizeKg);
+    void restart(int64_t nowUs);
+
+    Param& _param;
+    Bosun& _bosun;
+    Listener _listener;
+    Tuning _tun = {};
+    bool _primed = false;
+    int64_t _lastUs = 0;
+    float _filt = 0.0F;     ///< Smoothed input
+    float _var = 0.0F;      ///< Variance of input around the smoothed value
+    float _ref = 0.0F;      ///< Slow reference level
+    float _pos = 0.0F;      ///< Sum of rises
+    float _neg = 0.0F;      ///< Sum of drops
+    int64_t _startUs = 0;   ///< When the currently accumulating sum left zero
+    State _state = State::IDLE;
+    int64_t _alarmUs = 0;   ///< When the sum crossed the threshold
+    float _peak = 0.0F;     ///< Largest excursion from reference during confirmation
+};
+
+const char* Detector::typeName(Type type) {
+    switch (type) {
+        case Type::SWARM:       return "swarm";
+        case Type::HARVEST:     return "harvest";
+        case Type::ADDITION:    return "addition";
+        case Type::VISIT:       return "visit";
+        case Type::FLOW_GAIN:   return "flow_gain";
+        case Type::FLOW_LOSS:   return "flow_loss";
+        default:                return "unknown";
+    }
+}
+
+bool DetectorImpl::setTune(const string& name, float value) {
+    for (const auto& t: TUNES) {
+        if (name == t.name) {
+            const int32_t milli = lroundf(value * 1000.0F);
+            if (!t.key.valid(milli)) {
+                err("Invalid %s: %f, range [%.3f, %.3f]", t.name, value, t.key.min / 1000.0F, t.key.max / 1000.0F);
+                return false;
+            }
+            _tun.*t.value = value;
+            return _param.set(t.key, milli);
+        }
+    }
+    err("Unknown tune [%s]", name.c_str());
+    return false;
+}
+
+void DetectorImpl::printTunes() const {
+    for (const auto& t: TUNES) {
+        printf("%-8s %10.3f  %s\n", t.name, _tun.*t.value, t.help);
+    }
+    printf("state %s ref=%.3f filt=%.3f sd=%.3f pos=%.1f neg=%.1f\n",
+        State::IDLE == _state ? "idle" : "confirm", _ref, _filt, sqrtf(_var), _pos, _neg);
+}
+
+bool DetectorImpl::init(const Listener& listener) {
+    _listener = listener;
+    for (const auto& t: TUNES) {
+        _tun.*t.value = _param.get(t.key) / 1000.0F;
+    }
+    _bosun.addCmd(
+        "det", Cmd(
+            "[name value]\n\tShow or set change detector tuning",
+            [this](const vector<string>& args) {
+                if (3 == args.size()) {
+                    float value;
+                    if (!Params::parse(args[2], value)) {
+                        err("Invalid value [%s]", args[2].c_str());
+                        return;
+                    }
+                    if (setTune(args[1], value)) {
+                        info("Set %s=%s", args[1].c_str(), args[2].c_str());
+                    }
+                } else if (1 != args.size()) {
+                    err("Need name and value");
+                    return;
+                }
+                printTunes();
+            }
+        )
+    );
+    return true;
+}
+
+void DetectorImpl::raise(Type type, int64_t nowUs, float sizeKg) {
+    Event ev;
+    ev.type = type;
+    ev.startUs = _startUs;
+    ev.detectUs = nowUs;
+    ev.sizeKg = sizeKg;
+    // Confidence from ratio of step to noise: a step of 3 standard
+    // deviations is a coin toss, larger steps approach certainty
+    const float noise = 3.0F * sqrtf(_var);
+    ev.confidence = fabsf(sizeKg) / (fabsf(sizeKg) + noise);
+    info("Event %s size=%.3f conf=%.2f", typeName(type), sizeKg, ev.confidence);
+    if (_listener) {
+        _listener(ev);
+    }
+}
+
+void DetectorImpl::classify(int64_t nowUs, float stepKg) {
+    // A change is sudden if it's at least as steep as the smallest sudden
+    // step spread over the longest time allowed for it
+    const float duration = (nowUs - _startUs) / 1e6F;
+    const bool sudden = fabsf(stepKg) * _tun.fastS >= _tun.swarmKg * duration;
+    if (fabsf(stepKg) < fabsf(_peak) / 2.0F) {
+        raise(Type::VISIT, nowUs, _peak);
+    } else if (!sudden) {
+        raise(stepKg > 0 ? Type::FLOW_GAIN : Type::FLOW_LOSS, nowUs, stepKg);
+    } else if (fabsf(stepKg) < _tun.swarmKg) {
+        debug("Step too small: %.3f", stepKg);
+    } else if (stepKg > 0) {
+        raise(Type::ADDITION, nowUs, stepKg);
+    } else if (-stepKg >= _tun.harvestKg) {
+        raise(Type::HARVEST, nowUs, stepKg);
+    } else {
+        raise(Type::SWARM, nowUs, stepKg);
+    }
+}
+
+void DetectorImpl::restart(int64_t nowUs) {
+    _state = State::IDLE;
+    _ref = _filt;
+    _pos = _neg = 0.0F;
+    _startUs = nowUs;
+}
+
+void DetectorImpl::feed(int64_t timeUs, float weightKg) {
+    if (!_primed || timeUs <= _lastUs) {
+        _primed = true;
+        _lastUs = timeUs;
+        _filt = weightKg;
+        _var = 0.0F;
+        restart(timeUs);
+        return;
+    }
+    const float dt = (timeUs - _lastUs) / 1e6F;
+    _lastUs = timeUs;
+
+    // Smooth the input and track its noise
+    const float innov = weightKg - _filt;
+    _filt += innov * dt / (_tun.filtTauS + dt);
+    _var += (innov * innov - _var) * dt / (10.0F * _tun.filtTauS + dt);
+
+    const float r = _filt - _ref;
+    if (State::CONFIRM == _state) {
+        if (fabsf(r) > fabsf(_peak)) {
+            _peak = r;
+        }
+        if (timeUs - _alarmUs >= static_cast<int64_t>(_tun.confirmS * 1e6F)) {
+            classify(timeUs, r);
+            restart(timeUs);
+        }
+        return;
+    }
+
+    // Reference follows the level only while nothing is accumulating, so it
+    // doesn't chase a step we're about to detect
+    if (0.0F == _pos && 0.0F == _neg) {
+        _ref += r * dt / (_tun.refTauS + dt);
+        _startUs = timeUs;
+    }
+    _pos = max(0.0F, _pos + (r - _tun.driftKg) * dt);
+    _neg = max(0.0F, _neg + (-r - _tun.driftKg) * dt);
+    if (_pos > _tun.threshKgS || _neg > _tun.threshKgS) {
+        debug("Alarm pos=%.1f neg=%.1f r=%.3f", _pos, _neg, r);
+        _state = State::CONFIRM;
+        _alarmUs = timeUs;
+        _peak = r;
+    }
+}
+
+Detector::Hnd Detector::create(Param& param, Bosun& bosun) {
+    return make_unique<DetectorImpl>(param, bosun);
+}
+
+} // namespace
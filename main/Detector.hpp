@@ -0,0 +1,58 @@
+/**
+ * @brief Streaming change-point detection on the weight series
+*/
+
+#pragma once
+
+#include <memory>
+#include <cinttypes>
+#include <functional>
+
+namespace beegram {
+
+class Param; class Bosun;
+
+class Detector {
+public:
+    using Hnd = std::unique_ptr<Detector>;
+    /// @brief Kind of change detected in hive weight
+    enum class Type : uint8_t {
+        SWARM,      ///< Sudden lasting drop of a few kg (colony leaves)
+        HARVEST,    ///< Sudden lasting large drop (supers removed)
+        ADDITION,   ///< Sudden lasting rise (super or feed added)
+        VISIT,      ///< Sudden change which returned to the old level (hive opened)
+        FLOW_GAIN,  ///< Slow lasting rise (nectar flow)
+        FLOW_LOSS,  ///< Slow lasting drop (consumption, robbing)
+    };
+    /// @brief A detected change in hive weight
+    struct Event {
+        Type type;
+        int64_t startUs;    ///< Time when the change started, us since boot
+        int64_t detectUs;   ///< Time when the change was detected, us since boot
+        float sizeKg;       ///< Size of the step (peak excursion for a visit), negative for a drop
+        float confidence;   ///< Confidence of detection in range [0, 1]
+    };
+    using Listener = std::function<void(const Event&)>;
+    virtual ~Detector() = default;
+
+    /**
+     * Load tuning and register commands
+     * @param listener Called on the feeding task for every detected event
+     * @return True on success; false on failure
+    */
+    virtual bool init(const Listener& listener) = 0;
+
+    /**
+     * Feed the next weight sample. Constant time and memory.
+     * @param timeUs Sample time in us since boot
+     * @param weightKg Weight in kg
+    */
+    virtual void feed(int64_t timeUs, float weightKg) = 0;
+
+    /// @return Short lowercase name of event type
+    static const char* typeName(Type type);
+
+    static Hnd create(Param& param, Bosun& bosun);
+};
+
+} // namespace
@@ -0,0 +1,188 @@
+#include "Factory.hpp"
+#include "Log.hpp"
+#include "Bosun.hpp"
+
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace beegram {
+
+class FactoryImpl : public Factory {
+public:
+    FactoryImpl(Bosun& bosun)
+    : _bosun(bosun)
+    {}
+    virtual ~FactoryImpl();
+    virtual bool init() override;
+    virtual string_view getId() const override;
+    virtual const Calib* getCalib() const override;
+    virtual span<const uint8_t> getCa() const override { return get(Tag::CA); }
+    virtual span<const uint8_t> getCert() const override { return get(Tag::CERT); }
+    virtual span<const uint8_t> getKey() const override { return get(Tag::KEY); }
+private:
+    static constexpr const char* PARTITION = "dev_id";
+    static constexpr uint32_t MAGIC = 0x31464742;   // "BGF1"
+    static constexpr uint16_t VERSION = 1;
+    enum class Tag : uint16_t {
+        ID      = 1,
+        CALIB   = 2,
+        CA      = 3,
+        CERT    = 4,
+        KEY     = 5,
+    };
+    struct Header {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t scheme;
+        uint16_t count;
+        uint16_t reserved;
+        uint32_t len;
+        uint32_t crc;
+    };
+    struct Record {
+        Tag tag;
+        uint16_t reserved;
+        uint32_t offset;
+        uint32_t len;
+    };
+    static_assert(20 == sizeof(Header) && 12 == sizeof(Record));
+
+    bool check(const esp_partition_t& part) const;
+    span<const uint8_t> get(Tag tag) const;
+    void print() const;
+
+    Bosun& _bosun;
+    esp_partition_mmap_handle_t _map = 0;
+    const uint8_t* _base = nullptr;     ///< Partition in flash, null if not mapped
+    bool _valid = false;
+    uint32_t _mapUs = 0;                ///< Time to map and check
+};
+
+FactoryImpl::~FactoryImpl() {
+    if (_base) {
+        esp_partition_munmap(_map);
+    }
+}
+
+bool FactoryImpl::check(const esp_partition_t& part) const {
+    const auto& h = *reinterpret_cast<const Header*>(_base);
+    if (MAGIC != h.magic) {
+        warn("No factory data");
+        return false;
+    }
+    if (VERSION != h.version) {
+        err("Unsupported factory data version %u", h.version);
+        return false;
+    }
+    if (SCHEME != h.scheme) {
+        warn("Factory data for partition scheme %u, firmware has %u", h.scheme, SCHEME);
+    }
+    const size_t end = sizeof(Header) + h.len;
+    if (h.len > part.size - sizeof(Header) || h.count * sizeof(Record) > h.len) {
+        err("Factory data length out of range: %lu", static_cast<unsigned long>(h.len));
+        return false;
+    }
+    if (h.crc != esp_rom_crc32_le(0, _base + sizeof(Header), h.len)) {
+        err("Factory data corrupt");
+        return false;
+    }
+    const auto* records = reinterpret_cast<const Record*>(_base + sizeof(Header));
+    for (uint16_t i = 0; i < h.count; i++) {
+        const Record& r = records[i];
+        if (0 != r.offset % alignof(uint32_t) || r.offset > end || r.len > end - r.offset) {
+            err("Factory record %u out of range", i);
+            return false;
+        }
+        if (Tag::CALIB == r.tag && sizeof(Calib) != r.len) {
+            err("Factory calibration of wrong size: %lu", static_cast<unsigned long>(r.len));
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FactoryImpl::init() {
+    _bosun.addCmd(
+        "factory", Cmd(
+            "\n\tShow factory data and what reading it in place saves",
+            [this](const vector<string>& args) { print(); }
+        )
+    );
+    const int64_t startUs = esp_timer_get_time();
+    const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, PARTITION);
+    if (!part) {
+        err("No partition [%s]", PARTITION);
+        return false;
+    }
+    const void* ptr = nullptr;
+    const esp_err_t ret = esp_partition_mmap(part, 0, part->size, ESP_PARTITION_MMAP_DATA, &ptr, &_map);
+    if (ESP_OK != ret) {
+        err("Fail map partition [%s]: %d", PARTITION, ret);
+        return false;
+    }
+    _base = static_cast<const uint8_t*>(ptr);
+    _valid = check(*part);
+    _mapUs = esp_timer_get_time() - startUs;
+    if (_valid) {
+        info("Factory data of [%.*s] mapped in %lu us", static_cast<int>(getId().size()), getId().data(),
+            static_cast<unsigned long>(_mapUs));
+    }
+    return _valid;
+}
+
+span<const uint8_t> FactoryImpl::get(Tag tag) const {
+    if (!_valid) {
+        return {};
+    }
+    const auto& h = *reinterpret_cast<const Header*>(_base);
+    const auto* records = reinterpret_cast<const Record*>(_base + sizeof(Header));
+    for (uint16_t i = 0; i < h.count; i++) {
+        if (tag == records[i].tag) {
+            return { _base + records[i].offset, records[i].len };
+        }
+    }
+    return {};
+}
+
+string_view FactoryImpl::getId() const {
+    const auto id = get(Tag::ID);
+    return { reinterpret_cast<const char*>(id.data()), id.size() };
+}
+
+const Factory::Calib* FactoryImpl::getCalib() const {
+    const auto calib = get(Tag::CALIB);
+    return calib.empty() ? nullptr : reinterpret_cast<const Calib*>(calib.data());
+}
+
+void FactoryImpl::print() const {
+    if (!_valid) {
+        printf("No factory data\n");
+        return;
+    }
+    const auto& h = *reinterpret_cast<const Header*>(_base);
+    printf("Id: %.*s\n", static_cast<int>(getId().size()), getId().data());
+    printf("Version %u, partition scheme %u\n", h.version, h.scheme);
+    const Calib* c = getCalib();
+    if (c) {
+        printf("Calib: load %ld at %.3f kg, load %ld at %.3f kg\n", static_cast<long>(c->loadLow), c->weightLow,
+            static_cast<long>(c->loadHigh), c->weightHigh);
+    }
+    printf("CA %u B, cert %u B, key %u B\n", static_cast<unsigned>(getCa().size()),
+        static_cast<unsigned>(getCert().size()), static_cast<unsigned>(getKey().size()));
+    // Read through NVS, every record would be a heap copy and a lookup
+    printf("Mapped and checked in %lu us, %lu B used in place\n", static_cast<unsigned long>(_mapUs),
+        static_cast<unsigned long>(sizeof(Header) + h.len));
+}
+
+Factory::Hnd Factory::create(Bosun& bosun) {
+    return make_unique<FactoryImpl>(bosun);
+}
+
+} // namespace
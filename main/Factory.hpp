@@ -0,0 +1,71 @@
+/**
+ * @brief Factory data of the device, read in place from flash
+ *
+ * Identity, certificates and calibration are written once by provisioning
+ * into the read-only partition "dev_id", see support/factory. The partition
+ * is mapped into the address space, so nothing is copied to RAM: the TLS
+ * client and the scales use pointers straight into flash.
+ *
+ * Layout, little endian, every record aligned to 4 bytes:
+ *   header  "BGF1", u16 layout version, u16 partition scheme version,
+ *           u16 record count, u16 reserved, u32 length after header,
+ *           u32 CRC-32 of the bytes after header
+ *   table   u16 tag, u16 reserved, u32 offset from partition start,
+ *           u32 length, one per record
+ *   data    records
+ * Tags are ID (1) device id text, CALIB (2) Calib, CA (3) broker CA
+ * certificate, CERT (4) device certificate, KEY (5) device private key.
+ * Certificates and key are DER.
+*/
+
+#pragma once
+
+#include <memory>
+#include <span>
+#include <string_view>
+#include <cinttypes>
+
+namespace beegram {
+
+class Bosun;
+
+class Factory {
+public:
+    using Hnd = std::unique_ptr<Factory>;
+    /// Partition scheme this firmware expects, see partitions.csv
+    static constexpr uint16_t SCHEME = 3;
+    /// @brief Calibration points measured at the factory
+    struct Calib {
+        int32_t loadLow;
+        float weightLow;
+        int32_t loadHigh;
+        float weightHigh;
+    };
+    virtual ~Factory() = default;
+
+    /**
+     * Map the partition and check its layout. A device without factory data
+     * still runs, on the defaults.
+     * @return True if factory data is present and intact; false otherwise
+    */
+    virtual bool init() = 0;
+
+    /// @return Device id; empty if none
+    virtual std::string_view getId() const = 0;
+
+    /// @return Calibration points; null if none
+    virtual const Calib* getCalib() const = 0;
+
+    /// @return CA certificate of the broker; empty if none
+    virtual std::span<const uint8_t> getCa() const = 0;
+
+    /// @return Certificate of the device; empty if none
+    virtual std::span<const uint8_t> getCert() const = 0;
+
+    /// @return Private key of the device; empty if none
+    virtual std::span<const uint8_t> getKey() const = 0;
+
+    static Hnd create(Bosun& bosun);
+};
+
+} // namespace
@@ -0,0 +1,429 @@
+#include "Hive.hpp"
+#include "Log.hpp"
+#include "Params.hpp"
+#include "Bosun.hpp"
+#include "Telemetry.hpp"
+#include "Cloud.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace beegram {
+
+static constexpr uint16_t MAGIC = 0x4842;   // "BH"
+static constexpr uint8_t VERSION = 1;
+static constexpr size_t HEADER_LEN = 16;
+
+static uint32_t nowS() {
+    return static_cast<uint32_t>(esp_timer_get_time() / (1000 * 1000));
+}
+
+template <typename T>
+static void put(uint8_t*& p, T val) {
+    memcpy(p, &val, sizeof(val));
+    p += sizeof(val);
+}
+
+template <typename T>
+static T get(const uint8_t*& p) {
+    T val;
+    memcpy(&val, p, sizeof(val));
+    p += sizeof(val);
+    return val;
+}
+
+size_t Hive::encode(span<uint8_t> out, const Batch& batch, uint32_t nowS) {
+    const size_t len = HEADER_LEN + batch.count * (sizeof(uint16_t) + sizeof(int32_t));
+    if (batch.count > BATCH_MAX || len > out.size()) {
+        return 0;
+    }
+    uint8_t* p = out.data();
+    put(p, MAGIC);
+    put(p, VERSION);
+    put(p, batch.count);
+    put(p, batch.session);
+    put(p, batch.seq);
+    put(p, nowS - batch.startS);
+    for (uint8_t i = 0; i < batch.count; i++) {
+        put(p, batch.offsetS[i]);
+    }
+    for (uint8_t i = 0; i < batch.count; i++) {
+        put(p, batch.weightG[i]);
+    }
+    return len;
+}
+
+bool Hive::decode(span<const uint8_t> frame, const Link::Addr& from, uint32_t nowS, Batch& batch) {
+    if (frame.size() < HEADER_LEN) {
+        return false;
+    }
+    const uint8_t* p = frame.data();
+    if (MAGIC != get<uint16_t>(p) || VERSION != get<uint8_t>(p)) {
+        return false;
+    }
+    batch.count = get<uint8_t>(p);
+    if (batch.count > BATCH_MAX || frame.size() != HEADER_LEN + batch.count * (sizeof(uint16_t) + sizeof(int32_t))) {
+        return false;
+    }
+    batch.node = from;
+    batch.session = get<uint32_t>(p);
+    batch.seq = get<uint32_t>(p);
+    // Nodes have no common clock, their samples are moved to ours
+    const uint32_t ageS = get<uint32_t>(p);
+    batch.startS = ageS < nowS ? nowS - ageS : 0;
+    for (uint8_t i = 0; i < batch.count; i++) {
+        batch.offsetS[i] = get<uint16_t>(p);
+    }
+    for (uint8_t i = 0; i < batch.count; i++) {
+        batch.weightG[i] = get<int32_t>(p);
+    }
+    return true;
+}
+
+class NodeImpl : public Hive::Node {
+public:
+    NodeImpl(Link& link, const Link::Addr& gateway, uint32_t periodS)
+    : _link(link), _gateway(gateway), _periodS(periodS)
+    {}
+    virtual bool init() override;
+    virtual void feed(int64_t timeUs, float weightKg) override;
+    virtual Stats getStats() const override { return _stats; }
+private:
+    /// Attempts of a batch at each send, the radio retries on its own too
+    static constexpr unsigned SEND_TRIES = 2;
+
+    bool send(const Hive::Batch& batch, uint32_t nowS);
+    void flush(uint32_t nowS);
+
+    Link& _link;
+    const Link::Addr _gateway;
+    const uint32_t _periodS;
+    uint32_t _session = 0;
+    uint32_t _seq = 0;
+    Hive::Batch _open = {};         ///< Filling
+    Hive::Batch _unsent = {};       ///< Not acknowledged, count 0 if none
+    Stats _stats = {};
+};
+
+bool NodeImpl::init() {
+    // A node which restarts counts from 0 again, the session tells
+    _session = esp_random();
+    return _link.init(nullptr);
+}
+
+bool NodeImpl::send(const Hive::Batch& batch, uint32_t nowS) {
+    uint8_t frame[Link::MTU];
+    const size_t len = Hive::encode(frame, batch, nowS);
+    for (unsigned i = 0; i < SEND_TRIES; i++) {
+        if (_link.send(_gateway, span<const uint8_t>(frame, len))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void NodeImpl::flush(uint32_t nowS) {
+    // The older batch goes first, the gateway drops it if it had arrived
+    if (_unsent.count > 0 && send(_unsent, nowS)) {
+        _stats.resent++;
+        _unsent.count = 0;
+    }
+    if (send(_open, nowS)) {
+        _stats.sent++;
+    } else {
+        if (_unsent.count > 0) {
+            _stats.dropped++;
+        }
+        _unsent = _open;
+    }
+    _open.count = 0;
+}
+
+void NodeImpl::feed(int64_t timeUs, float weightKg) {
+    const uint32_t nowS = static_cast<uint32_t>(timeUs / (1000 * 1000));
+    if (0 == _open.count) {
+        _open.session = _session;
+        _open.seq = _seq++;
+        _open.startS = nowS;
+    }
+    _open.offsetS[_open.count] = static_cast<uint16_t>(nowS - _open.startS);
+    _open.weightG[_open.count] = static_cast<int32_t>(lroundf(weightKg * 1000.0F));
+    _open.count++;
+    if (Hive::BATCH_MAX == _open.count || nowS - _open.startS >= _periodS) {
+        flush(nowS);
+    }
+}
+
+Hive::Node::Hnd Hive::Node::create(Link& link, const Link::Addr& gateway, uint32_t periodS) {
+    return make_unique<NodeImpl>(link, gateway, periodS);
+}
+
+class GatewayImpl : public Hive::Gateway {
+public:
+    GatewayImpl(Link& link, const Publish& publish, const Wake& wake, const Clock& clock)
+    : _link(link), _publish(publish), _wake(wake), _clock(clock)
+    {}
+    virtual bool init() override;
+    virtual bool forward() override;
+    virtual Stats getStats() const override { return _stats; }
+private:
+    /// Batches waiting for the uplink, nodes sending at once beyond this
+    /// are lost until the uplink catches up
+    static constexpr uint32_t STAGE_LEN = 32;
+    static_assert(0 == (STAGE_LEN & (STAGE_LEN - 1)));
+    /// Nodes told apart for duplicates
+    static constexpr size_t MAX_NODES = 32;
+    /// Batches taken at most for one message
+    static constexpr size_t PACK_MAX = 8;
+    /// @brief Sequence numbers seen of a node
+    struct Peer {
+        Link::Addr addr;
+        uint32_t session;
+        uint32_t high;              ///< Highest sequence number
+        uint32_t seen;              ///< Bit n set if high - n was received
+    };
+
+    void receive(const Link::Addr& from, span<const uint8_t> frame);
+    bool isNew(const Hive::Batch& batch);
+    size_t pack(span<uint8_t> buf, size_t& taken) const;
+
+    Link& _link;
+    Publish _publish;
+    Wake _wake;
+    const Clock& _clock;
+    // The node table is used by the link's task only
+    Peer _peers[MAX_NODES] = {};
+    size_t _peerCount = 0;
+    // Stage filled by the link's task, emptied by the uplink's
+    mutable portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+    Hive::Batch _stage[STAGE_LEN];
+    uint32_t _head = 0;
+    uint32_t _tail = 0;
+    Stats _stats = {};
+};
+
+bool GatewayImpl::init() {
+    return _link.init([this](const Link::Addr& from, span<const uint8_t> frame) { receive(from, frame); });
+}
+
+bool GatewayImpl::isNew(const Hive::Batch& batch) {
+    Peer* peer = nullptr;
+    for (size_t i = 0; i < _peerCount && !peer; i++) {
+        if (batch.node == _peers[i].addr) {
+            peer = &_peers[i];
+        }
+    }
+    if (!peer) {
+        if (MAX_NODES == _peerCount) {
+            _stats.refused++;
+            return false;
+        }
+        peer = &_peers[_peerCount++];
+        *peer = { batch.node, batch.session, batch.seq, 1 };
+        _stats.nodes = _peerCount;
+        return true;
+    }
+    if (batch.session != peer->session) {
+        // Node restarted
+        *peer = { batch.node, batch.session, batch.seq, 1 };
+        return true;
+    }
+    if (static_cast<int32_t>(batch.seq - peer->high) > 0) {
+        const uint32_t shift = batch.seq - peer->high;
+        peer->seen = (shift < 32 ? peer->seen << shift : 0) | 1;
+        peer->high = batch.seq;
+        return true;
+    }
+    // Late or resent, new only if within the window and not seen
+    const uint32_t back = peer->high - batch.seq;
+    if (back >= 32 || (peer->seen & (1U << back))) {
+        _stats.duplicates++;
+        return false;
+    }
+    peer->seen |= 1U << back;
+    return true;
+}
+
+void GatewayImpl::receive(const Link::Addr& from, span<const uint8_t> frame) {
+    _stats.frames++;
+    Hive::Batch batch;
+    if (!Hive::decode(frame, from, nowS(), batch)) {
+        _stats.invalid++;
+        return;
+    }
+    if (!isNew(batch)) {
+        return;
+    }
+    bool staged = false;
+    portENTER_CRITICAL(&_lock);
+    if (_head - _tail < STAGE_LEN) {
+        _stage[_head % STAGE_LEN] = batch;
+        _head++;
+        staged = true;
+    }
+    portEXIT_CRITICAL(&_lock);
+    if (!staged) {
+        _stats.dropped++;
+        return;
+    }
+    _stats.accepted++;
+    _wake();
+}
+
+size_t GatewayImpl::pack(span<uint8_t> buf, size_t& taken) const {
+    // Staged batches stay put until the tail moves past them
+    Hive::Batch batches[PACK_MAX];
+    portENTER_CRITICAL(&_lock);
+    const size_t n = min<size_t>(_head - _tail, PACK_MAX);
+    portEXIT_CRITICAL(&_lock);
+    for (size_t i = 0; i < n; i++) {
+        batches[i] = _stage[(_tail + i) % STAGE_LEN];
+    }
+    // As many as fit, a single batch always does
+    for (size_t k = n; k > 0; k--) {
+        const size_t len = Telemetry::encodeHives(buf, span<const Hive::Batch>(batches, k), _clock);
+        if (len) {
+            taken = k;
+            return len;
+        }
+    }
+    return 0;
+}
+
+bool GatewayImpl::forward() {
+    while (true) {
+        portENTER_CRITICAL(&_lock);
+        const bool empty = _head == _tail;
+        portEXIT_CRITICAL(&_lock);
+        if (empty) {
+            return true;
+        }
+        size_t taken = 0;
+        if (!_publish([this, &taken](span<uint8_t> buf) { return pack(buf, taken); })) {
+            return false;
+        }
+        portENTER_CRITICAL(&_lock);
+        _tail += taken;
+        portEXIT_CRITICAL(&_lock);
+        _stats.messages++;
+        _stats.forwarded += taken;
+    }
+}
+
+Hive::Gateway::Hnd Hive::Gateway::create(Link& link, const Publish& publish, const Wake& wake, const Clock& clock) {
+    return make_unique<GatewayImpl>(link, publish, wake, clock);
+}
+
+/**
+ * Run nodes and a gateway over a loopback link. Each round every node
+ * sends a full batch before the gateway forwards, the worst fan-in.
+*/
+static void runLoop(size_t nodeCount, size_t rounds, uint32_t ackLossPct, const Clock& clock) {
+    auto loop = Link::Loop::create(ackLossPct);
+    // Locally administered addresses
+    const Link::Addr gwAddr = { 0x02, 0, 0, 0, 0, 0 };
+    auto gwLink = Link::createLoop(*loop, gwAddr);
+    size_t bytes = 0;
+    uint8_t buf[Cloud::PAYLOAD_MAX_LEN];
+    auto publish = [&bytes, &buf](const Cloud::Fill& fill) {
+        const size_t len = fill(buf);
+        bytes += len;
+        return len > 0;
+    };
+    auto gateway = Hive::Gateway::create(*gwLink, publish, []() {}, clock);
+    gateway->init();
+    vector<Link::Hnd> links;
+    vector<Hive::Node::Hnd> nodes;
+    for (size_t i = 0; i < nodeCount; i++) {
+        links.push_back(Link::createLoop(*loop, { 0x02, 0, 0, 0, static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i + 1) }));
+        nodes.push_back(Hive::Node::create(*links.back(), gwAddr, UINT32_MAX));
+        nodes.back()->init();
+    }
+    static constexpr int64_t SAMPLE_US = 15 * 1000 * 1000;
+    int64_t timeUs = 0;
+    int64_t gatewayUs = 0;
+    const int64_t startUs = esp_timer_get_time();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t k = 0; k < Hive::BATCH_MAX; k++, timeUs += SAMPLE_US) {
+            for (size_t i = 0; i < nodeCount; i++) {
+                nodes[i]->feed(timeUs, 40.0F + 0.001F * (r * Hive::BATCH_MAX + k) + i);
+            }
+        }
+        const int64_t forwardUs = esp_timer_get_time();
+        gateway->forward();
+        gatewayUs += esp_timer_get_time() - forwardUs;
+    }
+    const int64_t elapsedUs = esp_timer_get_time() - startUs;
+    Hive::Node::Stats ns = {};
+    for (const auto& n: nodes) {
+        const auto s = n->getStats();
+        ns.sent += s.sent;
+        ns.resent += s.resent;
+        ns.dropped += s.dropped;
+    }
+    const auto gs = gateway->getStats();
+    printf("%u nodes, %u rounds, ack loss %lu%%\n", static_cast<unsigned>(nodeCount), static_cast<unsigned>(rounds),
+        static_cast<unsigned long>(ackLossPct));
+    printf("nodes   sent %lu resent %lu dropped %lu\n", static_cast<unsigned long>(ns.sent),
+        static_cast<unsigned long>(ns.resent), static_cast<unsigned long>(ns.dropped));
+    printf("gateway frames %lu accepted %lu dup %lu stage full %lu refused %lu\n", static_cast<unsigned long>(gs.frames),
+        static_cast<unsigned long>(gs.accepted), static_cast<unsigned long>(gs.duplicates),
+        static_cast<unsigned long>(gs.dropped), static_cast<unsigned long>(gs.refused));
+    printf("uplink  %lu messages, %lu batches, %u B, %.1f batches/message\n", static_cast<unsigned long>(gs.messages),
+        static_cast<unsigned long>(gs.forwarded), static_cast<unsigned>(bytes),
+        gs.messages ? static_cast<double>(gs.forwarded) / gs.messages : 0.0);
+    printf("%" PRId64 " us total, %" PRId64 " us forwarding, %.0f frames/s\n", elapsedUs, gatewayUs,
+        elapsedUs ? 1e6 * gs.frames / elapsedUs : 0.0);
+}
+
+void Hive::addCmds(Bosun& bosun, const Node* node, const Gateway* gateway, const Clock& clock) {
+    bosun.addCmd(
+        "hive", Cmd(
+            "[loop [nodes] [rounds] [ack loss %]]\n\tShow node or gateway statistics, or measure fan-in over loopback",
+            [node, gateway, &clock](const vector<string>& args) {
+                if (args.size() >= 2 && "loop" == args[1]) {
+                    uint32_t nodes = 16;
+                    uint32_t rounds = 4;
+                    uint32_t lossPct = 0;
+                    if ((args.size() >= 3 && !Params::parse(args[2], nodes))
+                        || (args.size() >= 4 && !Params::parse(args[3], rounds))
+                        || (args.size() >= 5 && !Params::parse(args[4], lossPct))
+                        || nodes < 1 || nodes > 60 || lossPct > 100) {
+                        err("Invalid arguments");
+                        return;
+                    }
+                    runLoop(nodes, rounds, lossPct, clock);
+                    return;
+                }
+                if (node) {
+                    const auto s = node->getStats();
+                    printf("node sent %lu resent %lu dropped %lu\n", static_cast<unsigned long>(s.sent),
+                        static_cast<unsigned long>(s.resent), static_cast<unsigned long>(s.dropped));
+                } else if (gateway) {
+                    const auto s = gateway->getStats();
+                    printf("gateway %lu nodes, frames %lu accepted %lu dup %lu invalid %lu stage full %lu refused %lu\n",
+                        static_cast<unsigned long>(s.nodes), static_cast<unsigned long>(s.frames),
+                        static_cast<unsigned long>(s.accepted), static_cast<unsigned long>(s.duplicates),
+                        static_cast<unsigned long>(s.invalid), static_cast<unsigned long>(s.dropped),
+                        static_cast<unsigned long>(s.refused));
+                    printf("uplink %lu messages, %lu batches\n", static_cast<unsigned long>(s.messages),
+                        static_cast<unsigned long>(s.forwarded));
+                } else {
+                    printf("Standalone, set hive_role to 1 for a node or 2 for a gateway\n");
+                }
+            }
+        )
+    );
+}
+
+} // namespace
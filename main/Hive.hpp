@@ -0,0 +1,161 @@
+/**
+ * @brief Hive nodes reporting through one gateway of the apiary
+ *
+ * Giving each hive its own Wi-Fi association, TLS session and cloud
+ * connection costs most of its energy. Instead nodes batch their samples
+ * and send them over a Link to a mains-powered gateway, the only device
+ * which uploads. The gateway packs the batches of all nodes into the
+ * messages of its one Cloud session. A node resends a batch the radio
+ * didn't acknowledge, the gateway drops duplicates by sequence number.
+ * Nodes keep no wall clock, a frame tells the age of its samples and the
+ * gateway maps them to UTC with its own Clock.
+ *
+ * Batch frame, little endian:
+ *   header  u16 magic "BH", u8 version, u8 count, u32 session (random per
+ *           node boot), u32 sequence, u32 age in s of the first sample
+ *   samples u16 offset in s from the first [count], i32 weight g [count]
+*/
+
+#pragma once
+
+#include "Link.hpp"
+
+#include <memory>
+#include <span>
+#include <functional>
+#include <cinttypes>
+
+namespace beegram {
+
+class Bosun; class Clock;
+
+class Hive {
+public:
+    /// @brief Part a device plays, see Params::HIVE_ROLE
+    enum class Role : uint8_t {
+        NONE,       ///< Standalone, uploads itself
+        NODE,       ///< Sends its samples to the gateway
+        GATEWAY,    ///< Uploads for the nodes too
+    };
+    /// Samples per batch, a full batch is sent at once
+    static constexpr size_t BATCH_MAX = 8;
+    /// @brief Samples of one node
+    struct Batch {
+        Link::Addr node;
+        uint32_t session;
+        uint32_t seq;
+        uint32_t startS;            ///< First sample, s since boot of whoever holds the batch
+        uint8_t count;
+        uint16_t offsetS[BATCH_MAX];
+        int32_t weightG[BATCH_MAX];
+    };
+
+    /// @brief End at the hive, batches samples for the gateway
+    class Node {
+    public:
+        using Hnd = std::unique_ptr<Node>;
+        struct Stats {
+            uint32_t sent;          ///< Batches delivered
+            uint32_t resent;        ///< Batches delivered on a later attempt
+            uint32_t dropped;       ///< Batches given up
+        };
+        virtual ~Node() = default;
+
+        /**
+         * Bring the link up
+         * @return True on success; false on failure
+        */
+        virtual bool init() = 0;
+
+        /**
+         * Add a sample, sends the batch when full or old enough. Blocks
+         * while sending.
+         * @param timeUs Sample time in us since boot
+         * @param weightKg Weight in kg
+        */
+        virtual void feed(int64_t timeUs, float weightKg) = 0;
+
+        virtual Stats getStats() const = 0;
+
+        /**
+         * Create a node
+         * @param link Link to the gateway
+         * @param gateway Address of the gateway, or Link::BROADCAST
+         * @param periodS Longest time a sample is held
+        */
+        static Hnd create(Link& link, const Link::Addr& gateway, uint32_t periodS);
+    };
+
+    /// @brief End at the uplink, forwards the batches of all nodes
+    class Gateway {
+    public:
+        using Hnd = std::unique_ptr<Gateway>;
+        /// @brief Encodes a message in place, the type of Cloud::Fill
+        using Fill = std::function<size_t(std::span<uint8_t> buf)>;
+        /// @brief Hands a message to the uplink, e.g. Cloud::publish()
+        using Publish = std::function<bool(const Fill& fill)>;
+        /// @brief Asks the uplink's task to call forward(), must not block
+        using Wake = std::function<void()>;
+        struct Stats {
+            uint32_t frames;        ///< Frames received
+            uint32_t accepted;      ///< Batches staged for the uplink
+            uint32_t duplicates;    ///< Batches received before
+            uint32_t invalid;       ///< Frames which aren't batches
+            uint32_t dropped;       ///< Batches lost as the stage was full
+            uint32_t refused;       ///< Batches of nodes beyond the node table
+            uint32_t messages;      ///< Messages published
+            uint32_t forwarded;     ///< Batches published
+            uint32_t nodes;         ///< Nodes heard from
+        };
+        virtual ~Gateway() = default;
+
+        /**
+         * Start receiving
+         * @return True on success; false on failure
+        */
+        virtual bool init() = 0;
+
+        /**
+         * Publish the staged batches, as many to a message as fit. Call on
+         * the uplink's task when woken, and again later if it fails.
+         * @return True if all went out; false if the uplink took no more
+        */
+        virtual bool forward() = 0;
+
+        virtual Stats getStats() const = 0;
+
+        /**
+         * Create a gateway
+         * @param link Link to the nodes
+         * @param publish Hands messages to the uplink
+         * @param wake Asks for forward()
+         * @param clock Maps the times of batches to UTC
+        */
+        static Hnd create(Link& link, const Publish& publish, const Wake& wake, const Clock& clock);
+    };
+
+    /**
+     * Encode a batch into a frame
+     * @param nowS Time of sending, s since boot
+     * @return Length of the frame; 0 if it didn't fit
+    */
+    static size_t encode(std::span<uint8_t> out, const Batch& batch, uint32_t nowS);
+
+    /**
+     * Decode a frame into a batch
+     * @param nowS Time of receiving, s since boot, the batch is moved to it
+     * @return True if the frame is a valid batch; false otherwise
+    */
+    static bool decode(std::span<const uint8_t> frame, const Link::Addr& from, uint32_t nowS, Batch& batch);
+
+    /**
+     * Add the shell command hive, which shows the statistics and runs nodes
+     * and a gateway over a loopback link to measure fan-in
+     * @param node Node of this device; null if none
+     * @param gateway Gateway of this device; null if none
+     * @param clock Maps times to UTC, also for the loopback gateway
+    */
+    static void addCmds(Bosun& bosun, const Node* node, const Gateway* gateway, const Clock& clock);
+};
+
+} // namespace
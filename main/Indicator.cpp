@@ -0,0 +1,283 @@
+#include "Indicator.hpp"
+#include "Log.hpp"
+#include "Bosun.hpp"
+#include "Tasks.hpp"
+#include "driver/GpioBank.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/ledc.h"
+#include "esp_attr.h"
+
+#include <atomic>
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace beegram {
+
+class IndicatorImpl : public Indicator {
+public:
+    IndicatorImpl(GpioBank& bank, Bosun& bosun)
+    : _bank(bank), _bosun(bosun)
+    {}
+    virtual bool init() override;
+    virtual void set(State state, bool on) override;
+    virtual uint32_t getStates() const override { return _states.load(); }
+private:
+    /// @brief How a pattern lights the LED
+    enum class Shape : uint8_t {
+        OFF,
+        BLINK,      ///< PWM at the blink rate, the duty is the time on
+        BREATHE,    ///< Fades up and down
+    };
+    struct Pattern {
+        Shape shape;
+        GpioBank::Bits colors;      ///< Bit per LED of the bank
+        uint32_t freqHz;            ///< Blinks per second
+        uint32_t dutyPct;           ///< Time on of a blink
+        uint32_t rampMs;            ///< Time of a fade up or down
+    };
+    static constexpr GpioBank::Bits RED = 1 << 0;
+    static constexpr GpioBank::Bits GREEN = 1 << 1;
+    static constexpr GpioBank::Bits BLUE = 1 << 2;
+    static constexpr size_t COLORS = 3;
+    static constexpr Pattern DARK = { Shape::OFF, 0, 0, 0, 0 };
+    /// By state, short blinks for lasting states
+    static constexpr Pattern PATTERNS[STATE_COUNT] = {
+        { Shape::BLINK, BLUE, 1, 5, 0 },            // NO_UPLINK
+        { Shape::BLINK, RED, 1, 5, 0 },             // LOW_BATTERY
+        { Shape::BLINK, RED | GREEN, 4, 50, 0 },    // EVENT
+        { Shape::BREATHE, BLUE, 0, 0, 1000 },       // CALIBRATING
+    };
+    static constexpr ledc_mode_t MODE = LEDC_LOW_SPEED_MODE;
+    static constexpr ledc_timer_t TIMER = LEDC_TIMER_0;
+    static constexpr ledc_timer_bit_t RESOLUTION = LEDC_TIMER_10_BIT;
+    static constexpr uint32_t MAX_DUTY = (1 << RESOLUTION) - 1;
+    /// PWM of fades. With the 1 MHz REF_TICK and 10 bits the timer runs
+    /// from below 1 Hz, for blinks, to 976 Hz.
+    static constexpr uint32_t PWM_HZ = 500;
+    static constexpr TickType_t EVENT_HOLD = pdMS_TO_TICKS(10 * 1000);
+    /// Notifications of the task
+    static constexpr uint32_t CHANGED = 1 << 0;
+    static constexpr uint32_t TURN = 1 << 1;
+
+    static ledc_channel_t channel(size_t i) { return static_cast<ledc_channel_t>(LEDC_CHANNEL_0 + i); }
+    static uint32_t bit(State state) { return 1UL << static_cast<uint8_t>(state); }
+    static bool IRAM_ATTR onFadeEnd(const ledc_cb_param_t* param, void* arg);
+    static const Pattern& select(uint32_t states);
+    /// Hand the pins to LEDC
+    bool attach();
+    void show(const Pattern& p);
+    void ramp(const Pattern& p, bool up);
+    void run();
+    void print() const;
+
+    GpioBank& _bank;
+    Bosun& _bosun;
+    size_t _channels = 0;
+    bool _attached = false;         ///< Pins are driven by LEDC
+    TaskHandle_t _task = nullptr;
+    atomic<uint32_t> _states = 0;
+    atomic<TickType_t> _eventTick = 0;
+    /// Channel whose fade end turns a breathe around; -1 if none
+    atomic<int> _lead = -1;
+};
+
+static const char* STATE_NAMES[Indicator::STATE_COUNT] = { "no_uplink", "low_battery", "event", "calibrating" };
+
+const IndicatorImpl::Pattern& IndicatorImpl::select(uint32_t states) {
+    for (size_t i = STATE_COUNT; i > 0; i--) {
+        if (states & (1UL << (i - 1))) {
+            return PATTERNS[i - 1];
+        }
+    }
+    return DARK;
+}
+
+bool IRAM_ATTR IndicatorImpl::onFadeEnd(const ledc_cb_param_t* param, void* arg) {
+    auto* self = static_cast<IndicatorImpl*>(arg);
+    BaseType_t woken = pdFALSE;
+    if (LEDC_FADE_END_EVT == param->event && static_cast<int>(param->channel) == self->_lead.load()) {
+        xTaskNotifyFromISR(self->_task, TURN, eSetBits, &woken);
+    }
+    return pdTRUE == woken;
+}
+
+bool IndicatorImpl::init() {
+    _channels = min(_bank.size(), COLORS);
+    ledc_timer_config_t timer = {};
+    timer.speed_mode = MODE;
+    timer.duty_resolution = RESOLUTION;
+    timer.timer_num = TIMER;
+    timer.freq_hz = PWM_HZ;
+    timer.clk_cfg = LEDC_USE_REF_TICK;
+    esp_err_t ret = ledc_timer_config(&timer);
+    if (ESP_OK != ret) {
+        err("Fail config LEDC timer: %s", esp_err_to_name(ret));
+        return false;
+    }
+    ret = ledc_fade_func_install(0);
+    // Already installed by another user of LEDC
+    if (ESP_OK != ret && ESP_ERR_INVALID_STATE != ret) {
+        err("Fail install LEDC fades: %s", esp_err_to_name(ret));
+        return false;
+    }
+    if (!attach()) {
+        return false;
+    }
+    ledc_cbs_t cbs = {};
+    cbs.fade_cb = onFadeEnd;
+    for (size_t i = 0; i < _channels; i++) {
+        ret = ledc_cb_register(MODE, channel(i), &cbs, this);
+        if (ESP_OK != ret) {
+            err("Fail register LEDC callback: %s", esp_err_to_name(ret));
+            return false;
+        }
+    }
+    auto runTask = [](void* arg) {
+        assert(arg); static_cast<IndicatorImpl*>(arg)->run();
+    };
+    if (!Tasks::spawn(Tasks::LED, runTask, this, &_task)) {
+        return false;
+    }
+    _bosun.addCmd(
+        "led", Cmd(
+            "[state on | off]\n\tShow the states the LED shows or set one, e.g. low_battery",
+            [this](const vector<string>& args) {
+                if (3 == args.size()) {
+                    const auto* name = find(begin(STATE_NAMES), end(STATE_NAMES), args[1]);
+                    if (end(STATE_NAMES) == name || ("on" != args[2] && "off" != args[2])) {
+                        err("Invalid arguments");
+                        return;
+                    }
+                    set(static_cast<State>(name - begin(STATE_NAMES)), "on" == args[2]);
+                } else if (1 != args.size()) {
+                    err("Invalid arguments");
+                    return;
+                }
+                print();
+            }
+        )
+    );
+    return true;
+}
+
+void IndicatorImpl::set(State state, bool on) {
+    if (State::EVENT == state && on) {
+        // Held from the latest event
+        _eventTick.store(xTaskGetTickCount());
+    }
+    const uint32_t b = bit(state);
+    const uint32_t prev = on ? _states.fetch_or(b) : _states.fetch_and(~b);
+    if ((0 != (prev & b)) != on && _task) {
+        xTaskNotify(_task, CHANGED, eSetBits);
+    }
+}
+
+bool IndicatorImpl::attach() {
+    for (size_t i = 0; i < _channels; i++) {
+        ledc_channel_config_t cfg = {};
+        cfg.gpio_num = static_cast<int>(_bank.getPin(i));
+        cfg.speed_mode = MODE;
+        cfg.channel = channel(i);
+        cfg.intr_type = LEDC_INTR_DISABLE;
+        cfg.timer_sel = TIMER;
+        cfg.duty = 0;
+        cfg.hpoint = 0;
+        const esp_err_t ret = ledc_channel_config(&cfg);
+        if (ESP_OK != ret) {
+            err("Fail config LEDC channel %u: %s", static_cast<unsigned>(i), esp_err_to_name(ret));
+            return false;
+        }
+    }
+    _attached = true;
+    return true;
+}
+
+void IndicatorImpl::show(const Pattern& p) {
+    _lead.store(-1);
+    // Changing the duty waits for a fade in progress to end
+    if (Shape::OFF == p.shape) {
+        for (size_t i = 0; i < _channels; i++) {
+            ledc_stop(MODE, channel(i), 0);
+        }
+        // All dark in one write, the pins stay low without the timer
+        _bank.write(static_cast<GpioBank::Bits>((1ULL << _bank.size()) - 1), 0);
+        _bank.config();
+        _attached = false;
+        return;
+    }
+    if (!_attached && !attach()) {
+        return;
+    }
+    ledc_set_freq(MODE, TIMER, Shape::BLINK == p.shape ? p.freqHz : PWM_HZ);
+    for (size_t i = 0; i < _channels; i++) {
+        const bool lit = Shape::BLINK == p.shape && (p.colors & (1UL << i));
+        ledc_set_duty(MODE, channel(i), lit ? MAX_DUTY * p.dutyPct / 100 : 0);
+        ledc_update_duty(MODE, channel(i));
+    }
+    if (Shape::BREATHE == p.shape) {
+        for (size_t i = 0; i < _channels; i++) {
+            if (p.colors & (1UL << i)) {
+                _lead.store(static_cast<int>(i));
+                break;
+            }
+        }
+        ramp(p, true);
+    }
+}
+
+void IndicatorImpl::ramp(const Pattern& p, bool up) {
+    for (size_t i = 0; i < _channels; i++) {
+        if (p.colors & (1UL << i)) {
+            ledc_set_fade_with_time(MODE, channel(i), up ? MAX_DUTY : 0, static_cast<int>(p.rampMs));
+            ledc_fade_start(MODE, channel(i), LEDC_FADE_NO_WAIT);
+        }
+    }
+}
+
+void IndicatorImpl::run() {
+    const Pattern* shown = nullptr;
+    bool up = false;
+    while (true) {
+        TickType_t wait = portMAX_DELAY;
+        if (_states.load() & bit(State::EVENT)) {
+            const TickType_t held = xTaskGetTickCount() - _eventTick.load();
+            if (held >= EVENT_HOLD) {
+                _states.fetch_and(~bit(State::EVENT));
+            } else {
+                wait = EVENT_HOLD - held;
+            }
+        }
+        const Pattern& p = select(_states.load());
+        if (&p != shown) {
+            show(p);
+            shown = &p;
+            up = true;
+        }
+        uint32_t events = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &events, wait);
+        if ((events & TURN) && Shape::BREATHE == shown->shape) {
+            up = !up;
+            ramp(*shown, up);
+        }
+    }
+}
+
+void IndicatorImpl::print() const {
+    const uint32_t states = _states.load();
+    for (size_t i = 0; i < STATE_COUNT; i++) {
+        printf("%-12s %s\n", STATE_NAMES[i], (states & (1UL << i)) ? "on" : "off");
+    }
+}
+
+Indicator::Hnd Indicator::create(GpioBank& bank, Bosun& bosun) {
+    return make_unique<IndicatorImpl>(bank, bosun);
+}
+
+} // namespace
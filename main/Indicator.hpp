@@ -0,0 +1,62 @@
+/**
+ * @brief Status shown on the RGB LED
+*/
+
+#pragma once
+
+#include <memory>
+#include <cinttypes>
+#include <cstddef>
+
+namespace beegram {
+
+class GpioBank; class Bosun;
+
+/**
+ * Subsystems declare the states they are in, the LED shows the pattern of
+ * the most important state on. Patterns run on the LEDC hardware: a blink
+ * is a PWM of a period long enough to see, a breathe is a hardware fade up
+ * and down. Nothing runs between state changes except the interrupt at the
+ * end of each fade, which turns a breathe around. With no state on the LED
+ * is dark, its pins taken back by the GPIO bank.
+*/
+class Indicator {
+public:
+    using Hnd = std::unique_ptr<Indicator>;
+    /// @brief States shown, each more important than those before
+    enum class State : uint8_t {
+        NO_UPLINK,      ///< No uplink configured or the latest flush failed to connect
+        LOW_BATTERY,
+        EVENT,          ///< An event was detected, shown for a while
+        CALIBRATING,    ///< Scales are reading a calibration point or tare
+    };
+    static constexpr size_t STATE_COUNT = 4;
+    virtual ~Indicator() = default;
+
+    /**
+     * Set up LEDC, start the task which programs it and register the
+     * command led
+     * @return True on success; false on failure
+    */
+    virtual bool init() = 0;
+
+    /**
+     * Declare a state on or off, from any task. Cheap if it doesn't change.
+     * EVENT goes off by itself.
+     * @param state State
+     * @param on True if on
+    */
+    virtual void set(State state, bool on) = 0;
+
+    /// @return Bit per state on
+    virtual uint32_t getStates() const = 0;
+
+    /**
+     * Create the indicator
+     * @param bank Pins of the red, green and blue LED, in that order
+     * @param bosun Takes the command
+    */
+    static Hnd create(GpioBank& bank, Bosun& bosun);
+};
+
+} // namespace
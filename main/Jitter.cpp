@@ -0,0 +1,142 @@
+#include "Jitter.hpp"
+#include "Log.hpp"
+#include "Params.hpp"
+#include "Bosun.hpp"
+#include "Tasks.hpp"
+#include "driver/Hx711.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+
+#include <atomic>
+#include <cmath>
+#include <cinttypes>
+#include <string>
+
+using namespace std;
+
+namespace beegram {
+
+class JitterImpl : public Jitter {
+public:
+    JitterImpl(Bosun& bosun, Hx711& loadSensor)
+    : _bosun(bosun), _loadSensor(loadSensor)
+    {}
+    virtual bool init() override;
+private:
+    static constexpr unsigned DEFAULT_CONVERSIONS = 300;
+    /// Busy time per tick of the synthetic load, like a burst of TLS records
+    static constexpr int64_t LOAD_BURST_US = 5000;
+    /// One TCP segment worth of payload
+    static constexpr size_t LOAD_RECORD_LEN_B = 1460;
+    static constexpr TickType_t LOAD_STOP_TIMEOUT = pdMS_TO_TICKS(1000);
+
+    bool startLoad();
+    void stopLoad();
+    void runLoad();
+    void measure(unsigned n, bool load);
+
+    Bosun& _bosun;
+    Hx711& _loadSensor;
+    atomic<bool> _loadRun = false;
+    TaskHandle_t _caller = nullptr;
+    uint32_t _loadRecords = 0;
+    uint8_t _record[LOAD_RECORD_LEN_B] = {};
+};
+
+bool JitterImpl::init() {
+    _bosun.addCmd(
+        "jitter", Cmd(
+            "[count]\n\tMeasure load sensor timing over count conversions, without and with upload load",
+            [this](const vector<string>& args) {
+                uint32_t n = DEFAULT_CONVERSIONS;
+                if ((args.size() > 1 && !Params::parse(args[1], n)) || 0 == n) {
+                    err("Need count");
+                    return;
+                }
+                measure(n, false);
+                measure(n, true);
+            }
+        )
+    );
+    return true;
+}
+
+void JitterImpl::runLoad() {
+    // Checksumming records keeps the CPU and memory bus about as busy as
+    // encrypting them would, without needing a connection
+    uint32_t crc = 0;
+    uint32_t records = 0;
+    while (_loadRun) {
+        const int64_t until = esp_timer_get_time() + LOAD_BURST_US;
+        while (esp_timer_get_time() < until) {
+            crc = esp_rom_crc32_le(crc, _record, sizeof(_record));
+            _record[records++ % sizeof(_record)] ^= static_cast<uint8_t>(crc);
+        }
+        vTaskDelay(1);
+    }
+    _loadRecords = records;
+    xTaskNotifyGive(_caller);
+    vTaskDelete(nullptr);
+}
+
+bool JitterImpl::startLoad() {
+    _caller = xTaskGetCurrentTaskHandle();
+    _loadRecords = 0;
+    _loadRun = true;
+    auto runTask = [](void* arg) {
+        assert(arg); static_cast<JitterImpl*>(arg)->runLoad();
+    };
+    if (!Tasks::spawn(Tasks::LOAD, runTask, this)) {
+        _loadRun = false;
+        return false;
+    }
+    return true;
+}
+
+void JitterImpl::stopLoad() {
+    _loadRun = false;
+    if (0 == ulTaskNotifyTake(pdTRUE, LOAD_STOP_TIMEOUT)) {
+        warn("Load task didn't stop");
+    }
+}
+
+void JitterImpl::measure(unsigned n, bool load) {
+    if (load && !startLoad()) {
+        return;
+    }
+    _loadSensor.resetStats();
+    // Keeps the ADC powered and converting for the duration
+    const auto settled = _loadSensor.readSettled(n);
+    const Hx711::Stats st = _loadSensor.getStats();
+    if (load) {
+        stopLoad();
+    }
+    printf("Profile %s, load %s", Tasks::profile(), load ? "on" : "off");
+    if (load) {
+        printf(" (%lu records)", static_cast<unsigned long>(_loadRecords));
+    }
+    printf("\n");
+    if (!settled.has_value() || st.intervals < 2) {
+        err("Too few conversions");
+        return;
+    }
+    const double mean = static_cast<double>(st.intervalSumUs) / st.intervals;
+    const double var = static_cast<double>(st.intervalSqSumUs) / st.intervals - mean * mean;
+    printf("intervals %lu mean %.1f sd %.1f min %" PRId64 " max %" PRId64 " us\n",
+        static_cast<unsigned long>(st.intervals), mean, sqrt(max(0.0, var)), st.intervalMinUs, st.intervalMaxUs);
+    if (st.latencies > 0) {
+        printf("latency mean %.1f max %" PRId64 " us\n",
+            static_cast<double>(st.latencySumUs) / st.latencies, st.latencyMaxUs);
+    }
+    printf("discarded %lu overruns %lu\n",
+        static_cast<unsigned long>(st.discarded), static_cast<unsigned long>(st.overruns));
+}
+
+Jitter::Hnd Jitter::create(Bosun& bosun, Hx711& loadSensor) {
+    return make_unique<JitterImpl>(bosun, loadSensor);
+}
+
+} // namespace
@@ -0,0 +1,33 @@
+/**
+ * @brief Benchmark of sample timing jitter under upload load
+*/
+
+#pragma once
+
+#include <memory>
+
+namespace beegram {
+
+class Bosun; class Hx711;
+
+/**
+ * Measures the intervals at which the Hx711 driver reads conversions, with
+ * and without a synthetic load on the networking core that stands in for
+ * Wi-Fi and TLS upload traffic. Compare the results of the build profiles to
+ * see what pinning acquisition to its own core buys.
+*/
+class Jitter {
+public:
+    using Hnd = std::unique_ptr<Jitter>;
+    virtual ~Jitter() = default;
+
+    /**
+     * Register the benchmark command
+     * @return True on success; false on failure
+    */
+    virtual bool init() = 0;
+
+    static Hnd create(Bosun& bosun, Hx711& loadSensor);
+};
+
+} // namespace
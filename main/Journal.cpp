@@ -0,0 +1,444 @@
+#include "Journal.hpp"
+#include "Log.hpp"
+#include "Params.hpp"
+#include "Bosun.hpp"
+#include "Tasks.hpp"
+#include "Mem.hpp"
+#include "Telemetry.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+#include <cassert>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace beegram {
+
+class JournalImpl : public Journal {
+public:
+    JournalImpl(Bosun& bosun, uint32_t boot)
+    : _bosun(bosun), _boot(boot)
+    {}
+    virtual bool init() override;
+    virtual bool flush() override;
+    virtual void read(const function<void(const Record&)>& visit) const override;
+    virtual void setUplink(const Publish& publish) override { _publish = publish; }
+    virtual size_t send(uint32_t boot, size_t max) override;
+    virtual Stats getStats() const override;
+    /// Stage a record, if the module is within its rate
+    void stage(esp_log_level_t level, const char* module, LogLimit& limit, const char* fmt, va_list args);
+
+    /// Logging calls without context, there's one journal
+    static JournalImpl* _self;
+private:
+    static constexpr const char* PARTITION = "journal";
+    static constexpr uint32_t MAGIC = 0x314A4742;   // "BGJ1"
+    static constexpr size_t SECTOR_LEN = 4096;
+    static constexpr uint8_t ERASED = 0xFF;
+    static constexpr size_t MODULE_MAX = 24;
+    static constexpr size_t TEXT_MAX = 120;
+    /// Records a module may log at once
+    static constexpr uint16_t BURST = 5;
+    /// Time for one more record of a module
+    static constexpr int64_t REFILL_US = 10 * 1000 * 1000;
+    static constexpr TickType_t FLUSH_PERIOD = pdMS_TO_TICKS(60 * 1000);
+    static constexpr TickType_t FLUSH_TIMEOUT = pdMS_TO_TICKS(1000);
+    /// Records shown by the command unless told
+    static constexpr size_t SHOW_COUNT = 20;
+    /// Records sent by the command unless told
+    static constexpr size_t SEND_COUNT = 8;
+    struct SectorHeader {
+        uint32_t magic;
+        uint32_t seq;
+    };
+    struct __attribute__((packed)) RecordHeader {
+        uint8_t len;
+        uint8_t level;
+        uint16_t suppressed;
+        uint32_t boot;
+        uint32_t timeMs;
+        uint8_t moduleLen;
+    };
+    static constexpr size_t RECORD_MAX = sizeof(RecordHeader) + MODULE_MAX + TEXT_MAX;
+    static_assert(RECORD_MAX < ERASED);
+    /// Staged beyond this the writer is woken, before the sector is full
+    static constexpr size_t WAKE_LEN = SECTOR_LEN * 3 / 4;
+
+    static void onShutdown();
+    void run();
+    const uint8_t* sector(size_t i) const { return _base + i * SECTOR_LEN; }
+    static size_t recordsEnd(const uint8_t* sector);
+    void startSector(uint32_t seq);
+    void print(size_t n);
+
+    Bosun& _bosun;
+    const uint32_t _boot;
+    Publish _publish;
+    const esp_partition_t* _part = nullptr;
+    esp_partition_mmap_handle_t _map = 0;
+    const uint8_t* _base = nullptr;
+    size_t _sectors = 0;
+    TaskHandle_t _task = nullptr;
+    // Sector being filled, owned by whoever holds the flush lock
+    SemaphoreHandle_t _flushLock = nullptr;
+    size_t _sector = 0;
+    uint32_t _seq = 0;
+    size_t _written = 0;            ///< Bytes of the image in flash
+    bool _erasePending = false;     ///< Sector still holds the records of the last lap
+    // Image of the sector, appended to by logging tasks
+    mutable portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+    uint8_t _image[SECTOR_LEN];
+    size_t _used = 0;
+    Stats _stats = {};
+};
+
+JournalImpl* JournalImpl::_self = nullptr;
+
+} // namespace
+
+void logJournal(esp_log_level_t level, const char* module, LogLimit& limit, const char* fmt, ...) {
+    beegram::JournalImpl* journal = beegram::JournalImpl::_self;
+    if (!journal) {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    journal->stage(level, module, limit, fmt, args);
+    va_end(args);
+}
+
+namespace beegram {
+
+void JournalImpl::onShutdown() {
+    if (_self) {
+        _self->flush();
+    }
+}
+
+size_t JournalImpl::recordsEnd(const uint8_t* sector) {
+    size_t pos = sizeof(SectorHeader);
+    while (pos < SECTOR_LEN) {
+        const uint8_t len = sector[pos];
+        if (ERASED == len || len < sizeof(RecordHeader) || pos + len > SECTOR_LEN) {
+            break;
+        }
+        pos += len;
+    }
+    return pos;
+}
+
+void JournalImpl::startSector(uint32_t seq) {
+    _seq = seq;
+    memset(_image, ERASED, sizeof(_image));
+    const SectorHeader h = { MAGIC, seq };
+    memcpy(_image, &h, sizeof(h));
+    _used = sizeof(h);
+    _written = 0;
+    _erasePending = true;
+}
+
+bool JournalImpl::init() {
+    _part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, PARTITION);
+    if (!_part) {
+        err("No partition [%s]", PARTITION);
+        return false;
+    }
+    const void* ptr = nullptr;
+    const esp_err_t ret = esp_partition_mmap(_part, 0, _part->size, ESP_PARTITION_MMAP_DATA, &ptr, &_map);
+    if (ESP_OK != ret) {
+        err("Fail map partition [%s]: %d", PARTITION, ret);
+        return false;
+    }
+    _base = static_cast<const uint8_t*>(ptr);
+    _sectors = _part->size / SECTOR_LEN;
+    _flushLock = Mem::mutex();
+    if (!_flushLock) {
+        err("Fail create mutex");
+        return false;
+    }
+    // Continue the newest sector where its records end
+    bool found = false;
+    for (size_t i = 0; i < _sectors; i++) {
+        SectorHeader h;
+        memcpy(&h, sector(i), sizeof(h));
+        if (MAGIC == h.magic && (!found || h.seq > _seq)) {
+            found = true;
+            _sector = i;
+            _seq = h.seq;
+        }
+    }
+    if (!found) {
+        _sector = 0;
+        startSector(1);
+    } else {
+        const size_t end = recordsEnd(sector(_sector));
+        memset(_image, ERASED, sizeof(_image));
+        memcpy(_image, sector(_sector), end);
+        _used = _written = end;
+        if (SECTOR_LEN - end < RECORD_MAX) {
+            _sector = (_sector + 1) % _sectors;
+            startSector(_seq + 1);
+        }
+    }
+    auto runTask = [](void* arg) {
+        assert(arg); static_cast<JournalImpl*>(arg)->run();
+    };
+    if (!Tasks::spawn(Tasks::JOURNAL, runTask, this, &_task)) {
+        return false;
+    }
+    esp_register_shutdown_handler(onShutdown);
+    _bosun.addCmd(
+        "journal", Cmd(
+            "[n | send [n] | flush]\n\tShow the latest n records, send the latest of the previous boot over the uplink, or write the staged ones",
+            [this](const vector<string>& args) {
+                uint32_t n;
+                if (args.size() >= 2 && "send" == args[1]) {
+                    n = SEND_COUNT;
+                    if (args.size() >= 3 && !Params::parse(args[2], n)) {
+                        err("Invalid count [%s]", args[2].c_str());
+                        return;
+                    }
+                    if (!_publish) {
+                        err("No uplink");
+                        return;
+                    }
+                    printf("Sent %u records of boot %lu\n", static_cast<unsigned>(send(_boot - 1, n)),
+                        static_cast<unsigned long>(_boot - 1));
+                } else if (args.size() >= 2 && "flush" == args[1]) {
+                    flush();
+                } else {
+                    n = SHOW_COUNT;
+                    if (args.size() >= 2 && !Params::parse(args[1], n)) {
+                        err("Invalid count [%s]", args[1].c_str());
+                        return;
+                    }
+                    print(n);
+                }
+            }
+        )
+    );
+    info("Journal in sector %u of %u, %u B used", static_cast<unsigned>(_sector), static_cast<unsigned>(_sectors),
+        static_cast<unsigned>(_used));
+    // Take records from now on
+    _self = this;
+    return true;
+}
+
+void JournalImpl::stage(esp_log_level_t level, const char* module, LogLimit& limit, const char* fmt, va_list args) {
+    const int64_t nowUs = esp_timer_get_time();
+    uint16_t suppressed = 0;
+    bool keep;
+    portENTER_CRITICAL(&_lock);
+    if (0 == limit.lastUs) {
+        limit.lastUs = nowUs;
+        limit.tokens = BURST;
+    }
+    const int64_t refills = (nowUs - limit.lastUs) / REFILL_US;
+    if (refills > 0) {
+        limit.tokens = static_cast<uint16_t>(min<int64_t>(BURST, limit.tokens + refills));
+        limit.lastUs += refills * REFILL_US;
+    }
+    keep = limit.tokens > 0;
+    if (keep) {
+        limit.tokens--;
+        suppressed = limit.suppressed;
+        limit.suppressed = 0;
+    } else {
+        limit.suppressed += (limit.suppressed < UINT16_MAX) ? 1 : 0;
+        _stats.suppressed++;
+    }
+    portEXIT_CRITICAL(&_lock);
+    if (!keep) {
+        return;
+    }
+    // Formatted outside the lock, on the stack of the logging task
+    uint8_t rec[RECORD_MAX + 1];
+    RecordHeader h;
+    h.level = static_cast<uint8_t>(level);
+    h.suppressed = suppressed;
+    h.boot = _boot;
+    h.timeMs = static_cast<uint32_t>(nowUs / 1000);
+    h.moduleLen = static_cast<uint8_t>(min(strlen(module), MODULE_MAX));
+    char* text = reinterpret_cast<char*>(rec) + sizeof(h) + h.moduleLen;
+    const int n = vsnprintf(text, TEXT_MAX + 1, fmt, args);
+    h.len = static_cast<uint8_t>(sizeof(h) + h.moduleLen + clamp<int>(n, 0, TEXT_MAX));
+    memcpy(rec, &h, sizeof(h));
+    memcpy(rec + sizeof(h), module, h.moduleLen);
+
+    bool wake;
+    portENTER_CRITICAL(&_lock);
+    if (_used + h.len > SECTOR_LEN) {
+        // Writer is behind, it's been woken already
+        _stats.lost++;
+        wake = false;
+    } else {
+        memcpy(_image + _used, rec, h.len);
+        _used += h.len;
+        _stats.staged++;
+        wake = _used >= WAKE_LEN;
+    }
+    portEXIT_CRITICAL(&_lock);
+    if (wake) {
+        xTaskNotifyGive(_task);
+    }
+}
+
+bool JournalImpl::flush() {
+    if (pdTRUE != xSemaphoreTake(_flushLock, FLUSH_TIMEOUT)) {
+        return false;
+    }
+    portENTER_CRITICAL(&_lock);
+    const size_t used = _used;
+    portEXIT_CRITICAL(&_lock);
+    const size_t offset = _sector * SECTOR_LEN;
+    bool ok = true;
+    // A sector is erased only once it has records, each once per lap
+    if (_erasePending && used > sizeof(SectorHeader)) {
+        ok = ESP_OK == esp_partition_erase_range(_part, offset, SECTOR_LEN);
+        if (ok) {
+            _erasePending = false;
+            _stats.erases++;
+        } else {
+            err("Fail erase sector %u", static_cast<unsigned>(_sector));
+        }
+    }
+    if (ok && !_erasePending && used > _written) {
+        // Only the bytes staged since, the rest of the sector is still erased
+        ok = ESP_OK == esp_partition_write(_part, offset + _written, _image + _written, used - _written);
+        if (ok) {
+            _written = used;
+            _stats.writes++;
+        } else {
+            err("Fail write sector %u", static_cast<unsigned>(_sector));
+        }
+    }
+    if (ok && SECTOR_LEN - used < RECORD_MAX) {
+        // Full, the next sector is erased when its first records are written.
+        // Records staged since the write move on to it, they are fewer than
+        // RECORD_MAX bytes as the sector was full.
+        uint8_t carry[RECORD_MAX];
+        portENTER_CRITICAL(&_lock);
+        const size_t carried = _used - used;
+        memcpy(carry, _image + used, carried);
+        _sector = (_sector + 1) % _sectors;
+        startSector(_seq + 1);
+        memcpy(_image + _used, carry, carried);
+        _used += carried;
+        portEXIT_CRITICAL(&_lock);
+    }
+    xSemaphoreGive(_flushLock);
+    return ok;
+}
+
+void JournalImpl::run() {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, FLUSH_PERIOD);
+        flush();
+    }
+}
+
+void JournalImpl::read(const function<void(const Record&)>& visit) const {
+    // Sectors in the order they were filled, the oldest is the next to erase
+    vector<pair<uint32_t, size_t>> order;
+    for (size_t i = 0; i < _sectors; i++) {
+        SectorHeader h;
+        memcpy(&h, sector(i), sizeof(h));
+        if (MAGIC == h.magic) {
+            order.emplace_back(h.seq, i);
+        }
+    }
+    sort(order.begin(), order.end());
+    for (const auto& [seq, i]: order) {
+        const uint8_t* s = sector(i);
+        const size_t end = recordsEnd(s);
+        for (size_t pos = sizeof(SectorHeader); pos < end; pos += s[pos]) {
+            RecordHeader h;
+            memcpy(&h, s + pos, sizeof(h));
+            const char* p = reinterpret_cast<const char*>(s + pos + sizeof(h));
+            const size_t moduleLen = min<size_t>(h.moduleLen, h.len - sizeof(h));
+            const Record r = {
+                h.level, h.suppressed, h.boot, h.timeMs,
+                string_view(p, moduleLen), string_view(p + moduleLen, h.len - sizeof(h) - moduleLen),
+            };
+            visit(r);
+        }
+    }
+}
+
+size_t JournalImpl::send(uint32_t boot, size_t max) {
+    if (!_publish) {
+        return 0;
+    }
+    flush();
+    size_t count = 0;
+    read([boot, &count](const Record& r) { count += (boot == r.boot) ? 1 : 0; });
+    size_t skip = count > max ? count - max : 0;
+    size_t sent = 0;
+    bool full = false;
+    read([&](const Record& r) {
+        if (boot != r.boot || full) {
+            return;
+        }
+        if (skip > 0) {
+            skip--;
+            return;
+        }
+        auto encode = [&r](span<uint8_t> buf) { return Telemetry::encodeLog(buf, r); };
+        if (_publish(encode)) {
+            sent++;
+        } else {
+            full = true;
+        }
+    });
+    return sent;
+}
+
+Journal::Stats JournalImpl::getStats() const {
+    portENTER_CRITICAL(&_lock);
+    const Stats stats = _stats;
+    portEXIT_CRITICAL(&_lock);
+    return stats;
+}
+
+void JournalImpl::print(size_t n) {
+    flush();
+    const Stats st = getStats();
+    printf("sector %u of %u, staged %lu suppressed %lu lost %lu, writes %lu erases %lu\n",
+        static_cast<unsigned>(_sector), static_cast<unsigned>(_sectors), static_cast<unsigned long>(st.staged),
+        static_cast<unsigned long>(st.suppressed), static_cast<unsigned long>(st.lost),
+        static_cast<unsigned long>(st.writes), static_cast<unsigned long>(st.erases));
+    size_t count = 0;
+    read([&count](const Record&) { count++; });
+    size_t skip = count > n ? count - n : 0;
+    read([&skip](const Record& r) {
+        if (skip > 0) {
+            skip--;
+            return;
+        }
+        printf("#%lu %8lu.%03lu %c %.*s: %.*s", static_cast<unsigned long>(r.boot),
+            static_cast<unsigned long>(r.timeMs / 1000), static_cast<unsigned long>(r.timeMs % 1000),
+            ESP_LOG_ERROR == r.level ? 'E' : 'W', static_cast<int>(r.module.size()), r.module.data(),
+            static_cast<int>(r.text.size()), r.text.data());
+        if (r.suppressed > 0) {
+            printf(" (%u suppressed before)", r.suppressed);
+        }
+        printf("\n");
+    });
+}
+
+Journal::Hnd Journal::create(Bosun& bosun, uint32_t boot) {
+    return make_unique<JournalImpl>(bosun, boot);
+}
+
+} // namespace
@@ -0,0 +1,101 @@
+/**
+ * @brief Persistent log of warnings and errors, for post-mortem retrieval
+ *
+ * Warnings and errors logged through Log.hpp are also staged in RAM, in the
+ * image of the flash sector being filled, and written to the partition
+ * "journal" by a task of the lowest priority. Loggers don't wait for flash.
+ * Records are appended to the sector as it fills, and when it is full the
+ * next sector is erased, so the partition is a ring and every sector is
+ * erased once per lap. Each module may log a burst, then a record every few
+ * seconds; records dropped by the limit are counted in the next one kept.
+ *
+ * Layout, little endian:
+ *   sector  u32 magic "BGJ1", u32 sequence number of the sector, records
+ *   record  u8 length (header included), u8 level, u16 records of the module
+ *           suppressed before it, u32 boot count, u32 ms since boot,
+ *           u8 module length, module, message
+ * Erased flash (0xFF) ends the records of a sector.
+*/
+
+#pragma once
+
+#include <memory>
+#include <string_view>
+#include <span>
+#include <functional>
+#include <cinttypes>
+
+namespace beegram {
+
+class Bosun;
+
+class Journal {
+public:
+    using Hnd = std::unique_ptr<Journal>;
+    /// @brief A logged warning or error
+    struct Record {
+        uint8_t level;              ///< esp_log_level_t, ESP_LOG_WARN or ESP_LOG_ERROR
+        uint16_t suppressed;        ///< Records of the module dropped before this one
+        uint32_t boot;              ///< Boot count when logged
+        uint32_t timeMs;            ///< Time since boot
+        std::string_view module;
+        std::string_view text;
+    };
+    /// @brief Encodes a message in place, the type of Cloud::Fill
+    using Fill = std::function<size_t(std::span<uint8_t> buf)>;
+    /// @brief Hands a message to the uplink, e.g. Cloud::publish()
+    using Publish = std::function<bool(const Fill& fill)>;
+    struct Stats {
+        uint32_t staged;            ///< Records staged since boot
+        uint32_t suppressed;        ///< Records dropped by the rate limits
+        uint32_t lost;              ///< Records dropped as the sector was full
+        uint32_t writes;            ///< Flash writes
+        uint32_t erases;            ///< Sectors erased
+    };
+    virtual ~Journal() = default;
+
+    /**
+     * Find the newest sector and continue filling it, then start taking
+     * records and register the command journal
+     * @return True on success; false on failure
+    */
+    virtual bool init() = 0;
+
+    /**
+     * Write the staged records now, e.g. before a restart. Also done when
+     * the sector fills up, periodically and on esp_restart().
+     * @return True on success; false on failure
+    */
+    virtual bool flush() = 0;
+
+    /**
+     * Visit the records in flash, oldest first
+     * @param visit Called for each record, which is only valid during the call
+    */
+    virtual void read(const std::function<void(const Record&)>& visit) const = 0;
+
+    /**
+     * Set the uplink for sending records, by the command or send()
+     * @param publish Hands messages to the uplink
+    */
+    virtual void setUplink(const Publish& publish) = 0;
+
+    /**
+     * Send the latest records of a boot over the uplink, one message each
+     * @param boot Boot count of the records
+     * @param max Most records to send
+     * @return Number of records the uplink took
+    */
+    virtual size_t send(uint32_t boot, size_t max) = 0;
+
+    virtual Stats getStats() const = 0;
+
+    /**
+     * Create the journal, there's one
+     * @param bosun Takes the command
+     * @param boot Boot count, recorded with each record
+    */
+    static Hnd create(Bosun& bosun, uint32_t boot);
+};
+
+} // namespace
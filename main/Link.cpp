@@ -0,0 +1,255 @@
+#include "Link.hpp"
+#include "Log.hpp"
+#include "Mem.hpp"
+#include "Wifi.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "esp_wifi.h"
+#include "esp_now.h"
+#include "esp_random.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+using namespace std;
+
+namespace beegram {
+
+class LinkEspNow : public Link {
+public:
+    LinkEspNow(Wifi& wifi, uint8_t channel)
+    : _wifi(wifi), _channel(channel)
+    {}
+    virtual ~LinkEspNow();
+    virtual bool init(const Receive& receive) override;
+    virtual bool send(const Addr& to, span<const uint8_t> frame) override;
+    virtual Addr getAddr() const override { return _addr; }
+private:
+    /// Time for the MAC-layer acknowledge, retries included
+    static constexpr TickType_t SEND_TIMEOUT = pdMS_TO_TICKS(100);
+
+    static void onReceive(const esp_now_recv_info_t* info, const uint8_t* data, int len);
+    static void onSent(const uint8_t* addr, esp_now_send_status_t status);
+    bool open();
+    void close();
+
+    /// ESP-NOW calls back without context, there's one radio
+    static LinkEspNow* _self;
+    Wifi& _wifi;
+    const uint8_t _channel;
+    Addr _addr = {};
+    Receive _receive;
+    QueueHandle_t _status = nullptr;
+    bool _open = false;
+};
+
+LinkEspNow* LinkEspNow::_self = nullptr;
+
+LinkEspNow::~LinkEspNow() {
+    close();
+    if (this == _self) {
+        _self = nullptr;
+    }
+}
+
+void LinkEspNow::onReceive(const esp_now_recv_info_t* info, const uint8_t* data, int len) {
+    if (_self && _self->_receive) {
+        Addr from;
+        memcpy(from.data(), info->src_addr, from.size());
+        _self->_receive(from, span<const uint8_t>(data, len));
+    }
+}
+
+void LinkEspNow::onSent(const uint8_t* addr, esp_now_send_status_t status) {
+    if (_self) {
+        xQueueOverwrite(_self->_status, &status);
+    }
+}
+
+bool LinkEspNow::init(const Receive& receive) {
+    if (_self) {
+        err("ESP-NOW link exists");
+        return false;
+    }
+    _status = Mem::queue(1, sizeof(esp_now_send_status_t));
+    if (!_status) {
+        err("Fail create queue");
+        return false;
+    }
+    _self = this;
+    _receive = receive;
+    esp_wifi_get_mac(WIFI_IF_STA, _addr.data());
+    // A receiver listens all the time
+    return !_receive || open();
+}
+
+bool LinkEspNow::open() {
+    if (_open) {
+        return true;
+    }
+    if (!_wifi.hold()) {
+        return false;
+    }
+    esp_err_t ret = esp_wifi_set_channel(_channel, WIFI_SECOND_CHAN_NONE);
+    if (ESP_OK != ret) {
+        warn("Fail set channel %u: %s", _channel, esp_err_to_name(ret));
+    }
+    ret = esp_now_init();
+    if (ESP_OK != ret) {
+        err("Fail init ESP-NOW: %s", esp_err_to_name(ret));
+        _wifi.release();
+        return false;
+    }
+    esp_now_register_recv_cb(onReceive);
+    esp_now_register_send_cb(onSent);
+    _open = true;
+    return true;
+}
+
+void LinkEspNow::close() {
+    if (!_open) {
+        return;
+    }
+    esp_now_deinit();
+    _wifi.release();
+    _open = false;
+}
+
+bool LinkEspNow::send(const Addr& to, span<const uint8_t> frame) {
+    if (frame.size() > MTU) {
+        err("Frame too long: %u B", static_cast<unsigned>(frame.size()));
+        return false;
+    }
+    // A sender turns the radio on only for its frames
+    const bool keep = _open;
+    if (!open()) {
+        return false;
+    }
+    bool ok = true;
+    if (!esp_now_is_peer_exist(to.data())) {
+        esp_now_peer_info_t peer = {};
+        memcpy(peer.peer_addr, to.data(), to.size());
+        peer.ifidx = WIFI_IF_STA;
+        ok = ESP_OK == esp_now_add_peer(&peer);
+        if (!ok) {
+            err("Fail add peer");
+        }
+    }
+    if (ok) {
+        xQueueReset(_status);
+        esp_now_send_status_t status = ESP_NOW_SEND_FAIL;
+        ok = ESP_OK == esp_now_send(to.data(), frame.data(), frame.size())
+            && pdTRUE == xQueueReceive(_status, &status, SEND_TIMEOUT)
+            && ESP_NOW_SEND_SUCCESS == status;
+    }
+    if (!keep) {
+        close();
+    }
+    return ok;
+}
+
+optional<Link::Addr> Link::parseAddr(const string_view& text) {
+    const string s(text);
+    Addr addr;
+    char end;
+    if (6 != sscanf(s.c_str(), "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx%c",
+        &addr[0], &addr[1], &addr[2], &addr[3], &addr[4], &addr[5], &end)) {
+        return nullopt;
+    }
+    return addr;
+}
+
+Link::Hnd Link::createEspNow(Wifi& wifi, uint8_t channel) {
+    return make_unique<LinkEspNow>(wifi, channel);
+}
+
+class LinkLoop;
+
+class LoopImpl : public Link::Loop {
+public:
+    LoopImpl(uint32_t ackLossPct)
+    : _ackLossPct(ackLossPct)
+    {}
+    void attach(LinkLoop* link);
+    void detach(LinkLoop* link);
+    bool deliver(const Link::Addr& from, const Link::Addr& to, span<const uint8_t> frame) const;
+private:
+    static constexpr size_t MAX_LINKS = 64;
+    const uint32_t _ackLossPct;
+    LinkLoop* _links[MAX_LINKS] = {};
+};
+
+class LinkLoop : public Link {
+public:
+    LinkLoop(LoopImpl& loop, const Addr& addr)
+    : _loop(loop), _addr(addr)
+    {
+        _loop.attach(this);
+    }
+    virtual ~LinkLoop() { _loop.detach(this); }
+    virtual bool init(const Receive& receive) override {
+        _receive = receive;
+        return true;
+    }
+    virtual bool send(const Addr& to, span<const uint8_t> frame) override {
+        return frame.size() <= MTU && _loop.deliver(_addr, to, frame);
+    }
+    virtual Addr getAddr() const override { return _addr; }
+    /// @return True if taken
+    bool receive(const Addr& from, span<const uint8_t> frame) const {
+        if (!_receive) {
+            return false;
+        }
+        _receive(from, frame);
+        return true;
+    }
+private:
+    LoopImpl& _loop;
+    const Addr _addr;
+    Receive _receive;
+};
+
+void LoopImpl::attach(LinkLoop* link) {
+    for (auto& l: _links) {
+        if (!l) {
+            l = link;
+            return;
+        }
+    }
+    err("Out of loop links");
+}
+
+void LoopImpl::detach(LinkLoop* link) {
+    for (auto& l: _links) {
+        if (link == l) {
+            l = nullptr;
+        }
+    }
+}
+
+bool LoopImpl::deliver(const Link::Addr& from, const Link::Addr& to, span<const uint8_t> frame) const {
+    // Delivered at once on the sending task, like the radio's receive
+    // callback the receiver must not block
+    bool delivered = false;
+    for (const auto* l: _links) {
+        if (l && from != l->getAddr() && (Link::BROADCAST == to || to == l->getAddr())) {
+            delivered = l->receive(from, frame) || delivered;
+        }
+    }
+    if (Link::BROADCAST == to) {
+        return true;
+    }
+    return delivered && esp_random() % 100 >= _ackLossPct;
+}
+
+Link::Loop::Hnd Link::Loop::create(uint32_t ackLossPct) {
+    return make_unique<LoopImpl>(ackLossPct);
+}
+
+Link::Hnd Link::createLoop(Loop& loop, const Addr& addr) {
+    return make_unique<LinkLoop>(static_cast<LoopImpl&>(loop), addr);
+}
+
+} // namespace
@@ -0,0 +1,91 @@
+/**
+ * @brief Connectionless frame transport between devices of an apiary
+ *
+ * Hive nodes send their samples to a gateway over ESP-NOW, without an
+ * access point, association or TLS. The loopback link joins any number of
+ * links within one process over a Loop instead of the radio, so nodes and a
+ * gateway can run together on one device, e.g. to measure fan-in.
+*/
+
+#pragma once
+
+#include <array>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <span>
+#include <functional>
+#include <cinttypes>
+
+namespace beegram {
+
+class Wifi;
+
+class Link {
+public:
+    using Hnd = std::unique_ptr<Link>;
+    /// @brief Station MAC address of a device
+    using Addr = std::array<uint8_t, 6>;
+    /// Longest frame, the ESP-NOW limit
+    static constexpr size_t MTU = 250;
+    static constexpr Addr BROADCAST = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    /**
+     * Takes a received frame. Called on the task of the link, so it must not
+     * block, and the frame is only valid during the call.
+    */
+    using Receive = std::function<void(const Addr& from, std::span<const uint8_t> frame)>;
+
+    /// @brief Medium of loopback links, delivers frames in process
+    class Loop {
+    public:
+        using Hnd = std::unique_ptr<Loop>;
+        virtual ~Loop() = default;
+        /**
+         * Create a medium. Its links must be used from one task.
+         * @param ackLossPct Share of delivered frames reported as lost to
+         * the sender, as when acknowledges are lost, to provoke resends
+        */
+        static Hnd create(uint32_t ackLossPct = 0);
+    };
+
+    virtual ~Link() = default;
+
+    /**
+     * Bring the link up
+     * @param receive Takes received frames; null for a link which only sends
+     * @return True on success; false on failure
+    */
+    virtual bool init(const Receive& receive) = 0;
+
+    /**
+     * Send a frame. Blocks until it's acknowledged, or just sent if to
+     * BROADCAST.
+     * @param to Receiver
+     * @param frame Up to MTU bytes
+     * @return True if delivered; false otherwise
+    */
+    virtual bool send(const Addr& to, std::span<const uint8_t> frame) = 0;
+
+    /// @return Own address
+    virtual Addr getAddr() const = 0;
+
+    /// @return Address written as "aa:bb:cc:dd:ee:ff"; nullopt if invalid
+    static std::optional<Addr> parseAddr(const std::string_view& text);
+
+    /**
+     * Create the ESP-NOW link. A link which receives keeps the radio on, one
+     * which only sends turns it on for each frame.
+     * @param wifi Owns the radio
+     * @param channel Wi-Fi channel shared by nodes and gateway
+    */
+    static Hnd createEspNow(Wifi& wifi, uint8_t channel);
+
+    /**
+     * Create a loopback link
+     * @param loop Medium shared with the other links
+     * @param addr Address of the link, unique on the medium
+    */
+    static Hnd createLoop(Loop& loop, const Addr& addr);
+};
+
+} // namespace
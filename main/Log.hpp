@@ -7,6 +7,7 @@
 
 #include "esp_log.h"
 #include <string_view>
+#include <cinttypes>
 
 // Note: path processing naïvely assumes a valid Unix file path containing
 // directories and an extension.
@@ -60,8 +61,29 @@ static constexpr TerminatedString<moduleName.length() + 1> logPrefix{moduleName}
 // Sanity check, assumes all file stems in project are less than 100 chars
 static_assert(moduleName.length() < 100);
 
-#define err(args...) ESP_LOGE(logPrefix.str(), args)
-#define warn(args...) ESP_LOGW(logPrefix.str(), args)
+/// Rate limit of records to the journal, one per module
+struct LogLimit {
+    int64_t lastUs;         ///< Last refill, 0 before the first record
+    uint16_t tokens;        ///< Records allowed until the next refill
+    uint16_t suppressed;    ///< Records dropped since the last one kept
+};
+
+/// Shared by the tasks logging from this module
+[[maybe_unused]] static LogLimit logLimit;
+
+/**
+ * Stage a warning or error for the persistent journal, see Journal.hpp.
+ * Dropped before the journal is up, or if the module is over its rate.
+ * @param level Log level of the record
+ * @param module Log prefix of the module
+ * @param limit Rate limit of the module
+ * @param fmt Format of the message, printf style
+ */
+void logJournal(esp_log_level_t level, const char* module, LogLimit& limit, const char* fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+#define err(args...) do { ESP_LOGE(logPrefix.str(), args); logJournal(ESP_LOG_ERROR, logPrefix.str(), logLimit, args); } while (0)
+#define warn(args...) do { ESP_LOGW(logPrefix.str(), args); logJournal(ESP_LOG_WARN, logPrefix.str(), logLimit, args); } while (0)
 #define info(args...) ESP_LOGI(logPrefix.str(), args)
 #define debug(args...) ESP_LOGD(logPrefix.str(), args)
 #define trace(args...) ESP_LOGV(logPrefix.str(), args)
@@ -0,0 +1,198 @@
+#include "Mailbox.hpp"
+#include "Log.hpp"
+#include "Bosun.hpp"
+#include "Mem.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace beegram {
+
+class MailboxImpl : public Mailbox {
+public:
+    MailboxImpl(const char* name, const Wake& wake);
+    virtual bool call(const function<void()>& fn) override;
+    virtual size_t drain() override;
+    virtual bool pending() const override;
+    virtual Stats getStats() const override;
+    void print() const;
+private:
+    /// Calls in flight, each sender waits for its own
+    static constexpr uint32_t CAPACITY = 8;
+    static_assert(0 == (CAPACITY & (CAPACITY - 1)));
+
+    /// @brief A call, on the stack of the sender until it's done
+    struct Request {
+        const function<void()>* fn;
+        int64_t postUs;
+        SemaphoreHandle_t done;
+    };
+    /// @brief Slot of the ring, its sequence tells whose turn it is
+    struct Cell {
+        atomic<uint32_t> seq;
+        Request* req;
+    };
+
+    bool push(Request* req);
+    Request* pop();
+
+    const char* _name;
+    Wake _wake;
+    atomic<TaskHandle_t> _owner = nullptr;
+    Cell _cells[CAPACITY];
+    atomic<uint32_t> _head = 0;     ///< Next to push, any task
+    atomic<uint32_t> _tail = 0;     ///< Next to pop, the owner
+    // Statistics, written by the owner except busy
+    atomic<uint32_t> _calls = 0;
+    atomic<uint32_t> _busy = 0;
+    atomic<uint32_t> _waitMaxUs = 0;
+    atomic<uint64_t> _waitSumUs = 0;
+    atomic<uint32_t> _waitLastUs = 0;
+};
+
+/// Mailboxes for the shell command
+static constexpr size_t MAX_MAILBOXES = 4;
+static MailboxImpl* mailboxes[MAX_MAILBOXES] = {};
+
+MailboxImpl::MailboxImpl(const char* name, const Wake& wake)
+: _name(name), _wake(wake)
+{
+    for (uint32_t i = 0; i < CAPACITY; i++) {
+        _cells[i].seq = i;
+        _cells[i].req = nullptr;
+    }
+    for (auto& m: mailboxes) {
+        if (!m) {
+            m = this;
+            break;
+        }
+    }
+}
+
+// Bounded multi-producer ring after Dmitry Vyukov. A cell is free to push
+// at position pos when its sequence is pos and ready to pop when pos + 1.
+
+bool MailboxImpl::push(Request* req) {
+    uint32_t pos = _head.load(memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+        cell = &_cells[pos & (CAPACITY - 1)];
+        const int32_t diff = static_cast<int32_t>(cell->seq.load(memory_order_acquire) - pos);
+        if (0 == diff) {
+            if (_head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = _head.load(memory_order_relaxed);
+        }
+    }
+    cell->req = req;
+    cell->seq.store(pos + 1, memory_order_release);
+    return true;
+}
+
+MailboxImpl::Request* MailboxImpl::pop() {
+    const uint32_t pos = _tail.load(memory_order_relaxed);
+    Cell& cell = _cells[pos & (CAPACITY - 1)];
+    if (static_cast<int32_t>(cell.seq.load(memory_order_acquire) - (pos + 1)) < 0) {
+        return nullptr;
+    }
+    Request* req = cell.req;
+    cell.seq.store(pos + CAPACITY, memory_order_release);
+    _tail.store(pos + 1, memory_order_relaxed);
+    return req;
+}
+
+bool MailboxImpl::call(const function<void()>& fn) {
+    if (xTaskGetCurrentTaskHandle() == _owner) {
+        fn();
+        return true;
+    }
+    StaticSemaphore_t doneBuf;
+    Request req = { &fn, esp_timer_get_time(), xSemaphoreCreateBinaryStatic(&doneBuf) };
+    if (!push(&req)) {
+        _busy++;
+        vSemaphoreDelete(req.done);
+        return false;
+    }
+    _wake();
+    // The request lives on this stack, so wait for as long as it takes
+    xSemaphoreTake(req.done, portMAX_DELAY);
+    vSemaphoreDelete(req.done);
+    return true;
+}
+
+size_t MailboxImpl::drain() {
+    if (!_owner) {
+        _owner = xTaskGetCurrentTaskHandle();
+    }
+    size_t n = 0;
+    Request* req;
+    while ((req = pop())) {
+        const uint32_t waitUs = esp_timer_get_time() - req->postUs;
+        _waitLastUs = waitUs;
+        _waitSumUs += waitUs;
+        if (waitUs > _waitMaxUs) {
+            _waitMaxUs = waitUs;
+        }
+        _calls++;
+        {
+            // Callers are shell commands, which may allocate after boot; the
+            // Allow of the caller's task doesn't cover the owner
+            Mem::Allow allow;
+            (*req->fn)();
+        }
+        xSemaphoreGive(req->done);
+        n++;
+    }
+    return n;
+}
+
+bool MailboxImpl::pending() const {
+    const uint32_t pos = _tail.load(memory_order_relaxed);
+    return _cells[pos & (CAPACITY - 1)].seq.load(memory_order_acquire) == pos + 1;
+}
+
+Mailbox::Stats MailboxImpl::getStats() const {
+    return { _calls, _busy, _waitMaxUs, _waitSumUs, _waitLastUs };
+}
+
+void MailboxImpl::print() const {
+    const Stats s = getStats();
+    printf("%-6s %7lu %5lu %9.0f %9lu %9lu\n", _name, static_cast<unsigned long>(s.calls),
+        static_cast<unsigned long>(s.busy), s.calls ? static_cast<double>(s.waitSumUs) / s.calls : 0.0,
+        static_cast<unsigned long>(s.waitMaxUs), static_cast<unsigned long>(s.waitLastUs));
+}
+
+Mailbox::Hnd Mailbox::create(const char* name, const Wake& wake) {
+    return make_unique<MailboxImpl>(name, wake);
+}
+
+void Mailbox::addCmds(Bosun& bosun) {
+    bosun.addCmd(
+        "mbox", Cmd(
+            "\n\tShow calls to each subsystem owner and how long they waited",
+            [](const vector<string>& args) {
+                printf("%-6s %7s %5s %9s %9s %9s\n", "owner", "calls", "busy", "mean us", "max us", "last us");
+                for (const auto* m: mailboxes) {
+                    if (m) {
+                        m->print();
+                    }
+                }
+            }
+        )
+    );
+}
+
+} // namespace
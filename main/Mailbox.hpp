@@ -0,0 +1,70 @@
+/**
+ * @brief Calls carried out by the task that owns a subsystem
+ *
+ * Subsystems aren't thread safe, each is used from one task only. Other
+ * tasks, e.g. the shell running a command, send the call to the owning task
+ * through its mailbox and wait for the reply. The mailbox is a bounded
+ * lock-free ring of pointers to requests kept on the caller's stack, so
+ * posting neither allocates nor takes a lock, and the owner only checks it
+ * between its own work. The time calls wait in the mailbox is measured.
+*/
+
+#pragma once
+
+#include <memory>
+#include <functional>
+#include <cinttypes>
+
+namespace beegram {
+
+class Bosun;
+
+class Mailbox {
+public:
+    using Hnd = std::unique_ptr<Mailbox>;
+    /// @brief Wakes the owner to drain the mailbox, called by the sender
+    using Wake = std::function<void()>;
+    /// @brief Calls and the time they waited to be carried out
+    struct Stats {
+        uint32_t calls;
+        uint32_t busy;          ///< Calls refused because the mailbox was full
+        uint32_t waitMaxUs;
+        uint64_t waitSumUs;
+        uint32_t waitLastUs;
+    };
+    virtual ~Mailbox() = default;
+
+    /**
+     * Run fn on the owner and wait until it's done. Runs it straight away
+     * if called by the owner. fn may allocate after boot, see Mem::Allow.
+     * @return True if fn ran; false if the mailbox was full
+    */
+    virtual bool call(const std::function<void()>& fn) = 0;
+
+    /**
+     * Carry out the calls waiting, on the owner. The first task to drain
+     * becomes the owner.
+     * @return Number of calls carried out
+    */
+    virtual size_t drain() = 0;
+
+    /// @return True if calls are waiting
+    virtual bool pending() const = 0;
+
+    virtual Stats getStats() const = 0;
+
+    /**
+     * Create a mailbox
+     * @param name Name of the owner, a literal
+     * @param wake Wakes the owner, must not block
+    */
+    static Hnd create(const char* name, const Wake& wake);
+
+    /**
+     * Add the shell command mbox, which shows the statistics of all mailboxes
+     * @param bosun Executes the commands
+    */
+    static void addCmds(Bosun& bosun);
+};
+
+} // namespace
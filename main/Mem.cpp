@@ -0,0 +1,295 @@
+#include "Mem.hpp"
+#include "Log.hpp"
+#include "Bosun.hpp"
+
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_rom_sys.h"
+
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace beegram {
+
+/// @brief Prepended to every C++ allocation, keeps the alignment of malloc
+struct Header {
+    uint32_t len;
+    uint16_t magic;
+    Mem::Sys sys;
+    bool inArena;
+};
+static_assert(sizeof(Header) == 8);
+static constexpr uint16_t HEADER_MAGIC = 0xA11C;
+static constexpr uint32_t HEAP_CAPS = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+
+struct Counters {
+    atomic<size_t> current;
+    atomic<size_t> peak;
+    atomic<uint32_t> allocs;
+    atomic<uint32_t> late;
+};
+
+static Counters counters[Mem::SYS_COUNT];
+static atomic<bool> sealed = false;
+static thread_local Mem::Sys taskSys = Mem::Sys::SYSTEM;
+static thread_local unsigned allowDepth = 0;
+
+#if CONFIG_BEEGRAM_STATIC_ALLOC
+alignas(8) static uint8_t arena[CONFIG_BEEGRAM_ARENA_SIZE];
+static size_t arenaTop = 0;
+static size_t arenaOverflow = 0;
+static portMUX_TYPE arenaLock = portMUX_INITIALIZER_UNLOCKED;
+
+static void* arenaAlloc(size_t len) {
+    len = (len + 7) & ~static_cast<size_t>(7);
+    void* p = nullptr;
+    portENTER_CRITICAL(&arenaLock);
+    if (arenaTop + len <= sizeof(arena)) {
+        p = &arena[arenaTop];
+        arenaTop += len;
+    } else {
+        arenaOverflow += len;
+    }
+    portEXIT_CRITICAL(&arenaLock);
+    return p;
+}
+
+/// Only the most recent allocation is returned, which covers temporaries
+static void arenaFree(void* p, size_t len) {
+    len = (len + 7) & ~static_cast<size_t>(7);
+    portENTER_CRITICAL(&arenaLock);
+    if (static_cast<uint8_t*>(p) + len == &arena[arenaTop]) {
+        arenaTop -= len;
+    }
+    portEXIT_CRITICAL(&arenaLock);
+}
+#endif
+
+/// Thread local storage is set up per task, static constructors run before
+static bool inTask() {
+    return taskSCHEDULER_NOT_STARTED != xTaskGetSchedulerState();
+}
+
+static void charge(Mem::Sys sys, size_t len) {
+    auto& c = counters[static_cast<size_t>(sys)];
+    const size_t now = c.current += len;
+    size_t peak = c.peak;
+    while (now > peak && !c.peak.compare_exchange_weak(peak, now)) {}
+    c.allocs++;
+}
+
+/// Count allocations after boot, abort on them if guarded
+static void checkLate(Mem::Sys sys, size_t len) {
+    if (!sealed || (inTask() && allowDepth > 0)) {
+        return;
+    }
+    counters[static_cast<size_t>(sys)].late++;
+#if CONFIG_BEEGRAM_ALLOC_GUARD
+    // Logging could allocate, the ROM printf doesn't
+    esp_rom_printf("Allocation of %u B by %s after boot\n", static_cast<unsigned>(len), Mem::sysName(sys));
+    abort();
+#endif
+}
+
+static void* allocate(size_t len) {
+    const Mem::Sys sys = Mem::getSys();
+    checkLate(sys, len);
+    const size_t total = sizeof(Header) + len;
+    Header* h = nullptr;
+    bool fromArena = false;
+#if CONFIG_BEEGRAM_STATIC_ALLOC
+    if (!sealed) {
+        h = static_cast<Header*>(arenaAlloc(total));
+        fromArena = nullptr != h;
+    }
+#endif
+    if (!h) {
+        h = static_cast<Header*>(malloc(total));
+    }
+    if (!h) {
+        // Exceptions are disabled, so bad_alloc would abort anyway
+        abort();
+    }
+    *h = { static_cast<uint32_t>(len), HEADER_MAGIC, sys, fromArena };
+    charge(sys, len);
+    return h + 1;
+}
+
+static void deallocate(void* p) {
+    if (!p) {
+        return;
+    }
+    Header* h = static_cast<Header*>(p) - 1;
+    assert(HEADER_MAGIC == h->magic);
+    h->magic = 0;
+    counters[static_cast<size_t>(h->sys)].current -= h->len;
+#if CONFIG_BEEGRAM_STATIC_ALLOC
+    if (h->inArena) {
+        arenaFree(h, sizeof(Header) + h->len);
+        return;
+    }
+#endif
+    free(h);
+}
+
+Mem::Scope::Scope(Sys sys)
+: _prev(getSys())
+{
+    setSys(sys);
+}
+
+Mem::Scope::~Scope() {
+    setSys(_prev);
+}
+
+Mem::Allow::Allow() {
+    if (inTask()) {
+        allowDepth++;
+    }
+}
+
+Mem::Allow::~Allow() {
+    if (inTask()) {
+        allowDepth--;
+    }
+}
+
+void Mem::setSys(Sys sys) {
+    if (inTask()) {
+        taskSys = sys;
+    }
+}
+
+Mem::Sys Mem::getSys() {
+    return inTask() ? taskSys : Sys::SYSTEM;
+}
+
+void Mem::seal() {
+    sealed = true;
+    const auto heap = getHeapStats();
+    info("Boot done, arena %u/%u B, overflow %u B, heap free %u B",
+        static_cast<unsigned>(heap.arenaUsed), static_cast<unsigned>(heap.arenaLen),
+        static_cast<unsigned>(heap.arenaOverflow), static_cast<unsigned>(heap.free));
+}
+
+bool Mem::isSealed() {
+    return sealed;
+}
+
+void* Mem::alloc(size_t len) {
+    void* p = tryAlloc(len);
+    if (!p) {
+        esp_rom_printf("Out of memory for %u B\n", static_cast<unsigned>(len));
+        abort();
+    }
+    return p;
+}
+
+void* Mem::tryAlloc(size_t len) {
+    const Sys sys = getSys();
+    checkLate(sys, len);
+    void* p = nullptr;
+#if CONFIG_BEEGRAM_STATIC_ALLOC
+    if (!sealed) {
+        p = arenaAlloc(len);
+    }
+#endif
+    if (!p) {
+        p = heap_caps_malloc(len, HEAP_CAPS);
+    }
+    if (p) {
+        charge(sys, len);
+    }
+    return p;
+}
+
+QueueHandle_t Mem::queue(size_t len, size_t itemLen) {
+    auto* q = static_cast<StaticQueue_t*>(alloc(sizeof(StaticQueue_t)));
+    auto* items = static_cast<uint8_t*>(alloc(len * itemLen));
+    return xQueueCreateStatic(len, itemLen, items, q);
+}
+
+EventGroupHandle_t Mem::eventGroup() {
+    return xEventGroupCreateStatic(static_cast<StaticEventGroup_t*>(alloc(sizeof(StaticEventGroup_t))));
+}
+
+SemaphoreHandle_t Mem::mutex() {
+    return xSemaphoreCreateMutexStatic(static_cast<StaticSemaphore_t*>(alloc(sizeof(StaticSemaphore_t))));
+}
+
+Mem::Stats Mem::getStats(Sys sys) {
+    const auto& c = counters[static_cast<size_t>(sys)];
+    return { c.current, c.peak, c.allocs, c.late };
+}
+
+Mem::HeapStats Mem::getHeapStats() {
+    HeapStats s = {};
+#if CONFIG_BEEGRAM_STATIC_ALLOC
+    portENTER_CRITICAL(&arenaLock);
+    s.arenaUsed = arenaTop;
+    s.arenaOverflow = arenaOverflow;
+    portEXIT_CRITICAL(&arenaLock);
+    s.arenaLen = sizeof(arena);
+#endif
+    s.free = heap_caps_get_free_size(HEAP_CAPS);
+    s.minFree = heap_caps_get_minimum_free_size(HEAP_CAPS);
+    s.largestFree = heap_caps_get_largest_free_block(HEAP_CAPS);
+    return s;
+}
+
+const char* Mem::sysName(Sys sys) {
+    switch (sys) {
+        case Sys::SYSTEM:   return "system";
+        case Sys::ACQ:      return "acq";
+        case Sys::DSP:      return "dsp";
+        case Sys::NET:      return "net";
+        case Sys::SHELL:    return "shell";
+        default:            return "unknown";
+    }
+}
+
+void Mem::addCmds(Bosun& bosun) {
+    bosun.addCmd(
+        "mem", Cmd(
+            "\n\tShow C++ allocations per subsystem and heap state",
+            [](const vector<string>& args) {
+                printf("%-8s %9s %9s %8s %6s\n", "sys", "current", "peak", "allocs", "late");
+                for (size_t i = 0; i < SYS_COUNT; i++) {
+                    const Sys sys = static_cast<Sys>(i);
+                    const auto s = getStats(sys);
+                    printf("%-8s %9u %9u %8lu %6lu\n", sysName(sys), static_cast<unsigned>(s.current),
+                        static_cast<unsigned>(s.peak), static_cast<unsigned long>(s.allocs),
+                        static_cast<unsigned long>(s.late));
+                }
+                const auto h = getHeapStats();
+                printf("arena %u/%u B, overflow %u B\n", static_cast<unsigned>(h.arenaUsed),
+                    static_cast<unsigned>(h.arenaLen), static_cast<unsigned>(h.arenaOverflow));
+                // Largest block well below free means the heap fragments
+                printf("heap free %u B, min free %u B, largest block %u B\n", static_cast<unsigned>(h.free),
+                    static_cast<unsigned>(h.minFree), static_cast<unsigned>(h.largestFree));
+            }
+        )
+    );
+}
+
+} // namespace
+
+// Every C++ allocation, including the standard containers, goes through
+// these. The array, nothrow and sized forms call them in libstdc++.
+
+void* operator new(size_t len) {
+    return beegram::allocate(len);
+}
+
+void operator delete(void* p) noexcept {
+    beegram::deallocate(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    beegram::deallocate(p);
+}
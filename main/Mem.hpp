@@ -0,0 +1,121 @@
+/**
+ * @brief Memory of the long-lived objects, accounting per subsystem
+ *
+ * All C++ allocations are counted against the subsystem of the calling
+ * task, see Tasks::Cfg. Boot ends with seal(), after that an allocation
+ * outside an Allow scope is counted as late and, with
+ * CONFIG_BEEGRAM_ALLOC_GUARD, aborts.
+ *
+ * With CONFIG_BEEGRAM_STATIC_ALLOC the objects, task stacks and RTOS
+ * objects created during boot come from a static arena of
+ * CONFIG_BEEGRAM_ARENA_SIZE bytes instead of the heap. Whatever doesn't fit
+ * falls back to the heap and shows as overflow in the "mem" command.
+*/
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+
+#include <cinttypes>
+#include <cstddef>
+
+namespace beegram {
+
+class Bosun;
+
+class Mem {
+public:
+    /// @brief Subsystem allocations are charged to
+    enum class Sys : uint8_t {
+        SYSTEM,     ///< ESP-IDF, static constructors and anything unattributed
+        ACQ,        ///< Load sensor, scales and sampling
+        DSP,        ///< Event detection and rollups
+        NET,        ///< Wi-Fi, MQTT and the cloud uplink
+        SHELL,      ///< Shell and commands
+    };
+    static constexpr size_t SYS_COUNT = 5;
+
+    /// @brief Allocations of a subsystem, in bytes
+    struct Stats {
+        size_t current;
+        size_t peak;
+        uint32_t allocs;
+        uint32_t late;      ///< After boot, outside an Allow scope
+    };
+
+    /// @brief Overall heap and arena state, in bytes
+    struct HeapStats {
+        size_t arenaUsed;
+        size_t arenaLen;
+        size_t arenaOverflow;   ///< Wanted from the arena but came from heap
+        size_t free;
+        size_t minFree;         ///< Low water mark since boot
+        size_t largestFree;     ///< Largest block that can be allocated
+    };
+
+    /// @brief Charge allocations of the calling task to a subsystem while in scope
+    class Scope {
+    public:
+        explicit Scope(Sys sys);
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    private:
+        Sys _prev;
+    };
+
+    /// @brief Permit allocations of the calling task after boot while in scope
+    class Allow {
+    public:
+        Allow();
+        ~Allow();
+        Allow(const Allow&) = delete;
+        Allow& operator=(const Allow&) = delete;
+    };
+
+    /// Charge allocations of the calling task to sys from now on
+    static void setSys(Sys sys);
+
+    /// @return Subsystem of the calling task
+    static Sys getSys();
+
+    /// End of boot, further allocations are late
+    static void seal();
+
+    static bool isSealed();
+
+    /**
+     * Allocate storage which is never freed, e.g. a task stack
+     * @param len Length in bytes
+     * @return Word aligned storage in internal RAM; aborts if out of memory
+    */
+    static void* alloc(size_t len);
+
+    /// @brief As alloc(), for storage large enough that its owner should
+    /// fail to init rather than abort; nullptr if out of memory
+    static void* tryAlloc(size_t len);
+
+    /// @brief Create a queue in storage from alloc()
+    static QueueHandle_t queue(size_t len, size_t itemLen);
+
+    /// @brief Create an event group in storage from alloc()
+    static EventGroupHandle_t eventGroup();
+
+    /// @brief Create a mutex in storage from alloc()
+    static SemaphoreHandle_t mutex();
+
+    static Stats getStats(Sys sys);
+    static HeapStats getHeapStats();
+    static const char* sysName(Sys sys);
+
+    /**
+     * Add the shell command mem
+     * @param bosun Executes the commands
+    */
+    static void addCmds(Bosun& bosun);
+};
+
+} // namespace
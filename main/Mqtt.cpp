@@ -0,0 +1,565 @@
+#include "Mqtt.hpp"
+#include "Log.hpp"
+#include "Params.hpp"
+#include "Bosun.hpp"
+#include "Factory.hpp"
+
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_mac.h"
+#include "esp_rom_crc.h"
+#include "esp_crt_bundle.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+#include <cstdio>
+#include <string>
+
+using namespace std;
+
+namespace beegram {
+
+static constexpr size_t SESSION_MAX_LEN = 1024;
+
+/// @brief Saved TLS session and telemetry
+struct MqttCache {
+    uint32_t magic;
+    uint32_t peer;                  ///< Hash of broker host and port the session belongs to
+    uint16_t len;                   ///< Length of saved session, 0 if none
+    uint8_t session[SESSION_MAX_LEN];
+    Mqtt::Stats stats;
+    uint32_t crc;                   ///< Of everything above
+};
+
+/// Survives deep sleep and software resets. The session holds the master
+/// secret, RTC memory isn't readable from outside the chip.
+static RTC_NOINIT_ATTR MqttCache rtcCache;
+
+class MqttImpl : public Mqtt {
+public:
+    MqttImpl(Param& param, Bosun& bosun, const Factory& factory)
+    : _param(param), _bosun(bosun), _factory(factory)
+    {}
+    virtual bool init() override;
+    virtual bool isConfigured() const override { return !_host.empty(); }
+    virtual bool connect() override;
+    virtual bool publish(const string_view& topic, const string_view& payload) override;
+    virtual bool subscribe(const string_view& topic) override;
+    virtual bool receive(const Handler& handler, uint32_t timeoutMs) override;
+    virtual void disconnect() override;
+    virtual Stats getStats() const override { return rtcCache.stats; }
+private:
+    static constexpr uint32_t CACHE_MAGIC = 0xBEE7150C;
+    static constexpr uint16_t KEEPALIVE_S = 60;
+    static constexpr uint32_t READ_TIMEOUT_MS = 5000;
+    static constexpr size_t PACKET_MAX_LEN = 512;
+    /// Room for the fixed header in front of a packet body
+    static constexpr size_t HEADER_MAX_LEN = 5;
+    static constexpr size_t MASTER_LEN = 48;
+    enum PacketType : uint8_t {
+        CONNECT     = 0x10,
+        CONNACK     = 0x20,
+        PUBLISH     = 0x30,
+        SUBSCRIBE   = 0x82,     ///< With the flags the type requires
+        DISCONNECT  = 0xE0,
+    };
+
+    static uint32_t cacheCrc();
+    static void seal();
+    uint32_t peerId() const;
+    bool setupCerts();
+    bool handshake();
+    void saveSession(const mbedtls_ssl_session& session);
+    void forget();
+    bool sendPacket(PacketType type, size_t bodyLen);
+    bool readAll(uint8_t* data, size_t len);
+    size_t putStr(size_t pos, const string_view& s);
+    void close();
+    void printStatus() const;
+
+    Param& _param;
+    Bosun& _bosun;
+    const Factory& _factory;
+    string _host;
+    uint32_t _port = Params::MQTT_PORT.def;
+    bool _verify = true;
+    string _clientId;
+    string _prefix;
+    bool _connected = false;
+    mbedtls_entropy_context _entropy;
+    mbedtls_ctr_drbg_context _drbg;
+    mbedtls_ssl_config _conf;
+    mbedtls_ssl_context _ssl;
+    mbedtls_net_context _net;
+    // Certificates refer to the factory data in flash, they aren't copied
+    mbedtls_x509_crt _ca;
+    mbedtls_x509_crt _cert;
+    mbedtls_pk_context _key;
+    /// Packet under construction, body starts at HEADER_MAX_LEN
+    uint8_t _buf[PACKET_MAX_LEN];
+};
+
+uint32_t MqttImpl::cacheCrc() {
+    return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(&rtcCache), offsetof(MqttCache, crc));
+}
+
+void MqttImpl::seal() {
+    rtcCache.magic = CACHE_MAGIC;
+    rtcCache.crc = cacheCrc();
+}
+
+uint32_t MqttImpl::peerId() const {
+    const uint32_t crc = esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(_host.data()), _host.size());
+    return esp_rom_crc32_le(crc, reinterpret_cast<const uint8_t*>(&_port), sizeof(_port));
+}
+
+bool MqttImpl::setupCerts() {
+    mbedtls_x509_crt_init(&_ca);
+    mbedtls_x509_crt_init(&_cert);
+    mbedtls_pk_init(&_key);
+    const auto ca = _factory.getCa();
+    if (ca.empty()) {
+        // No broker CA provisioned, trust the public ones
+        if (ESP_OK != esp_crt_bundle_attach(&_conf)) {
+            err("Fail attach certificate bundle");
+            return false;
+        }
+    } else {
+        const int ret = mbedtls_x509_crt_parse_der_nocopy(&_ca, ca.data(), ca.size());
+        if (0 != ret) {
+            err("Fail parse factory CA: -0x%04x", -ret);
+            return false;
+        }
+        mbedtls_ssl_conf_ca_chain(&_conf, &_ca, nullptr);
+    }
+    const auto cert = _factory.getCert();
+    const auto key = _factory.getKey();
+    if (cert.empty() || key.empty()) {
+        return true;
+    }
+    int ret = mbedtls_x509_crt_parse_der_nocopy(&_cert, cert.data(), cert.size());
+    if (0 != ret) {
+        err("Fail parse factory certificate: -0x%04x", -ret);
+        return false;
+    }
+    ret = mbedtls_pk_parse_key(&_key, key.data(), key.size(), nullptr, 0, mbedtls_ctr_drbg_random, &_drbg);
+    if (0 != ret) {
+        err("Fail parse factory key: -0x%04x", -ret);
+        return false;
+    }
+    ret = mbedtls_ssl_conf_own_cert(&_conf, &_cert, &_key);
+    if (0 != ret) {
+        err("Fail set certificate: -0x%04x", -ret);
+        return false;
+    }
+    return true;
+}
+
+void MqttImpl::forget() {
+    rtcCache.len = 0;
+    seal();
+}
+
+bool MqttImpl::init() {
+    if (CACHE_MAGIC != rtcCache.magic || cacheCrc() != rtcCache.crc) {
+        memset(&rtcCache, 0, sizeof(rtcCache));
+        seal();
+    }
+    _host = _param.get(Params::MQTT_HOST);
+    _port = _param.get(Params::MQTT_PORT);
+    _verify = _param.get(Params::MQTT_VERIFY);
+    uint8_t mac[6];
+    esp_efuse_mac_get_default(mac);
+    char id[16];
+    snprintf(id, sizeof(id), "bg-%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    _clientId = _factory.getId().empty() ? string(id) : string(_factory.getId());
+    _prefix = "beegram/" + _clientId + "/";
+
+    mbedtls_net_init(&_net);
+    mbedtls_ssl_init(&_ssl);
+    mbedtls_ssl_config_init(&_conf);
+    mbedtls_ctr_drbg_init(&_drbg);
+    mbedtls_entropy_init(&_entropy);
+    int ret = mbedtls_ctr_drbg_seed(&_drbg, mbedtls_entropy_func, &_entropy, nullptr, 0);
+    if (0 != ret) {
+        err("Fail seed DRBG: -0x%04x", -ret);
+        return false;
+    }
+    ret = mbedtls_ssl_config_defaults(&_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    if (0 != ret) {
+        err("Fail TLS config: -0x%04x", -ret);
+        return false;
+    }
+    mbedtls_ssl_conf_max_tls_version(&_conf, MBEDTLS_SSL_VERSION_TLS1_2);
+    mbedtls_ssl_conf_rng(&_conf, mbedtls_ctr_drbg_random, &_drbg);
+    mbedtls_ssl_conf_session_tickets(&_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+    mbedtls_ssl_conf_read_timeout(&_conf, READ_TIMEOUT_MS);
+    if (!setupCerts()) {
+        return false;
+    }
+    ret = mbedtls_ssl_setup(&_ssl, &_conf);
+    if (0 != ret) {
+        err("Fail TLS setup: -0x%04x", -ret);
+        return false;
+    }
+    _bosun.addCmd(
+        "mqtt", Cmd(
+            "[host name [port] | verify 0|1 | forget | test]\n\tShow or set MQTT broker and TLS session telemetry",
+            [this](const vector<string>& args) {
+                if (args.size() >= 3 && args.size() <= 4 && "host" == args[1]) {
+                    uint32_t port = Params::MQTT_PORT.def;
+                    if (!Params::MQTT_HOST.valid(args[2]) || (4 == args.size() && !Params::parse(args[3], port))
+                        || !Params::MQTT_PORT.valid(port)) {
+                        err("Invalid host or port");
+                        return;
+                    }
+                    _host = args[2];
+                    _port = port;
+                    _param.set(Params::MQTT_HOST, _host);
+                    _param.set(Params::MQTT_PORT, _port);
+                    forget();
+                } else if (3 == args.size() && "verify" == args[1]) {
+                    uint32_t verify;
+                    if (!Params::parse(args[2], verify) || !_param.set(Params::MQTT_VERIFY, verify)) {
+                        err("Invalid verify [%s]", args[2].c_str());
+                        return;
+                    }
+                    _verify = verify;
+                } else if (2 == args.size() && "forget" == args[1]) {
+                    forget();
+                } else if (2 == args.size() && "test" == args[1]) {
+                    // Needs the link up, e.g. with "wifi up"
+                    if (connect()) {
+                        publish("test", "{}");
+                        disconnect();
+                    }
+                } else if (1 != args.size()) {
+                    err("Invalid arguments");
+                    return;
+                }
+                printStatus();
+            }
+        )
+    );
+    return true;
+}
+
+void MqttImpl::saveSession(const mbedtls_ssl_session& session) {
+    size_t len = 0;
+    const int ret = mbedtls_ssl_session_save(&session, rtcCache.session, sizeof(rtcCache.session), &len);
+    if (0 != ret) {
+        warn("Fail save TLS session: -0x%04x", -ret);
+        len = 0;
+    }
+    rtcCache.len = len;
+    rtcCache.peer = peerId();
+    seal();
+}
+
+bool MqttImpl::handshake() {
+    mbedtls_ssl_session_reset(&_ssl);
+    mbedtls_ssl_conf_authmode(&_conf, _verify ? MBEDTLS_SSL_VERIFY_REQUIRED : MBEDTLS_SSL_VERIFY_NONE);
+    int ret = mbedtls_ssl_set_hostname(&_ssl, _host.c_str());
+    if (0 != ret) {
+        err("Fail set hostname: -0x%04x", -ret);
+        return false;
+    }
+    char port[8];
+    snprintf(port, sizeof(port), "%lu", static_cast<unsigned long>(_port));
+    ret = mbedtls_net_connect(&_net, _host.c_str(), port, MBEDTLS_NET_PROTO_TCP);
+    if (0 != ret) {
+        err("Fail connect %s:%s: -0x%04x", _host.c_str(), port, -ret);
+        return false;
+    }
+    mbedtls_ssl_set_bio(&_ssl, &_net, mbedtls_net_send, nullptr, mbedtls_net_recv_timeout);
+
+    // Offer the saved session. A resumed session keeps its master secret,
+    // a full handshake makes a new one, that's how resumption is told.
+    bool offered = false;
+    uint8_t master[MASTER_LEN];
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    if (rtcCache.len > 0 && peerId() == rtcCache.peer
+        && 0 == mbedtls_ssl_session_load(&session, rtcCache.session, rtcCache.len)
+        && 0 == mbedtls_ssl_set_session(&_ssl, &session)) {
+        memcpy(master, session.MBEDTLS_PRIVATE(master), MASTER_LEN);
+        offered = true;
+    }
+    mbedtls_ssl_session_free(&session);
+
+    const int64_t startUs = esp_timer_get_time();
+    while (0 != (ret = mbedtls_ssl_handshake(&_ssl))) {
+        if (MBEDTLS_ERR_SSL_WANT_READ != ret && MBEDTLS_ERR_SSL_WANT_WRITE != ret) {
+            err("Fail TLS handshake: -0x%04x", -ret);
+            return false;
+        }
+    }
+    Stats& st = rtcCache.stats;
+    st.handshakes++;
+    st.lastHandshakeMs = static_cast<uint32_t>((esp_timer_get_time() - startUs) / 1000);
+    st.handshakeMsTotal += st.lastHandshakeMs;
+
+    mbedtls_ssl_session_init(&session);
+    bool resumed = false;
+    if (0 == mbedtls_ssl_get_session(&_ssl, &session)) {
+        resumed = offered && 0 == memcmp(master, session.MBEDTLS_PRIVATE(master), MASTER_LEN);
+        // Save also when resumed, the server may have issued a new ticket
+        saveSession(session);
+    }
+    mbedtls_ssl_session_free(&session);
+    if (resumed) {
+        st.resumed++;
+    }
+    seal();
+    info("TLS handshake %lu ms, %s", static_cast<unsigned long>(st.lastHandshakeMs), resumed ? "resumed" : "full");
+    return true;
+}
+
+size_t MqttImpl::putStr(size_t pos, const string_view& s) {
+    _buf[pos++] = s.size() >> 8;
+    _buf[pos++] = s.size() & 0xFF;
+    memcpy(&_buf[pos], s.data(), s.size());
+    return pos + s.size();
+}
+
+bool MqttImpl::sendPacket(PacketType type, size_t bodyLen) {
+    // Fixed header goes right in front of the body, so the packet is
+    // written in one TLS record
+    uint8_t hdr[HEADER_MAX_LEN];
+    size_t hdrLen = 0;
+    hdr[hdrLen++] = type;
+    size_t rem = bodyLen;
+    do {
+        uint8_t byte = rem & 0x7F;
+        rem >>= 7;
+        hdr[hdrLen++] = byte | (rem > 0 ? 0x80 : 0);
+    } while (rem > 0);
+    uint8_t* start = &_buf[HEADER_MAX_LEN - hdrLen];
+    memcpy(start, hdr, hdrLen);
+    size_t len = hdrLen + bodyLen;
+    while (len > 0) {
+        const int ret = mbedtls_ssl_write(&_ssl, start, len);
+        if (ret > 0) {
+            start += ret;
+            len -= ret;
+        } else if (MBEDTLS_ERR_SSL_WANT_READ != ret && MBEDTLS_ERR_SSL_WANT_WRITE != ret) {
+            err("Fail TLS write: -0x%04x", -ret);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MqttImpl::readAll(uint8_t* data, size_t len) {
+    while (len > 0) {
+        const int ret = mbedtls_ssl_read(&_ssl, data, len);
+        if (ret > 0) {
+            data += ret;
+            len -= ret;
+        } else if (MBEDTLS_ERR_SSL_WANT_READ != ret && MBEDTLS_ERR_SSL_WANT_WRITE != ret) {
+            err("Fail TLS read: -0x%04x", -ret);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MqttImpl::connect() {
+    if (_connected) {
+        return true;
+    }
+    if (!isConfigured()) {
+        debug("No broker configured");
+        return false;
+    }
+    if (!handshake()) {
+        rtcCache.stats.failures++;
+        seal();
+        close();
+        return false;
+    }
+    // Clean session, no will, no credentials
+    static constexpr uint8_t CONNECT_HEADER[] = { 0, 4, 'M', 'Q', 'T', 'T', 4, 0x02 };
+    size_t pos = HEADER_MAX_LEN;
+    memcpy(&_buf[pos], CONNECT_HEADER, sizeof(CONNECT_HEADER));
+    pos += sizeof(CONNECT_HEADER);
+    _buf[pos++] = KEEPALIVE_S >> 8;
+    _buf[pos++] = KEEPALIVE_S & 0xFF;
+    pos = putStr(pos, _clientId);
+    uint8_t connack[4];
+    if (!sendPacket(CONNECT, pos - HEADER_MAX_LEN) || !readAll(connack, sizeof(connack))) {
+        rtcCache.stats.failures++;
+        seal();
+        close();
+        return false;
+    }
+    if (CONNACK != connack[0] || 0 != connack[3]) {
+        err("Connection refused: %02x %02x", connack[0], connack[3]);
+        rtcCache.stats.failures++;
+        seal();
+        close();
+        return false;
+    }
+    _connected = true;
+    return true;
+}
+
+bool MqttImpl::publish(const string_view& topic, const string_view& payload) {
+    if (!_connected) {
+        return false;
+    }
+    const size_t bodyLen = 2 + _prefix.size() + topic.size() + payload.size();
+    if (HEADER_MAX_LEN + bodyLen > sizeof(_buf)) {
+        err("Message too long: %u B", static_cast<unsigned>(bodyLen));
+        return false;
+    }
+    size_t pos = HEADER_MAX_LEN;
+    _buf[pos++] = (_prefix.size() + topic.size()) >> 8;
+    _buf[pos++] = (_prefix.size() + topic.size()) & 0xFF;
+    memcpy(&_buf[pos], _prefix.data(), _prefix.size());
+    pos += _prefix.size();
+    memcpy(&_buf[pos], topic.data(), topic.size());
+    pos += topic.size();
+    memcpy(&_buf[pos], payload.data(), payload.size());
+    pos += payload.size();
+    if (!sendPacket(PUBLISH, pos - HEADER_MAX_LEN)) {
+        close();
+        return false;
+    }
+    rtcCache.stats.publishes++;
+    seal();
+    return true;
+}
+
+bool MqttImpl::subscribe(const string_view& topic) {
+    if (!_connected) {
+        return false;
+    }
+    const size_t filterLen = _prefix.size() + topic.size();
+    if (HEADER_MAX_LEN + 2 + 2 + filterLen + 1 > sizeof(_buf)) {
+        err("Topic too long: %u B", static_cast<unsigned>(filterLen));
+        return false;
+    }
+    size_t pos = HEADER_MAX_LEN;
+    // Packet id, the acknowledgement isn't awaited
+    _buf[pos++] = 0;
+    _buf[pos++] = 1;
+    _buf[pos++] = filterLen >> 8;
+    _buf[pos++] = filterLen & 0xFF;
+    memcpy(&_buf[pos], _prefix.data(), _prefix.size());
+    pos += _prefix.size();
+    memcpy(&_buf[pos], topic.data(), topic.size());
+    pos += topic.size();
+    _buf[pos++] = 0;    // QoS
+    if (!sendPacket(SUBSCRIBE, pos - HEADER_MAX_LEN)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool MqttImpl::receive(const Handler& handler, uint32_t timeoutMs) {
+    if (!_connected) {
+        return false;
+    }
+    const int64_t endUs = esp_timer_get_time() + static_cast<int64_t>(timeoutMs) * 1000;
+    while (true) {
+        const int64_t leftUs = endUs - esp_timer_get_time();
+        if (leftUs <= 0) {
+            return true;
+        }
+        // Waits for the start of a packet at most the time left, the rest
+        // of it follows at once
+        uint8_t type;
+        mbedtls_ssl_conf_read_timeout(&_conf, static_cast<uint32_t>(max<int64_t>(1, leftUs / 1000)));
+        const int ret = mbedtls_ssl_read(&_ssl, &type, 1);
+        mbedtls_ssl_conf_read_timeout(&_conf, READ_TIMEOUT_MS);
+        if (MBEDTLS_ERR_SSL_TIMEOUT == ret) {
+            return true;
+        }
+        if (MBEDTLS_ERR_SSL_WANT_READ == ret || MBEDTLS_ERR_SSL_WANT_WRITE == ret) {
+            continue;
+        }
+        if (1 != ret) {
+            err("Fail TLS read: -0x%04x", -ret);
+            close();
+            return false;
+        }
+        size_t len = 0;
+        uint8_t byte = 0x80;
+        for (size_t shift = 0; (byte & 0x80) && shift < 28; shift += 7) {
+            if (!readAll(&byte, 1)) {
+                close();
+                return false;
+            }
+            len |= static_cast<size_t>(byte & 0x7F) << shift;
+        }
+        if (len > sizeof(_buf)) {
+            // Can't skip it without reading it, the stream is lost
+            err("Packet too long: %u B", static_cast<unsigned>(len));
+            close();
+            return false;
+        }
+        if (!readAll(_buf, len)) {
+            close();
+            return false;
+        }
+        // Acknowledgements of subscriptions are ignored, messages come at
+        // QoS 0, without a packet id
+        if (PUBLISH != (type & 0xF0) || len < 2) {
+            continue;
+        }
+        const size_t topicLen = (_buf[0] << 8) | _buf[1];
+        if (2 + topicLen > len) {
+            continue;
+        }
+        string_view topic(reinterpret_cast<const char*>(&_buf[2]), topicLen);
+        if (!topic.starts_with(_prefix)) {
+            continue;
+        }
+        topic.remove_prefix(_prefix.size());
+        if (!handler(topic, span<const uint8_t>(&_buf[2 + topicLen], len - 2 - topicLen))) {
+            return true;
+        }
+    }
+}
+
+void MqttImpl::close() {
+    mbedtls_net_free(&_net);
+    _connected = false;
+}
+
+void MqttImpl::disconnect() {
+    if (!_connected) {
+        return;
+    }
+    sendPacket(DISCONNECT, 0);
+    mbedtls_ssl_close_notify(&_ssl);
+    close();
+}
+
+void MqttImpl::printStatus() const {
+    const Stats& st = rtcCache.stats;
+    printf("broker %s:%lu verify %s, %s\n", _host.c_str(), static_cast<unsigned long>(_port),
+        _verify ? "on" : "off", _connected ? "connected" : "disconnected");
+    printf("client %s, saved session %u B\n", _clientId.c_str(), rtcCache.len);
+    printf("handshakes %lu resumed %lu (%lu%%) last %lu ms mean %lu ms, published %lu, fail %lu\n",
+        static_cast<unsigned long>(st.handshakes), static_cast<unsigned long>(st.resumed),
+        static_cast<unsigned long>(st.handshakes ? 100 * st.resumed / st.handshakes : 0),
+        static_cast<unsigned long>(st.lastHandshakeMs),
+        static_cast<unsigned long>(st.handshakes ? st.handshakeMsTotal / st.handshakes : 0),
+        static_cast<unsigned long>(st.publishes), static_cast<unsigned long>(st.failures));
+}
+
+Mqtt::Hnd Mqtt::create(Param& param, Bosun& bosun, const Factory& factory) {
+    return make_unique<MqttImpl>(param, bosun, factory);
+}
+
+} // namespace
@@ -0,0 +1,95 @@
+/**
+ * @brief Minimal MQTT 3.1.1 client over TLS
+*/
+
+#pragma once
+
+#include <memory>
+#include <cinttypes>
+#include <string_view>
+#include <span>
+#include <functional>
+
+namespace beegram {
+
+class Param; class Bosun; class Factory;
+
+/**
+ * Publishes at QoS 0 over one TLS connection per batch, and receives at QoS 0
+ * what the backend sends to the device while connected. The TLS session
+ * is kept in RTC memory, so the next connection resumes it with an
+ * abbreviated handshake, also after deep sleep. Only TLS 1.2 is used, as
+ * its session tickets arrive within the handshake. The broker CA and the
+ * device certificate come from the factory data, parsed in place in flash.
+*/
+class Mqtt {
+public:
+    using Hnd = std::unique_ptr<Mqtt>;
+    /**
+     * Handles a received message
+     * @param topic Topic relative to the device prefix
+     * @param payload Message content, valid during the call
+     * @return True to receive more; false to stop
+    */
+    using Handler = std::function<bool(std::string_view topic, std::span<const uint8_t> payload)>;
+    /// @brief Handshake telemetry, kept across sleep
+    struct Stats {
+        uint32_t handshakes;        ///< Completed TLS handshakes
+        uint32_t resumed;           ///< Handshakes which resumed a saved session
+        uint32_t lastHandshakeMs;   ///< Duration of the latest handshake
+        uint32_t handshakeMsTotal;  ///< Sum of handshake durations
+        uint32_t publishes;         ///< Messages published
+        uint32_t failures;          ///< Failed connections
+    };
+    virtual ~Mqtt() = default;
+
+    /**
+     * Set up TLS contexts. Doesn't connect.
+     * @return True on success; false on failure
+    */
+    virtual bool init() = 0;
+
+    /// @return True if a broker is configured
+    virtual bool isConfigured() const = 0;
+
+    /**
+     * Connect to the broker, resuming the saved TLS session if there's one.
+     * Blocks. Requires a network link.
+     * @return True if connected; false otherwise
+    */
+    virtual bool connect() = 0;
+
+    /**
+     * Publish a message at QoS 0 under the topic prefix of this device
+     * @param topic Topic relative to the device prefix
+     * @param payload Message content
+     * @return True if sent; false otherwise
+    */
+    virtual bool publish(const std::string_view& topic, const std::string_view& payload) = 0;
+
+    /**
+     * Subscribe at QoS 0 to a topic under the device prefix, for the rest of
+     * the connection. Doesn't wait for the broker to confirm.
+     * @param topic Topic relative to the device prefix
+     * @return True if sent; false otherwise
+    */
+    virtual bool subscribe(const std::string_view& topic) = 0;
+
+    /**
+     * Receive messages of the subscriptions. Blocks.
+     * @param handler Called for each message
+     * @param timeoutMs Longest time to wait in total
+     * @return True if the handler stopped it or time ran out; false if the connection failed
+    */
+    virtual bool receive(const Handler& handler, uint32_t timeoutMs) = 0;
+
+    /// @brief Disconnect from the broker and close the connection
+    virtual void disconnect() = 0;
+
+    /// @return Handshake telemetry
+    virtual Stats getStats() const = 0;
+
+    static Hnd create(Param& param, Bosun& bosun, const Factory& factory);
+};
+
+} // namespace
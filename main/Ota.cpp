@@ -0,0 +1,414 @@
+#include "Ota.hpp"
+#include "Log.hpp"
+#include "Params.hpp"
+#include "Bosun.hpp"
+#include "Wifi.hpp"
+
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+#include "esp_efuse.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace beegram {
+
+class OtaImpl : public Ota {
+public:
+    OtaImpl(Param& param, Bosun& bosun, Wifi& wifi)
+    : _param(param), _bosun(bosun), _wifi(wifi)
+    {}
+    virtual bool init() override;
+    virtual bool update(const char* url) override;
+    virtual void confirm(const SelfTest& selfTest) override;
+private:
+    static constexpr size_t BUF_LEN = 1024;
+    static constexpr size_t HASH_LEN = 32;
+    static constexpr char MAGIC[4] = { 'B', 'G', 'D', '1' };
+    static constexpr uint32_t CONNECT_TIMEOUT_MS = 10 * 1000;
+    static constexpr int HTTP_TIMEOUT_MS = 10 * 1000;
+
+    enum Op : uint8_t {
+        END     = 0,
+        COPY    = 1,    ///< Range of the running image
+        DATA    = 2,    ///< Literal bytes follow
+    };
+    enum class State : uint8_t {
+        HEADER,
+        OP,
+        DATA,
+        DONE,
+    };
+    struct __attribute__((packed)) Header {
+        char magic[4];
+        uint32_t sourceLen;
+        uint8_t sourceHash[HASH_LEN];
+        uint32_t targetLen;
+        uint8_t targetHash[HASH_LEN];
+    };
+    static_assert(sizeof(Header) == 76);
+    struct __attribute__((packed)) OpHeader {
+        uint8_t type;
+        uint32_t offset;
+        uint32_t len;
+    };
+    static_assert(sizeof(OpHeader) == 9);
+
+    bool download(const char* url);
+    bool feed(const uint8_t* data, size_t len);
+    size_t gather(const uint8_t* data, size_t len, void* dst, size_t want);
+    bool begin();
+    bool checkSource();
+    bool runOp();
+    bool write(const uint8_t* data, size_t len);
+    bool copy(uint32_t offset, uint32_t len);
+    bool finish();
+    void printStatus();
+
+    Param& _param;
+    Bosun& _bosun;
+    Wifi& _wifi;
+    const esp_partition_t* _running = nullptr;
+    const esp_partition_t* _target = nullptr;
+    esp_ota_handle_t _handle = 0;
+    bool _begun = false;
+    mbedtls_sha256_context _sha;
+    // Parser state, headers are gathered across reads
+    State _state = State::HEADER;
+    Header _header = {};
+    OpHeader _op = {};
+    size_t _gathered = 0;
+    uint32_t _dataLeft = 0;
+    uint32_t _written = 0;
+    uint32_t _received = 0;
+    uint8_t _rx[BUF_LEN];
+    uint8_t _copy[BUF_LEN];
+};
+
+bool OtaImpl::init() {
+    _running = esp_ota_get_running_partition();
+    if (!_running) {
+        err("Fail get running partition");
+        return false;
+    }
+    _bosun.addCmd(
+        "ota", Cmd(
+            "[url | restart]\n\tShow update state, update from a delta at url or restart into the update",
+            [this](const vector<string>& args) {
+                if (2 == args.size() && "restart" == args[1]) {
+                    esp_restart();
+                } else if (2 == args.size()) {
+                    if (!_wifi.connect(CONNECT_TIMEOUT_MS)) {
+                        err("Offline");
+                        return;
+                    }
+                    if (update(args[1].c_str())) {
+                        info("Update ready, restart to run it");
+                    }
+                    _wifi.disconnect();
+                } else if (1 != args.size()) {
+                    err("Invalid arguments");
+                    return;
+                }
+                printStatus();
+            }
+        )
+    );
+    return true;
+}
+
+bool OtaImpl::update(const char* url) {
+    _target = esp_ota_get_next_update_partition(nullptr);
+    if (!_target) {
+        err("No slot to update");
+        return false;
+    }
+    _state = State::HEADER;
+    _gathered = 0;
+    _written = 0;
+    _received = 0;
+    _begun = false;
+    mbedtls_sha256_init(&_sha);
+    const int64_t startUs = esp_timer_get_time();
+    bool ok = download(url) && finish();
+    const uint32_t timeMs = (esp_timer_get_time() - startUs) / 1000;
+    if (!ok && _begun) {
+        esp_ota_abort(_handle);
+    }
+    mbedtls_sha256_free(&_sha);
+    if (ok) {
+        info("Updated %s: %lu B received for %lu B image in %lu ms", _target->label,
+            static_cast<unsigned long>(_received), static_cast<unsigned long>(_written),
+            static_cast<unsigned long>(timeMs));
+        _param.set(Params::OTA_BYTES, _received);
+        _param.set(Params::OTA_IMAGE_BYTES, _written);
+        _param.set(Params::OTA_TIME, timeMs);
+    }
+    return ok;
+}
+
+bool OtaImpl::download(const char* url) {
+    esp_http_client_config_t cfg = {};
+    cfg.url = url;
+    cfg.timeout_ms = HTTP_TIMEOUT_MS;
+    cfg.crt_bundle_attach = esp_crt_bundle_attach;
+    esp_http_client_handle_t client = esp_http_client_init(&cfg);
+    if (!client) {
+        err("Fail init HTTP client");
+        return false;
+    }
+    bool ok = false;
+    esp_err_t ret = esp_http_client_open(client, 0);
+    if (ESP_OK != ret) {
+        err("Fail open %s: %s", url, esp_err_to_name(ret));
+    } else if (esp_http_client_fetch_headers(client) < 0 || 200 != esp_http_client_get_status_code(client)) {
+        err("Fail get %s: HTTP %d", url, esp_http_client_get_status_code(client));
+    } else {
+        // Pieces go to flash as they arrive
+        ok = true;
+        while (ok && State::DONE != _state) {
+            const int n = esp_http_client_read(client, reinterpret_cast<char*>(_rx), sizeof(_rx));
+            if (n <= 0) {
+                err("Delta ends early after %lu B", static_cast<unsigned long>(_received));
+                ok = false;
+                break;
+            }
+            _received += n;
+            ok = feed(_rx, n);
+        }
+    }
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+    return ok;
+}
+
+size_t OtaImpl::gather(const uint8_t* data, size_t len, void* dst, size_t want) {
+    const size_t n = min(len, want - _gathered);
+    memcpy(static_cast<uint8_t*>(dst) + _gathered, data, n);
+    _gathered += n;
+    return n;
+}
+
+bool OtaImpl::feed(const uint8_t* data, size_t len) {
+    while (len > 0) {
+        size_t n = 0;
+        switch (_state) {
+        case State::HEADER:
+            n = gather(data, len, &_header, sizeof(_header));
+            if (sizeof(_header) == _gathered) {
+                _gathered = 0;
+                if (!begin()) {
+                    return false;
+                }
+                _state = State::OP;
+            }
+            break;
+        case State::OP:
+            n = gather(data, len, &_op, sizeof(_op));
+            if (sizeof(_op) == _gathered) {
+                _gathered = 0;
+                if (!runOp()) {
+                    return false;
+                }
+            }
+            break;
+        case State::DATA:
+            n = min<size_t>(len, _dataLeft);
+            if (!write(data, n)) {
+                return false;
+            }
+            _dataLeft -= n;
+            if (0 == _dataLeft) {
+                _state = State::OP;
+            }
+            break;
+        case State::DONE:
+            err("Data after end of delta");
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool OtaImpl::begin() {
+    if (0 != memcmp(_header.magic, MAGIC, sizeof(MAGIC))) {
+        err("Not a delta");
+        return false;
+    }
+    if (_header.sourceLen > _running->size || _header.targetLen > _target->size) {
+        err("Delta doesn't fit: source %lu B, target %lu B", static_cast<unsigned long>(_header.sourceLen),
+            static_cast<unsigned long>(_header.targetLen));
+        return false;
+    }
+    if (!checkSource()) {
+        return false;
+    }
+    // Erases as much of the slot as the image needs
+    esp_err_t ret = esp_ota_begin(_target, _header.targetLen, &_handle);
+    if (ESP_OK != ret) {
+        err("Fail begin update of %s: %s", _target->label, esp_err_to_name(ret));
+        return false;
+    }
+    _begun = true;
+    mbedtls_sha256_starts(&_sha, 0);
+    info("Updating %s, %lu B image", _target->label, static_cast<unsigned long>(_header.targetLen));
+    return true;
+}
+
+bool OtaImpl::checkSource() {
+    uint8_t hash[HASH_LEN];
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    bool ok = true;
+    for (uint32_t pos = 0; ok && pos < _header.sourceLen; pos += sizeof(_copy)) {
+        const size_t n = min<size_t>(sizeof(_copy), _header.sourceLen - pos);
+        ok = ESP_OK == esp_partition_read(_running, pos, _copy, n);
+        mbedtls_sha256_update(&sha, _copy, n);
+    }
+    mbedtls_sha256_finish(&sha, hash);
+    mbedtls_sha256_free(&sha);
+    if (!ok || 0 != memcmp(hash, _header.sourceHash, sizeof(hash))) {
+        err("Delta is for another image than %s", _running->label);
+        return false;
+    }
+    return true;
+}
+
+bool OtaImpl::runOp() {
+    switch (_op.type) {
+    case Op::END:
+        _state = State::DONE;
+        return true;
+    case Op::COPY:
+        if (_op.offset > _header.sourceLen || _op.len > _header.sourceLen - _op.offset) {
+            err("Copy out of source: %lu+%lu", static_cast<unsigned long>(_op.offset),
+                static_cast<unsigned long>(_op.len));
+            return false;
+        }
+        return copy(_op.offset, _op.len);
+    case Op::DATA:
+        _dataLeft = _op.len;
+        _state = _dataLeft > 0 ? State::DATA : State::OP;
+        return true;
+    default:
+        err("Unknown op %u", _op.type);
+        return false;
+    }
+}
+
+bool OtaImpl::write(const uint8_t* data, size_t len) {
+    if (len > _header.targetLen - _written) {
+        err("Delta makes more than %lu B", static_cast<unsigned long>(_header.targetLen));
+        return false;
+    }
+    esp_err_t ret = esp_ota_write(_handle, data, len);
+    if (ESP_OK != ret) {
+        err("Fail write at %lu: %s", static_cast<unsigned long>(_written), esp_err_to_name(ret));
+        return false;
+    }
+    mbedtls_sha256_update(&_sha, data, len);
+    _written += len;
+    return true;
+}
+
+bool OtaImpl::copy(uint32_t offset, uint32_t len) {
+    while (len > 0) {
+        const size_t n = min<size_t>(sizeof(_copy), len);
+        esp_err_t ret = esp_partition_read(_running, offset, _copy, n);
+        if (ESP_OK != ret) {
+            err("Fail read source at %lu: %s", static_cast<unsigned long>(offset), esp_err_to_name(ret));
+            return false;
+        }
+        if (!write(_copy, n)) {
+            return false;
+        }
+        offset += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool OtaImpl::finish() {
+    uint8_t hash[HASH_LEN];
+    mbedtls_sha256_finish(&_sha, hash);
+    if (_written != _header.targetLen || 0 != memcmp(hash, _header.targetHash, sizeof(hash))) {
+        err("Result doesn't match delta: %lu of %lu B", static_cast<unsigned long>(_written),
+            static_cast<unsigned long>(_header.targetLen));
+        return false;
+    }
+    // Checks the image structure and its own hash
+    esp_err_t ret = esp_ota_end(_handle);
+    _begun = false;
+    if (ESP_OK != ret) {
+        err("Invalid image: %s", esp_err_to_name(ret));
+        return false;
+    }
+    esp_app_desc_t desc;
+    ret = esp_ota_get_partition_description(_target, &desc);
+    if (ESP_OK != ret) {
+        err("Fail read image description: %s", esp_err_to_name(ret));
+        return false;
+    }
+    // The bootloader would refuse it anyway
+    if (!esp_efuse_check_secure_version(desc.secure_version)) {
+        err("Image secure version %lu is revoked", static_cast<unsigned long>(desc.secure_version));
+        return false;
+    }
+    ret = esp_ota_set_boot_partition(_target);
+    if (ESP_OK != ret) {
+        err("Fail set boot slot: %s", esp_err_to_name(ret));
+        return false;
+    }
+    info("Next boot runs %s %s", desc.project_name, desc.version);
+    return true;
+}
+
+void OtaImpl::confirm(const SelfTest& selfTest) {
+    esp_ota_img_states_t state;
+    if (ESP_OK != esp_ota_get_state_partition(_running, &state) || ESP_OTA_IMG_PENDING_VERIFY != state) {
+        return;
+    }
+    info("First boot of %s, self test", _running->label);
+    if (!selfTest()) {
+        err("Self test failed, rolling back");
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+        return;
+    }
+    esp_ota_mark_app_valid_cancel_rollback();
+    info("Update kept: %lu B received for %lu B image in %lu ms",
+        static_cast<unsigned long>(_param.get(Params::OTA_BYTES)),
+        static_cast<unsigned long>(_param.get(Params::OTA_IMAGE_BYTES)),
+        static_cast<unsigned long>(_param.get(Params::OTA_TIME)));
+}
+
+void OtaImpl::printStatus() {
+    const esp_app_desc_t* desc = esp_app_get_description();
+    const esp_partition_t* next = esp_ota_get_boot_partition();
+    printf("running %s %s in %s, secure version %lu\n", desc->project_name, desc->version, _running->label,
+        static_cast<unsigned long>(desc->secure_version));
+    if (next && next != _running) {
+        printf("next boot %s\n", next->label);
+    }
+    printf("latest update %lu B received for %lu B image in %lu ms\n",
+        static_cast<unsigned long>(_param.get(Params::OTA_BYTES)),
+        static_cast<unsigned long>(_param.get(Params::OTA_IMAGE_BYTES)),
+        static_cast<unsigned long>(_param.get(Params::OTA_TIME)));
+}
+
+Ota::Hnd Ota::create(Param& param, Bosun& bosun, Wifi& wifi) {
+    return make_unique<OtaImpl>(param, bosun, wifi);
+}
+
+} // namespace
@@ -0,0 +1,60 @@
+/**
+ * @brief Firmware updates from binary deltas
+ *
+ * A delta rebuilds the new image from ranges of the running one and
+ * literal bytes. It's streamed over HTTP(S) straight into the inactive OTA
+ * slot through a small buffer, nothing is kept in RAM. See support/ota for
+ * the delta tool and a local file server to test with.
+ *
+ * Delta format, little endian:
+ *   header  "BGD1", u32 source length, source SHA-256,
+ *           u32 target length, target SHA-256
+ *   ops     u8 type, u32 offset, u32 length
+ *           COPY (1)  length bytes of the running image from offset
+ *           DATA (2)  length literal bytes follow, offset is 0
+ *           END  (0)  offset and length are 0
+*/
+
+#pragma once
+
+#include <memory>
+#include <functional>
+
+namespace beegram {
+
+class Param; class Bosun; class Wifi;
+
+class Ota {
+public:
+    using Hnd = std::unique_ptr<Ota>;
+    /// @brief Checks the firmware works; true if it does
+    using SelfTest = std::function<bool()>;
+    virtual ~Ota() = default;
+
+    /**
+     * Register the command
+     * @return True on success; false on failure
+    */
+    virtual bool init() = 0;
+
+    /**
+     * Apply a delta to the running image into the inactive slot and boot it
+     * next. Checks the delta was made against the running image, the hash of
+     * the result and the image itself. Blocks for the download.
+     * @param url Location of the delta
+     * @return True if the new image is ready to boot; false otherwise
+    */
+    virtual bool update(const char* url) = 0;
+
+    /**
+     * Keep an image booted for the first time only if it passes the self
+     * test, otherwise roll back to the previous one and reboot. Does nothing
+     * for an image that's been kept already.
+     * @param selfTest Run once all modules are up
+    */
+    virtual void confirm(const SelfTest& selfTest) = 0;
+
+    static Hnd create(Param& param, Bosun& bosun, Wifi& wifi);
+};
+
+} // namespace
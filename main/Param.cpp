@@ -3,6 +3,8 @@
 
 #include "nvs_flash.h"
 
+#include <bit>
+
 using namespace std;
 
 namespace beegram {
@@ -15,9 +17,12 @@ public:
     virtual optional<int32_t> getI32(const char* key) override;
     virtual optional<uint32_t> getU32(const char* key) override;
     virtual optional<float> getFloat(const char* key) override;
+    virtual optional<string> getStr(const char* key) override;
     virtual bool setI32(const char* key, int32_t val) override;
     virtual bool setU32(const char* key, uint32_t val) override;
     virtual bool setFloat(const char* key, float val) override;
+    virtual bool setStr(const char* key, const string_view& val) override;
+    virtual bool erase(const char* key) override;
 private:
     nvs_handle_t _nvs;
 };
@@ -41,15 +46,29 @@ optional<uint32_t> ParamImpl::getU32(const char* key) {
 }
 
 optional<float> ParamImpl::getFloat(const char* key) {
-    // NVS doesn't support floats, so we use uint32 as storage
+    // NVS doesn't support floats, so the bits are stored as uint32
     uint32_t val;
     if (ESP_OK == nvs_get_u32(_nvs, key, &val)) {
-        return static_cast<float>(val);
+        return bit_cast<float>(val);
     } else {
         return nullopt;
     }
 }
 
+optional<string> ParamImpl::getStr(const char* key) {
+    // First query the length, which includes the terminating zero
+    size_t len = 0;
+    if (ESP_OK != nvs_get_str(_nvs, key, nullptr, &len) || 0 == len) {
+        return nullopt;
+    }
+    string val(len, '\0');
+    if (ESP_OK != nvs_get_str(_nvs, key, val.data(), &len)) {
+        return nullopt;
+    }
+    val.resize(len - 1);
+    return val;
+}
+
 bool ParamImpl::setI32(const char* key, int32_t val) {
     return ESP_OK == nvs_set_i32(_nvs, key, val);
 }
@@ -59,7 +78,16 @@ bool ParamImpl::setU32(const char* key, uint32_t val) {
 }
 
 bool ParamImpl::setFloat(const char* key, float val) {
-    return setU32(key, *reinterpret_cast<uint32_t*>(&val));
+    return setU32(key, bit_cast<uint32_t>(val));
+}
+
+bool ParamImpl::setStr(const char* key, const string_view& val) {
+    return ESP_OK == nvs_set_str(_nvs, key, string(val).c_str());
+}
+
+bool ParamImpl::erase(const char* key) {
+    const esp_err_t ret = nvs_erase_key(_nvs, key);
+    return ESP_OK == ret || ESP_ERR_NVS_NOT_FOUND == ret;
 }
 
 Param::Hnd Param::create(const char* part, const char* ns) {
@@ -1,25 +1,159 @@
 /**
  * @brief Interface for key-value storage of parameters
+ *
+ * Parameters are declared once in Params.hpp as typed keys. Key length,
+ * default and range are checked at compile time, access through a key
+ * needs no lookup by name.
 */
 
 #pragma once
 
+#include "nvs.h"
+
 #include <cinttypes>
 #include <memory>
 #include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <variant>
 
 namespace beegram {
 
+/// Not constexpr, so a consteval key constructor calling it fails to
+/// compile, with the reason in the diagnostic. Works without exceptions.
+inline void invalidParam(const char* why) {}
+
 class Param {
 public:
+    /// Longest key NVS can store, without the terminating zero
+    static constexpr size_t KEY_MAX_LEN = NVS_KEY_NAME_MAX_SIZE - 1;
+
+    /// @brief Typed handle of a numeric parameter
+    template <typename T>
+    struct Key {
+        static_assert(std::is_same_v<T, int32_t> || std::is_same_v<T, uint32_t> || std::is_same_v<T, float>,
+            "Unsupported parameter type");
+        /// Fails to compile if the key doesn't fit NVS or the default is out of range
+        consteval Key(const char* name, T def, T min, T max, const char* help)
+        : name(name), def(def), min(min), max(max), help(help)
+        {
+            if (std::string_view(name).empty() || std::string_view(name).size() > KEY_MAX_LEN) {
+                invalidParam("Parameter key length out of range");
+            }
+            if (!(min <= def && def <= max)) {
+                invalidParam("Parameter default out of range");
+            }
+        }
+        bool valid(T val) const { return min <= val && val <= max; }
+        const char* name;
+        T def;
+        T min;
+        T max;
+        const char* help;
+    };
+
+    /// @brief Typed handle of a string parameter
+    struct StrKey {
+        consteval StrKey(const char* name, const char* def, size_t maxLen, const char* help)
+        : name(name), def(def), maxLen(maxLen), help(help)
+        {
+            if (std::string_view(name).empty() || std::string_view(name).size() > KEY_MAX_LEN) {
+                invalidParam("Parameter key length out of range");
+            }
+            if (std::string_view(def).size() > maxLen) {
+                invalidParam("Parameter default too long");
+            }
+        }
+        bool valid(const std::string_view& val) const { return val.size() <= maxLen; }
+        const char* name;
+        const char* def;
+        size_t maxLen;
+        const char* help;
+    };
+
+    /// @brief Any key, for listing all parameters
+    using Entry = std::variant<const Key<int32_t>*, const Key<uint32_t>*, const Key<float>*, const StrKey*>;
+
     using Hnd = std::unique_ptr<Param>;
     virtual ~Param() = default;
     virtual std::optional<int32_t> getI32(const char* key) = 0;
     virtual std::optional<uint32_t> getU32(const char* key) = 0;
     virtual std::optional<float> getFloat(const char* key) = 0;
+    virtual std::optional<std::string> getStr(const char* key) = 0;
     virtual bool setI32(const char* key, int32_t val) = 0;
     virtual bool setU32(const char* key, uint32_t val) = 0;
     virtual bool setFloat(const char* key, float val) = 0;
+    virtual bool setStr(const char* key, const std::string_view& val) = 0;
+    /**
+     * Remove a parameter, so that it reads as its default
+     * @return True if removed or not stored; false on failure
+    */
+    virtual bool erase(const char* key) = 0;
+
+    /**
+     * Read a parameter
+     * @return Stored value; nullopt if not stored or out of range
+    */
+    template <typename T>
+    std::optional<T> find(const Key<T>& key) {
+        std::optional<T> val;
+        if constexpr (std::is_same_v<T, int32_t>) {
+            val = getI32(key.name);
+        } else if constexpr (std::is_same_v<T, uint32_t>) {
+            val = getU32(key.name);
+        } else {
+            val = getFloat(key.name);
+        }
+        if (val.has_value() && !key.valid(val.value())) {
+            return std::nullopt;
+        }
+        return val;
+    }
+
+    /// @copydoc find
+    std::optional<std::string> find(const StrKey& key) {
+        auto val = getStr(key.name);
+        if (val.has_value() && !key.valid(val.value())) {
+            return std::nullopt;
+        }
+        return val;
+    }
+
+    /// @return Stored value; default if not stored or out of range
+    template <typename T>
+    T get(const Key<T>& key) {
+        return find(key).value_or(key.def);
+    }
+
+    /// @copydoc get
+    std::string get(const StrKey& key) {
+        return find(key).value_or(key.def);
+    }
+
+    /**
+     * Store a parameter
+     * @return True on success; false if out of range or failed to store
+    */
+    template <typename T>
+    bool set(const Key<T>& key, std::type_identity_t<T> val) {
+        if (!key.valid(val)) {
+            return false;
+        }
+        if constexpr (std::is_same_v<T, int32_t>) {
+            return setI32(key.name, val);
+        } else if constexpr (std::is_same_v<T, uint32_t>) {
+            return setU32(key.name, val);
+        } else {
+            return setFloat(key.name, val);
+        }
+    }
+
+    /// @copydoc set
+    bool set(const StrKey& key, const std::string_view& val) {
+        return key.valid(val) && setStr(key.name, val);
+    }
+
     static Hnd create(const char* part, const char* ns);
 };
 
@@ -0,0 +1,174 @@
+#include "Params.hpp"
+#include "Log.hpp"
+#include "Bosun.hpp"
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+using namespace std;
+
+namespace beegram {
+
+static const char* nameOf(const Param::Entry& entry) {
+    return visit([](const auto* key) { return key->name; }, entry);
+}
+
+static const Param::Entry* findEntry(const string& name) {
+    for (const auto& entry: Params::ALL) {
+        if (name == nameOf(entry)) {
+            return &entry;
+        }
+    }
+    err("Unknown parameter [%s]", name.c_str());
+    return nullptr;
+}
+
+/// @return Value as text, "-" appended if not stored
+static string show(Param& param, const Param::Entry& entry) {
+    char buf[24];
+    return visit([&param, &buf](const auto* key) -> string {
+        using K = remove_cvref_t<decltype(*key)>;
+        const auto stored = param.find(*key);
+        string text;
+        if constexpr (is_same_v<K, Param::StrKey>) {
+            text = "\"" + stored.value_or(key->def) + "\"";
+        } else if constexpr (is_same_v<K, Params::F32>) {
+            snprintf(buf, sizeof(buf), "%g", stored.value_or(key->def));
+            text = buf;
+        } else if constexpr (is_same_v<K, Params::I32>) {
+            snprintf(buf, sizeof(buf), "%ld", static_cast<long>(stored.value_or(key->def)));
+            text = buf;
+        } else {
+            snprintf(buf, sizeof(buf), "%lu", static_cast<unsigned long>(stored.value_or(key->def)));
+            text = buf;
+        }
+        return stored.has_value() ? text : text + " -";
+    }, entry);
+}
+
+static void print(Param& param, const Param::Entry& entry) {
+    visit([&param, &entry](const auto* key) {
+        printf("%-15s %-16s %s\n", key->name, show(param, entry).c_str(), key->help);
+    }, entry);
+}
+
+template <typename T>
+bool Params::parse(const string& text, T& val) {
+    char* end = nullptr;
+    errno = 0;
+    if constexpr (is_same_v<T, float>) {
+        val = strtof(text.c_str(), &end);
+    } else if constexpr (is_same_v<T, int32_t>) {
+        const long long v = strtoll(text.c_str(), &end, 0);
+        if (v < INT32_MIN || v > INT32_MAX) {
+            return false;
+        }
+        val = static_cast<int32_t>(v);
+    } else {
+        const unsigned long long v = strtoull(text.c_str(), &end, 0);
+        if ('-' == text[0] || v > UINT32_MAX) {
+            return false;
+        }
+        val = static_cast<uint32_t>(v);
+    }
+    return !text.empty() && 0 == errno && '\0' == *end;
+}
+
+template bool Params::parse(const string& text, float& val);
+template bool Params::parse(const string& text, int32_t& val);
+template bool Params::parse(const string& text, uint32_t& val);
+
+static bool store(Param& param, const Param::Entry& entry, const string& text) {
+    return visit([&param, &text](const auto* key) {
+        using K = remove_cvref_t<decltype(*key)>;
+        if constexpr (is_same_v<K, Param::StrKey>) {
+            if (!key->valid(text)) {
+                err("Too long for %s, max %u", key->name, static_cast<unsigned>(key->maxLen));
+                return false;
+            }
+            return param.set(*key, text);
+        } else {
+            decltype(key->def) val;
+            if (!Params::parse(text, val) || !key->valid(val)) {
+                err("Invalid %s: %s, range [%s, %s]", key->name, text.c_str(),
+                    to_string(key->min).c_str(), to_string(key->max).c_str());
+                return false;
+            }
+            return param.set(*key, val);
+        }
+    }, entry);
+}
+
+void Params::addCmds(Param& param, Bosun& bosun) {
+    bosun.addCmd(
+        "list", Cmd(
+            "\n\tList all parameters, - marks defaults",
+            [&param](const vector<string>& args) {
+                for (const auto& entry: ALL) {
+                    print(param, entry);
+                }
+            }
+        )
+    );
+    bosun.addCmd(
+        "get", Cmd(
+            "name\n\tShow a parameter",
+            [&param](const vector<string>& args) {
+                if (2 != args.size()) {
+                    err("Need name");
+                    return;
+                }
+                const auto* entry = findEntry(args[1]);
+                if (entry) {
+                    print(param, *entry);
+                }
+            }
+        )
+    );
+    bosun.addCmd(
+        "set", Cmd(
+            "name value\n\tStore a parameter, effective on reboot",
+            [&param](const vector<string>& args) {
+                if (args.size() < 2 || args.size() > 3) {
+                    err("Need name and value");
+                    return;
+                }
+                const auto* entry = findEntry(args[1]);
+                if (!entry) {
+                    return;
+                }
+                // An empty string needs no value
+                if (!store(param, *entry, args.size() > 2 ? args[2] : "")) {
+                    err("Fail set %s", args[1].c_str());
+                    return;
+                }
+                print(param, *entry);
+            }
+        )
+    );
+    bosun.addCmd(
+        "unset", Cmd(
+            "name\n\tReturn a parameter to its default, effective on reboot",
+            [&param](const vector<string>& args) {
+                if (2 != args.size()) {
+                    err("Need name");
+                    return;
+                }
+                const auto* entry = findEntry(args[1]);
+                if (!entry) {
+                    return;
+                }
+                if (!param.erase(nameOf(*entry))) {
+                    err("Fail unset %s", args[1].c_str());
+                    return;
+                }
+                print(param, *entry);
+            }
+        )
+    );
+}
+
+} // namespace
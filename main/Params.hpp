@@ -0,0 +1,119 @@
+/**
+ * @brief Registry of all persistent parameters
+ *
+ * Each parameter is declared here once with its NVS key, type, default and
+ * range. Modules access them through these keys, the shell commands get,
+ * set and list cover all of them. Tunings are stored as integer milli-units
+ * of the value shown by their module's command.
+*/
+
+#pragma once
+
+#include "Param.hpp"
+
+#include <cinttypes>
+
+namespace beegram {
+
+class Bosun;
+
+class Params {
+public:
+    using I32 = Param::Key<int32_t>;
+    using U32 = Param::Key<uint32_t>;
+    using F32 = Param::Key<float>;
+    using Str = Param::StrKey;
+
+    // System
+    static constexpr U32 BOOT_COUNT         = { "bootCount", 0, 0, UINT32_MAX, "Number of boots" };
+    // Scales calibration, two known points and the tare
+    static constexpr I32 CALIB_LOAD_LOW     = { "scacall_load", -207124, INT32_MIN, INT32_MAX, "Load of low calibration point" };
+    static constexpr F32 CALIB_WEIGHT_LOW   = { "scacall_weight", 0.0F, 0.0F, 400.0F, "Weight in kg of low calibration point" };
+    static constexpr I32 CALIB_LOAD_HIGH    = { "scacalh_load", -593571, INT32_MIN, INT32_MAX, "Load of high calibration point" };
+    static constexpr F32 CALIB_WEIGHT_HIGH  = { "scacalh_weight", 32.0F, 0.0F, 400.0F, "Weight in kg of high calibration point" };
+    static constexpr I32 TARE_LOAD          = { "scale_tare", 0, INT32_MIN, INT32_MAX, "Load at 0 kg, unset for none" };
+    // Load sensor
+    static constexpr U32 INTERLEAVE_A       = { "hx_ab_a", 1, 1, 1000, "Channel A conversions per interleave run" };
+    static constexpr U32 INTERLEAVE_B       = { "hx_ab_b", 0, 0, 1000, "Channel B conversions per interleave run, 0 for none" };
+    // Sampler tuning
+    static constexpr I32 SMP_PERIOD         = { "smp_period_ms", 15000, 100, 24 * 3600 * 1000, "Interval in ms of sparse reads" };
+    static constexpr I32 SMP_ENTER          = { "smp_enter_g", 100, 1, 100000, "Activity in g to start a burst" };
+    static constexpr I32 SMP_EXIT           = { "smp_exit_g", 30, 1, 100000, "Activity in g to end a burst" };
+    static constexpr I32 SMP_HOLD           = { "smp_hold_ms", 30000, 100, 24 * 3600 * 1000, "Time in ms of calm before a burst ends" };
+    static constexpr I32 SMP_BUDGET         = { "smp_budget_m", 20000000, 1000, 1000000000, "Average samples per 1000 h" };
+    // Detector tuning
+    static constexpr I32 DET_DRIFT          = { "det_k_g", 150, 1, 100000, "Slack in g ignored by the sums" };
+    static constexpr I32 DET_THRESH         = { "det_h_gs", 30000, 1, 100000000, "Alarm threshold in g*s" };
+    static constexpr I32 DET_SWARM          = { "det_swarm_g", 800, 1, 100000, "Minimum sudden step in g" };
+    static constexpr I32 DET_HARVEST        = { "det_harv_g", 5000, 1, 400000, "Minimum sudden drop in g for a harvest" };
+    static constexpr I32 DET_FAST           = { "det_fast_ms", 1200000, 1, 24 * 3600 * 1000, "Duration in ms of the slowest sudden step" };
+    static constexpr I32 DET_CONFIRM        = { "det_conf_ms", 300000, 1, 24 * 3600 * 1000, "Hold time in ms before a change is reported" };
+    static constexpr I32 DET_REF_TAU        = { "det_tau_ms", 3600000, 1, 7 * 24 * 3600 * 1000, "Time constant in ms of the reference level" };
+    static constexpr I32 DET_FILT_TAU       = { "det_filt_ms", 2000, 1, 3600 * 1000, "Time constant in ms of the input filter" };
+    // Rollups
+    static constexpr U32 UPLOAD_TIER        = { "rup_tier", 2, 0, 3, "Rollup tier uploaded by default, 0 = 1 min .. 3 = 1 day" };
+    // Uplink
+    static constexpr Str WIFI_SSID          = { "wifi_ssid", "", 32, "Wi-Fi network" };
+    static constexpr Str WIFI_PASS          = { "wifi_pass", "", 64, "Wi-Fi passphrase" };
+    static constexpr U32 WIFI_LEASE         = { "wifi_lease_s", 3600, 0, 7 * 24 * 3600, "Reuse of the cached IP lease in s, 0 for always DHCP" };
+    static constexpr Str MQTT_HOST          = { "mqtt_host", "", 64, "MQTT broker host name" };
+    static constexpr U32 MQTT_PORT          = { "mqtt_port", 8883, 1, 65535, "MQTT broker TLS port" };
+    static constexpr U32 MQTT_VERIFY        = { "mqtt_verify", 1, 0, 1, "Verify the broker certificate" };
+    // Wall clock
+    static constexpr Str TIME_SERVER        = { "time_server", "pool.ntp.org", 64, "SNTP server, empty for none" };
+    static constexpr U32 TIME_SYNC          = { "time_sync_s", 3600, 60, 7 * 24 * 3600, "Interval in s of SNTP syncs, made while the uplink is up" };
+    // Backfill of what the backend missed
+    static constexpr U32 BF_RATE            = { "bf_rate", 50, 0, 10000, "Average bytes per s of buckets resent from history, 0 for none" };
+    // Local dashboard
+    static constexpr U32 WEB_ENABLE         = { "web_enable", 0, 0, 1, "Keep Wi-Fi up and serve the dashboard" };
+    static constexpr U32 WEB_RATE_MS        = { "web_rate_ms", 500, 100, 10000, "Interval in ms of weight updates to the dashboard" };
+    static constexpr Str WEB_KEY            = { "web_key", "", 32, "Key the dashboard sends to tare or calibrate, empty refuses them" };
+    // Remote shell
+    static constexpr U32 RSH_PORT           = { "rsh_port", 0, 0, 65535, "TCP port of the remote shell, 0 for none" };
+    static constexpr Str RSH_KEY            = { "rsh_key", "", 32, "Key a remote shell session sends first, empty for none" };
+    // Apiary of nodes and a gateway
+    static constexpr U32 HIVE_ROLE          = { "hive_role", 0, 0, 2, "0 standalone, 1 node sending to a gateway, 2 gateway" };
+    static constexpr U32 HIVE_CHANNEL       = { "hive_chan", 1, 1, 13, "Wi-Fi channel of nodes and gateway, the gateway's AP must use it" };
+    static constexpr Str HIVE_GATEWAY       = { "hive_gw", "", 17, "MAC address of the gateway, empty to broadcast" };
+    static constexpr U32 HIVE_PERIOD        = { "hive_period_s", 600, 15, 3600, "Longest time in s a node holds a sample" };
+    // Firmware updates, written by the latest update
+    static constexpr U32 OTA_BYTES          = { "ota_bytes", 0, 0, UINT32_MAX, "Bytes of delta received" };
+    static constexpr U32 OTA_IMAGE_BYTES    = { "ota_img_bytes", 0, 0, UINT32_MAX, "Bytes of image made from the delta" };
+    static constexpr U32 OTA_TIME           = { "ota_ms", 0, 0, UINT32_MAX, "Duration in ms of download and flashing" };
+
+    /// Every parameter, in the order listed
+    static constexpr Param::Entry ALL[] = {
+        &BOOT_COUNT,
+        &CALIB_LOAD_LOW, &CALIB_WEIGHT_LOW, &CALIB_LOAD_HIGH, &CALIB_WEIGHT_HIGH, &TARE_LOAD,
+        &INTERLEAVE_A, &INTERLEAVE_B,
+        &SMP_PERIOD, &SMP_ENTER, &SMP_EXIT, &SMP_HOLD, &SMP_BUDGET,
+        &DET_DRIFT, &DET_THRESH, &DET_SWARM, &DET_HARVEST, &DET_FAST, &DET_CONFIRM, &DET_REF_TAU, &DET_FILT_TAU,
+        &UPLOAD_TIER,
+        &WIFI_SSID, &WIFI_PASS, &WIFI_LEASE, &MQTT_HOST, &MQTT_PORT, &MQTT_VERIFY,
+        &TIME_SERVER, &TIME_SYNC,
+        &BF_RATE,
+        &WEB_ENABLE, &WEB_RATE_MS, &WEB_KEY,
+        &RSH_PORT, &RSH_KEY,
+        &HIVE_ROLE, &HIVE_CHANNEL, &HIVE_GATEWAY, &HIVE_PERIOD,
+        &OTA_BYTES, &OTA_IMAGE_BYTES, &OTA_TIME,
+    };
+
+    /**
+     * Add the shell commands get, set, unset and list. Modules read their
+     * parameters at init, changes made with set take effect on reboot.
+     * @param param Storage of the parameters
+     * @param bosun Executes the commands
+    */
+    static void addCmds(Param& param, Bosun& bosun);
+
+    /**
+     * Parse the whole of text as a number, e.g. an argument of a command
+     * @tparam T float, int32_t or uint32_t
+     * @param[out] val Set to the number on success
+     * @return True on success; false if text isn't a number of type T
+    */
+    template <typename T>
+    static bool parse(const std::string& text, T& val);
+};
+
+} // namespace
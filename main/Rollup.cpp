@@ -0,0 +1,289 @@
+#include "Rollup.hpp"
+#include "Log.hpp"
+#include "Params.hpp"
+#include "Bosun.hpp"
+#include "Mem.hpp"
+#include "Cloud.hpp"
+#include "Telemetry.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace beegram {
+
+class RollupImpl : public Rollup {
+public:
+    RollupImpl(Param& param, Bosun& bosun, Cloud& cloud, const Clock& clock, uint32_t boot)
+    : _param(param), _bosun(bosun), _cloud(cloud), _clock(clock), _boot(boot)
+    {}
+    virtual bool init() override;
+    virtual void feed(int64_t timeUs, float weightKg) override;
+    virtual size_t count(Tier tier) const override;
+    virtual bool get(Tier tier, size_t age, Stats& stats) const override;
+    virtual bool find(Tier tier, uint32_t seq, Stats& stats) const override;
+    virtual uint32_t nextSeq(Tier tier) const override;
+    virtual Tier getUploadTier() const override { return _uploadTier; }
+private:
+    static constexpr uint32_t PERIOD_S[TIER_COUNT] = { 60, 15 * 60, 60 * 60, 24 * 60 * 60 };
+    static constexpr size_t RING_LEN[TIER_COUNT] = { 24 * 60, 2 * 24 * 4, 14 * 24, 366 };
+    static constexpr size_t RING_OFFSET[TIER_COUNT] = {
+        0, RING_LEN[0], RING_LEN[0] + RING_LEN[1], RING_LEN[0] + RING_LEN[1] + RING_LEN[2] };
+    static constexpr size_t RING_TOTAL = RING_OFFSET[TIER_COUNT - 1] + RING_LEN[TIER_COUNT - 1];
+    static constexpr size_t DEFAULT_PRINT_COUNT = 10;
+
+    /// @brief Running accumulator of a bucket (Welford)
+    struct Acc {
+        uint32_t startS;
+        uint32_t count;
+        float min;
+        float max;
+        float mean;
+        float m2;   ///< Sum of squared deviations from mean
+    };
+    /// Rings of all tiers, about 56 KB
+    static constexpr size_t RING_BYTES = RING_TOTAL * sizeof(Acc);
+
+    static void merge(Acc& into, const Acc& from);
+    static Stats toStats(const Acc& acc, uint32_t seq);
+    static bool parseTier(const string& name, Tier& tier);
+    void add(size_t tier, const Acc& acc);
+    void close(size_t tier);
+    void publish(Tier tier, const Stats& stats);
+    void print(Tier tier, size_t n) const;
+    void send(Tier tier, size_t n);
+
+    Param& _param;
+    Bosun& _bosun;
+    Cloud& _cloud;
+    const Clock& _clock;
+    const uint32_t _boot;
+    SemaphoreHandle_t _lock = nullptr;
+    Tier _uploadTier = Tier::HOUR_1;
+    Acc _open[TIER_COUNT] = {};
+    size_t _head[TIER_COUNT] = {};      ///< Index of next write in ring
+    size_t _count[TIER_COUNT] = {};
+    uint32_t _closed[TIER_COUNT] = {};  ///< Buckets closed since boot
+    Acc* _ring = nullptr;                ///< All tiers, RING_OFFSET apart
+    // Bucket closed in upload tier while holding the lock, published after
+    bool _pendingUpload = false;
+    Stats _pending = {};
+};
+
+const char* Rollup::tierName(Tier tier) {
+    switch (tier) {
+        case Tier::MIN_1:   return "1m";
+        case Tier::MIN_15:  return "15m";
+        case Tier::HOUR_1:  return "1h";
+        case Tier::DAY_1:   return "1d";
+        default:            return "unknown";
+    }
+}
+
+bool RollupImpl::parseTier(const string& name, Tier& tier) {
+    for (size_t t = 0; t < TIER_COUNT; t++) {
+        if (name == tierName(static_cast<Tier>(t))) {
+            tier = static_cast<Tier>(t);
+            return true;
+        }
+    }
+    err("Unknown tier [%s]", name.c_str());
+    return false;
+}
+
+void RollupImpl::merge(Acc& into, const Acc& from) {
+    // Chan et al. parallel variance: combine two partial accumulators
+    const uint32_t n = into.count + from.count;
+    const float delta = from.mean - into.mean;
+    into.mean += delta * from.count / n;
+    into.m2 += from.m2 + delta * delta * into.count * from.count / n;
+    into.min = min(into.min, from.min);
+    into.max = max(into.max, from.max);
+    into.count = n;
+}
+
+Rollup::Stats RollupImpl::toStats(const Acc& acc, uint32_t seq) {
+    Stats stats;
+    stats.seq = seq;
+    stats.startS = acc.startS;
+    stats.count = acc.count;
+    stats.min = acc.min;
+    stats.max = acc.max;
+    stats.mean = acc.mean;
+    stats.stddev = acc.count > 1 ? sqrtf(acc.m2 / (acc.count - 1)) : 0.0F;
+    return stats;
+}
+
+void RollupImpl::add(size_t tier, const Acc& acc) {
+    Acc& open = _open[tier];
+    const uint32_t start = acc.startS - acc.startS % PERIOD_S[tier];
+    if (open.count > 0 && open.startS != start) {
+        close(tier);
+    }
+    if (0 == open.count) {
+        open = acc;
+        open.startS = start;
+    } else {
+        merge(open, acc);
+    }
+}
+
+void RollupImpl::close(size_t tier) {
+    const Acc closed = _open[tier];
+    _open[tier].count = 0;
+    _ring[RING_OFFSET[tier] + _head[tier]] = closed;
+    _head[tier] = (_head[tier] + 1) % RING_LEN[tier];
+    _count[tier] = min(_count[tier] + 1, RING_LEN[tier]);
+    const uint32_t seq = _closed[tier]++;
+    if (static_cast<Tier>(tier) == _uploadTier) {
+        _pending = toStats(closed, seq);
+        _pendingUpload = true;
+    }
+    if (tier + 1 < TIER_COUNT) {
+        add(tier + 1, closed);
+    }
+}
+
+void RollupImpl::feed(int64_t timeUs, float weightKg) {
+    if (!_ring) {
+        // No memory at init, nothing is kept
+        return;
+    }
+    Acc acc;
+    acc.startS = static_cast<uint32_t>(timeUs / 1000000);
+    acc.count = 1;
+    acc.min = acc.max = acc.mean = weightKg;
+    acc.m2 = 0.0F;
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    add(0, acc);
+    const bool upload = _pendingUpload;
+    const Stats pending = _pending;
+    _pendingUpload = false;
+    xSemaphoreGive(_lock);
+    if (upload) {
+        publish(_uploadTier, pending);
+    }
+}
+
+size_t RollupImpl::count(Tier tier) const {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    const size_t n = _count[static_cast<size_t>(tier)];
+    xSemaphoreGive(_lock);
+    return n;
+}
+
+uint32_t RollupImpl::nextSeq(Tier tier) const {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    const uint32_t seq = _closed[static_cast<size_t>(tier)];
+    xSemaphoreGive(_lock);
+    return seq;
+}
+
+bool RollupImpl::get(Tier tier, size_t age, Stats& stats) const {
+    const size_t t = static_cast<size_t>(tier);
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    const bool found = age < _count[t];
+    if (found) {
+        const size_t idx = (_head[t] + RING_LEN[t] - 1 - age) % RING_LEN[t];
+        stats = toStats(_ring[RING_OFFSET[t] + idx], _closed[t] - 1 - age);
+    }
+    xSemaphoreGive(_lock);
+    return found;
+}
+
+bool RollupImpl::find(Tier tier, uint32_t seq, Stats& stats) const {
+    const size_t t = static_cast<size_t>(tier);
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    // Held are the latest closed, up to the length of the ring
+    const bool found = seq < _closed[t] && _closed[t] - seq <= _count[t];
+    if (found) {
+        const size_t idx = (_head[t] + RING_LEN[t] - (_closed[t] - seq)) % RING_LEN[t];
+        stats = toStats(_ring[RING_OFFSET[t] + idx], seq);
+    }
+    xSemaphoreGive(_lock);
+    return found;
+}
+
+void RollupImpl::publish(Tier tier, const Stats& stats) {
+    auto encode = [this, tier, &stats](span<uint8_t> buf) { return Telemetry::encodeRollup(buf, tier, stats, _boot, _clock); };
+    _cloud.publish("rollup", encode, Cloud::Priority::NORMAL);
+}
+
+void RollupImpl::print(Tier tier, size_t n) const {
+    printf("%8s %-10s %8s %9s %9s %9s %7s\n", "seq", "start", "count", "min", "max", "mean", "sd");
+    Stats s;
+    for (size_t age = 0; age < n && get(tier, age, s); age++) {
+        printf("%8lu %10lu %8lu %9.3f %9.3f %9.3f %7.3f\n", static_cast<unsigned long>(s.seq),
+            static_cast<unsigned long>(s.startS), static_cast<unsigned long>(s.count), s.min, s.max, s.mean, s.stddev);
+    }
+}
+
+void RollupImpl::send(Tier tier, size_t n) {
+    Stats s;
+    // Oldest first, so the backend receives them in order
+    for (size_t age = min(n, count(tier)); age-- > 0;) {
+        if (get(tier, age, s)) {
+            publish(tier, s);
+        }
+    }
+}
+
+bool RollupImpl::init() {
+    _lock = Mem::mutex();
+    if (!_lock) {
+        err("Fail create mutex");
+        return false;
+    }
+    // The largest block of the firmware, more than the default arena holds
+    // next to the rest, so it's allowed to fail
+    _ring = static_cast<Acc*>(Mem::tryAlloc(RING_BYTES));
+    if (!_ring) {
+        err("No memory for %u B of rollups", static_cast<unsigned>(RING_BYTES));
+        return false;
+    }
+    memset(_ring, 0, RING_BYTES);
+    static_assert(Params::UPLOAD_TIER.max < TIER_COUNT);
+    _uploadTier = static_cast<Tier>(_param.get(Params::UPLOAD_TIER));
+    _bosun.addCmd(
+        "rollup", Cmd(
+            "[tier [count]] | send tier [count] | up tier\n"
+            "\tShow rollups of tier (1m 15m 1h 1d), send them to cloud or set the tier uploaded by default",
+            [this](const vector<string>& args) {
+                Tier tier;
+                uint32_t n;
+                if (1 == args.size()) {
+                    for (size_t t = 0; t < TIER_COUNT; t++) {
+                        printf("%-4s %4u/%-4u buckets of %lu s\n", tierName(static_cast<Tier>(t)),
+                            static_cast<unsigned>(count(static_cast<Tier>(t))), static_cast<unsigned>(RING_LEN[t]),
+                            static_cast<unsigned long>(PERIOD_S[t]));
+                    }
+                    printf("upload %s\n", tierName(_uploadTier));
+                } else if ("up" == args[1] && 3 == args.size() && parseTier(args[2], tier)) {
+                    _uploadTier = tier;
+                    _param.set(Params::UPLOAD_TIER, static_cast<uint32_t>(tier));
+                    info("Upload tier %s", tierName(tier));
+                } else if ("send" == args[1] && args.size() <= 4 && args.size() >= 3 && parseTier(args[2], tier)
+                    && (args.size() < 4 || Params::parse(args[3], n))) {
+                    send(tier, args.size() > 3 ? n : count(tier));
+                } else if (args.size() <= 3 && parseTier(args[1], tier) && (args.size() < 3 || Params::parse(args[2], n))) {
+                    print(tier, args.size() > 2 ? n : DEFAULT_PRINT_COUNT);
+                } else {
+                    err("Invalid arguments");
+                }
+            }
+        )
+    );
+    return true;
+}
+
+Rollup::Hnd Rollup::create(Param& param, Bosun& bosun, Cloud& cloud, const Clock& clock, uint32_t boot) {
+    return make_unique<RollupImpl>(param, bosun, cloud, clock, boot);
+}
+
+} // namespace
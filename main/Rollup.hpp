@@ -0,0 +1,98 @@
+/**
+ * @brief Multi-resolution rollups of the weight series
+*/
+
+#pragma once
+
+#include <memory>
+#include <cinttypes>
+#include <cstddef>
+
+namespace beegram {
+
+class Param; class Bosun; class Cloud; class Clock;
+
+/**
+ * Keeps min/max/mean/stddev/count of the weight in fixed-size rings at
+ * several resolutions. Samples only update the open bucket of the finest
+ * tier, closed buckets are merged into the next coarser tier, so the cost
+ * per sample is constant. Closed buckets of each tier are numbered from 0
+ * at boot, so the backend can tell which it is missing.
+*/
+class Rollup {
+public:
+    using Hnd = std::unique_ptr<Rollup>;
+    enum class Tier : uint8_t {
+        MIN_1,      ///< 1 minute buckets, last day
+        MIN_15,     ///< 15 minute buckets, last 2 days
+        HOUR_1,     ///< 1 hour buckets, last 2 weeks
+        DAY_1,      ///< 1 day buckets, last year
+    };
+    static constexpr size_t TIER_COUNT = 4;
+    /// @brief Summary of the samples in one bucket
+    struct Stats {
+        uint32_t seq;       ///< Of the bucket in its tier, from 0 at boot
+        uint32_t startS;    ///< Start of bucket, s since boot
+        uint32_t count;     ///< Number of samples
+        float min;
+        float max;
+        float mean;
+        float stddev;
+    };
+    virtual ~Rollup() = default;
+
+    /**
+     * Register commands
+     * @return True on success; false on failure
+    */
+    virtual bool init() = 0;
+
+    /**
+     * Add a sample. Constant time.
+     * @param timeUs Sample time in us since boot
+     * @param weightKg Weight in kg
+    */
+    virtual void feed(int64_t timeUs, float weightKg) = 0;
+
+    /// @return Number of closed buckets held for tier
+    virtual size_t count(Tier tier) const = 0;
+
+    /**
+     * Get a closed bucket
+     * @param tier Resolution
+     * @param age 0 for the most recently closed bucket, 1 for the one before etc
+     * @param stats Receives the bucket
+     * @return True if found; false if age is beyond what is held
+    */
+    virtual bool get(Tier tier, size_t age, Stats& stats) const = 0;
+
+    /**
+     * Get a closed bucket by its sequence number
+     * @param tier Resolution
+     * @param seq Sequence number
+     * @param stats Receives the bucket
+     * @return True if found; false if not closed yet or no longer held
+    */
+    virtual bool find(Tier tier, uint32_t seq, Stats& stats) const = 0;
+
+    /// @return Sequence number the next bucket closed in tier gets
+    virtual uint32_t nextSeq(Tier tier) const = 0;
+
+    /// @return Tier whose buckets are uploaded as they close
+    virtual Tier getUploadTier() const = 0;
+
+    /// @return Short name of tier, e.g. "15m"
+    static const char* tierName(Tier tier);
+
+    /**
+     * Create the rollups
+     * @param param Upload tier
+     * @param bosun Takes the command
+     * @param cloud Uplink of the closed buckets of the upload tier
+     * @param clock Maps bucket times to UTC
+     * @param boot Boot count, sent along with the sequence numbers
+    */
+    static Hnd create(Param& param, Bosun& bosun, Cloud& cloud, const Clock& clock, uint32_t boot);
+};
+
+} // namespace
@@ -0,0 +1,437 @@
+#include "Rsh.hpp"
+#include "Log.hpp"
+#include "Bosun.hpp"
+#include "Param.hpp"
+#include "Params.hpp"
+#include "Tasks.hpp"
+#include "Mem.hpp"
+#include "Wifi.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+namespace beegram {
+
+class RshImpl : public Rsh {
+public:
+    RshImpl(Param& param, Bosun& bosun, Wifi& wifi)
+    : _param(param), _bosun(bosun), _wifi(wifi)
+    {}
+    virtual bool init() override;
+    virtual Stats getStats() const override { return _stats; }
+private:
+    static constexpr size_t MAX_SESSIONS = 3;
+    static constexpr size_t LINE_MAX_LEN = 128;
+    /// Fits the output of help
+    static constexpr size_t OUT_BUF_LEN = 4096;
+    static constexpr int POLL_S = 1;
+    static constexpr TickType_t LINK_RETRY = pdMS_TO_TICKS(30 * 1000);
+    static constexpr uint32_t CONNECT_TIMEOUT_MS = 10 * 1000;
+    static constexpr TickType_t IDLE_TIMEOUT = pdMS_TO_TICKS(10 * 60 * 1000);
+    /// Output left when a session ends is sent for at most this long
+    static constexpr TickType_t CLOSE_TIMEOUT = pdMS_TO_TICKS(2000);
+    static constexpr int LOOP_TIMEOUT_S = 5;
+    static constexpr string_view PROMPT = "> ";
+
+    struct Session {
+        RshImpl* rsh;
+        int sock;               ///< -1 if free
+        bool authed;
+        bool closing;           ///< Closed once its output is sent
+        TickType_t lastTick;    ///< Of the latest input, or when closing
+        FILE* out;              ///< stdout of its commands
+        char line[LINE_MAX_LEN];
+        size_t lineLen;
+        uint8_t buf[OUT_BUF_LEN];   ///< Ring of output not sent yet
+        size_t head;                ///< Oldest byte
+        size_t len;
+        uint32_t droppedB;
+        char peer[16];
+    };
+
+    static ssize_t writeOut(void* cookie, const char* data, size_t len);
+    bool listen();
+    void holdLink();
+    void accept();
+    void receive(Session& s);
+    /// Send what the socket takes now, then close if ending
+    void flush(Session& s);
+    void close(Session& s);
+    void onLine(Session& s);
+    void put(Session& s, string_view text) { writeOut(&s, text.data(), text.size()); }
+    void run();
+    /// Run a command through a session over loopback and print what came back
+    void loop(const vector<string>& args);
+    void print() const;
+
+    Param& _param;
+    Bosun& _bosun;
+    Wifi& _wifi;
+    uint16_t _port = 0;
+    string _key;
+    TaskHandle_t _task = nullptr;
+    int _listen = -1;
+    bool _held = false;
+    TickType_t _lastLinkTry = 0;
+    Session _sessions[MAX_SESSIONS] = {};
+    Stats _stats = {};
+};
+
+static vector<string> splitWords(string_view line) {
+    vector<string> words;
+    size_t pos = 0;
+    while (pos < line.size()) {
+        while (pos < line.size() && isspace(static_cast<unsigned char>(line[pos]))) {
+            pos++;
+        }
+        const size_t start = pos;
+        while (pos < line.size() && !isspace(static_cast<unsigned char>(line[pos]))) {
+            pos++;
+        }
+        if (pos > start) {
+            words.emplace_back(line.substr(start, pos - start));
+        }
+    }
+    return words;
+}
+
+ssize_t RshImpl::writeOut(void* cookie, const char* data, size_t len) {
+    auto& s = *static_cast<Session*>(cookie);
+    // Never waits for the client, what doesn't fit is lost
+    const size_t n = min(len, OUT_BUF_LEN - s.len);
+    for (size_t i = 0; i < n; i++) {
+        s.buf[(s.head + s.len + i) % OUT_BUF_LEN] = static_cast<uint8_t>(data[i]);
+    }
+    s.len += n;
+    s.droppedB += len - n;
+    s.rsh->_stats.droppedB += len - n;
+    return static_cast<ssize_t>(len);
+}
+
+bool RshImpl::init() {
+    _port = static_cast<uint16_t>(_param.get(Params::RSH_PORT));
+    _key = _param.get(Params::RSH_KEY);
+    cookie_io_functions_t io = {};
+    io.write = writeOut;
+    for (auto& s: _sessions) {
+        s.rsh = this;
+        s.sock = -1;
+        // Unbuffered, commands write straight into the ring
+        s.out = fopencookie(&s, "w", io);
+        if (!s.out || 0 != setvbuf(s.out, nullptr, _IONBF, 0)) {
+            err("Fail open session output");
+            return false;
+        }
+    }
+    _bosun.addCmd(
+        "rsh", Cmd(
+            "[loop command]\n\tShow the remote shell sessions, or run a command through one over loopback",
+            [this](const vector<string>& args) {
+                if (args.size() >= 3 && "loop" == args[1]) {
+                    loop(args);
+                } else if (1 == args.size()) {
+                    print();
+                } else {
+                    err("Invalid arguments");
+                }
+            }
+        )
+    );
+    if (0 == _port) {
+        return true;
+    }
+    auto runTask = [](void* arg) {
+        assert(arg); static_cast<RshImpl*>(arg)->run();
+    };
+    return Tasks::spawn(Tasks::RSH, runTask, this, &_task);
+}
+
+bool RshImpl::listen() {
+    _listen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (_listen < 0) {
+        err("Fail create socket: %d", errno);
+        return false;
+    }
+    const int on = 1;
+    setsockopt(_listen, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    // Any address, loopback included, so it serves before Wi-Fi is up
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(_port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (0 != bind(_listen, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) || 0 != ::listen(_listen, 1)
+        || 0 != fcntl(_listen, F_SETFL, O_NONBLOCK)) {
+        err("Fail listen on port %u: %d", _port, errno);
+        ::close(_listen);
+        _listen = -1;
+        return false;
+    }
+    info("Serving on port %u", _port);
+    return true;
+}
+
+void RshImpl::holdLink() {
+    if (_held && _wifi.isConnected()) {
+        return;
+    }
+    if (_lastLinkTry && xTaskGetTickCount() - _lastLinkTry < LINK_RETRY) {
+        return;
+    }
+    _lastLinkTry = xTaskGetTickCount();
+    // Lost the link, or never had it
+    if (_held) {
+        _wifi.disconnect();
+    }
+    _held = _wifi.connect(CONNECT_TIMEOUT_MS);
+    if (_held) {
+        _lastLinkTry = 0;
+    }
+}
+
+void RshImpl::accept() {
+    sockaddr_in addr = {};
+    socklen_t addrLen = sizeof(addr);
+    const int sock = ::accept(_listen, reinterpret_cast<sockaddr*>(&addr), &addrLen);
+    if (sock < 0) {
+        return;
+    }
+    auto* s = find_if(begin(_sessions), end(_sessions), [](const Session& s) { return s.sock < 0; });
+    if (end(_sessions) == s || 0 != fcntl(sock, F_SETFL, O_NONBLOCK)) {
+        static constexpr string_view busy = "Busy\n";
+        ::send(sock, busy.data(), busy.size(), MSG_DONTWAIT);
+        ::close(sock);
+        _stats.refused++;
+        return;
+    }
+    s->sock = sock;
+    s->authed = _key.empty();
+    s->closing = false;
+    s->lastTick = xTaskGetTickCount();
+    s->lineLen = 0;
+    s->head = 0;
+    s->len = 0;
+    s->droppedB = 0;
+    inet_ntop(AF_INET, &addr.sin_addr, s->peer, sizeof(s->peer));
+    _stats.sessions++;
+    info("Session from %s", s->peer);
+    put(*s, s->authed ? PROMPT : "Key: ");
+}
+
+void RshImpl::receive(Session& s) {
+    char buf[64];
+    const int n = recv(s.sock, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+        return;
+    }
+    if (n <= 0) {
+        // Client went away
+        close(s);
+        return;
+    }
+    s.lastTick = xTaskGetTickCount();
+    for (int i = 0; i < n && !s.closing; i++) {
+        const char chr = buf[i];
+        if ('\n' == chr || '\r' == chr) {
+            onLine(s);
+            s.lineLen = 0;
+        } else if (isprint(static_cast<unsigned char>(chr)) && s.lineLen < LINE_MAX_LEN) {
+            s.line[s.lineLen++] = chr;
+        }
+    }
+}
+
+void RshImpl::onLine(Session& s) {
+    const string_view line(s.line, s.lineLen);
+    if (line.empty()) {
+        return;
+    }
+    if (!s.authed) {
+        if (line != _key) {
+            warn("Wrong key from %s", s.peer);
+            _stats.refused++;
+            put(s, "Wrong key\n");
+            s.closing = true;
+            return;
+        }
+        s.authed = true;
+        put(s, PROMPT);
+        return;
+    }
+    // Line editing and commands are interactive, they may allocate
+    Mem::Allow allow;
+    const auto words = splitWords(line);
+    if (1 == words.size() && ("exit" == words[0] || "quit" == words[0])) {
+        s.closing = true;
+        s.lastTick = xTaskGetTickCount();
+        return;
+    }
+    FILE* const prev = stdout;
+    stdout = s.out;
+    _bosun.runCmd(words);
+    fflush(stdout);
+    stdout = prev;
+    _stats.commands++;
+    put(s, PROMPT);
+}
+
+void RshImpl::flush(Session& s) {
+    while (s.len > 0) {
+        const size_t chunk = min(s.len, OUT_BUF_LEN - s.head);
+        const int n = ::send(s.sock, s.buf + s.head, chunk, MSG_DONTWAIT);
+        if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            return;
+        }
+        if (n < 0) {
+            close(s);
+            return;
+        }
+        s.head = (s.head + n) % OUT_BUF_LEN;
+        s.len -= n;
+        if (static_cast<size_t>(n) < chunk) {
+            // Socket buffer full, the rest goes when it's writable
+            return;
+        }
+    }
+    if (s.closing) {
+        close(s);
+    }
+}
+
+void RshImpl::close(Session& s) {
+    ::close(s.sock);
+    s.sock = -1;
+    info("Session from %s closed, %lu B of output lost", s.peer, static_cast<unsigned long>(s.droppedB));
+}
+
+void RshImpl::run() {
+    while (!listen()) {
+        vTaskDelay(LINK_RETRY);
+    }
+    while (true) {
+        {
+            // Bringing the link up allocates
+            Mem::Allow allow;
+            holdLink();
+        }
+        fd_set rd;
+        fd_set wr;
+        FD_ZERO(&rd);
+        FD_ZERO(&wr);
+        FD_SET(_listen, &rd);
+        int maxFd = _listen;
+        const TickType_t now = xTaskGetTickCount();
+        for (auto& s: _sessions) {
+            if (s.sock < 0) {
+                continue;
+            }
+            const TickType_t idle = now - s.lastTick;
+            if ((s.closing && idle >= CLOSE_TIMEOUT) || idle >= IDLE_TIMEOUT) {
+                close(s);
+                continue;
+            }
+            if (!s.closing) {
+                FD_SET(s.sock, &rd);
+            }
+            if (s.len > 0) {
+                FD_SET(s.sock, &wr);
+            }
+            maxFd = max(maxFd, s.sock);
+        }
+        timeval tv = { POLL_S, 0 };
+        if (select(maxFd + 1, &rd, &wr, nullptr, &tv) < 0) {
+            warn("Fail select: %d", errno);
+            vTaskDelay(pdMS_TO_TICKS(POLL_S * 1000));
+            continue;
+        }
+        for (auto& s: _sessions) {
+            if (s.sock >= 0 && FD_ISSET(s.sock, &rd)) {
+                receive(s);
+            }
+            // Output of the commands just run goes out at once
+            if (s.sock >= 0 && (s.len > 0 || s.closing)) {
+                flush(s);
+            }
+        }
+        if (FD_ISSET(_listen, &rd)) {
+            accept();
+        }
+    }
+}
+
+void RshImpl::loop(const vector<string>& args) {
+    if (xTaskGetCurrentTaskHandle() == _task) {
+        // The session would wait for this task, which serves it
+        err("Loop from the UART shell, not a remote session");
+        return;
+    }
+    if (0 == _port) {
+        err("Not serving, set %s", Params::RSH_PORT.name);
+        return;
+    }
+    string input = _key.empty() ? "" : _key + "\n";
+    for (size_t i = 2; i < args.size(); i++) {
+        input += args[i] + (i + 1 < args.size() ? " " : "\n");
+    }
+    input += "exit\n";
+    const int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) {
+        err("Fail create socket: %d", errno);
+        return;
+    }
+    const timeval tv = { LOOP_TIMEOUT_S, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const int64_t startUs = esp_timer_get_time();
+    size_t got = 0;
+    if (0 == connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))
+        && static_cast<int>(input.size()) == ::send(sock, input.data(), input.size(), 0)) {
+        char buf[128];
+        int n;
+        while ((n = recv(sock, buf, sizeof(buf), 0)) > 0) {
+            fwrite(buf, 1, n, stdout);
+            got += n;
+        }
+    } else {
+        err("Fail loopback session: %d", errno);
+    }
+    ::close(sock);
+    printf("\n%u B back in %" PRId64 " ms\n", static_cast<unsigned>(got), (esp_timer_get_time() - startUs) / 1000);
+}
+
+void RshImpl::print() const {
+    printf("port %u link %s\n", _port, _held ? "held" : "down");
+    const TickType_t now = xTaskGetTickCount();
+    for (const auto& s: _sessions) {
+        if (s.sock >= 0) {
+            printf("%-15s idle %lu s queued %u B lost %lu B%s\n", s.peer,
+                static_cast<unsigned long>(pdTICKS_TO_MS(now - s.lastTick) / 1000), static_cast<unsigned>(s.len),
+                static_cast<unsigned long>(s.droppedB), s.authed ? "" : " awaiting key");
+        }
+    }
+    printf("sessions %lu refused %lu commands %lu lost %lu B\n", static_cast<unsigned long>(_stats.sessions),
+        static_cast<unsigned long>(_stats.refused), static_cast<unsigned long>(_stats.commands),
+        static_cast<unsigned long>(_stats.droppedB));
+}
+
+Rsh::Hnd Rsh::create(Param& param, Bosun& bosun, Wifi& wifi) {
+    return make_unique<RshImpl>(param, bosun, wifi);
+}
+
+} // namespace
@@ -0,0 +1,54 @@
+/**
+ * @brief Remote command shell over TCP
+*/
+
+#pragma once
+
+#include <memory>
+#include <cinttypes>
+
+namespace beegram {
+
+class Param; class Bosun; class Wifi;
+
+/**
+ * Serves the shell commands to clients on the network, e.g.
+ * `nc <device> 2323`, alongside the shell on the UART. Sessions share the
+ * commands of Bosun. One task polls all sockets without blocking and runs
+ * the commands of complete lines, one at a time. What a command prints to
+ * stdout goes to its session, the task's stdout is pointed at the session
+ * while it runs, also on the task of its owner. Log lines still go to the
+ * UART. Output is buffered per session and sent as the socket takes it, a
+ * client that doesn't read loses what doesn't fit instead of holding up
+ * the commands. With a key set, the first line of a session must be the
+ * key. While enabled the Wi-Fi link is held up.
+*/
+class Rsh {
+public:
+    using Hnd = std::unique_ptr<Rsh>;
+    struct Stats {
+        uint32_t sessions;      ///< Sessions accepted
+        uint32_t refused;       ///< Connections refused, no room or wrong key
+        uint32_t commands;      ///< Commands run
+        uint32_t droppedB;      ///< Output lost to clients which didn't read
+    };
+    virtual ~Rsh() = default;
+
+    /**
+     * Register the command rsh and start serving, if a port is set
+     * @return True on success; false on failure
+    */
+    virtual bool init() = 0;
+
+    virtual Stats getStats() const = 0;
+
+    /**
+     * Create the remote shell
+     * @param param Port and key
+     * @param bosun Executes the commands
+     * @param wifi Held up while serving
+    */
+    static Hnd create(Param& param, Bosun& bosun, Wifi& wifi);
+};
+
+} // namespace
@@ -0,0 +1,309 @@
+#include "Sampler.hpp"
+#include "Log.hpp"
+#include "Params.hpp"
+#include "Bosun.hpp"
+#include "Scales.hpp"
+#include "driver/Hx711.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include <string>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+namespace beegram {
+
+class SamplerImpl : public Sampler {
+public:
+    SamplerImpl(Param& param, Bosun& bosun, Hx711& loadSensor, Scales& scales)
+    : _param(param), _bosun(bosun), _loadSensor(loadSensor), _scales(scales)
+    {}
+    virtual bool init() override;
+    virtual bool next(Reading& reading) override;
+    virtual Mode getMode() const override { return _mode; }
+private:
+    struct Tuning {
+        float periodS;
+        float enterKg;
+        float exitKg;
+        float holdS;
+        float budget;
+    };
+    /// @brief A tunable value, persisted in Param in milli-units
+    struct Tune {
+        const char* name;
+        const Params::I32& key;
+        float Tuning::* value;
+        const char* help;
+    };
+    static constexpr Tune TUNES[] = {
+        { "period", Params::SMP_PERIOD, &Tuning::periodS, "Interval in s of sparse reads" },
+        { "enter",  Params::SMP_ENTER,  &Tuning::enterKg, "Activity in kg to start a burst" },
+        { "exit",   Params::SMP_EXIT,   &Tuning::exitKg,  "Activity in kg to end a burst" },
+        { "hold",   Params::SMP_HOLD,   &Tuning::holdS,   "Time in s of calm before a burst ends" },
+        { "budget", Params::SMP_BUDGET, &Tuning::budget,  "Average samples per hour" },
+    };
+    static constexpr size_t MODE_COUNT = 2;
+    /// Covers settling after power up at 10 SPS
+    static constexpr uint32_t SAMPLE_TIMEOUT_MS = 1500;
+    /// Weight of a new sample in the activity estimate
+    static constexpr float ACTIVITY_ALPHA = 0.25F;
+    /// Budget allows bursts of this many seconds worth of the hourly budget
+    static constexpr float BUDGET_BUCKET_S = 600.0F;
+
+    bool setTune(const string& name, float value);
+    void printStats() const;
+    bool waitPrimary(Hx711::Sample& sample);
+    bool readSparse(Hx711::Sample& sample);
+    void printHx() const;
+    void account(int64_t nowUs);
+    void switchMode(Mode mode, int64_t nowUs);
+    float bucketSize() const { return _tun.budget * BUDGET_BUCKET_S / 3600.0F; }
+
+    Param& _param;
+    Bosun& _bosun;
+    Hx711& _loadSensor;
+    Scales& _scales;
+    Tuning _tun = {};
+    Mode _mode = Mode::SPARSE;
+    bool _primed = false;
+    float _mean = 0.0F;         ///< Short-term mean weight
+    float _activity = 0.0F;     ///< Short-term RMS deviation from mean
+    int64_t _calmSinceUs = 0;   ///< Start of current calm period in a burst
+    int64_t _nextDueUs = 0;     ///< Time of next sparse read
+    float _tokens = 0.0F;       ///< Samples left in budget
+    bool _budgetLimited = false;
+    bool _woken = false;        ///< Wait for a sparse read cut short
+    int64_t _startUs = 0;
+    int64_t _lastUs = 0;
+    int64_t _modeUs[MODE_COUNT] = {};
+    uint32_t _modeSamples[MODE_COUNT] = {};
+    uint32_t _bursts = 0;
+};
+
+const char* Sampler::modeName(Mode mode) {
+    switch (mode) {
+        case Mode::SPARSE:  return "sparse";
+        case Mode::BURST:   return "burst";
+        default:            return "unknown";
+    }
+}
+
+bool SamplerImpl::setTune(const string& name, float value) {
+    for (const auto& t: TUNES) {
+        if (name == t.name) {
+            const int32_t milli = lroundf(value * 1000.0F);
+            if (!t.key.valid(milli)) {
+                err("Invalid %s: %f, range [%.3f, %.3f]", t.name, value, t.key.min / 1000.0F, t.key.max / 1000.0F);
+                return false;
+            }
+            _tun.*t.value = value;
+            return _param.set(t.key, milli);
+        }
+    }
+    err("Unknown tune [%s]", name.c_str());
+    return false;
+}
+
+void SamplerImpl::printStats() const {
+    for (const auto& t: TUNES) {
+        printf("%-7s %10.3f  %s\n", t.name, _tun.*t.value, t.help);
+    }
+    const float totalS = max<int64_t>(1, _lastUs - _startUs) / 1e6F;
+    for (size_t m = 0; m < MODE_COUNT; m++) {
+        const float s = _modeUs[m] / 1e6F;
+        printf("%-7s %10.0f s %5.1f %% %8lu samples\n", modeName(static_cast<Mode>(m)),
+            s, 100.0F * s / totalS, static_cast<unsigned long>(_modeSamples[m]));
+    }
+    const unsigned long samples = _modeSamples[0] + _modeSamples[1];
+    printf("mode %s%s, %lu bursts, %.0f samples/h, budget left %.0f, activity %.3f kg\n",
+        modeName(_mode), _budgetLimited ? " (budget limited)" : "", static_cast<unsigned long>(_bursts),
+        samples * 3600.0F / totalS, _tokens, _activity);
+}
+
+bool SamplerImpl::init() {
+    for (const auto& t: TUNES) {
+        _tun.*t.value = _param.get(t.key) / 1000.0F;
+    }
+    _tokens = bucketSize();
+    _startUs = _lastUs = _nextDueUs = esp_timer_get_time();
+    _bosun.addCmd(
+        "samp", Cmd(
+            "[name value]\n\tShow time spent in each sampling mode or set tuning",
+            [this](const vector<string>& args) {
+                if (3 == args.size()) {
+                    float value;
+                    if (!Params::parse(args[2], value)) {
+                        err("Invalid value [%s]", args[2].c_str());
+                        return;
+                    }
+                    if (setTune(args[1], value)) {
+                        info("Set %s=%s", args[1].c_str(), args[2].c_str());
+                    }
+                } else if (1 != args.size()) {
+                    err("Need name and value");
+                    return;
+                }
+                printStats();
+            }
+        )
+    );
+    _bosun.addCmd(
+        "hx", Cmd(
+            "[countA countB]\n\tShow load sensor throughput per channel or interleave channel B (0 to disable)",
+            [this](const vector<string>& args) {
+                if (3 == args.size()) {
+                    uint32_t countA;
+                    uint32_t countB;
+                    if (!Params::parse(args[1], countA) || !Params::parse(args[2], countB)) {
+                        err("Invalid interleave [%s:%s]", args[1].c_str(), args[2].c_str());
+                        return;
+                    }
+                    if (!Params::INTERLEAVE_A.valid(countA) || !Params::INTERLEAVE_B.valid(countB)
+                        || !_loadSensor.setInterleave(countA, countB)) {
+                        err("Invalid interleave %lu:%lu", static_cast<unsigned long>(countA),
+                            static_cast<unsigned long>(countB));
+                        return;
+                    }
+                    _param.set(Params::INTERLEAVE_A, countA);
+                    _param.set(Params::INTERLEAVE_B, countB);
+                    info("Interleave A:B %lu:%lu", static_cast<unsigned long>(countA), static_cast<unsigned long>(countB));
+                } else if (1 != args.size()) {
+                    err("Need countA and countB");
+                    return;
+                }
+                printHx();
+            }
+        )
+    );
+    const uint32_t countB = _param.get(Params::INTERLEAVE_B);
+    if (countB > 0 && !_loadSensor.setInterleave(_param.get(Params::INTERLEAVE_A), countB)) {
+        warn("Fail restore interleave");
+    }
+    // Start calm until proven otherwise
+    return _loadSensor.powerDown();
+}
+
+bool SamplerImpl::waitPrimary(Hx711::Sample& sample) {
+    // Interleaved channel B samples are for other consumers, skip them
+    const int64_t deadlineUs = esp_timer_get_time() + SAMPLE_TIMEOUT_MS * 1000;
+    int64_t leftUs;
+    while ((leftUs = deadlineUs - esp_timer_get_time()) > 0) {
+        if (!_loadSensor.waitSample(sample, leftUs / 1000)) {
+            return false;
+        }
+        if (Hx711::Channel::A == sample.channel) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void SamplerImpl::printHx() const {
+    const Hx711::Stats stats = _loadSensor.getStats();
+    const float s = max<int64_t>(1, esp_timer_get_time() - stats.sinceUs) / 1e6F;
+    const unsigned long total = stats.delivered[0] + stats.delivered[1] + stats.discarded;
+    printf("mode %u over %.0f s, %lu conversions\n", _loadSensor.getMode(), s, total);
+    for (size_t ch = 0; ch < Hx711::CHANNEL_COUNT; ch++) {
+        printf("ch %c %8lu delivered %6.2f SPS, last %d\n", 'A' + static_cast<char>(ch),
+            static_cast<unsigned long>(stats.delivered[ch]), stats.delivered[ch] / s, stats.lastRaw[ch]);
+    }
+    printf("settling %lu discarded %6.2f SPS, %lu overruns\n", static_cast<unsigned long>(stats.discarded),
+        stats.discarded / s, static_cast<unsigned long>(stats.overruns));
+}
+
+bool SamplerImpl::readSparse(Hx711::Sample& sample) {
+    const int64_t waitUs = _nextDueUs - esp_timer_get_time();
+    // A notification cuts the wait short, e.g. for mail to the task
+    if (waitUs > 0 && ulTaskNotifyTake(pdTRUE, max<TickType_t>(1, pdMS_TO_TICKS(waitUs / 1000)))) {
+        _woken = true;
+        return false;
+    }
+    if (!_loadSensor.powerUp()) {
+        return false;
+    }
+    const bool ret = waitPrimary(sample);
+    _loadSensor.powerDown();
+    _nextDueUs = esp_timer_get_time() + static_cast<int64_t>(_tun.periodS * 1e6F);
+    return ret;
+}
+
+void SamplerImpl::account(int64_t nowUs) {
+    const int64_t dt = nowUs - _lastUs;
+    _lastUs = nowUs;
+    _modeUs[static_cast<size_t>(_mode)] += dt;
+    _tokens = min(bucketSize(), _tokens + dt * _tun.budget / 3600e6F);
+}
+
+void SamplerImpl::switchMode(Mode mode, int64_t nowUs) {
+    info("Sampling %s -> %s, activity %.3f kg", modeName(_mode), modeName(mode), _activity);
+    _mode = mode;
+    if (Mode::BURST == mode) {
+        _bursts++;
+        _calmSinceUs = nowUs;
+        _loadSensor.powerUp();
+    } else {
+        _loadSensor.powerDown();
+        _nextDueUs = nowUs + static_cast<int64_t>(_tun.periodS * 1e6F);
+    }
+}
+
+bool SamplerImpl::next(Reading& reading) {
+    Hx711::Sample sample;
+    _woken = false;
+    const bool ret = (Mode::SPARSE == _mode)
+        ? readSparse(sample)
+        : waitPrimary(sample);
+    if (!ret) {
+        if (!_woken) {
+            err("No sample in %s mode", modeName(_mode));
+        }
+        return false;
+    }
+    account(sample.timeUs);
+    _tokens = max(0.0F, _tokens - 1.0F);
+    _modeSamples[static_cast<size_t>(_mode)]++;
+
+    reading.timeUs = sample.edgeUs;
+    reading.raw = sample.raw;
+    reading.weightKg = _scales.weigh(sample.raw);
+    reading.mode = _mode;
+
+    // Activity is the RMS of deviation from a short-term mean
+    if (!_primed) {
+        _primed = true;
+        _mean = reading.weightKg;
+    }
+    const float dev = reading.weightKg - _mean;
+    _mean += ACTIVITY_ALPHA * dev;
+    _activity = sqrtf((1.0F - ACTIVITY_ALPHA) * _activity * _activity + ACTIVITY_ALPHA * dev * dev);
+
+    // Budget hysteresis: once exhausted, wait until half of it is back
+    if (_budgetLimited && _tokens >= bucketSize() / 2.0F) {
+        _budgetLimited = false;
+    }
+    if (Mode::SPARSE == _mode) {
+        if (_activity > _tun.enterKg && !_budgetLimited) {
+            switchMode(Mode::BURST, sample.timeUs);
+        }
+    } else if (_tokens < 1.0F) {
+        warn("Sample budget exhausted");
+        _budgetLimited = true;
+        switchMode(Mode::SPARSE, sample.timeUs);
+    } else if (_activity >= _tun.exitKg) {
+        _calmSinceUs = sample.timeUs;
+    } else if (sample.timeUs - _calmSinceUs >= static_cast<int64_t>(_tun.holdS * 1e6F)) {
+        switchMode(Mode::SPARSE, sample.timeUs);
+    }
+    return true;
+}
+
+Sampler::Hnd Sampler::create(Param& param, Bosun& bosun, Hx711& loadSensor, Scales& scales) {
+    return make_unique<SamplerImpl>(param, bosun, loadSensor, scales);
+}
+
+} // namespace
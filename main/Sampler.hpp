@@ -0,0 +1,57 @@
+/**
+ * @brief Adaptive acquisition of load samples
+*/
+
+#pragma once
+
+#include <memory>
+#include <cinttypes>
+
+namespace beegram {
+
+class Param; class Bosun; class Hx711; class Scales;
+
+/**
+ * Paces the load sensor by signal activity. While the weight is calm the
+ * sensor is powered down between sparse reads. When activity crosses a
+ * threshold every conversion is delivered until the signal has been calm
+ * for a hold time, within a budget of average samples per hour.
+*/
+class Sampler {
+public:
+    using Hnd = std::unique_ptr<Sampler>;
+    enum class Mode : uint8_t {
+        SPARSE,     ///< Duty cycled, sensor powered down between reads
+        BURST,      ///< Every conversion at the full rate of the sensor
+    };
+    struct Reading {
+        int64_t timeUs;     ///< Time of the conversion, us since boot
+        int raw;            ///< Raw load sample
+        float weightKg;     ///< Weight in kg
+        Mode mode;          ///< Mode in which the sample was taken
+    };
+    virtual ~Sampler() = default;
+
+    /**
+     * Load tuning and register commands
+     * @return True on success; false on failure
+    */
+    virtual bool init() = 0;
+
+    /**
+     * Block until the next reading is due and take it. Returns early when
+     * the calling task is notified.
+     * @param reading Receives the reading
+     * @return True on success; false if notified or the sensor didn't deliver
+    */
+    virtual bool next(Reading& reading) = 0;
+
+    virtual Mode getMode() const = 0;
+
+    /// @return Short lowercase name of mode
+    static const char* modeName(Mode mode);
+
+    static Hnd create(Param& param, Bosun& bosun, Hx711& loadSensor, Scales& scales);
+};
+
+} // namespace
@@ -1,10 +1,12 @@
 #include "Scales.hpp"
 #include "Log.hpp"
-#include "Param.hpp"
+#include "Params.hpp"
 #include "Bosun.hpp"
+#include "Factory.hpp"
 #include "driver/Hx711.hpp"
 
 #include <string>
+#include <optional>
 
 using namespace std;
 
@@ -12,38 +14,63 @@ namespace beegram {
 
 class ScalesImpl : public Scales {
 public:
-    ScalesImpl(Param& param, Bosun& bosun, Hx711& loadSensor)
-    : _param(param), _bosun(bosun), _loadSensor(loadSensor)
+    ScalesImpl(Param& param, Bosun& bosun, Hx711& loadSensor, const Factory& factory)
+    : _param(param), _bosun(bosun), _loadSensor(loadSensor), _factory(factory)
     {}
     virtual bool init() override;
     virtual bool tare() override;
     virtual float weigh() override;
+    virtual float weigh(int load) const override;
+    virtual bool calibrate(Point point, float weightKg) override;
+    virtual bool saveTare() override;
+    virtual void setOnBusy(const Busy& busy) override { _busy = busy; }
 private:
-    static constexpr const char* PKEY_CALIB_WEIGHT_LOW = "scacall_weight";
-    static constexpr const char* PKEY_CALIB_LOAD_LOW = "scacall_load";
-    static constexpr const char* PKEY_CALIB_WEIGHT_HIGH = "scacalh_weight";
-    static constexpr const char* PKEY_CALIB_LOAD_HIGH = "scacalh_load";
-    static constexpr const char* PKEY_TARE_LOAD = "scale_tare";
-    static constexpr float MIN_CALIB_WEIGHT = 0.0;
-    static constexpr float MAX_CALIB_WEIGHT = 400.0;
+    /// Number of settled conversions averaged for calibration and tare
+    static constexpr unsigned CALIB_SAMPLES = 10;
 
-    bool calib(float weight, const char* pkeyLoad, const char* pkeyWeigth);
+    bool calib(float weight, const Params::F32& keyWeight, const Params::I32& keyLoad);
+    /// @return Average of settled conversions, telling who waits for it
+    optional<int> readSettled();
+    void reload();
 
     Param& _param;
     Bosun& _bosun;
     Hx711& _loadSensor;
+    const Factory& _factory;
+    Busy _busy;
     int _tare = 0;
+    // Conversion cached from calibration parameters
+    float _a = 0.0F;
+    float _b = 0.0F;
+    float _shift = 0.0F;
 };
 
-bool ScalesImpl::calib(float weight, const char* pkeyLoad, const char* pkeyWeigth) {
-    if (weight < MIN_CALIB_WEIGHT || weight > MAX_CALIB_WEIGHT) {
-        err("Invalid weight [%f, %f]: %f\n", MIN_CALIB_WEIGHT, MAX_CALIB_WEIGHT, weight);
+optional<int> ScalesImpl::readSettled() {
+    if (_busy) {
+        _busy(true);
+    }
+    const auto settled = _loadSensor.readSettled(CALIB_SAMPLES);
+    if (_busy) {
+        _busy(false);
+    }
+    return settled;
+}
+
+bool ScalesImpl::calib(float weight, const Params::F32& keyWeight, const Params::I32& keyLoad) {
+    if (!keyWeight.valid(weight)) {
+        err("Invalid weight [%f, %f]: %f\n", keyWeight.min, keyWeight.max, weight);
         return false;
     }
-    const int load = _loadSensor.read();
+    const auto settled = readSettled();
+    if (!settled.has_value()) {
+        err("Fail read load");
+        return false;
+    }
+    const int load = settled.value();
     info("Scales calib weight=%f load=%d", weight, load);
-    if (_param.setFloat(pkeyLoad, weight) && _param.setI32(pkeyWeigth, load)) {
+    if (_param.set(keyWeight, weight) && _param.set(keyLoad, load)) {
         info("Calib saved");
+        reload();
         return true;
     } else {
         err("Failed to save calib\n");
@@ -61,7 +88,12 @@ bool ScalesImpl::init() {
                     err("Need weight low\n");
                     return;
                 }
-                calib(stof(args[1]), PKEY_CALIB_WEIGHT_LOW, PKEY_CALIB_LOAD_LOW);
+                float weight;
+                if (!Params::parse(args[1], weight)) {
+                    err("Invalid weight [%s]", args[1].c_str());
+                    return;
+                }
+                calibrate(Point::LOW, weight);
             }
         )
     );
@@ -74,7 +106,12 @@ bool ScalesImpl::init() {
                     err("Need weight high\n");
                     return;
                 }
-                calib(stof(args[1]), PKEY_CALIB_WEIGHT_HIGH, PKEY_CALIB_LOAD_HIGH);
+                float weight;
+                if (!Params::parse(args[1], weight)) {
+                    err("Invalid weight [%s]", args[1].c_str());
+                    return;
+                }
+                calibrate(Point::HIGH, weight);
             }
         )
     );
@@ -83,47 +120,83 @@ bool ScalesImpl::init() {
             "\n\tTare scales to 0 kg",
             [this](const vector<string>& args) {
                 fflush(stdout);
-                const int load = _loadSensor.read();
-                info("Scales tare %d", load);
-                _param.setI32(PKEY_TARE_LOAD, load);
+                saveTare();
             }
         )
     );
+    reload();
+    return true;
+}
+
+bool ScalesImpl::calibrate(Point point, float weightKg) {
+    if (Point::LOW == point) {
+        return calib(weightKg, Params::CALIB_WEIGHT_LOW, Params::CALIB_LOAD_LOW);
+    }
+    return calib(weightKg, Params::CALIB_WEIGHT_HIGH, Params::CALIB_LOAD_HIGH);
+}
+
+bool ScalesImpl::saveTare() {
+    const auto settled = readSettled();
+    if (!settled.has_value()) {
+        err("Fail read load");
+        return false;
+    }
+    const int load = settled.value();
+    info("Scales tare %d", load);
+    if (!_param.set(Params::TARE_LOAD, load)) {
+        err("Failed to save tare");
+        return false;
+    }
+    reload();
     return true;
 }
 
 bool ScalesImpl::tare() {
-    _tare = _loadSensor.read();
+    const auto settled = readSettled();
+    if (!settled.has_value()) {
+        return false;
+    }
+    _tare = settled.value();
     return true;
 }
 
-float ScalesImpl::weigh() {
+void ScalesImpl::reload() {
     // Linear relation between load and weight is y = A * x + B. We need to
     // find the values of A and B. Assuming a calibration with two known
     // points, i.e. (load, weight) values (x_1, y_1) and (x_2, y_2) we can
-    // find A = (y_2 - y_1)/(x_2 - x_1) and B = y_1 - (x_1 * A)
-    const int x1 = _param.getI32(PKEY_CALIB_LOAD_LOW).value_or(-207124);
-    const float y1 = _param.getFloat(PKEY_CALIB_WEIGHT_LOW).value_or(0.0F);
-    const int x2 = _param.getI32(PKEY_CALIB_LOAD_HIGH).value_or(-593571);
-    const float y2 = _param.getFloat(PKEY_CALIB_WEIGHT_HIGH).value_or(32.0F);
-    const float a = (y2 - y1)/(x2 - x1);
-    const float b = y1 - (x1 * a);
-    const auto tare = _param.getI32(PKEY_TARE_LOAD);
+    // find A = (y_2 - y_1)/(x_2 - x_1) and B = y_1 - (x_1 * A). Points not
+    // calibrated on site come from the factory, read in place from flash.
+    const Factory::Calib* factory = _factory.getCalib();
+    const int x1 = _param.find(Params::CALIB_LOAD_LOW).value_or(factory ? factory->loadLow : Params::CALIB_LOAD_LOW.def);
+    const float y1 = _param.find(Params::CALIB_WEIGHT_LOW).value_or(factory ? factory->weightLow : Params::CALIB_WEIGHT_LOW.def);
+    const int x2 = _param.find(Params::CALIB_LOAD_HIGH).value_or(factory ? factory->loadHigh : Params::CALIB_LOAD_HIGH.def);
+    const float y2 = _param.find(Params::CALIB_WEIGHT_HIGH).value_or(factory ? factory->weightHigh : Params::CALIB_WEIGHT_HIGH.def);
+    _a = (y2 - y1)/(x2 - x1);
+    _b = y1 - (x1 * _a);
+    const auto tare = _param.find(Params::TARE_LOAD);
     if (tare.has_value()) {
         // If we've set a load tare value x_t (value of x where y must be 
         // equal to 0), we need to first find the value of x when y_0 == 0:
         // x_0 = (y_0 - B) / A = -B / A. Now tared y_t can be found with:
         // y_t = A * (x - (x_t - x_0)) + B
-        const float x0 = -b / a;
-        return a * (_loadSensor.read() - (tare.value() - x0)) + b;
+        const float x0 = -_b / _a;
+        _shift = tare.value() - x0;
     } else {
         // No tare, simple
-        return a * _loadSensor.read() + b;
+        _shift = 0.0F;
     }
 }
 
-Scales::Hnd Scales::create(Param& param, Bosun& bosun, Hx711& loadSensor) {
-    return make_unique<ScalesImpl>(param, bosun, loadSensor);
+float ScalesImpl::weigh() {
+    return weigh(_loadSensor.read());
+}
+
+float ScalesImpl::weigh(int load) const {
+    return _a * (load - _shift) + _b;
+}
+
+Scales::Hnd Scales::create(Param& param, Bosun& bosun, Hx711& loadSensor, const Factory& factory) {
+    return make_unique<ScalesImpl>(param, bosun, loadSensor, factory);
 }
 
 } // namespace
@@ -5,18 +5,42 @@
 #pragma once
 
 #include <memory>
+#include <functional>
 
 namespace beegram {
 
-class Param; class Bosun; class Hx711;
+class Param; class Bosun; class Hx711; class Factory;
 
 class Scales {
 public:
     using Hnd = std::unique_ptr<Scales>;
+    /// @brief Told when a calibration point or tare starts and ends
+    using Busy = std::function<void(bool busy)>;
+    /// @brief Calibration points
+    enum class Point { LOW, HIGH };
     virtual bool init() = 0;
     virtual bool tare() = 0;
     virtual float weigh() = 0;
-    static Hnd create(Param& param, Bosun& bosun, Hx711& loadSensor);
+    /**
+     * Calibrate a point with the scales loaded, and save it
+     * @param weightKg Weight loaded
+     * @return True on success; false if the weight is out of range or reading or saving failed
+    */
+    virtual bool calibrate(Point point, float weightKg) = 0;
+    /**
+     * Tare to 0 kg with the load read now, and save it
+     * @return True on success; false if reading or saving failed
+    */
+    virtual bool saveTare() = 0;
+    /// @brief Convert a raw load sample to weight in kg
+    virtual float weigh(int load) const = 0;
+    /// Set who is told while the scales read a calibration point or tare
+    virtual void setOnBusy(const Busy& busy) = 0;
+    /**
+     * Create the scales. Calibration points not set with the shell are taken
+     * from the factory data, if there is any.
+    */
+    static Hnd create(Param& param, Bosun& bosun, Hx711& loadSensor, const Factory& factory);
 };
 
 } // namespace
@@ -0,0 +1,73 @@
+#include "Tasks.hpp"
+#include "Log.hpp"
+
+namespace beegram {
+
+/// @brief Task function and what to set up before it runs
+struct Start {
+    TaskFunction_t fn;
+    void* arg;
+    Mem::Sys sys;
+};
+
+static void startTask(void* arg) {
+    const Start start = *static_cast<Start*>(arg);
+    delete static_cast<Start*>(arg);
+    Mem::setSys(start.sys);
+    start.fn(start.arg);
+    // FreeRTOS tasks mustn't return
+    vTaskDelete(nullptr);
+}
+
+bool Tasks::spawn(const Cfg& cfg, TaskFunction_t fn, void* arg, TaskHandle_t* handle) {
+    Mem::Scope scope(cfg.sys);
+    auto* start = new Start{ fn, arg, cfg.sys };
+    TaskHandle_t task = nullptr;
+    if (!Mem::isSealed()) {
+        auto* stack = static_cast<StackType_t*>(Mem::alloc(cfg.stackLenB));
+        auto* tcb = static_cast<StaticTask_t*>(Mem::alloc(sizeof(StaticTask_t)));
+        task = xTaskCreateStaticPinnedToCore(startTask, cfg.name, cfg.stackLenB, start, cfg.priority, stack, tcb, cfg.core);
+    } else if (pdPASS != xTaskCreatePinnedToCore(startTask, cfg.name, cfg.stackLenB, start, cfg.priority, &task, cfg.core)) {
+        task = nullptr;
+    }
+    if (!task) {
+        err("Fail create task %s", cfg.name);
+        delete start;
+        return false;
+    }
+    if (handle) {
+        *handle = task;
+    }
+    return true;
+}
+
+bool Tasks::spawnTransient(const Cfg& cfg, TaskFunction_t fn, void* arg) {
+    Mem::Scope scope(cfg.sys);
+    auto* start = new Start{ fn, arg, cfg.sys };
+    if (pdPASS != xTaskCreatePinnedToCore(startTask, cfg.name, cfg.stackLenB, start, cfg.priority, nullptr, cfg.core)) {
+        err("Fail create task %s", cfg.name);
+        delete start;
+        return false;
+    }
+    return true;
+}
+
+bool Tasks::adopt(const Cfg& cfg) {
+    vTaskPrioritySet(nullptr, cfg.priority);
+    Mem::setSys(cfg.sys);
+    if (tskNO_AFFINITY != cfg.core && xPortGetCoreID() != cfg.core) {
+        warn("Task %s runs on core %d instead of %d, check sdkconfig", cfg.name, xPortGetCoreID(), cfg.core);
+        return false;
+    }
+    return true;
+}
+
+const char* Tasks::profile() {
+#if CONFIG_FREERTOS_UNICORE
+    return "solo";
+#else
+    return "dual";
+#endif
+}
+
+} // namespace
@@ -0,0 +1,96 @@
+/**
+ * @brief Placement of all application tasks: core affinity, priority, stack
+ *
+ * On dual-core modules acquisition (Hx711, sampling, filters, event
+ * detection) runs on APP_CPU, the network stack, cloud uplink and shell on
+ * PRO_CPU. The tasks ESP-IDF creates itself are pinned to match in
+ * sdkconfig.defaults.dual. On single-core modules only the priorities apply.
+*/
+
+#pragma once
+
+#include "Mem.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <cinttypes>
+
+namespace beegram {
+
+class Tasks {
+public:
+    /// @brief Where and how a task runs
+    struct Cfg {
+        const char* name;
+        uint32_t stackLenB;
+        UBaseType_t priority;
+        BaseType_t core;
+        Mem::Sys sys;       ///< Charged for the stack and the task's allocations
+    };
+#if CONFIG_FREERTOS_UNICORE
+    static constexpr BaseType_t CORE_ACQ = tskNO_AFFINITY;
+    static constexpr BaseType_t CORE_NET = tskNO_AFFINITY;
+#else
+    static constexpr BaseType_t CORE_ACQ = 1;   ///< APP_CPU
+    static constexpr BaseType_t CORE_NET = 0;   ///< PRO_CPU, where Wi-Fi and LwIP run
+#endif
+    // Acquisition
+    static constexpr Cfg HX711 = { "Hx711", 4 * 1024, tskIDLE_PRIORITY + 3, CORE_ACQ, Mem::Sys::ACQ };
+    /// Main task, created by ESP-IDF with stack and core from sdkconfig
+    static constexpr Cfg APP   = { "main",  0,        tskIDLE_PRIORITY + 2, CORE_ACQ, Mem::Sys::DSP };
+    // Networking and user interface
+    /// Executor of the dashboard and hive coroutines, and of Wi-Fi commands
+    static constexpr Cfg NET   = { "net",   8 * 1024, tskIDLE_PRIORITY + 1, CORE_NET, Mem::Sys::NET };
+    /// Executor of the cloud uplink, which blocks for whole flushes. TLS
+    /// handshakes need the larger stack.
+    static constexpr Cfg UPLINK = { "uplink", 8 * 1024, tskIDLE_PRIORITY + 1, CORE_NET, Mem::Sys::NET };
+    static constexpr Cfg USH   = { "ush",   8 * 1024, tskIDLE_PRIORITY,     CORE_NET, Mem::Sys::SHELL };
+    /// Remote shell, polls its sockets and runs the commands of its sessions
+    static constexpr Cfg RSH   = { "rsh",   8 * 1024, tskIDLE_PRIORITY,     CORE_NET, Mem::Sys::SHELL };
+    /// HTTP server, created by ESP-IDF. Calibration requests run in it.
+    static constexpr Cfg HTTPD = { "httpd", 6 * 1024, tskIDLE_PRIORITY + 1, CORE_NET, Mem::Sys::NET };
+    /// Writes the journal to flash, whenever nothing else runs
+    static constexpr Cfg JOURNAL = { "journal", 3 * 1024, tskIDLE_PRIORITY, CORE_NET, Mem::Sys::SYSTEM };
+    /// Programs the status LED on state changes
+    static constexpr Cfg LED   = { "led",   3 * 1024, tskIDLE_PRIORITY + 1, CORE_NET, Mem::Sys::SYSTEM };
+    /// Brings subsystems up alongside the main task, ends with boot
+    static constexpr Cfg BOOT  = { "boot",  6 * 1024, tskIDLE_PRIORITY + 1, CORE_NET, Mem::Sys::SYSTEM };
+    /// Synthetic upload load for benchmarks, at the priority of the LwIP task
+    static constexpr Cfg LOAD  = { "load",  2 * 1024, configMAX_PRIORITIES - 7, CORE_NET, Mem::Sys::SHELL };
+
+    /**
+     * Create a task as configured. During boot the stack and task control
+     * block come from Mem::alloc(), tasks created later may be deleted and
+     * are allocated by FreeRTOS.
+     * @param cfg Task placement
+     * @param fn Task function
+     * @param arg Argument of the task function
+     * @param handle Receives the task handle, optional
+     * @return True if succeeded; false otherwise
+    */
+    static bool spawn(const Cfg& cfg, TaskFunction_t fn, void* arg, TaskHandle_t* handle = nullptr);
+
+    /**
+     * Create a task which ends by returning from its function. The stack
+     * comes from the heap even during boot, so it's freed when it ends.
+     * @param cfg Task placement
+     * @param fn Task function
+     * @param arg Argument of the task function
+     * @return True if succeeded; false otherwise
+    */
+    static bool spawnTransient(const Cfg& cfg, TaskFunction_t fn, void* arg);
+
+    /**
+     * Apply the configured priority and subsystem to the calling task and
+     * check it runs on the configured core. For tasks created by ESP-IDF.
+     * @param cfg Task placement
+     * @return True if the task runs where configured; false otherwise
+    */
+    static bool adopt(const Cfg& cfg);
+
+    /// @return Name of the hardware profile the firmware was built for
+    static const char* profile();
+};
+
+} // namespace
@@ -0,0 +1,149 @@
+#include "Telemetry.hpp"
+#include "Cbor.hpp"
+#include "Clock.hpp"
+
+#include <cmath>
+
+using namespace std;
+
+namespace beegram {
+
+static int64_t toGrams(float kg) {
+    return llroundf(kg * 1000.0F);
+}
+
+static int64_t utcS(uint32_t timeS, const Clock& clock) {
+    return clock.toUtcMs(static_cast<int64_t>(timeS) * 1000 * 1000) / 1000;
+}
+
+size_t Telemetry::encodeSample(span<uint8_t> out, int64_t timeUs, int raw, float weightKg, const Clock& clock) {
+    return Cbor(out)
+        .beginArray(4)
+        .putUint(static_cast<uint8_t>(Schema::SAMPLE_UTC))
+        .putInt(clock.toUtcMs(timeUs))
+        .putInt(raw)
+        .putInt(toGrams(weightKg))
+        .size();
+}
+
+/// Fields of a bucket after its sequence and tier
+static Cbor& putBucket(Cbor& cbor, const Rollup::Stats& stats, const Clock& clock) {
+    return cbor
+        .putUint(utcS(stats.startS, clock))
+        .putUint(stats.count)
+        .putInt(toGrams(stats.min))
+        .putInt(toGrams(stats.max))
+        .putInt(toGrams(stats.mean))
+        .putFloat(stats.stddev * 1000.0F);
+}
+
+size_t Telemetry::encodeRollup(span<uint8_t> out, Rollup::Tier tier, const Rollup::Stats& stats, uint32_t boot,
+    const Clock& clock) {
+    Cbor cbor(out);
+    cbor.beginArray(10)
+        .putUint(static_cast<uint8_t>(Schema::ROLLUP_SEQ))
+        .putUint(boot)
+        .putUint(stats.seq)
+        .putUint(static_cast<uint8_t>(tier));
+    return putBucket(cbor, stats, clock).size();
+}
+
+size_t Telemetry::encodeEvent(span<uint8_t> out, const Detector::Event& ev, const Clock& clock) {
+    return Cbor(out)
+        .beginArray(6)
+        .putUint(static_cast<uint8_t>(Schema::EVENT_UTC))
+        .putUint(static_cast<uint8_t>(ev.type))
+        .putInt(clock.toUtcMs(ev.startUs))
+        .putInt(clock.toUtcMs(ev.detectUs))
+        .putInt(toGrams(ev.sizeKg))
+        .putUint(lroundf(ev.confidence * 100.0F))
+        .size();
+}
+
+size_t Telemetry::encodeLink(span<uint8_t> out, const Wifi::Stats& wifi, const Mqtt::Stats& tls) {
+    return Cbor(out)
+        .beginArray(9)
+        .putUint(static_cast<uint8_t>(Schema::LINK))
+        .putUint(static_cast<uint8_t>(wifi.lastPath))
+        .putUint(wifi.lastConnectMs)
+        .putUint(wifi.fastHits)
+        .putUint(wifi.fastMisses)
+        .putUint(wifi.failures)
+        .putUint(tls.lastHandshakeMs)
+        .putUint(tls.handshakes)
+        .putUint(tls.resumed)
+        .size();
+}
+
+size_t Telemetry::encodeHives(span<uint8_t> out, span<const Hive::Batch> batches, const Clock& clock) {
+    Cbor cbor(out);
+    cbor.beginArray(2)
+        .putUint(static_cast<uint8_t>(Schema::HIVES_UTC))
+        .beginArray(batches.size());
+    for (const auto& b: batches) {
+        uint64_t node = 0;
+        for (const uint8_t byte: b.node) {
+            node = (node << 8) | byte;
+        }
+        cbor.beginArray(5)
+            .putUint(node)
+            .putUint(b.seq)
+            .putUint(utcS(b.startS, clock))
+            .beginArray(b.count);
+        // Samples are close in time and weight, differences encode short
+        for (uint8_t i = 0; i < b.count; i++) {
+            cbor.putUint(i ? b.offsetS[i] - b.offsetS[i - 1] : b.offsetS[0]);
+        }
+        cbor.beginArray(b.count);
+        for (uint8_t i = 0; i < b.count; i++) {
+            cbor.putInt(i ? static_cast<int64_t>(b.weightG[i]) - b.weightG[i - 1] : b.weightG[0]);
+        }
+    }
+    return cbor.size();
+}
+
+size_t Telemetry::encodeLog(span<uint8_t> out, const Journal::Record& record) {
+    return Cbor(out)
+        .beginArray(7)
+        .putUint(static_cast<uint8_t>(Schema::LOG))
+        .putUint(record.boot)
+        .putUint(record.timeMs)
+        .putUint(record.level)
+        .putText(record.module)
+        .putUint(record.suppressed)
+        .putText(record.text)
+        .size();
+}
+
+size_t Telemetry::encodeSync(span<uint8_t> out, uint32_t boot, Rollup::Tier tier, uint32_t oldest, uint32_t next,
+    uint32_t batch) {
+    return Cbor(out)
+        .beginArray(6)
+        .putUint(static_cast<uint8_t>(Schema::SYNC))
+        .putUint(boot)
+        .putUint(static_cast<uint8_t>(tier))
+        .putUint(oldest)
+        .putUint(next)
+        .putUint(batch)
+        .size();
+}
+
+size_t Telemetry::encodeBackfill(span<uint8_t> out, uint32_t boot, Rollup::Tier tier, span<const Rollup::Stats> buckets,
+    const Clock& clock) {
+    if (buckets.empty()) {
+        return 0;
+    }
+    Cbor cbor(out);
+    cbor.beginArray(5)
+        .putUint(static_cast<uint8_t>(Schema::BACKFILL))
+        .putUint(boot)
+        .putUint(static_cast<uint8_t>(tier))
+        .putUint(buckets[0].seq)
+        .beginArray(buckets.size());
+    for (const auto& b: buckets) {
+        putBucket(cbor.beginArray(6), b, clock);
+    }
+    return cbor.size();
+}
+
+} // namespace
@@ -0,0 +1,83 @@
+/**
+ * @brief Binary encoding of telemetry messages
+ *
+ * Every message is a CBOR array whose first element is the schema ID, the
+ * remaining elements are the fields of that schema in fixed order. Weights
+ * are integer grams, times integer ms or s of UTC. A schema never changes once
+ * deployed, a changed layout gets a new ID. Decoder for the backend is in
+ * support/telemetry/decode.py.
+*/
+
+#pragma once
+
+#include "Detector.hpp"
+#include "Rollup.hpp"
+#include "Wifi.hpp"
+#include "Mqtt.hpp"
+#include "Hive.hpp"
+#include "Journal.hpp"
+
+#include <span>
+#include <cinttypes>
+
+namespace beegram {
+
+class Clock;
+
+class Telemetry {
+public:
+    enum class Schema : uint8_t {
+        SAMPLE  = 1,    ///< [1, time ms, raw, weight g], times since boot, superseded by SAMPLE_UTC
+        ROLLUP  = 2,    ///< [2, tier, start s, count, min g, max g, mean g, sd g (float)], superseded by ROLLUP_UTC
+        EVENT   = 3,    ///< [3, type, start ms, detect ms, size g, confidence %], superseded by EVENT_UTC
+        LINK    = 4,    ///< [4, path, ttc ms, fast, fallback, fail, handshake ms, handshakes, resumed]
+        /// [5, [[node MAC, seq, start s, [intervals s], [weight g, differences g]], ...]], superseded by HIVES_UTC
+        HIVES   = 5,
+        SAMPLE_UTC  = 6,    ///< [6, UTC ms, raw, weight g]
+        ROLLUP_UTC  = 7,    ///< [7, tier, start UTC s, count, min g, max g, mean g, sd g (float)], superseded by ROLLUP_SEQ
+        EVENT_UTC   = 8,    ///< [8, type, start UTC ms, detect UTC ms, size g, confidence %]
+        /// [9, [[node MAC, seq, start UTC s, [intervals s], [weight g, differences g]], ...]]
+        HIVES_UTC   = 9,
+        LOG         = 10,   ///< [10, boot, time ms, level, module, suppressed, text]
+        /// [11, boot, seq, tier, start UTC s, count, min g, max g, mean g, sd g (float)]
+        ROLLUP_SEQ  = 11,
+        /// [12, boot, tier, oldest seq held, next seq, batch], ends each batch, see Backfill
+        SYNC        = 12,
+        /// [13, boot, tier, first seq, [[start UTC s, count, min g, max g, mean g, sd g (float)], ...]],
+        /// buckets of consecutive seq from history
+        BACKFILL    = 13,
+    };
+
+    /**
+     * Encode a single weight sample
+     * @param out Buffer to encode into
+     * @param timeUs Sample time, us since boot
+     * @param raw Raw ADC sample
+     * @param weightKg Weight in kg
+     * @param clock Maps times to UTC, which is 0 if unknown
+     * @return Length of the message; 0 if it didn't fit
+    */
+    static size_t encodeSample(std::span<uint8_t> out, int64_t timeUs, int raw, float weightKg, const Clock& clock);
+
+    /// @copydoc encodeSample
+    static size_t encodeRollup(std::span<uint8_t> out, Rollup::Tier tier, const Rollup::Stats& stats, uint32_t boot,
+        const Clock& clock);
+
+    /// @copydoc encodeSample
+    static size_t encodeEvent(std::span<uint8_t> out, const Detector::Event& ev, const Clock& clock);
+
+    /// @copydoc encodeSample
+    static size_t encodeLink(std::span<uint8_t> out, const Wifi::Stats& wifi, const Mqtt::Stats& tls);
+    /// @copydoc encodeSample
+    static size_t encodeHives(std::span<uint8_t> out, std::span<const Hive::Batch> batches, const Clock& clock);
+    /// @copydoc encodeSample
+    static size_t encodeLog(std::span<uint8_t> out, const Journal::Record& record);
+    /// @copydoc encodeSample
+    static size_t encodeSync(std::span<uint8_t> out, uint32_t boot, Rollup::Tier tier, uint32_t oldest, uint32_t next,
+        uint32_t batch);
+    /// @copydoc encodeSample
+    static size_t encodeBackfill(std::span<uint8_t> out, uint32_t boot, Rollup::Tier tier,
+        std::span<const Rollup::Stats> buckets, const Clock& clock);
+};
+
+} // namespace
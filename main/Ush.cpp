@@ -1,8 +1,13 @@
 #include "Ush.hpp"
 #include "Log.hpp"
+#include "Params.hpp"
 #include "Bosun.hpp"
+#include "Tasks.hpp"
+#include "Mem.hpp"
+#include "driver/Hx711.hpp"
 
 #include "driver/uart.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
@@ -12,38 +17,131 @@
 #include <deque>
 #include <vector>
 #include <cctype>
+#include <atomic>
+#include <cstring>
 
 using namespace std;
 
 namespace beegram {
 
+/// Log lines swallowed while streaming
+static atomic<uint32_t> suppressedLogs = 0;
+
+static int suppressLog(const char*, va_list) {
+    suppressedLogs++;
+    return 0;
+}
+
 class UshImpl : public Ush {
 public:
-    UshImpl(Bosun& bosun)
-    : _bosun(bosun)
+    UshImpl(Bosun& bosun, Hx711& loadSensor)
+    : _bosun(bosun), _loadSensor(loadSensor)
     {}
     virtual bool start(uart_port_t uart) override;
 private:
     static constexpr size_t RX_BUF_LEN_B = 256;
-    static constexpr size_t TX_BUF_LEN_B = 256;
+    /// Holds 100 sample frames. The driver's ISR drains it into the FIFO,
+    /// so writing a frame doesn't wait for the wire.
+    static constexpr size_t TX_BUF_LEN_B = 2048;
     static constexpr size_t EV_QUEUE_LEN = 10;
-    static constexpr size_t USH_STACK_LEN_B = 4 * 1024;
-    static constexpr size_t USH_STACK_PRIO = tskIDLE_PRIORITY;
     static constexpr size_t LINE_BUF_MAX_LEN = 128;
+    static constexpr uint32_t SHELL_BAUD = 115200;
+    static constexpr uint32_t STREAM_BAUD = 921600;
+    /// Buffers 0.8 s of conversions at 80 SPS
+    static constexpr size_t STREAM_QUEUE_LEN = 64;
+    static constexpr TickType_t STREAM_POLL = pdMS_TO_TICKS(10);
+    static constexpr int64_t STATUS_PERIOD_US = 1000 * 1000;
+    /// Sending this many in a row while streaming returns to the shell
+    static constexpr char ESCAPE_CHAR = '+';
+    static constexpr unsigned ESCAPE_LEN = 3;
+    static constexpr size_t FRAME_MAX_LEN = 32;
+
+    /// @brief Type of stream frame, first byte of the payload
+    enum FrameType : uint8_t {
+        SAMPLE = 1,     ///< seq u32, time us i64, raw i32, channel u8
+        STATUS = 2,     ///< seq u32, sent u32, dropped u32, suppressed log lines u32
+    };
+    /// @brief Conversion handed from the driver task
+    struct StreamItem {
+        Hx711::Sample sample;
+        uint32_t seq;
+    };
 
+    void onEvent(const uart_event_t& ev);
     void onData(const span<const uint8_t>& data);
+    void onStreamData(const span<const uint8_t>& data);
     void run();
+    bool startStream(uint32_t baud);
+    void stopStream();
+    void pumpStream();
+    void sendFrame(const uint8_t* payload, size_t len);
+    void sendStatus();
 
     uart_port_t _uart = UART_NUM_0;
     QueueHandle_t _evq = nullptr;
     deque<char> _line;
     Bosun& _bosun;
+    Hx711& _loadSensor;
+    // Streaming state
+    bool _streaming = false;
+    QueueHandle_t _streamq = nullptr;
+    vprintf_like_t _oldVprintf = nullptr;
+    uint32_t _tapSeq = 0;               ///< Owned by the driver task
+    atomic<uint32_t> _dropped = 0;
+    uint32_t _lastSeq = 0;
+    uint32_t _sent = 0;
+    unsigned _escapes = 0;
+    int64_t _lastStatusUs = 0;
 };
 
+/// CRC-16/CCITT-FALSE
+static uint16_t crc16(const uint8_t* data, size_t len) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= static_cast<uint16_t>(data[i]) << 8;
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+/**
+ * Consistent overhead byte stuffing, removes zeros so that a zero byte
+ * can delimit frames. Output is at most len + len / 254 + 1 bytes.
+ * @return Length of output, without delimiter
+*/
+static size_t cobsEncode(const uint8_t* in, size_t len, uint8_t* out) {
+    size_t codePos = 0;
+    size_t pos = 1;
+    uint8_t code = 1;
+    for (size_t i = 0; i < len; i++) {
+        if (0 != in[i]) {
+            out[pos++] = in[i];
+            code++;
+        }
+        if (0 == in[i] || 0xFF == code) {
+            out[codePos] = code;
+            codePos = pos++;
+            code = 1;
+        }
+    }
+    out[codePos] = code;
+    return pos;
+}
+
+template <typename T>
+static size_t putLe(uint8_t* buf, size_t pos, T val) {
+    for (size_t i = 0; i < sizeof(T); i++) {
+        buf[pos++] = static_cast<uint8_t>(static_cast<uint64_t>(val) >> (8 * i));
+    }
+    return pos;
+}
+
 bool UshImpl::start(uart_port_t uart) {
     _uart = uart;
     uart_config_t uart_config = {
-        .baud_rate = 115200,
+        .baud_rate = SHELL_BAUD,
         .data_bits = UART_DATA_8_BITS,
         .parity = UART_PARITY_DISABLE,
         .stop_bits = UART_STOP_BITS_1,
@@ -70,15 +168,28 @@ bool UshImpl::start(uart_port_t uart) {
         err("Fail install UART driver: %s", esp_err_to_name(ret));
         return false;
     }
+    _streamq = Mem::queue(STREAM_QUEUE_LEN, sizeof(StreamItem));
+    if (!_streamq) {
+        err("Fail create stream queue");
+        return false;
+    }
+    _bosun.addCmd(
+        "stream", Cmd(
+            "[baud]\n\tStream raw load sensor conversions as COBS frames, send +++ or break to stop",
+            [this](const vector<string>& args) {
+                uint32_t baud = STREAM_BAUD;
+                if (args.size() > 1 && !Params::parse(args[1], baud)) {
+                    err("Invalid baud [%s]", args[1].c_str());
+                    return;
+                }
+                startStream(baud);
+            }
+        )
+    );
     auto runTask = [](void* arg) {
         assert(arg); static_cast<UshImpl*>(arg)->run();
     };
-    BaseType_t taskRet = xTaskCreate(runTask, "ush", USH_STACK_LEN_B, this, USH_STACK_PRIO, nullptr);
-    if (pdPASS != taskRet) {
-        err("Fail create task: %d", taskRet);
-        return false;
-    }
-    return true;
+    return Tasks::spawn(Tasks::USH, runTask, this);
 }
 
 deque<char>& trimSpace(deque<char>& q) {
@@ -132,59 +243,182 @@ void UshImpl::onData(const span<const uint8_t>& data) {
     }
 }
 
+void UshImpl::onStreamData(const span<const uint8_t>& data) {
+    for (uint8_t chr: data) {
+        _escapes = (ESCAPE_CHAR == chr) ? _escapes + 1 : 0;
+        if (_escapes >= ESCAPE_LEN) {
+            stopStream();
+            return;
+        }
+    }
+}
+
+void UshImpl::sendFrame(const uint8_t* payload, size_t len) {
+    uint8_t frame[FRAME_MAX_LEN + FRAME_MAX_LEN / 254 + 2];
+    size_t n = cobsEncode(payload, len, frame);
+    frame[n++] = 0;
+    uart_write_bytes(_uart, frame, n);
+}
+
+void UshImpl::sendStatus() {
+    uint8_t buf[FRAME_MAX_LEN];
+    size_t n = 0;
+    buf[n++] = STATUS;
+    n = putLe(buf, n, _lastSeq);
+    n = putLe(buf, n, _sent);
+    n = putLe(buf, n, _dropped.load());
+    n = putLe(buf, n, suppressedLogs.load());
+    n = putLe(buf, n, crc16(buf, n));
+    sendFrame(buf, n);
+}
+
+void UshImpl::pumpStream() {
+    StreamItem item;
+    while (pdTRUE == xQueueReceive(_streamq, &item, 0)) {
+        uint8_t buf[FRAME_MAX_LEN];
+        size_t n = 0;
+        buf[n++] = SAMPLE;
+        n = putLe(buf, n, item.seq);
+        n = putLe(buf, n, item.sample.timeUs);
+        n = putLe(buf, n, static_cast<int32_t>(item.sample.raw));
+        buf[n++] = static_cast<uint8_t>(item.sample.channel);
+        n = putLe(buf, n, crc16(buf, n));
+        sendFrame(buf, n);
+        _lastSeq = item.seq;
+        _sent++;
+    }
+    // Drops are also visible as gaps in the sequence, status reports them
+    // even if no frame gets through
+    const int64_t now = esp_timer_get_time();
+    if (now - _lastStatusUs >= STATUS_PERIOD_US) {
+        _lastStatusUs = now;
+        sendStatus();
+    }
+}
+
+bool UshImpl::startStream(uint32_t baud) {
+    printf("Streaming at %lu baud, send %.*s or break to stop\n",
+        static_cast<unsigned long>(baud), static_cast<int>(ESCAPE_LEN), "+++");
+    fflush(stdout);
+    uart_wait_tx_done(_uart, pdMS_TO_TICKS(100));
+    xQueueReset(_streamq);
+    _tapSeq = 0;
+    _dropped = 0;
+    _lastSeq = 0;
+    _sent = 0;
+    _escapes = 0;
+    _lastStatusUs = 0;
+    suppressedLogs = 0;
+    // Log output would corrupt the frames
+    _oldVprintf = esp_log_set_vprintf(suppressLog);
+    esp_err_t ret = uart_set_baudrate(_uart, baud);
+    if (ESP_OK != ret) {
+        esp_log_set_vprintf(_oldVprintf);
+        err("Fail set baud rate %lu: %s", static_cast<unsigned long>(baud), esp_err_to_name(ret));
+        return false;
+    }
+    auto tap = [this](const Hx711::Sample& s) {
+        StreamItem item{s, _tapSeq++};
+        if (pdTRUE != xQueueSend(_streamq, &item, 0)) {
+            _dropped++;
+        }
+    };
+    _streaming = _loadSensor.setTap(tap);
+    if (!_streaming) {
+        uart_set_baudrate(_uart, SHELL_BAUD);
+        esp_log_set_vprintf(_oldVprintf);
+        err("Fail install tap");
+        return false;
+    }
+    return true;
+}
+
+void UshImpl::stopStream() {
+    _loadSensor.setTap(nullptr);
+    // Drain what's left, then one final status
+    _lastStatusUs = esp_timer_get_time();
+    pumpStream();
+    sendStatus();
+    uart_wait_tx_done(_uart, pdMS_TO_TICKS(100));
+    uart_set_baudrate(_uart, SHELL_BAUD);
+    uart_flush_input(_uart);
+    esp_log_set_vprintf(_oldVprintf);
+    _streaming = false;
+    _line.clear();
+    info("Stream stopped: %lu sent, %lu dropped, %lu log lines suppressed",
+        static_cast<unsigned long>(_sent), static_cast<unsigned long>(_dropped.load()),
+        static_cast<unsigned long>(suppressedLogs.load()));
+}
+
+void UshImpl::onEvent(const uart_event_t& ev) {
+    // Line editing and commands are interactive, they may allocate
+    Mem::Allow allow;
+    uint8_t buf[RX_BUF_LEN_B];
+    switch (ev.type) {
+    case UART_DATA: {
+        int read;
+        trace("UART_DATA len=%u%s", ev.size, ev.timeout_flag ? " RX TOUT" : "");
+        // Suck the RX buffer dry
+        do {
+            read = uart_read_bytes(_uart, buf, sizeof(buf), 0);
+            if (read > 0 && _streaming) {
+                onStreamData(span{buf, static_cast<size_t>(read)});
+            } else if (read > 0) {
+                uart_write_bytes(_uart, buf, read); // Echo back
+                onData(span{buf, static_cast<size_t>(read)});
+            } else if (read < 0) {
+                warn("UART read error: %d", read);
+            }
+        } while (read > 0);
+        break;
+    }
+    case UART_BREAK:
+        debug("UART_BREAK");
+        if (_streaming) {
+            stopStream();
+        }
+        break;
+    case UART_BUFFER_FULL:
+        debug("UART_BUFFER_FULL");
+        break;
+    case UART_FIFO_OVF:
+        debug("UART_FIFO_OVF");
+        break;
+    case UART_FRAME_ERR:
+        debug("UART_FRAME_ERR");
+        break;
+    case UART_PARITY_ERR:
+        debug("UART_PARITY_ERR");
+        break;
+    case UART_DATA_BREAK:
+        debug("UART_DATA_BREAK");
+        break;
+    case UART_PATTERN_DET:
+        debug("UART_PATTERN_DET");
+        break;
+    default:
+        warn("Unknown UART event type=%u len=%u", static_cast<unsigned int>(ev.type), ev.size);
+    }
+}
+
 void UshImpl::run() {
     uart_event_t ev;
-    uint8_t buf[RX_BUF_LEN_B];
     while (true) {
-        if (pdTRUE != xQueueReceive(_evq, &ev, portMAX_DELAY)) {
+        // Poll while streaming to keep up with the conversions
+        const TickType_t wait = _streaming ? STREAM_POLL : portMAX_DELAY;
+        if (pdTRUE == xQueueReceive(_evq, &ev, wait)) {
+            onEvent(ev);
+        } else if (!_streaming) {
             warn("Queue timeout");
-            continue;
-        }
-        switch (ev.type) {
-        case UART_DATA: {
-            int read;
-            trace("UART_DATA len=%u%s", ev.size, ev.timeout_flag ? " RX TOUT" : "");
-            // Suck the RX buffer dry
-            do {
-                read = uart_read_bytes(_uart, buf, sizeof(buf), 0);
-                if (read > 0) {
-                    uart_write_bytes(_uart, buf, read); // Echo back
-                    onData(span{buf, static_cast<size_t>(read)});
-                } else if (read < 0) {
-                    warn("UART read error: %d", read);
-                }
-            } while (read > 0);
-            break;
         }
-        case UART_BREAK:
-            debug("UART_BREAK");
-            break;
-        case UART_BUFFER_FULL:
-            debug("UART_BUFFER_FULL");
-            break;
-        case UART_FIFO_OVF:
-            debug("UART_FIFO_OVF");
-            break;
-        case UART_FRAME_ERR:
-            debug("UART_FRAME_ERR");
-            break;
-        case UART_PARITY_ERR:
-            debug("UART_PARITY_ERR");
-            break;
-        case UART_DATA_BREAK:
-            debug("UART_DATA_BREAK");
-            break;
-        case UART_PATTERN_DET:
-            debug("UART_PATTERN_DET");
-            break;
-        default:
-            warn("Unknown UART event type=%u len=%u", static_cast<unsigned int>(ev.type), ev.size);
+        if (_streaming) {
+            pumpStream();
         }
     }
 }
 
-unique_ptr<Ush> Ush::create(Bosun& bosun) {
-    return make_unique<UshImpl>(bosun);
+unique_ptr<Ush> Ush::create(Bosun& bosun, Hx711& loadSensor) {
+    return make_unique<UshImpl>(bosun, loadSensor);
 }
 
 
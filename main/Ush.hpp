@@ -9,13 +9,24 @@
 
 namespace beegram {
 
-class Bosun;
+class Bosun; class Hx711;
 
 class Ush {
 public:
     using Hnd = std::unique_ptr<Ush>;
+    /**
+     * Install the UART driver and start the shell task
+     * @param uart UART of the shell
+     * @return True on success; false on failure
+    */
     virtual bool start(uart_port_t uart) = 0;
-    static Hnd create(Bosun& bosun);
+
+    /**
+     * Create the shell
+     * @param bosun Executes the commands
+     * @param loadSensor Source of the "stream" command
+    */
+    static Hnd create(Bosun& bosun, Hx711& loadSensor);
 };
 
 } // namespace
@@ -0,0 +1,424 @@
+#include "Web.hpp"
+#include "Log.hpp"
+#include "Params.hpp"
+#include "Bosun.hpp"
+#include "Wifi.hpp"
+#include "Scales.hpp"
+#include "Mailbox.hpp"
+#include "Tasks.hpp"
+#include "Mem.hpp"
+#include "Co.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_http_server.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+// The page, embedded by EMBED_TXTFILES, zero terminated
+extern const char indexHtmlStart[] asm("_binary_index_html_start");
+extern const char indexHtmlEnd[] asm("_binary_index_html_end");
+
+namespace beegram {
+
+class WebImpl : public Web {
+public:
+    WebImpl(Param& param, Bosun& bosun, Wifi& wifi, Co::Executor& executor, Scales& scales, Mailbox& scalesOwner)
+    : _param(param), _bosun(bosun), _wifi(wifi), _executor(executor), _scales(scales), _scalesOwner(scalesOwner),
+        _wake(executor)
+    {}
+    virtual bool init() override;
+    virtual void feed(int64_t timeUs, float weightKg) override;
+    virtual void onEvent(const Detector::Event& ev) override;
+private:
+    /// WebSocket clients, one more socket serves the page and requests
+    static constexpr size_t MAX_CLIENTS = 4;
+    static constexpr size_t MAX_SOCKETS = MAX_CLIENTS + 1;
+    /// A client which can't take a push in this time is closed
+    static constexpr uint16_t SEND_TIMEOUT_S = 1;
+    static constexpr size_t EVENT_QUEUE_LEN = 8;
+    static constexpr size_t MAX_EVENTS_PER_PUSH = 4;
+    static constexpr size_t FRAME_MAX_LEN = 512;
+    static constexpr size_t QUERY_MAX_LEN = 128;
+    static constexpr float FILTER_TAU_S = 2.0F;
+    static constexpr uint32_t CONNECT_TIMEOUT_MS = 10 * 1000;
+    static constexpr TickType_t LINK_RETRY = pdMS_TO_TICKS(30 * 1000);
+    static constexpr uint32_t WAKE = 1 << 0;
+
+    /// @brief Latest reading, written by acquisition
+    struct Latest {
+        int64_t timeUs;
+        float weightKg;     ///< Filtered
+        bool fresh;         ///< Not pushed yet
+    };
+
+    static esp_err_t onPage(httpd_req_t* req);
+    static esp_err_t onSocket(httpd_req_t* req);
+    static esp_err_t onTare(httpd_req_t* req);
+    static esp_err_t onCalib(httpd_req_t* req);
+    static void sendWork(void* arg);
+    Co::Task run();
+    bool startServer();
+    void stopServer();
+    void holdLink();
+    void releaseLink();
+    void push();
+    void sendAll();
+    bool checkKey(httpd_req_t* req, char* query, size_t len) const;
+    esp_err_t callScales(httpd_req_t* req, const char* what, const function<bool()>& fn);
+    void printStatus() const;
+
+    Param& _param;
+    Bosun& _bosun;
+    Wifi& _wifi;
+    Co::Executor& _executor;
+    Scales& _scales;
+    Mailbox& _scalesOwner;
+    Co::Flags _wake;
+    string _key;
+    httpd_handle_t _server = nullptr;
+    QueueHandle_t _events = nullptr;
+    portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+    Latest _latest = {};
+    atomic<bool> _enabled = false;
+    atomic<uint32_t> _rateMs = Params::WEB_RATE_MS.def;
+    bool _held = false;
+    TickType_t _lastLinkTry = 0;
+    // Frame in flight, owned by the HTTP server while _pushPending
+    atomic<bool> _pushPending = false;
+    char _frame[FRAME_MAX_LEN];
+    size_t _frameLen = 0;
+    // Statistics
+    atomic<uint32_t> _clients = 0;
+    uint32_t _pushes = 0;
+    uint32_t _skipped = 0;
+    atomic<uint32_t> _closed = 0;
+    atomic<uint32_t> _eventDrops = 0;
+};
+
+bool WebImpl::init() {
+    _events = Mem::queue(EVENT_QUEUE_LEN, sizeof(Detector::Event));
+    if (!_events) {
+        err("Fail create event queue");
+        return false;
+    }
+    _enabled = 0 != _param.get(Params::WEB_ENABLE);
+    _rateMs = _param.get(Params::WEB_RATE_MS);
+    _key = _param.get(Params::WEB_KEY);
+    _bosun.addCmd(
+        "web", Cmd(
+            "[on | off | rate ms]\n\tShow or set the local dashboard",
+            [this](const vector<string>& args) {
+                if (2 == args.size() && ("on" == args[1] || "off" == args[1])) {
+                    _enabled = "on" == args[1];
+                    _param.set(Params::WEB_ENABLE, _enabled ? 1 : 0);
+                    _wake.set(WAKE);
+                } else if (3 == args.size() && "rate" == args[1]) {
+                    uint32_t rateMs;
+                    if (!Params::parse(args[2], rateMs) || !_param.set(Params::WEB_RATE_MS, rateMs)) {
+                        err("Invalid rate [%s] ms", args[2].c_str());
+                        return;
+                    }
+                    _rateMs = rateMs;
+                } else if (1 != args.size()) {
+                    err("Invalid arguments");
+                    return;
+                }
+                printStatus();
+            }
+        )
+    );
+    return _executor.spawn("web", run());
+}
+
+void WebImpl::feed(int64_t timeUs, float weightKg) {
+    portENTER_CRITICAL(&_lock);
+    if (0 == _latest.timeUs) {
+        _latest.weightKg = weightKg;
+    } else {
+        // Readings come at any rate, so the filter goes by time
+        const float dtS = (timeUs - _latest.timeUs) / 1e6F;
+        _latest.weightKg += (weightKg - _latest.weightKg) * (1.0F - expf(-dtS / FILTER_TAU_S));
+    }
+    _latest.timeUs = timeUs;
+    _latest.fresh = true;
+    portEXIT_CRITICAL(&_lock);
+}
+
+void WebImpl::onEvent(const Detector::Event& ev) {
+    if (_enabled && pdTRUE != xQueueSend(_events, &ev, 0)) {
+        _eventDrops++;
+    }
+}
+
+Co::Task WebImpl::run() {
+    while (true) {
+        co_await _wake.wait(WAKE, _enabled ? pdMS_TO_TICKS(_rateMs) : portMAX_DELAY);
+        // Bringing the link and server up allocates
+        Mem::Allow allow;
+        if (!_enabled) {
+            stopServer();
+            releaseLink();
+            xQueueReset(_events);
+            continue;
+        }
+        holdLink();
+        if (_held && (_server || startServer())) {
+            push();
+        }
+    }
+}
+
+void WebImpl::holdLink() {
+    if (_held && _wifi.isConnected()) {
+        return;
+    }
+    if (_lastLinkTry && xTaskGetTickCount() - _lastLinkTry < LINK_RETRY) {
+        return;
+    }
+    _lastLinkTry = xTaskGetTickCount();
+    // Lost the link, or never had it
+    releaseLink();
+    _held = _wifi.connect(CONNECT_TIMEOUT_MS);
+    if (_held) {
+        _lastLinkTry = 0;
+    }
+}
+
+void WebImpl::releaseLink() {
+    if (_held) {
+        _wifi.disconnect();
+        _held = false;
+    }
+}
+
+bool WebImpl::startServer() {
+    httpd_config_t cfg = HTTPD_DEFAULT_CONFIG();
+    cfg.task_priority = Tasks::HTTPD.priority;
+    cfg.stack_size = Tasks::HTTPD.stackLenB;
+    cfg.core_id = Tasks::HTTPD.core;
+    cfg.max_open_sockets = MAX_SOCKETS;
+    cfg.send_wait_timeout = SEND_TIMEOUT_S;
+    // A new client beats a stale one
+    cfg.lru_purge_enable = true;
+    esp_err_t ret = httpd_start(&_server, &cfg);
+    if (ESP_OK != ret) {
+        err("Fail start HTTP server: %s", esp_err_to_name(ret));
+        _server = nullptr;
+        return false;
+    }
+    const httpd_uri_t uris[] = {
+        { .uri = "/", .method = HTTP_GET, .handler = onPage, .user_ctx = this,
+            .is_websocket = false, .handle_ws_control_frames = false, .supported_subprotocol = nullptr },
+        { .uri = "/ws", .method = HTTP_GET, .handler = onSocket, .user_ctx = this,
+            .is_websocket = true, .handle_ws_control_frames = false, .supported_subprotocol = nullptr },
+        { .uri = "/api/tare", .method = HTTP_POST, .handler = onTare, .user_ctx = this,
+            .is_websocket = false, .handle_ws_control_frames = false, .supported_subprotocol = nullptr },
+        { .uri = "/api/calib", .method = HTTP_POST, .handler = onCalib, .user_ctx = this,
+            .is_websocket = false, .handle_ws_control_frames = false, .supported_subprotocol = nullptr },
+    };
+    for (const auto& uri: uris) {
+        ret = httpd_register_uri_handler(_server, &uri);
+        if (ESP_OK != ret) {
+            err("Fail register %s: %s", uri.uri, esp_err_to_name(ret));
+            stopServer();
+            return false;
+        }
+    }
+    info("Dashboard up");
+    return true;
+}
+
+void WebImpl::stopServer() {
+    if (!_server) {
+        return;
+    }
+    httpd_stop(_server);
+    _server = nullptr;
+    _pushPending = false;
+    _clients = 0;
+}
+
+void WebImpl::push() {
+    if (_pushPending) {
+        // The server is still sending the last one
+        _skipped++;
+        return;
+    }
+    Latest latest;
+    portENTER_CRITICAL(&_lock);
+    latest = _latest;
+    _latest.fresh = false;
+    portEXIT_CRITICAL(&_lock);
+    size_t len = snprintf(_frame, sizeof(_frame), "{\"t\":%" PRId64, latest.timeUs / 1000);
+    if (latest.fresh) {
+        len += snprintf(&_frame[len], sizeof(_frame) - len, ",\"w\":%.3f", latest.weightKg);
+    }
+    Detector::Event ev;
+    size_t nEvents = 0;
+    // Each event is short, stop while the rest still fits
+    while (nEvents < MAX_EVENTS_PER_PUSH && len < sizeof(_frame) - 128
+        && pdTRUE == xQueueReceive(_events, &ev, 0)) {
+        len += snprintf(&_frame[len], sizeof(_frame) - len,
+            "%s{\"type\":\"%s\",\"start\":%" PRId64 ",\"detect\":%" PRId64 ",\"size\":%.3f,\"conf\":%.2f}",
+            0 == nEvents ? ",\"ev\":[" : ",", Detector::typeName(ev.type), ev.startUs / 1000, ev.detectUs / 1000,
+            ev.sizeKg, ev.confidence);
+        nEvents++;
+    }
+    if (nEvents) {
+        len += snprintf(&_frame[len], sizeof(_frame) - len, "]");
+    }
+    len += snprintf(&_frame[len], sizeof(_frame) - len, "}");
+    if (len >= sizeof(_frame)) {
+        warn("Frame too long: %u B", static_cast<unsigned>(len));
+        return;
+    }
+    _frameLen = len;
+    _pushPending = true;
+    if (ESP_OK != httpd_queue_work(_server, sendWork, this)) {
+        _pushPending = false;
+        return;
+    }
+    _pushes++;
+}
+
+void WebImpl::sendWork(void* arg) {
+    static_cast<WebImpl*>(arg)->sendAll();
+}
+
+void WebImpl::sendAll() {
+    size_t n = MAX_SOCKETS;
+    int fds[MAX_SOCKETS];
+    uint32_t clients = 0;
+    if (ESP_OK == httpd_get_client_list(_server, &n, fds)) {
+        for (size_t i = 0; i < n; i++) {
+            if (HTTPD_WS_CLIENT_WEBSOCKET != httpd_ws_get_fd_info(_server, fds[i])) {
+                continue;
+            }
+            httpd_ws_frame_t frame = {};
+            frame.final = true;
+            frame.type = HTTPD_WS_TYPE_TEXT;
+            frame.payload = reinterpret_cast<uint8_t*>(_frame);
+            frame.len = _frameLen;
+            if (ESP_OK == httpd_ws_send_frame_async(_server, fds[i], &frame)) {
+                clients++;
+            } else {
+                // Too slow or gone, don't let it hold up the others
+                httpd_sess_trigger_close(_server, fds[i]);
+                _closed++;
+            }
+        }
+    }
+    _clients = clients;
+    _pushPending = false;
+}
+
+esp_err_t WebImpl::onPage(httpd_req_t* req) {
+    httpd_resp_set_type(req, "text/html");
+    httpd_resp_set_hdr(req, "Cache-Control", "max-age=3600");
+    // Sent straight from flash, without the terminating zero
+    return httpd_resp_send(req, indexHtmlStart, indexHtmlEnd - indexHtmlStart - 1);
+}
+
+esp_err_t WebImpl::onSocket(httpd_req_t* req) {
+    if (HTTP_GET == req->method) {
+        debug("Client %d", httpd_req_to_sockfd(req));
+        return ESP_OK;
+    }
+    // Clients have nothing to say, read and drop whatever comes
+    httpd_ws_frame_t frame = {};
+    uint8_t buf[64];
+    esp_err_t ret = httpd_ws_recv_frame(req, &frame, 0);
+    if (ESP_OK != ret || 0 == frame.len) {
+        return ret;
+    }
+    if (frame.len > sizeof(buf)) {
+        return ESP_FAIL;
+    }
+    frame.payload = buf;
+    return httpd_ws_recv_frame(req, &frame, frame.len);
+}
+
+bool WebImpl::checkKey(httpd_req_t* req, char* query, size_t len) const {
+    char key[Params::WEB_KEY.maxLen + 1];
+    if (_key.empty() || ESP_OK != httpd_req_get_url_query_str(req, query, len)
+        || ESP_OK != httpd_query_key_value(query, "key", key, sizeof(key)) || _key != key) {
+        warn("Dashboard refused %s from %d", req->uri, httpd_req_to_sockfd(req));
+        return false;
+    }
+    return true;
+}
+
+esp_err_t WebImpl::callScales(httpd_req_t* req, const char* what, const function<bool()>& fn) {
+    info("Dashboard runs %s", what);
+    bool done = false;
+    if (!_scalesOwner.call([&done, &fn]() { done = fn(); })) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Busy, try again");
+    }
+    if (!done) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed, see the log");
+    }
+    httpd_resp_set_type(req, HTTPD_TYPE_JSON);
+    return httpd_resp_send(req, "{\"ok\":true}", HTTPD_RESP_USE_STRLEN);
+}
+
+esp_err_t WebImpl::onTare(httpd_req_t* req) {
+    Mem::Allow allow;
+    auto self = static_cast<WebImpl*>(req->user_ctx);
+    char query[QUERY_MAX_LEN];
+    if (!self->checkKey(req, query, sizeof(query))) {
+        return httpd_resp_send_err(req, HTTPD_403_FORBIDDEN, "Need key");
+    }
+    return self->callScales(req, "tare", [self]() { return self->_scales.saveTare(); });
+}
+
+esp_err_t WebImpl::onCalib(httpd_req_t* req) {
+    Mem::Allow allow;
+    auto self = static_cast<WebImpl*>(req->user_ctx);
+    char query[QUERY_MAX_LEN];
+    if (!self->checkKey(req, query, sizeof(query))) {
+        return httpd_resp_send_err(req, HTTPD_403_FORBIDDEN, "Need key");
+    }
+    char point[8];
+    char kg[16];
+    if (ESP_OK != httpd_query_key_value(query, "point", point, sizeof(point))
+        || ESP_OK != httpd_query_key_value(query, "kg", kg, sizeof(kg))) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Need point and kg");
+    }
+    char* end = nullptr;
+    const float weightKg = strtof(kg, &end);
+    if (end == kg || '\0' != *end) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid kg");
+    }
+    const string_view p(point);
+    if ("low" != p && "high" != p) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Point is low or high");
+    }
+    const auto at = "low" == p ? Scales::Point::LOW : Scales::Point::HIGH;
+    return self->callScales(req, "calib", [self, at, weightKg]() { return self->_scales.calibrate(at, weightKg); });
+}
+
+void WebImpl::printStatus() const {
+    printf("%s, link %s, %s, every %lu ms\n", _enabled ? "on" : "off", _held ? "held" : "down",
+        _server ? "serving" : "not serving", static_cast<unsigned long>(_rateMs.load()));
+    printf("clients %lu, pushes %lu, skipped %lu, closed %lu, events dropped %lu\n",
+        static_cast<unsigned long>(_clients.load()), static_cast<unsigned long>(_pushes),
+        static_cast<unsigned long>(_skipped), static_cast<unsigned long>(_closed.load()),
+        static_cast<unsigned long>(_eventDrops.load()));
+}
+
+Web::Hnd Web::create(Param& param, Bosun& bosun, Wifi& wifi, Co::Executor& executor, Scales& scales, Mailbox& scalesOwner) {
+    return make_unique<WebImpl>(param, bosun, wifi, executor, scales, scalesOwner);
+}
+
+} // namespace
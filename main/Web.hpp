@@ -0,0 +1,68 @@
+/**
+ * @brief Local live dashboard over HTTP and WebSocket
+*/
+
+#pragma once
+
+#include "Detector.hpp"
+#include "Co.hpp"
+
+#include <memory>
+#include <cinttypes>
+
+namespace beegram {
+
+class Param; class Bosun; class Wifi; class Scales; class Mailbox;
+
+/**
+ * Serves a page from flash which shows live weight and events, pushed over
+ * a WebSocket to each connected client at a configured rate. Acquisition
+ * only leaves the latest weight and queues events, the pushes run in the
+ * dashboard's coroutine and the HTTP server. A client which can't keep up
+ * is closed, one push is in flight at a time and later ones are skipped
+ * until it's done. While enabled the Wi-Fi link is held up.
+ *
+ * Endpoints:
+ *   GET  /                                 the dashboard
+ *   GET  /ws                               WebSocket of JSON updates
+ *   POST /api/tare?key=K                   tares the scales
+ *   POST /api/calib?key=K&point=low&kg=1.5 calibrates the low or high point
+ *
+ * The POSTs need the key of the parameter web_key and are refused while it
+ * isn't set. They run on the owner of the scales and fail with 500 if the
+ * scales do.
+*/
+class Web {
+public:
+    using Hnd = std::unique_ptr<Web>;
+    virtual ~Web() = default;
+
+    /**
+     * Register the command and start the dashboard coroutine, serving if enabled
+     * @return True on success; false on failure
+    */
+    virtual bool init() = 0;
+
+    /**
+     * Update the weight shown. Doesn't block.
+     * @param timeUs Time of the reading
+     * @param weightKg Weight of the reading
+    */
+    virtual void feed(int64_t timeUs, float weightKg) = 0;
+
+    /**
+     * Show an event. Doesn't block, dropped if the clients lag behind.
+     * @param ev The event
+    */
+    virtual void onEvent(const Detector::Event& ev) = 0;
+
+    /**
+     * Create the dashboard
+     * @param executor Runs the updates and holds the link up
+     * @param scales Tared and calibrated from the page
+     * @param scalesOwner Carries out the calls to the scales
+    */
+    static Hnd create(Param& param, Bosun& bosun, Wifi& wifi, Co::Executor& executor, Scales& scales, Mailbox& scalesOwner);
+};
+
+} // namespace
@@ -0,0 +1,415 @@
+#include "Wifi.hpp"
+#include "Log.hpp"
+#include "Params.hpp"
+#include "Bosun.hpp"
+#include "Mem.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "esp_wifi.h"
+#include "esp_netif.h"
+#include "esp_event.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+
+#include <cstring>
+#include <cstddef>
+#include <ctime>
+#include <string>
+
+using namespace std;
+
+namespace beegram {
+
+/// @brief Last association and address lease
+struct WifiCache {
+    uint32_t magic;
+    uint8_t bssid[6];
+    uint8_t channel;                ///< 0 if nothing cached
+    esp_netif_ip_info_t ip;
+    esp_netif_dns_info_t dns;
+    time_t leaseUntil;              ///< Wall clock time when the address is no longer reused
+    Wifi::Stats stats;
+    uint32_t crc;                   ///< Of everything above
+};
+
+/// Survives deep sleep and software resets, not power loss. The RTC clock
+/// keeps the wall time across both, so lease expiry works too.
+static RTC_NOINIT_ATTR WifiCache rtcCache;
+
+class WifiImpl : public Wifi {
+public:
+    WifiImpl(Param& param, Bosun& bosun)
+    : _param(param), _bosun(bosun)
+    {}
+    virtual bool init() override;
+    virtual bool isConfigured() const override { return !_ssid.empty(); }
+    virtual bool connect(uint32_t timeoutMs) override;
+    virtual void disconnect() override;
+    virtual bool isConnected() const override { return _connected; }
+    virtual bool hold() override;
+    virtual void release() override;
+    virtual Stats getStats() const override { return rtcCache.stats; }
+private:
+    enum Events : uint32_t {
+        STARTED         = 1 << 0,
+        GOT_IP          = 1 << 1,
+        DISCONNECTED    = 1 << 2,
+    };
+    static constexpr uint32_t CACHE_MAGIC = 0xBEE6F1F1;
+    static constexpr TickType_t START_TIMEOUT = pdMS_TO_TICKS(1000);
+    static constexpr uint32_t CMD_CONNECT_TIMEOUT_MS = 10 * 1000;
+
+    static void onEvent(void* arg, esp_event_base_t base, int32_t id, void* data);
+    static uint32_t cacheCrc();
+    static void seal();
+    bool start();
+    void stop();
+    bool connectLocked(uint32_t timeoutMs);
+    bool attempt(bool fast, uint32_t timeoutMs);
+    bool cacheValid() const;
+    void remember(bool newLease);
+    void forget();
+    void printStatus() const;
+
+    Param& _param;
+    Bosun& _bosun;
+    esp_netif_t* _netif = nullptr;
+    EventGroupHandle_t _evGroup = nullptr;
+    /// Serializes connects of the users, the second finds the link up
+    SemaphoreHandle_t _lock = nullptr;
+    string _ssid;
+    string _pass;
+    uint32_t _leaseS = Params::WIFI_LEASE.def;
+    bool _started = false;
+    bool _connected = false;
+    unsigned _users = 0;    ///< Successful connects not yet released
+    unsigned _holds = 0;    ///< Holds of the radio not yet released
+};
+
+const char* Wifi::pathName(Path path) {
+    switch (path) {
+        case Path::NONE:    return "none";
+        case Path::FAST:    return "fast";
+        case Path::FULL:    return "full";
+        default:            return "unknown";
+    }
+}
+
+uint32_t WifiImpl::cacheCrc() {
+    return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(&rtcCache), offsetof(WifiCache, crc));
+}
+
+void WifiImpl::seal() {
+    rtcCache.magic = CACHE_MAGIC;
+    rtcCache.crc = cacheCrc();
+}
+
+bool WifiImpl::cacheValid() const {
+    return 0 != rtcCache.channel && time(nullptr) < rtcCache.leaseUntil;
+}
+
+void WifiImpl::remember(bool newLease) {
+    wifi_ap_record_t ap;
+    if (ESP_OK != esp_wifi_sta_get_ap_info(&ap)) {
+        warn("Fail get AP info");
+        return;
+    }
+    memcpy(rtcCache.bssid, ap.bssid, sizeof(rtcCache.bssid));
+    rtcCache.channel = ap.primary;
+    if (newLease) {
+        esp_netif_get_ip_info(_netif, &rtcCache.ip);
+        esp_netif_get_dns_info(_netif, ESP_NETIF_DNS_MAIN, &rtcCache.dns);
+        rtcCache.leaseUntil = time(nullptr) + _leaseS;
+    }
+    seal();
+}
+
+void WifiImpl::forget() {
+    rtcCache.channel = 0;
+    seal();
+}
+
+void WifiImpl::onEvent(void* arg, esp_event_base_t base, int32_t id, void* data) {
+    auto* self = static_cast<WifiImpl*>(arg);
+    if (WIFI_EVENT == base && WIFI_EVENT_STA_START == id) {
+        xEventGroupSetBits(self->_evGroup, STARTED);
+    } else if (WIFI_EVENT == base && WIFI_EVENT_STA_DISCONNECTED == id) {
+        const auto* ev = static_cast<const wifi_event_sta_disconnected_t*>(data);
+        debug("Disconnected, reason %u", ev->reason);
+        self->_connected = false;
+        xEventGroupSetBits(self->_evGroup, DISCONNECTED);
+    } else if (IP_EVENT == base && IP_EVENT_STA_GOT_IP == id) {
+        xEventGroupSetBits(self->_evGroup, GOT_IP);
+    }
+}
+
+bool WifiImpl::init() {
+    if (CACHE_MAGIC != rtcCache.magic || cacheCrc() != rtcCache.crc) {
+        // Power on or corrupted, start afresh
+        memset(&rtcCache, 0, sizeof(rtcCache));
+        seal();
+    }
+    _ssid = _param.get(Params::WIFI_SSID);
+    _pass = _param.get(Params::WIFI_PASS);
+    _leaseS = _param.get(Params::WIFI_LEASE);
+    _evGroup = Mem::eventGroup();
+    _lock = Mem::mutex();
+    if (!_evGroup || !_lock) {
+        err("Fail create event group");
+        return false;
+    }
+    esp_err_t ret = esp_netif_init();
+    if (ESP_OK != ret) {
+        err("Fail init netif: %s", esp_err_to_name(ret));
+        return false;
+    }
+    ret = esp_event_loop_create_default();
+    if (ESP_OK != ret && ESP_ERR_INVALID_STATE != ret) {
+        err("Fail create event loop: %s", esp_err_to_name(ret));
+        return false;
+    }
+    _netif = esp_netif_create_default_wifi_sta();
+    if (!_netif) {
+        err("Fail create netif");
+        return false;
+    }
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ret = esp_wifi_init(&cfg);
+    if (ESP_OK != ret) {
+        err("Fail init Wi-Fi: %s", esp_err_to_name(ret));
+        return false;
+    }
+    // Configuration is ours to keep, don't wear the flash on every connect
+    esp_wifi_set_storage(WIFI_STORAGE_RAM);
+    esp_wifi_set_mode(WIFI_MODE_STA);
+    if (ESP_OK != esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, onEvent, this, nullptr)
+        || ESP_OK != esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, onEvent, this, nullptr)) {
+        err("Fail register event handlers");
+        return false;
+    }
+    _bosun.addCmd(
+        "wifi", Cmd(
+            "[set ssid [pass] | lease s | forget | up | down]\n\tShow or set Wi-Fi state and connection telemetry",
+            [this](const vector<string>& args) {
+                if (args.size() >= 3 && args.size() <= 4 && "set" == args[1]) {
+                    const string pass = (4 == args.size()) ? args[3] : "";
+                    if (!Params::WIFI_SSID.valid(args[2]) || !Params::WIFI_PASS.valid(pass)) {
+                        err("SSID or passphrase too long");
+                        return;
+                    }
+                    _ssid = args[2];
+                    _pass = pass;
+                    _param.set(Params::WIFI_SSID, _ssid);
+                    _param.set(Params::WIFI_PASS, _pass);
+                    forget();
+                    info("Set SSID [%s]", _ssid.c_str());
+                } else if (3 == args.size() && "lease" == args[1]) {
+                    uint32_t leaseS;
+                    if (!Params::parse(args[2], leaseS) || !_param.set(Params::WIFI_LEASE, leaseS)) {
+                        err("Invalid lease [%s] s", args[2].c_str());
+                        return;
+                    }
+                    _leaseS = leaseS;
+                } else if (2 == args.size() && "forget" == args[1]) {
+                    forget();
+                } else if (2 == args.size() && "up" == args[1]) {
+                    connect(CMD_CONNECT_TIMEOUT_MS);
+                } else if (2 == args.size() && "down" == args[1]) {
+                    disconnect();
+                } else if (1 != args.size()) {
+                    err("Invalid arguments");
+                    return;
+                }
+                printStatus();
+            }
+        )
+    );
+    return true;
+}
+
+bool WifiImpl::start() {
+    if (_started) {
+        return true;
+    }
+    xEventGroupClearBits(_evGroup, STARTED);
+    esp_err_t ret = esp_wifi_start();
+    if (ESP_OK != ret) {
+        err("Fail start Wi-Fi: %s", esp_err_to_name(ret));
+        return false;
+    }
+    if (!(xEventGroupWaitBits(_evGroup, STARTED, pdTRUE, pdFALSE, START_TIMEOUT) & STARTED)) {
+        err("Timeout on Wi-Fi start");
+        return false;
+    }
+    _started = true;
+    return true;
+}
+
+bool WifiImpl::attempt(bool fast, uint32_t timeoutMs) {
+    wifi_config_t cfg = {};
+    strncpy(reinterpret_cast<char*>(cfg.sta.ssid), _ssid.c_str(), sizeof(cfg.sta.ssid));
+    strncpy(reinterpret_cast<char*>(cfg.sta.password), _pass.c_str(), sizeof(cfg.sta.password));
+    esp_err_t ret;
+    if (fast) {
+        // Probe only the known channel for the known AP, and skip DHCP. With
+        // the client stopped and an address set, esp_netif raises GOT_IP as
+        // soon as the link is up.
+        cfg.sta.scan_method = WIFI_FAST_SCAN;
+        cfg.sta.bssid_set = true;
+        memcpy(cfg.sta.bssid, rtcCache.bssid, sizeof(cfg.sta.bssid));
+        cfg.sta.channel = rtcCache.channel;
+        ret = esp_netif_dhcpc_stop(_netif);
+        if (ESP_OK != ret && ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED != ret) {
+            err("Fail stop DHCP: %s", esp_err_to_name(ret));
+            return false;
+        }
+        esp_netif_dns_info_t dns = rtcCache.dns;
+        if (ESP_OK != esp_netif_set_ip_info(_netif, &rtcCache.ip)
+            || ESP_OK != esp_netif_set_dns_info(_netif, ESP_NETIF_DNS_MAIN, &dns)) {
+            err("Fail set static address");
+            return false;
+        }
+    } else {
+        cfg.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+        cfg.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+        ret = esp_netif_dhcpc_start(_netif);
+        if (ESP_OK != ret && ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED != ret) {
+            err("Fail start DHCP: %s", esp_err_to_name(ret));
+            return false;
+        }
+    }
+    ret = esp_wifi_set_config(WIFI_IF_STA, &cfg);
+    if (ESP_OK != ret) {
+        err("Fail set Wi-Fi config: %s", esp_err_to_name(ret));
+        return false;
+    }
+    xEventGroupClearBits(_evGroup, GOT_IP | DISCONNECTED);
+    ret = esp_wifi_connect();
+    if (ESP_OK != ret) {
+        err("Fail connect: %s", esp_err_to_name(ret));
+        return false;
+    }
+    const EventBits_t evts = xEventGroupWaitBits(_evGroup, GOT_IP | DISCONNECTED, pdTRUE, pdFALSE, pdMS_TO_TICKS(timeoutMs));
+    if (evts & GOT_IP) {
+        _connected = true;
+        return true;
+    }
+    warn("Fail %s connect: %s", fast ? "fast" : "full", (evts & DISCONNECTED) ? "disconnected" : "timeout");
+    esp_wifi_disconnect();
+    return false;
+}
+
+bool WifiImpl::connect(uint32_t timeoutMs) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    const bool ret = connectLocked(timeoutMs);
+    xSemaphoreGive(_lock);
+    return ret;
+}
+
+bool WifiImpl::connectLocked(uint32_t timeoutMs) {
+    if (!isConfigured()) {
+        debug("No SSID configured");
+        return false;
+    }
+    if (_connected) {
+        _users++;
+        return true;
+    }
+    Stats& st = rtcCache.stats;
+    const int64_t startUs = esp_timer_get_time();
+    bool ret = start();
+    Path path = Path::FULL;
+    if (ret && cacheValid()) {
+        if (attempt(true, timeoutMs)) {
+            path = Path::FAST;
+            st.fastHits++;
+        } else {
+            // AP moved or went away, don't try the stale entry again
+            st.fastMisses++;
+            forget();
+        }
+    }
+    if (ret && Path::FULL == path) {
+        ret = attempt(false, timeoutMs);
+    }
+    if (!ret) {
+        st.failures++;
+        seal();
+        if (0 == _users) {
+            stop();
+        }
+        return false;
+    }
+    st.lastPath = path;
+    st.lastConnectMs = static_cast<uint32_t>((esp_timer_get_time() - startUs) / 1000);
+    // Address from the fast path is the cached one, keep its expiry
+    remember(Path::FULL == path);
+    _users++;
+    info("Connected in %lu ms (%s)", static_cast<unsigned long>(st.lastConnectMs), pathName(path));
+    return true;
+}
+
+void WifiImpl::disconnect() {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    if (0 == _users || 0 == --_users) {
+        stop();
+    }
+    xSemaphoreGive(_lock);
+}
+
+bool WifiImpl::hold() {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    const bool ret = start();
+    if (ret) {
+        _holds++;
+    }
+    xSemaphoreGive(_lock);
+    return ret;
+}
+
+void WifiImpl::release() {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    if (_holds > 0 && 0 == --_holds && 0 == _users) {
+        stop();
+    }
+    xSemaphoreGive(_lock);
+}
+
+void WifiImpl::stop() {
+    if (!_started) {
+        return;
+    }
+    _connected = false;
+    esp_wifi_disconnect();
+    if (_holds > 0) {
+        // Radio stays on for ESP-NOW
+        return;
+    }
+    esp_wifi_stop();
+    _started = false;
+}
+
+void WifiImpl::printStatus() const {
+    const Stats& st = rtcCache.stats;
+    printf("ssid [%s] %s, %u users, %u holds\n", _ssid.c_str(), _connected ? "connected" : "disconnected", _users, _holds);
+    if (cacheValid()) {
+        const uint8_t* b = rtcCache.bssid;
+        printf("cached %02x:%02x:%02x:%02x:%02x:%02x ch %u ip " IPSTR " for %ld s\n",
+            b[0], b[1], b[2], b[3], b[4], b[5], rtcCache.channel, IP2STR(&rtcCache.ip.ip),
+            static_cast<long>(rtcCache.leaseUntil - time(nullptr)));
+    } else {
+        printf("nothing cached\n");
+    }
+    printf("last %s %lu ms, fast %lu, fallback %lu, fail %lu\n", pathName(st.lastPath),
+        static_cast<unsigned long>(st.lastConnectMs), static_cast<unsigned long>(st.fastHits),
+        static_cast<unsigned long>(st.fastMisses), static_cast<unsigned long>(st.failures));
+}
+
+Wifi::Hnd Wifi::create(Param& param, Bosun& bosun) {
+    return make_unique<WifiImpl>(param, bosun);
+}
+
+} // namespace
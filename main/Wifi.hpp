@@ -0,0 +1,83 @@
+/**
+ * @brief Wi-Fi station connectivity manager
+*/
+
+#pragma once
+
+#include <memory>
+#include <cinttypes>
+
+namespace beegram {
+
+class Param; class Bosun;
+
+/**
+ * Brings the station link up on demand and down again to save power. Users
+ * pair every successful connect with a disconnect, the radio goes off when
+ * the last one disconnects and nobody holds it for ESP-NOW. The
+ * access point and IP lease of the last connection are kept in RTC memory,
+ * so the next connect after sleep or restart goes straight to the known
+ * channel and BSSID with a static address. A full scan and DHCP are used
+ * only when that fails.
+*/
+class Wifi {
+public:
+    using Hnd = std::unique_ptr<Wifi>;
+    /// @brief How a connection was made
+    enum class Path : uint8_t {
+        NONE,   ///< Not connected yet
+        FAST,   ///< Directed connect to cached access point, cached address
+        FULL,   ///< Full scan and DHCP
+    };
+    /// @brief Connection telemetry, kept across sleep
+    struct Stats {
+        Path lastPath;          ///< Path of the latest connection
+        uint32_t lastConnectMs; ///< Time to connected of the latest connection
+        uint32_t fastHits;      ///< Connections made on the fast path
+        uint32_t fastMisses;    ///< Fast path attempts that fell back to a full scan
+        uint32_t failures;      ///< Connect attempts that failed altogether
+    };
+    virtual ~Wifi() = default;
+
+    /**
+     * Initialize the network stack and the Wi-Fi driver. The radio stays off.
+     * @return True on success; false on failure
+    */
+    virtual bool init() = 0;
+
+    /// @return True if credentials are configured
+    virtual bool isConfigured() const = 0;
+
+    /**
+     * Connect to the configured network and obtain an address, unless
+     * already connected. Blocks.
+     * @param timeoutMs Maximum time to wait for each path
+     * @return True if connected; false otherwise
+    */
+    virtual bool connect(uint32_t timeoutMs) = 0;
+
+    /// @brief Release a connection, the last one turns the radio off
+    virtual void disconnect() = 0;
+
+    /// @return True if connected
+    virtual bool isConnected() const = 0;
+
+    /**
+     * Keep the radio on without connecting, e.g. for ESP-NOW. Pair every
+     * successful hold with a release.
+     * @return True if the radio is on; false on failure
+    */
+    virtual bool hold() = 0;
+
+    /// @brief Release the radio, it goes off unless connected or held
+    virtual void release() = 0;
+
+    /// @return Connection telemetry
+    virtual Stats getStats() const = 0;
+
+    static const char* pathName(Path path);
+
+    static Hnd create(Param& param, Bosun& bosun);
+};
+
+} // namespace
@@ -9,6 +9,8 @@ namespace beegram {
 
 using namespace std;
 
+portMUX_TYPE Gpio::outLock = portMUX_INITIALIZER_UNLOCKED;
+
 static gpio_int_type_t intrTrigToIdf(Gpio::IntrTrig trig) {
     switch (trig) {
         case Gpio::IntrTrig::DISABLED:  return GPIO_INTR_DISABLE;
@@ -126,7 +128,9 @@ bool GpioImpl::config(Way way, OutMode outMode, Pull pull) {
 }
 
 bool GpioImpl::set(bool value) {
+    portENTER_CRITICAL(&outLock);
     esp_err_t ret = gpio_set_level(static_cast<gpio_num_t>(_pin), value ? 1 : 0);
+    portEXIT_CRITICAL(&outLock);
     if (ESP_OK == ret) {
         _set_value = value;
         return true;
@@ -159,7 +163,8 @@ Interrupt::Hnd GpioImpl::addIsr(const Interrupt::Isr& isr, IntrTrig type) {
         return nullptr;
     }
     ret = gpio_install_isr_service(ESP_INTR_FLAG_LOWMED);
-    if (ESP_OK != ret) {
+    // Already installed for another pin
+    if (ESP_OK != ret && ESP_ERR_INVALID_STATE != ret) {
         err("Fail install per-pin ISR service: %u %s", ret, esp_err_to_name(ret));
         return nullptr;
     }
@@ -10,6 +10,8 @@
 
 #include "Interrupt.hpp"
 
+#include "freertos/FreeRTOS.h"
+
 namespace beegram {
 
 /**
@@ -47,6 +49,9 @@ public:
         HIGH
     };
 
+    /// @brief Taken while writing output levels, as GpioBank writes the output registers whole
+    static portMUX_TYPE outLock;
+
     /// @brief Mandatory virtual destructor
     virtual ~Gpio() = default;
 
@@ -0,0 +1,97 @@
+#include "GpioBank.hpp"
+#include "Log.hpp"
+
+#include "driver/gpio.h"
+#include "soc/gpio_struct.h"
+
+#include <cassert>
+
+namespace beegram {
+
+using namespace std;
+
+class GpioBankImpl : public GpioBank {
+public:
+    GpioBankImpl(initializer_list<Gpio::Pin> pins, Gpio::OutMode outMode)
+    : _outMode(outMode)
+    {
+        for (const Gpio::Pin pin: pins) {
+            assert(GPIO_IS_VALID_OUTPUT_GPIO(static_cast<int>(pin)));
+            _pinMask |= 1ULL << pin;
+            _pins[_count++] = pin;
+        }
+    }
+    virtual bool config() override;
+    virtual void write(Bits mask, Bits levels) override;
+    virtual Bits getLevels() const override { return _levels; }
+    virtual size_t size() const override { return _count; }
+    virtual Gpio::Pin getPin(size_t i) const override { return _pins[i]; }
+private:
+    /// @return Physical pins of the bits in mask, bit per GPIO number
+    uint64_t toPins(Bits mask) const;
+
+    const Gpio::OutMode _outMode;
+    Gpio::Pin _pins[MAX_PINS] = {};
+    size_t _count = 0;
+    uint64_t _pinMask = 0;
+    Bits _levels = 0;
+};
+
+uint64_t GpioBankImpl::toPins(Bits mask) const {
+    uint64_t pins = 0;
+    for (size_t i = 0; i < _count; i++) {
+        if (mask & (1UL << i)) {
+            pins |= 1ULL << _pins[i];
+        }
+    }
+    return pins;
+}
+
+bool GpioBankImpl::config() {
+    gpio_config_t iocfg = {};
+    iocfg.pin_bit_mask = _pinMask;
+    iocfg.mode = Gpio::OutMode::PUSH_PULL == _outMode ? GPIO_MODE_OUTPUT : GPIO_MODE_OUTPUT_OD;
+    iocfg.pull_up_en = GPIO_PULLUP_DISABLE;
+    iocfg.pull_down_en = GPIO_PULLDOWN_DISABLE;
+    iocfg.intr_type = GPIO_INTR_DISABLE;
+    // Also routes the pins back from any peripheral
+    const esp_err_t ret = gpio_config(&iocfg);
+    if (ESP_OK != ret) {
+        err("Fail GPIO bank config: %u %s", ret, esp_err_to_name(ret));
+        return false;
+    }
+    write(static_cast<Bits>((1ULL << _count) - 1), _levels);
+    return true;
+}
+
+void GpioBankImpl::write(Bits mask, Bits levels) {
+    const uint64_t pins = toPins(mask);
+    const uint64_t high = toPins(mask & levels);
+    const uint32_t pins0 = static_cast<uint32_t>(pins);
+    const uint32_t pins1 = static_cast<uint32_t>(pins >> 32);
+    // One write per register, other pins are written back as read. The lock
+    // keeps Gpio from changing any of them in between, e.g. on the other core.
+    portENTER_CRITICAL(&Gpio::outLock);
+    if (pins0) {
+        GPIO.out = (GPIO.out & ~pins0) | static_cast<uint32_t>(high);
+    }
+    if (pins1) {
+        GPIO.out1.val = (GPIO.out1.val & ~pins1) | static_cast<uint32_t>(high >> 32);
+    }
+    _levels = (_levels & ~mask) | (levels & mask);
+    portEXIT_CRITICAL(&Gpio::outLock);
+}
+
+GpioBank::Hnd GpioBank::create(initializer_list<Gpio::Pin> pins, Gpio::OutMode outMode) {
+    if (0 == pins.size() || pins.size() > MAX_PINS) {
+        err("Invalid GPIO bank of %u pins", static_cast<unsigned>(pins.size()));
+        return nullptr;
+    }
+    auto bank = make_unique<GpioBankImpl>(pins, outMode);
+    if (!bank->config()) {
+        return nullptr;
+    }
+    return bank;
+}
+
+} // namespace
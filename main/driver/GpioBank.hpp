@@ -0,0 +1,64 @@
+/**
+ * @brief Driver for a group of GPIO outputs set together
+*/
+
+#pragma once
+
+#include "Gpio.hpp"
+
+#include <memory>
+#include <cinttypes>
+#include <cstddef>
+#include <initializer_list>
+
+namespace beegram {
+
+/**
+ * Output pins updated with one write of the output register: all pins
+ * written change together, instead of one call per pin. Pins 32 and up are
+ * in a second register, written right after. Other pins are written back
+ * as read under Gpio::outLock, which Gpio takes too, so pins of other
+ * drivers, e.g. the clock of Hx711 on the other core, aren't disturbed.
+ * Use from one task at a time.
+*/
+class GpioBank {
+public:
+    using Hnd = std::unique_ptr<GpioBank>;
+    /// @brief Bit i stands for the i-th pin given to create()
+    using Bits = uint32_t;
+    static constexpr size_t MAX_PINS = 8;
+    virtual ~GpioBank() = default;
+
+    /**
+     * Configure the pins as outputs of the bank at the levels last written,
+     * e.g. to take them back from a peripheral such as LEDC
+     * @return True on success; false on failure
+    */
+    virtual bool config() = 0;
+
+    /**
+     * Set output levels
+     * @param mask Pins to set
+     * @param levels Levels of the pins in mask, bit set for high
+    */
+    virtual void write(Bits mask, Bits levels) = 0;
+
+    /// @return Levels last written, bit set for high
+    virtual Bits getLevels() const = 0;
+
+    /// @return Number of pins
+    virtual size_t size() const = 0;
+
+    /// @return Physical pin of bit i
+    virtual Gpio::Pin getPin(size_t i) const = 0;
+
+    /**
+     * Configure pins as outputs, all low
+     * @param pins Physical pins, at most MAX_PINS
+     * @param outMode Output mode of all pins
+     * @return Bank; null on failure
+    */
+    static Hnd create(std::initializer_list<Gpio::Pin> pins, Gpio::OutMode outMode = Gpio::OutMode::PUSH_PULL);
+};
+
+} // namespace
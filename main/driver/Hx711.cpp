@@ -1,10 +1,19 @@
 #include "Hx711.hpp"
 #include "Gpio.hpp"
 #include "Log.hpp"
+#include "Tasks.hpp"
+#include "Mem.hpp"
+#include "Clock.hpp"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_cpu.h"
+
+#include <atomic>
 
 namespace beegram {
 
@@ -14,44 +23,131 @@ namespace beegram {
 class Hx711Impl : public Hx711 {
 public:
     enum Events : uint32_t {
-        SAMPLE_READY = 1 << 0,
+        SAMPLE_READY  = 1 << 0,
+        POWER_DOWN    = 1 << 1,  ///< Request to power down
+        POWER_UP      = 1 << 2,  ///< Request to power up
+        POWER_DONE    = 1 << 3,  ///< Power request has been carried out
+        MODE_CHANGE   = 1 << 4,  ///< Request to change conversion mode
+        SETTLE_START  = 1 << 5,  ///< Request to average settled conversions
+        SETTLE_CANCEL = 1 << 6,  ///< Caller of readSettled() gave up
+        SETTLE_DONE   = 1 << 7,  ///< Average of settled conversions is ready
+        INTERLEAVE    = 1 << 8,  ///< Request to change channel schedule
+        STATS_RESET   = 1 << 9,  ///< Request to restart counters
+        TAP_CHANGE    = 1 << 10, ///< Request to install or remove tap
     };
-    static constexpr size_t TASK_STACK_LEN_B = 4 * 1024;
-    static constexpr unsigned TASK_PRIORITY = tskIDLE_PRIORITY + 2;
+    static constexpr size_t SAMPLE_QUEUE_LEN = 16;
+    static constexpr TickType_t POWER_TIMEOUT = pdMS_TO_TICKS(100);
+    /// Output settling time is 400 ms at 10 SPS and 50 ms at 80 SPS, four
+    /// conversion periods either way. Applies after power up, channel and
+    /// gain change.
+    static constexpr unsigned SETTLE_CONVERSIONS = 4;
+    /// Upper bound for a conversion period (10 SPS) with some margin
+    static constexpr uint32_t CONVERSION_TIMEOUT_MS = 150;
 
     Hx711Impl() = default;
     virtual bool init(unsigned int pinDout, unsigned int pinSck, Mode mode) override;
     virtual bool isReady() override;
     virtual int read() override;
+    virtual bool waitSample(Sample& sample, uint32_t timeoutMs) override;
+    virtual bool powerDown() override;
+    virtual bool powerUp() override;
+    virtual bool setMode(Mode mode) override;
+    virtual Mode getMode() const override { return _primary; }
+    virtual bool setInterleave(unsigned countA, unsigned countB) override;
+    virtual Stats getStats() const override;
+    virtual bool resetStats() override;
+    virtual std::optional<int> readSettled(unsigned n) override;
+    virtual bool setTap(const Tap& tap) override;
 private:
+    static Channel channelOf(Mode mode) { return Mode::CH_B_GN32 == mode ? Channel::B : Channel::A; }
     void run();
+    void readConversion();
     bool sample(int* sampleOut);
+    bool requestPower(Events request);
+    void applyPower();
+    void schedule(Channel delivered);
+    void clearStats();
+    void publishStats();
+    void countInterval(int64_t now);
+    void countLatency(int64_t edgeUs, int64_t now);
+    void enqueue(const Sample& s);
+    void settle(int raw);
     Gpio::Hnd _dout = nullptr;
     Gpio::Hnd _sck = nullptr;
-    Mode _mode = Mode::NONE;
     EventGroupHandle_t _evGroup = nullptr;
+    QueueHandle_t _samples = nullptr;
+    SemaphoreHandle_t _settleLock = nullptr;
     Interrupt::Hnd _intr = nullptr;
-    int _lastSample = 0;
+    /// Stamp of the latest data ready edge, taken by the ISR
+    volatile uint32_t _edgeStamp = 0;
+    /// Read by other tasks
+    std::atomic<int> _lastSample = 0;
+    std::atomic<unsigned> _lastCountB = 0;  ///< Copy of _countB
+    /// Copy of _stats, 64-bit counters can't be read whole across tasks
+    mutable portMUX_TYPE _statsLock = portMUX_INITIALIZER_UNLOCKED;
+    Stats _lastStats = {};
+    // Requests from other tasks
+    Mode _nextPrimary = Mode::NONE;
+    unsigned _nextCountA = 1;
+    unsigned _nextCountB = 0;
+    Tap _nextTap;
+    // Settled read requests, written under _settleLock
+    uint32_t _settleSeq = 0;        ///< Id of the latest request
+    unsigned _nextSettleWant = 0;
+    uint32_t _cancelId = 0;         ///< Request given up by its caller
+    // Conversion schedule, owned by the driver task
+    Mode _primary = Mode::NONE;     ///< Mode of channel A, or only mode if not interleaving
+    Mode _mode = Mode::NONE;        ///< Mode clocked for the next conversion
+    Mode _convMode = Mode::NONE;    ///< Mode of the conversion waiting to be read
+    unsigned _countA = 1;
+    unsigned _countB = 0;
+    Channel _phase = Channel::A;    ///< Channel currently scheduled
+    unsigned _phaseCount = 0;       ///< Conversions delivered in current phase
+    unsigned _discard = 0;          ///< Number of conversions to discard
+    Stats _stats = {};
+    int64_t _lastConvUs = 0;        ///< When the previous conversion was read, 0 after power up
+    // Power state, owned by the driver task
+    bool _poweredUp = true;
+    bool _wantUp = true;        ///< Power state requested by powerUp()/powerDown()
+    unsigned _holds = 0;        ///< Settled reads and tap keeping the chip powered
+    Tap _tap;                   ///< Owned by the driver task
+    // Settled read in progress, owned by the driver task
+    uint32_t _settleId = 0;
+    unsigned _settleWant = 0;
+    unsigned _settleGot = 0;
+    int64_t _settleSum = 0;
+    // Result of a settled read, valid with SETTLE_DONE
+    uint32_t _resultId = 0;
+    int _settleResult = 0;
 };
 
 bool Hx711Impl::init(unsigned int pinDout, unsigned int pinSck, Mode mode) {
     _dout = Gpio::create(pinDout, Gpio::Way::IN, Gpio::OutMode::PUSH_PULL, Gpio::Pull::NONE);
     _sck = Gpio::create(pinSck, Gpio::Way::OUT, Gpio::OutMode::PUSH_PULL, Gpio::Pull::NONE);
-    _mode = mode;
-    _evGroup = xEventGroupCreate();
-    if (!_dout || !_sck || Mode::NONE == _mode || !_evGroup) {
+    _primary = _nextPrimary = _mode = mode;
+    // Chip comes out of reset in channel A, gain 128
+    _convMode = Mode::CH_A_GN128;
+    _discard = SETTLE_CONVERSIONS;
+    clearStats();
+    publishStats();
+    _evGroup = Mem::eventGroup();
+    _samples = Mem::queue(SAMPLE_QUEUE_LEN, sizeof(Sample));
+    _settleLock = Mem::mutex();
+    if (!_dout || !_sck || Mode::NONE == _mode || !_evGroup || !_samples || !_settleLock) {
         return false;
     }
     // Create worker thread
     auto runTask = [](void* arg) {
         assert(arg); static_cast<Hx711Impl*>(arg)->run();
     };
-    BaseType_t ret = xTaskCreate(runTask, "Hx711", TASK_STACK_LEN_B, this, TASK_PRIORITY, nullptr);
-    if (pdPASS != ret) {
+    if (!Tasks::spawn(Tasks::HX711, runTask, this)) {
         return false;
     }
-    // Set up interrupt on sample ready
+    // Set up interrupt on sample ready. The GPIO ISR service allocates the
+    // interrupt on the calling core, so call from the acquisition core.
     auto onReady = [this]() {
+        // The task may wake much later, the conversion was made now
+        _edgeStamp = Clock::stamp();
         BaseType_t highTask = 0;
         BaseType_t ret = xEventGroupSetBitsFromISR(_evGroup, Hx711Impl::SAMPLE_READY, &highTask);
         if (pdFAIL != ret) {
@@ -75,6 +171,205 @@ int Hx711Impl::read() {
     return _lastSample;
 }
 
+bool Hx711Impl::waitSample(Sample& sample, uint32_t timeoutMs) {
+    assert(_samples);
+    return pdTRUE == xQueueReceive(_samples, &sample, pdMS_TO_TICKS(timeoutMs));
+}
+
+bool Hx711Impl::requestPower(Events request) {
+    // Pins are owned by the driver task, so it carries out the request
+    xEventGroupClearBits(_evGroup, POWER_DONE);
+    xEventGroupSetBits(_evGroup, request);
+    EventBits_t evts = xEventGroupWaitBits(_evGroup, POWER_DONE, pdTRUE, pdFALSE, POWER_TIMEOUT);
+    if (!(evts & POWER_DONE)) {
+        err("Timeout on power request 0x%lX", static_cast<unsigned long>(request));
+        return false;
+    }
+    return true;
+}
+
+bool Hx711Impl::setTap(const Tap& tap) {
+    // A tap holds power, so it's carried out like a power request
+    _nextTap = tap;
+    return requestPower(TAP_CHANGE);
+}
+
+bool Hx711Impl::powerDown() {
+    return requestPower(POWER_DOWN);
+}
+
+bool Hx711Impl::powerUp() {
+    return requestPower(POWER_UP);
+}
+
+bool Hx711Impl::setMode(Mode mode) {
+    if (Mode::NONE == mode || (_nextCountB > 0 && Channel::B == channelOf(mode))) {
+        return false;
+    }
+    _nextPrimary = mode;
+    xEventGroupSetBits(_evGroup, MODE_CHANGE);
+    return true;
+}
+
+bool Hx711Impl::setInterleave(unsigned countA, unsigned countB) {
+    if (0 == countA || (countB > 0 && Channel::B == channelOf(_nextPrimary))) {
+        return false;
+    }
+    _nextCountA = countA;
+    _nextCountB = countB;
+    xEventGroupSetBits(_evGroup, INTERLEAVE);
+    return true;
+}
+
+Hx711::Stats Hx711Impl::getStats() const {
+    portENTER_CRITICAL(&_statsLock);
+    const Stats stats = _lastStats;
+    portEXIT_CRITICAL(&_statsLock);
+    return stats;
+}
+
+bool Hx711Impl::resetStats() {
+    xEventGroupSetBits(_evGroup, STATS_RESET);
+    return true;
+}
+
+std::optional<int> Hx711Impl::readSettled(unsigned n) {
+    if (0 == n) {
+        return std::nullopt;
+    }
+    xSemaphoreTake(_settleLock, portMAX_DELAY);
+    // The driver takes the request when it handles SETTLE_START, not before
+    const uint32_t id = ++_settleSeq;
+    _nextSettleWant = n;
+    xEventGroupClearBits(_evGroup, SETTLE_DONE);
+    xEventGroupSetBits(_evGroup, SETTLE_START);
+    // Interleaved channel B conversions and their settling stretch the wait
+    const unsigned countB = _lastCountB;
+    const unsigned periods = (n + SETTLE_CONVERSIONS + 1) * (countB > 0 ? 2 + countB + 2 * SETTLE_CONVERSIONS : 1);
+    const TickType_t timeout = pdMS_TO_TICKS(periods * CONVERSION_TIMEOUT_MS) + POWER_TIMEOUT;
+    const TickType_t start = xTaskGetTickCount();
+    std::optional<int> result = std::nullopt;
+    while (!result) {
+        const TickType_t waited = xTaskGetTickCount() - start;
+        if (waited >= timeout) {
+            err("Timeout on settled read of %u", n);
+            _cancelId = id;
+            xEventGroupSetBits(_evGroup, SETTLE_CANCEL);
+            break;
+        }
+        const EventBits_t evts = xEventGroupWaitBits(_evGroup, SETTLE_DONE, pdTRUE, pdFALSE, timeout - waited);
+        // A read given up before may finish after this one was requested
+        if ((evts & SETTLE_DONE) && id == _resultId) {
+            result = _settleResult;
+        }
+    }
+    xSemaphoreGive(_settleLock);
+    return result;
+}
+
+void Hx711Impl::applyPower() {
+    const bool up = _wantUp || _holds > 0;
+    if (up == _poweredUp) {
+        return;
+    }
+    bool ret;
+    if (up) {
+        // Chip resets to channel A, gain 128 on power up
+        xQueueReset(_samples);
+        _sck->set(false);
+        _poweredUp = true;
+        _convMode = Mode::CH_A_GN128;
+        _discard = SETTLE_CONVERSIONS;
+        _phase = Channel::A;
+        _phaseCount = 0;
+        _mode = _primary;
+        _lastConvUs = 0;
+        ret = _intr->enable();
+        debug("Powered up");
+    } else {
+        // Interrupt stays off while powered down, so the task sleeps
+        // until powered up again. SCK high for over 60 us powers down.
+        ret = _intr->disable();
+        _sck->set(true);
+        _poweredUp = false;
+        debug("Powered down");
+    }
+    assert(ret);
+}
+
+void Hx711Impl::schedule(Channel delivered) {
+    if (0 == _countB) {
+        _mode = _primary;
+        return;
+    }
+    const unsigned runLen = (Channel::A == _phase) ? _countA : _countB;
+    if (delivered == _phase && ++_phaseCount >= runLen) {
+        _phase = (Channel::A == _phase) ? Channel::B : Channel::A;
+        _phaseCount = 0;
+    }
+    _mode = (Channel::A == _phase) ? _primary : Mode::CH_B_GN32;
+}
+
+void Hx711Impl::clearStats() {
+    _stats = {};
+    _stats.sinceUs = esp_timer_get_time();
+}
+
+void Hx711Impl::publishStats() {
+    portENTER_CRITICAL(&_statsLock);
+    _lastStats = _stats;
+    portEXIT_CRITICAL(&_statsLock);
+}
+
+void Hx711Impl::countInterval(int64_t now) {
+    if (0 != _lastConvUs) {
+        const int64_t interval = now - _lastConvUs;
+        if (0 == _stats.intervals || interval < _stats.intervalMinUs) {
+            _stats.intervalMinUs = interval;
+        }
+        if (interval > _stats.intervalMaxUs) {
+            _stats.intervalMaxUs = interval;
+        }
+        _stats.intervals++;
+        _stats.intervalSumUs += interval;
+        _stats.intervalSqSumUs += static_cast<uint64_t>(interval * interval);
+    }
+    _lastConvUs = now;
+}
+
+void Hx711Impl::countLatency(int64_t edgeUs, int64_t now) {
+    const int64_t latency = now - edgeUs;
+    _stats.latencies++;
+    _stats.latencySumUs += latency;
+    if (latency > _stats.latencyMaxUs) {
+        _stats.latencyMaxUs = latency;
+    }
+}
+
+void Hx711Impl::enqueue(const Sample& s) {
+    if (pdTRUE != xQueueSend(_samples, &s, 0)) {
+        // Drop the oldest sample to make room
+        Sample dropped;
+        xQueueReceive(_samples, &dropped, 0);
+        xQueueSend(_samples, &s, 0);
+        _stats.overruns++;
+        debug("Sample queue overrun %lu", static_cast<unsigned long>(_stats.overruns));
+    }
+}
+
+void Hx711Impl::settle(int raw) {
+    _settleSum += raw;
+    if (++_settleGot < _settleWant) {
+        return;
+    }
+    _settleResult = static_cast<int>(_settleSum / _settleGot);
+    _resultId = _settleId;
+    _settleWant = 0;
+    _holds--;
+    applyPower();
+    xEventGroupSetBits(_evGroup, SETTLE_DONE);
+}
+
 bool Hx711Impl::sample(int* sampleOut) {
     if (!isReady()) {
         return false;
@@ -98,21 +393,128 @@ bool Hx711Impl::sample(int* sampleOut) {
     return true;
 }
 
+void Hx711Impl::readConversion() {
+    bool ret = _intr->disable();
+    assert(ret);
+    // Whether this conversion is delivered is known before reading it, so
+    // the schedule can pick the pulse count that selects the next one
+    const Mode convMode = _convMode;
+    const Channel channel = channelOf(convMode);
+    const bool deliver = (0 == _discard);
+    if (deliver) {
+        schedule(channel);
+    }
+    // Converted on the core of the ISR, before the stamp grows old
+    int64_t edgeUs = Clock::stampToUs(_edgeStamp);
+    int raw = 0;
+    const uint32_t readStart = esp_cpu_get_cycle_count();
+    ret = sample(&raw);
+    const uint32_t readCycles = esp_cpu_get_cycle_count() - readStart;
+    const int64_t now = esp_timer_get_time();
+    if (!ret) {
+        err("Fail sample ADC");
+    } else {
+        if (edgeUs > now || now - edgeUs > static_cast<int64_t>(CONVERSION_TIMEOUT_MS) * 1000) {
+            // Stamp isn't of this conversion, e.g. read without an edge
+            edgeUs = now;
+        }
+        countInterval(now);
+        countLatency(edgeUs, now);
+        _convMode = _mode;
+        if (!deliver) {
+            _discard--;
+            _stats.discarded++;
+            trace("Discard %d", raw);
+        } else {
+            const size_t ch = static_cast<size_t>(channel);
+            _stats.delivered[ch]++;
+            _stats.lastRaw[ch] = raw;
+            if (Channel::A == channel) {
+                _lastSample = raw;
+            }
+            const Sample s{raw, now, channel, readCycles, edgeUs};
+            enqueue(s);
+            if (_tap) {
+                _tap(s);
+            }
+            if (_settleWant > 0 && channel == channelOf(_primary)) {
+                settle(raw);
+            }
+            trace("%c %d", Channel::A == channel ? 'A' : 'B', raw);
+        }
+        if (_convMode != convMode) {
+            // Input switched, following conversions are made while it settles
+            _discard = SETTLE_CONVERSIONS;
+        }
+    }
+    if (_poweredUp) {
+        ret = _intr->enable();
+        assert(ret);
+    }
+}
+
 void Hx711Impl::run() {
     EventBits_t evts;
+    const EventBits_t waitFor = SAMPLE_READY | POWER_DOWN | POWER_UP | MODE_CHANGE | SETTLE_START | SETTLE_CANCEL | INTERLEAVE | STATS_RESET | TAP_CHANGE;
     while (true) {
-        evts = xEventGroupWaitBits(_evGroup, SAMPLE_READY, pdTRUE, pdFALSE, portMAX_DELAY);
-        if (evts & SAMPLE_READY) {
-            bool ret = _intr->disable();
-            assert(ret);
-            ret = sample(&_lastSample);
-            if (!ret) {
-                err("Fail sample ADC");
+        evts = xEventGroupWaitBits(_evGroup, waitFor, pdTRUE, pdFALSE, portMAX_DELAY);
+        if (evts & (POWER_DOWN | POWER_UP)) {
+            _wantUp = (evts & POWER_UP);
+            applyPower();
+            xEventGroupSetBits(_evGroup, POWER_DONE);
+        }
+        if (evts & MODE_CHANGE) {
+            debug("Mode %u -> %u", _primary, _nextPrimary);
+            _primary = _nextPrimary;
+            if (Channel::A == _phase) {
+                // Switch is detected when the new pulse count is clocked
+                _mode = _primary;
+            }
+        }
+        if (evts & INTERLEAVE) {
+            debug("Interleave A:B %u:%u", _nextCountA, _nextCountB);
+            _countA = _nextCountA;
+            _countB = _nextCountB;
+            _lastCountB = _countB;
+            _phase = Channel::A;
+            _phaseCount = 0;
+            _mode = _primary;
+            clearStats();
+        }
+        if (evts & STATS_RESET) {
+            clearStats();
+        }
+        if (evts & TAP_CHANGE) {
+            if (_nextTap && !_tap) {
+                _holds++;
+            } else if (!_nextTap && _tap) {
+                _holds--;
             }
-            ret = _intr->enable();
-            assert(ret);
-            trace("%d", _lastSample);
+            _tap = _nextTap;
+            applyPower();
+            xEventGroupSetBits(_evGroup, POWER_DONE);
+        }
+        // A cancel is handled first, and only for the read it was meant for,
+        // so it can't end a request made after it
+        if ((evts & SETTLE_CANCEL) && _settleWant > 0 && _cancelId == _settleId) {
+            _settleWant = 0;
+            _holds--;
+            applyPower();
+        }
+        if (evts & SETTLE_START) {
+            if (0 == _settleWant) {
+                _holds++;
+            }
+            _settleId = _settleSeq;
+            _settleWant = _nextSettleWant;
+            _settleGot = 0;
+            _settleSum = 0;
+            applyPower();
+        }
+        if ((evts & SAMPLE_READY) && _poweredUp) {
+            readConversion();
         }
+        publishStats();
     }
 }
 
@@ -120,4 +522,4 @@ std::unique_ptr<Hx711> Hx711::create() {
     return std::make_unique<Hx711Impl>();
 }
 
-} // namespace
\ No newline at end of file
+} // namespace
@@ -6,6 +6,8 @@
 
 #include <memory>
 #include <cinttypes>
+#include <optional>
+#include <functional>
 
 namespace beegram {
 
@@ -21,6 +23,38 @@ public:
         CH_B_GN32   = 26,   ///< Channel B, gain 32
         CH_A_GN64   = 27,   ///< Channel A, gain 64
     };
+    /// @brief ADC input channel
+    enum class Channel : uint8_t {
+        A = 0,
+        B = 1,
+    };
+    static constexpr size_t CHANNEL_COUNT = 2;
+    /// @brief A single conversion result
+    struct Sample {
+        int raw;            ///< Raw ADC sample
+        int64_t timeUs;     ///< Time when the sample was read, us since boot
+        Channel channel;    ///< Input channel of the conversion
+        uint32_t readCycles;    ///< CPU cycles spent clocking out the frame
+        int64_t edgeUs;     ///< Time of the data ready edge, i.e. of the conversion, us since boot
+    };
+    /// @brief Conversion counters since the last change of schedule
+    struct Stats {
+        int64_t sinceUs;                    ///< Start of counting, us since boot
+        uint32_t delivered[CHANNEL_COUNT];  ///< Conversions delivered per channel
+        uint32_t discarded;                 ///< Conversions dropped while the input settled
+        uint32_t overruns;                  ///< Samples dropped from a full queue
+        int lastRaw[CHANNEL_COUNT];         ///< Latest sample per channel
+        uint32_t intervals;                 ///< Intervals measured between consecutive conversions
+        int64_t intervalMinUs;              ///< Shortest interval
+        int64_t intervalMaxUs;              ///< Longest interval
+        int64_t intervalSumUs;              ///< Sum of intervals
+        uint64_t intervalSqSumUs;           ///< Sum of squared intervals, us^2
+        uint32_t latencies;                 ///< Conversions read since the data ready edge
+        int64_t latencySumUs;               ///< Sum of times from edge to read
+        int64_t latencyMaxUs;               ///< Longest time from edge to read
+    };
+    /// @brief Receives conversions on the driver task, must not block
+    using Tap = std::function<void(const Sample&)>;
     virtual ~Hx711() = default;
 
     /**
@@ -38,11 +72,85 @@ public:
     virtual bool isReady() = 0;
 
     /**
-     * Read an ADC sample
+     * Read the latest sample of the primary channel
      * @return Raw ADC sample
     */
     virtual int read() = 0;
 
+    /**
+     * Wait for the next conversion. Conversions are queued by the driver,
+     * the oldest is dropped if the queue is full.
+     * @param sample Receives the sample
+     * @param timeoutMs Maximum time to wait
+     * @return True if a sample was received; false on timeout
+    */
+    virtual bool waitSample(Sample& sample, uint32_t timeoutMs) = 0;
+
+    /**
+     * Put the ADC into power down mode. No conversions are made until
+     * powered up again.
+     * @return True if succeeded; false otherwise
+    */
+    virtual bool powerDown() = 0;
+
+    /**
+     * Wake the ADC from power down mode. Discards queued conversions and
+     * those made while the input settles.
+     * @return True if succeeded; false otherwise
+    */
+    virtual bool powerUp() = 0;
+
+    /**
+     * Change the conversion mode of the primary channel. Takes effect after
+     * the next conversion, the conversions made while the input settles are
+     * discarded.
+     * @param mode New conversion mode
+     * @return True if succeeded; false otherwise
+    */
+    virtual bool setMode(Mode mode) = 0;
+
+    /// @return Conversion mode of the primary channel
+    virtual Mode getMode() const = 0;
+
+    /**
+     * Interleave conversions of channel B (gain 32) with the primary channel
+     * A. Every switch of channel costs the conversions made while the input
+     * settles, so longer runs give better throughput. Resets statistics.
+     * @param countA Number of channel A conversions in a row, at least 1
+     * @param countB Number of channel B conversions in a row, 0 to disable
+     * @return True if succeeded; false otherwise
+    */
+    virtual bool setInterleave(unsigned countA, unsigned countB) = 0;
+
+    /// @return Conversion counters since the last change of schedule
+    virtual Stats getStats() const = 0;
+
+    /**
+     * Restart conversion counters. The intervals between conversions show
+     * how promptly the driver task reads them, i.e. the timing jitter of
+     * samples.
+     * @return True if succeeded; false otherwise
+    */
+    virtual bool resetStats() = 0;
+
+    /**
+     * Read a settled average of the primary channel. Powers the ADC up for
+     * the duration if needed, skips the conversions made while the input
+     * settles and averages the next n. Blocks for about n conversion periods.
+     * @param n Number of conversions to average
+     * @return Mean of raw samples; empty on failure
+    */
+    virtual std::optional<int> readSettled(unsigned n) = 0;
+
+    /**
+     * Install a tap which receives every delivered conversion of both
+     * channels, independent of the sample queue. The ADC stays powered
+     * while a tap is installed.
+     * @param tap Receiver; empty to remove. Not called after this returns.
+     * @return True if succeeded; false otherwise
+    */
+    virtual bool setTap(const Tap& tap) = 0;
+
     /**
      * Create a singleton instance of the Hx711 driver
     */
@@ -0,0 +1,346 @@
+#!/usr/bin/env python3
+"""
+Backend stand-in for the backfill protocol, see main/Backfill.hpp.
+
+Keeps the rollup buckets received from each device, by boot and tier, and
+answers every sync with an ack of what it has and the ranges it misses.
+It counts the bytes of live and backfill messages, buckets received twice,
+and what a device would have resent for each gap found without the ranges:
+everything from the first missing bucket on ("resend from gap"), or
+everything it held ("resend all"). The difference is redundant bytes
+avoided.
+
+Usage:
+  server.py sim [--hours H] [--outage AT_H:LEN_H ...] [--loss PCT] [--rate B_PER_S] [--seed N]
+      Run a model of the device, flushes, link and budget as in the
+      firmware, against the backend in process. Needs no hardware.
+  server.py mqtt HOST [--port PORT] [--drop PCT]
+      Serve devices through the broker of support/broker/run.sh. --drop
+      ignores a share of live buckets, to make gaps. Needs paho-mqtt. On
+      the device set bf_rate, configure the broker and let it flush.
+"""
+
+import argparse
+import collections
+import os
+import random
+import ssl
+import struct
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "telemetry"))
+import decode  # noqa: E402
+
+ACK_HEADER = "<IIIB"
+ACK_RANGE = "<II"
+MAX_RANGES = 8
+
+
+class Stream:
+    """Buckets of one device boot and tier"""
+
+    def __init__(self):
+        self.have = set()
+        self.asked = set()
+        self.oldest = 0
+        self.next = 0
+        self.recovering = False
+
+    def missing(self):
+        """Ranges [first, end) below next not received, oldest first"""
+        ranges, start = [], None
+        for seq in range(self.next):
+            if seq not in self.have and start is None:
+                start = seq
+            elif seq in self.have and start is not None:
+                ranges.append((start, seq))
+                start = None
+        if start is not None:
+            ranges.append((start, self.next))
+        return ranges
+
+
+class Backend:
+    def __init__(self, drop=0.0, rand=None):
+        self.streams = {}
+        self.metrics = collections.Counter()
+        self.drop = drop
+        self.rand = rand or random.Random()
+
+    def stream(self, device, boot, tier):
+        return self.streams.setdefault((device, boot, tier), Stream())
+
+    def receive(self, device, payload):
+        """Take one message of a device, return the ack to send back or None"""
+        msg = decode.decode(payload)
+        m = self.metrics
+        if msg["schema"] == "rollup" and "seq" in msg:
+            if self.rand.random() < self.drop:
+                m["dropped"] += 1
+                return None
+            m["live_msgs"] += 1
+            m["live_b"] += len(payload)
+            self.add(self.stream(device, msg["boot"], msg["tier"]), [msg["seq"]])
+        elif msg["schema"] == "backfill":
+            m["backfill_msgs"] += 1
+            m["backfill_b"] += len(payload)
+            seqs = range(msg["first"], msg["first"] + len(msg["buckets"]))
+            self.add(self.stream(device, msg["boot"], msg["tier"]), seqs)
+        elif msg["schema"] == "sync":
+            m["syncs"] += 1
+            m["sync_b"] += len(payload)
+            return self.ack(self.stream(device, msg["boot"], msg["tier"]), msg)
+        return None
+
+    def add(self, stream, seqs):
+        for seq in seqs:
+            if seq in stream.have:
+                self.metrics["duplicates"] += 1
+            else:
+                self.metrics["buckets"] += 1
+            stream.have.add(seq)
+
+    def ack(self, stream, sync):
+        stream.oldest, stream.next = sync["oldest"], sync["next"]
+        missing = stream.missing()
+        acked = missing[0][0] if missing else stream.next
+        # Only what the device still holds can come back
+        wanted = [(max(f, stream.oldest), e) for f, e in missing if e > stream.oldest][:MAX_RANGES]
+        if wanted and not stream.recovering:
+            # A device without ranges would resend this once per gap, as
+            # live messages
+            stream.recovering = True
+            bucket_b = self.metrics["live_b"] / max(1, self.metrics["live_msgs"])
+            self.metrics["gap_resend_b"] += int((stream.next - wanted[0][0]) * bucket_b)
+            self.metrics["all_resend_b"] += int((stream.next - stream.oldest) * bucket_b)
+            self.metrics["gaps"] += 1
+        elif not wanted:
+            stream.recovering = False
+        for f, e in wanted:
+            self.metrics["requested"] += len(set(range(f, e)) - stream.asked)
+            stream.asked.update(range(f, e))
+        tier = decode.ROLLUP_TIERS.index(sync["tier"])
+        ack = struct.pack(ACK_HEADER, sync["boot"], sync["batch"], acked, tier)
+        ack += b"".join(struct.pack(ACK_RANGE, f, e) for f, e in wanted)
+        self.metrics["ack_b"] += len(ack)
+        return ack
+
+    def report(self):
+        m = self.metrics
+        held = sum(len(s.have) for s in self.streams.values())
+        lost = sum(s.next - len(s.have) for s in self.streams.values())
+        lines = [
+            "buckets %d received, %d missing, %d duplicates" % (held, lost, m["duplicates"]),
+            "live %d B in %d msgs, backfill %d B in %d msgs, sync %d B, ack %d B" % (
+                m["live_b"], m["live_msgs"], m["backfill_b"], m["backfill_msgs"], m["sync_b"], m["ack_b"]),
+            "gaps found %d, buckets requested %d" % (m["gaps"], m["requested"]),
+        ]
+        # Syncs and acks are the same for any resend scheme which knows what
+        # arrived, so only the buckets resent are compared
+        for name, key in (("resend from gap", "gap_resend_b"), ("resend all", "all_resend_b")):
+            avoided = m[key] - m["backfill_b"]
+            lines.append("vs %s: %d B, redundant bytes avoided %d B (%.0f%%)" % (
+                name, m[key], avoided, 100.0 * avoided / m[key] if m[key] else 0.0))
+        if m["dropped"]:
+            lines.append("dropped on purpose %d" % m["dropped"])
+        return "\n".join(lines)
+
+
+class Cbor:
+    """The subset of CBOR the device writes, see main/Cbor.hpp"""
+
+    def __init__(self):
+        self.buf = bytearray()
+
+    def head(self, major, val):
+        if val < 24:
+            self.buf.append(major << 5 | val)
+        else:
+            n = 0 if val <= 0xFF else 1 if val <= 0xFFFF else 2 if val <= 0xFFFFFFFF else 3
+            self.buf.append(major << 5 | (24 + n))
+            self.buf += val.to_bytes(1 << n, "big")
+        return self
+
+    def uint(self, val):
+        return self.head(0, val)
+
+    def int(self, val):
+        return self.head(0, val) if val >= 0 else self.head(1, -1 - val)
+
+    def float(self, val):
+        self.buf.append(0xFA)
+        self.buf += struct.pack(">f", val)
+        return self
+
+    def array(self, n):
+        return self.head(4, n)
+
+
+class Device:
+    """Model of the firmware: 1 minute upload tier, Cloud queue and Backfill"""
+    PERIOD_S = 60           # Rollup 1 minute tier
+    RING_LEN = 24 * 60
+    QUEUE_LEN = 8           # Cloud NORMAL_QUEUE_LEN, further messages are dropped
+    PAYLOAD_MAX_LEN = 200
+    RUN_MAX_LEN = 8
+    BURST_S = 600
+    TIER = 0
+
+    def __init__(self, rate, boot, rand):
+        self.rate, self.boot, self.rand = rate, boot, rand
+        self.buckets = {}
+        self.next = 0
+        self.queue = []
+        self.batch = 0
+        self.budget = 0
+        self.refill_t = 0
+        self.wants = []
+        self.weight_g = 40000
+
+    def bucket(self, seq, t):
+        self.weight_g += self.rand.randint(-30, 30)
+        w = self.weight_g
+        return [1700000000 + t, 60, w - self.rand.randint(0, 40), w + self.rand.randint(0, 40), w, 12.5]
+
+    def close(self, t):
+        """Close a bucket and queue its live message"""
+        b = self.bucket(self.next, t)
+        self.buckets[self.next] = b
+        self.buckets.pop(self.next - self.RING_LEN, None)
+        msg = Cbor().array(10).uint(11).uint(self.boot).uint(self.next).uint(self.TIER)
+        for v in b[:2]:
+            msg.uint(v)
+        for v in b[2:5]:
+            msg.int(v)
+        msg.float(b[5])
+        self.next += 1
+        if len(self.queue) < self.QUEUE_LEN:
+            self.queue.append(bytes(msg.buf))
+
+    def oldest(self):
+        return max(0, self.next - self.RING_LEN)
+
+    def run(self, first, n):
+        msg = Cbor().array(5).uint(13).uint(self.boot).uint(self.TIER).uint(first).array(n)
+        for seq in range(first, first + n):
+            b = self.buckets[seq]
+            msg.array(6).uint(b[0]).uint(b[1]).int(b[2]).int(b[3]).int(b[4]).float(b[5])
+        return bytes(msg.buf)
+
+    def flush(self, t, backend, loss):
+        """Connected flush: live first, then sync, ack and backfill"""
+        send = lambda payload: self.rand.random() >= loss and backend.receive("sim", payload)
+        for payload in self.queue:
+            send(payload)
+        self.queue = []
+        self.budget = min(self.budget + self.rate * (t - self.refill_t), self.rate * self.BURST_S)
+        self.refill_t = t
+        self.batch += 1
+        sync = bytes(Cbor().array(6).uint(12).uint(self.boot).uint(self.TIER).uint(self.oldest())
+                     .uint(self.next).uint(self.batch).buf)
+        ack = send(sync)
+        if ack and self.rand.random() >= loss:
+            boot, batch, _, tier = struct.unpack_from(ACK_HEADER, ack)
+            off = struct.calcsize(ACK_HEADER)
+            self.wants = [list(struct.unpack_from(ACK_RANGE, ack, o)) for o in range(off, len(ack), 8)]
+        for r in self.wants:
+            while r[0] < r[1]:
+                if self.budget < self.PAYLOAD_MAX_LEN:
+                    return
+                n = 0
+                while n < self.RUN_MAX_LEN and r[0] + n < r[1] and r[0] + n in self.buckets:
+                    n += 1
+                if n == 0:
+                    r[0] += 1
+                    continue
+                payload = self.run(r[0], n)
+                while len(payload) > self.PAYLOAD_MAX_LEN:
+                    n -= 1
+                    payload = self.run(r[0], n)
+                send(payload)
+                r[0] += n
+                self.budget -= len(payload)
+        self.wants = []
+
+
+def simulate(args):
+    rand = random.Random(args.seed)
+    backend = Backend(rand=rand)
+    device = Device(args.rate, 1, rand)
+    outages = []
+    for spec in args.outage or ["12:6"]:
+        at, length = (float(v) for v in spec.split(":"))
+        outages.append((at * 3600, (at + length) * 3600))
+    steps = int(args.hours * 3600 / Device.PERIOD_S)
+    for step in range(steps):
+        t = step * Device.PERIOD_S
+        device.close(t)
+        if not any(start <= t < end for start, end in outages):
+            device.flush(t, backend, args.loss / 100.0)
+    print("%.0f h of 1 minute buckets, %s, loss %.1f%%, bf_rate %d B/s" % (
+        args.hours, ", ".join("outage at %g h for %g h" % (s / 3600, (e - s) / 3600) for s, e in outages),
+        args.loss, args.rate))
+    print(backend.report())
+    return 0
+
+
+def serve(args):
+    try:
+        import paho.mqtt.client as mqtt
+    except ImportError:
+        print("Needs paho-mqtt: pip install paho-mqtt", file=sys.stderr)
+        return 1
+    backend = Backend(drop=args.drop / 100.0)
+    try:
+        client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION1)
+    except AttributeError:
+        client = mqtt.Client()
+    # The broker's certificate is throwaway and self-signed
+    client.tls_set(cert_reqs=ssl.CERT_NONE)
+    client.tls_insecure_set(True)
+
+    def on_connect(client, userdata, flags, rc):
+        for topic in ("rollup", "sync", "backfill"):
+            client.subscribe("beegram/+/" + topic)
+
+    def on_message(client, userdata, msg):
+        device = msg.topic.split("/")[1]
+        try:
+            ack = backend.receive(device, msg.payload)
+        except decode.CborError as e:
+            print("%s: %s" % (msg.topic, e), file=sys.stderr)
+            return
+        if ack is not None:
+            client.publish("beegram/%s/ack" % device, ack)
+            print(backend.report() + "\n", flush=True)
+
+    client.on_connect = on_connect
+    client.on_message = on_message
+    client.connect(args.host, args.port)
+    print("Serving devices through %s:%d, Ctrl-C to stop" % (args.host, args.port))
+    try:
+        client.loop_forever()
+    except KeyboardInterrupt:
+        print(backend.report())
+    return 0
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = ap.add_subparsers(dest="mode", required=True)
+    sim = sub.add_parser("sim")
+    sim.add_argument("--hours", type=float, default=48)
+    sim.add_argument("--outage", action="append", help="start and length in h, e.g. 12:6")
+    sim.add_argument("--loss", type=float, default=1.0, help="%% of messages lost either way")
+    sim.add_argument("--rate", type=int, default=50, help="bf_rate of the device, B/s")
+    sim.add_argument("--seed", type=int, default=1)
+    live = sub.add_parser("mqtt")
+    live.add_argument("host")
+    live.add_argument("--port", type=int, default=8883)
+    live.add_argument("--drop", type=float, default=0.0, help="%% of live buckets ignored")
+    args = ap.parse_args()
+    return simulate(args) if args.mode == "sim" else serve(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,36 @@
+#!/bin/bash
+#
+# Local MQTT over TLS broker standing in for the cloud, for checking session
+# resumption and connection reuse of the uplink.
+#
+# Needs mosquitto and openssl. Generates a throwaway self-signed certificate,
+# so on the device turn verification off:
+#
+#   mqtt host <address of this machine> 8883
+#   mqtt verify 0
+#   wifi up
+#   mqtt test       # full handshake
+#   mqtt test       # resumed handshake
+#
+# Every publish from the device shows up in the verbose broker log, the
+# handshake counts and durations in the output of "mqtt".
+
+set -e
+
+PORT="${1:-8883}"
+DIR="$(mktemp -d)"
+trap 'rm -rf "$DIR"' EXIT
+
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 1 \
+    -subj "/CN=beegram-broker" -keyout "$DIR/key.pem" -out "$DIR/cert.pem" 2>/dev/null
+
+cat > "$DIR/mosquitto.conf" <<EOF
+listener $PORT
+certfile $DIR/cert.pem
+keyfile $DIR/key.pem
+tls_version tlsv1.2
+allow_anonymous true
+EOF
+
+echo "Broker on port $PORT, Ctrl-C to stop"
+mosquitto -v -c "$DIR/mosquitto.conf"
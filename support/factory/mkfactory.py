@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+"""
+Make the factory data image for partition "dev_id".
+
+The layout is described in main/Factory.hpp. Certificates and the key may
+be PEM or DER, they are stored as DER. Write the image to a device with
+
+    parttool.py write_partition --partition-name dev_id --input factory.bin
+
+Usage: mkfactory.py OUT [--id ID] [--calib LOAD_LOW KG_LOW LOAD_HIGH KG_HIGH]
+                        [--ca FILE] [--cert FILE] [--key FILE]
+"""
+
+import argparse
+import base64
+import re
+import struct
+import sys
+import zlib
+
+MAGIC = b"BGF1"
+VERSION = 1
+# Partition scheme version, see partitions.csv
+SCHEME = 3
+PARTITION_SIZE = 0x4000
+ID, CALIB, CA, CERT, KEY = 1, 2, 3, 4, 5
+HEADER_FMT = "<4sHHHHII"
+RECORD_FMT = "<HHII"
+CALIB_FMT = "<ifif"
+
+
+def der(path):
+    data = open(path, "rb").read()
+    pem = re.search(rb"-----BEGIN [^-]+-----(.*?)-----END [^-]+-----", data, re.S)
+    return base64.b64decode(b"".join(pem.group(1).split())) if pem else data
+
+
+def pad(data):
+    return data + b"\0" * (-len(data) % 4)
+
+
+def make(records):
+    """Image of records, a list of (tag, bytes)"""
+    header_len = struct.calcsize(HEADER_FMT)
+    table_len = len(records) * struct.calcsize(RECORD_FMT)
+    table = b""
+    data = b""
+    offset = header_len + table_len
+    for tag, payload in records:
+        table += struct.pack(RECORD_FMT, tag, 0, offset + len(data), len(payload))
+        data += pad(payload)
+    body = table + data
+    header = struct.pack(HEADER_FMT, MAGIC, VERSION, SCHEME, len(records), 0, len(body), zlib.crc32(body))
+    image = header + body
+    if len(image) > PARTITION_SIZE:
+        sys.exit(f"Factory data of {len(image)} B doesn't fit partition of {PARTITION_SIZE} B")
+    return image
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Make factory data for partition dev_id")
+    parser.add_argument("out", help="image to write")
+    parser.add_argument("--id", help="device id, also the MQTT client id (up to 23 characters)")
+    parser.add_argument("--calib", nargs=4, metavar=("LOAD_LOW", "KG_LOW", "LOAD_HIGH", "KG_HIGH"),
+                        help="calibration points measured at the factory")
+    parser.add_argument("--ca", help="CA certificate of the broker")
+    parser.add_argument("--cert", help="certificate of the device")
+    parser.add_argument("--key", help="private key of the device")
+    args = parser.parse_args()
+
+    records = []
+    if args.id:
+        if len(args.id) > 23:
+            sys.exit("Device id longer than 23 characters")
+        records.append((ID, args.id.encode()))
+    if args.calib:
+        load_low, kg_low, load_high, kg_high = args.calib
+        records.append((CALIB, struct.pack(CALIB_FMT, int(load_low), float(kg_low), int(load_high), float(kg_high))))
+    for tag, path in ((CA, args.ca), (CERT, args.cert), (KEY, args.key)):
+        if path:
+            records.append((tag, der(path)))
+    if bool(args.cert) != bool(args.key):
+        sys.exit("Certificate and key go together")
+
+    image = make(records)
+    # Rest of the partition as erased flash
+    open(args.out, "wb").write(image + b"\xff" * (PARTITION_SIZE - len(image)))
+    print(f"{args.out}: {len(records)} records, {len(image)} of {PARTITION_SIZE} B")
+
+
+if __name__ == "__main__":
+    main()
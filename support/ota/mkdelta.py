@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+"""
+Make a firmware delta for the "ota" shell command.
+
+The delta rebuilds NEW from ranges of OLD, the image running on the
+device, and literal bytes, see main/Ota.hpp for the format. The delta is
+applied to OLD again before it's written, to check it.
+
+Usage: mkdelta.py OLD NEW DELTA     e.g. build/beegram.bin of each version
+"""
+
+import hashlib
+import struct
+import sys
+
+MAGIC = b"BGD1"
+END, COPY, DATA = 0, 1, 2
+OP_FMT = "<BII"
+# Matches are looked up by blocks of the old image at every STEP bytes
+BLOCK = 32
+STEP = 4
+
+
+def index(old):
+    blocks = {}
+    for pos in range(0, len(old) - BLOCK + 1, STEP):
+        blocks.setdefault(old[pos:pos + BLOCK], pos)
+    return blocks
+
+
+def diff(old, new):
+    """Yield (op, offset, bytes or length) covering new"""
+    blocks = index(old)
+    literal = bytearray()
+    pos = 0
+    while pos < len(new):
+        src = blocks.get(new[pos:pos + BLOCK])
+        if src is None:
+            literal.append(new[pos])
+            pos += 1
+            continue
+        # Grow the match both ways, backwards into the pending literal
+        back = 0
+        while back < len(literal) and src - back > 0 and old[src - back - 1] == literal[-back - 1]:
+            back += 1
+        end = pos + BLOCK
+        while end < len(new) and src + end - pos < len(old) and old[src + end - pos] == new[end]:
+            end += 1
+        if back:
+            del literal[-back:]
+        if literal:
+            yield DATA, 0, bytes(literal)
+            literal.clear()
+        yield COPY, src - back, end - pos + back
+        pos = end
+    if literal:
+        yield DATA, 0, bytes(literal)
+
+
+def make(old, new):
+    out = bytearray(MAGIC)
+    out += struct.pack("<I", len(old)) + hashlib.sha256(old).digest()
+    out += struct.pack("<I", len(new)) + hashlib.sha256(new).digest()
+    counts = {COPY: 0, DATA: 0}
+    for op, offset, arg in diff(old, new):
+        counts[op] += 1
+        if op == COPY:
+            out += struct.pack(OP_FMT, COPY, offset, arg)
+        else:
+            out += struct.pack(OP_FMT, DATA, 0, len(arg)) + arg
+    out += struct.pack(OP_FMT, END, 0, 0)
+    return bytes(out), counts
+
+
+def apply(old, delta):
+    assert delta[:4] == MAGIC, "not a delta"
+    src_len, = struct.unpack_from("<I", delta, 4)
+    assert src_len == len(old) and delta[8:40] == hashlib.sha256(old).digest(), "delta for another image"
+    dst_len, = struct.unpack_from("<I", delta, 40)
+    dst_hash = delta[44:76]
+    out = bytearray()
+    pos = 76
+    while True:
+        op, offset, length = struct.unpack_from(OP_FMT, delta, pos)
+        pos += struct.calcsize(OP_FMT)
+        if op == END:
+            break
+        if op == COPY:
+            out += old[offset:offset + length]
+        elif op == DATA:
+            out += delta[pos:pos + length]
+            pos += length
+        else:
+            raise ValueError("unknown op %d" % op)
+    assert pos == len(delta), "data after end"
+    assert len(out) == dst_len and hashlib.sha256(out).digest() == dst_hash, "result doesn't match"
+    return bytes(out)
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit(__doc__)
+    with open(sys.argv[1], "rb") as f:
+        old = f.read()
+    with open(sys.argv[2], "rb") as f:
+        new = f.read()
+    delta, counts = make(old, new)
+    assert apply(old, delta) == new
+    with open(sys.argv[3], "wb") as f:
+        f.write(delta)
+    print("old %d B, new %d B, delta %d B (%.1f%%), %d copies, %d literals"
+          % (len(old), len(new), len(delta), 100.0 * len(delta) / max(1, len(new)), counts[COPY], counts[DATA]))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+"""
+Local file server standing in for the update server.
+
+Serves the files of a directory over plain HTTP and logs the bytes sent
+and the time taken for each request. --rate limits the bandwidth, to try
+updates over a link as weak as at the hives.
+
+Usage: serve.py [DIR] [--port PORT] [--rate BYTES_PER_S]
+
+On the device, with Wi-Fi configured:
+
+    ota http://<address of this machine>:8000/beegram.delta
+    ota restart
+"""
+
+import argparse
+import functools
+import http.server
+import time
+
+CHUNK = 1024
+
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+    rate = 0
+
+    def copyfile(self, source, outputfile):
+        start = time.monotonic()
+        sent = 0
+        while True:
+            buf = source.read(CHUNK)
+            if not buf:
+                break
+            outputfile.write(buf)
+            sent += len(buf)
+            if self.rate:
+                # Sleep until the average is back at the rate
+                ahead = sent / self.rate - (time.monotonic() - start)
+                if ahead > 0:
+                    time.sleep(ahead)
+        took = time.monotonic() - start
+        self.log_message("sent %d B in %.1f s", sent, took)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("dir", nargs="?", default=".")
+    ap.add_argument("--port", type=int, default=8000)
+    ap.add_argument("--rate", type=int, default=0, help="bytes per second, 0 for unlimited")
+    args = ap.parse_args()
+    Handler.rate = args.rate
+    handler = functools.partial(Handler, directory=args.dir)
+    server = http.server.ThreadingHTTPServer(("", args.port), handler)
+    print("Serving %s on port %d, Ctrl-C to stop" % (args.dir, args.port))
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
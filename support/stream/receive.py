@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+"""
+Receive the binary sample stream of the "stream" shell command.
+
+Frames are COBS encoded and delimited by a zero byte. The decoded payload
+is a frame type, little endian fields and a CRC-16/CCITT-FALSE over all of
+it, see main/Ush.cpp. Samples are written as CSV to stdout, gaps in the
+sequence and frame errors are reported on stderr.
+
+Usage: receive.py PORT [BAUD]     needs pyserial; start the stream first
+       receive.py -              read a captured stream from stdin
+"""
+
+import struct
+import sys
+
+SAMPLE = 1
+STATUS = 2
+SAMPLE_FMT = "<BIqiB"
+STATUS_FMT = "<BIIII"
+CHANNELS = ["A", "B"]
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+        crc &= 0xFFFF
+    return crc
+
+
+def cobs_decode(frame):
+    out = bytearray()
+    pos = 0
+    while pos < len(frame):
+        code = frame[pos]
+        if code == 0 or pos + code > len(frame):
+            raise ValueError("bad COBS code")
+        out += frame[pos + 1:pos + code]
+        pos += code
+        if code < 0xFF and pos < len(frame):
+            out.append(0)
+    return bytes(out)
+
+
+def frames(read):
+    """Yield decoded frame payloads, CRC checked"""
+    buf = bytearray()
+    while True:
+        chunk = read()
+        if chunk is None:
+            return
+        buf += chunk
+        while True:
+            end = buf.find(0)
+            if end < 0:
+                break
+            raw, buf = bytes(buf[:end]), buf[end + 1:]
+            if not raw:
+                continue
+            try:
+                payload = cobs_decode(raw)
+            except ValueError as e:
+                yield None, str(e)
+                continue
+            if len(payload) < 3 or crc16(payload[:-2]) != struct.unpack("<H", payload[-2:])[0]:
+                yield None, "CRC mismatch"
+                continue
+            yield payload[:-2], None
+
+
+def main(args):
+    if not args:
+        print(__doc__.strip())
+        return 1
+    if args[0] == "-":
+        read = lambda: sys.stdin.buffer.read1(4096) or None
+    else:
+        import serial
+        port = serial.Serial(args[0], int(args[1]) if len(args) > 1 else 921600, timeout=1)
+        read = lambda: port.read(4096)
+    print("seq,time_us,raw,channel")
+    expected = None
+    errors = 0
+    for payload, error in frames(read):
+        if error:
+            errors += 1
+            print("frame error: %s" % error, file=sys.stderr)
+            continue
+        if payload[0] == SAMPLE and len(payload) == struct.calcsize(SAMPLE_FMT):
+            _, seq, time_us, raw, channel = struct.unpack(SAMPLE_FMT, payload)
+            if expected is not None and seq != expected:
+                print("gap: %d samples lost before %d" % ((seq - expected) & 0xFFFFFFFF, seq), file=sys.stderr)
+            expected = (seq + 1) & 0xFFFFFFFF
+            name = CHANNELS[channel] if channel < len(CHANNELS) else channel
+            print("%d,%d,%d,%s" % (seq, time_us, raw, name))
+        elif payload[0] == STATUS and len(payload) == struct.calcsize(STATUS_FMT):
+            _, seq, sent, dropped, suppressed = struct.unpack(STATUS_FMT, payload)
+            print("status: seq %d, %d sent, %d dropped, %d log lines suppressed, %d frame errors"
+                  % (seq, sent, dropped, suppressed, errors), file=sys.stderr)
+        else:
+            errors += 1
+            print("unknown frame type %d len %d" % (payload[0], len(payload)), file=sys.stderr)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
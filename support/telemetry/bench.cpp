@@ -0,0 +1,146 @@
+/**
+ * @brief Host benchmark of binary telemetry encoding against JSON
+ *
+ * Build and run from this directory:
+ *
+ *   g++ -O2 -std=gnu++20 -I../../main bench.cpp ../../main/Telemetry.cpp -o bench && ./bench
+ *
+ * Reports bytes per message and time per encode for each schema. Cycles are
+ * counted with the time stamp counter where there is one.
+*/
+
+#include "Telemetry.hpp"
+#include "Clock.hpp"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cmath>
+#include <functional>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+using namespace beegram;
+using namespace std;
+
+static constexpr size_t ROUNDS = 200000;
+static constexpr uint32_t BOOT = 57;
+
+static const char* TYPE_NAMES[] = { "swarm", "harvest", "addition", "visit", "flow_gain", "flow_loss" };
+static const char* TIER_NAMES[] = { "1min", "15min", "1h", "1day" };
+static const char* PATH_NAMES[] = { "none", "fast", "full" };
+
+/// @brief Synced clock, boot was at a fixed UTC
+class HostClock : public Clock {
+public:
+    virtual bool init() override { return true; }
+    virtual int64_t toUtcMs(int64_t timeUs) const override { return BOOT_UTC_MS + timeUs / 1000; }
+    virtual bool sync() override { return true; }
+    virtual Stats getStats() const override { return { Source::SNTP, 1, 0, 0, 0, 0.0F, 0.0F }; }
+private:
+    static constexpr int64_t BOOT_UTC_MS = 1767225600000;
+};
+
+struct Result {
+    double bytes;
+    double ns;
+    double cycles;
+};
+
+/// Run an encoder over ROUNDS inputs, the index selects the input
+static Result run(const function<size_t(size_t i, uint8_t* buf, size_t len)>& encode) {
+    uint8_t buf[256];
+    size_t total = 0;
+    const auto start = chrono::steady_clock::now();
+#ifdef HAVE_TSC
+    const uint64_t startTsc = __rdtsc();
+#endif
+    for (size_t i = 0; i < ROUNDS; i++) {
+        total += encode(i, buf, sizeof(buf));
+        // Keep the compiler from dropping the work
+        asm volatile("" : : "r"(buf) : "memory");
+    }
+    Result r;
+#ifdef HAVE_TSC
+    r.cycles = static_cast<double>(__rdtsc() - startTsc) / ROUNDS;
+#else
+    r.cycles = NAN;
+#endif
+    r.ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / ROUNDS;
+    r.bytes = static_cast<double>(total) / ROUNDS;
+    return r;
+}
+
+static void report(const char* name, const Result& json, const Result& cbor) {
+    printf("%-8s %8.1f %8.1f %8.1f %8.1f %8.0f %8.0f %6.2f\n", name,
+        json.bytes, cbor.bytes, json.ns, cbor.ns, json.cycles, cbor.cycles, json.ns / cbor.ns);
+}
+
+int main() {
+    HostClock clock;
+    // Inputs vary per round so nothing gets constant folded
+    vector<float> weights(1024);
+    float w = 42.0F;
+    for (auto& x: weights) {
+        w += (rand() % 2001 - 1000) / 1e5F;
+        x = w;
+    }
+    auto weight = [&weights](size_t i) { return weights[i % weights.size()]; };
+
+    printf("%-8s %8s %8s %8s %8s %8s %8s %6s\n", "schema", "json B", "cbor B", "json ns", "cbor ns", "json cyc", "cbor cyc", "speed");
+
+    report("sample",
+        run([&](size_t i, uint8_t* buf, size_t len) {
+            return static_cast<size_t>(snprintf(reinterpret_cast<char*>(buf), len,
+                "{\"t\":%" PRId64 ",\"raw\":%d,\"w\":%.3f}",
+                clock.toUtcMs(static_cast<int64_t>(i) * 100000), 0x123456 + static_cast<int>(i % 1000), weight(i)));
+        }),
+        run([&](size_t i, uint8_t* buf, size_t len) {
+            return Telemetry::encodeSample(span<uint8_t>(buf, len), static_cast<int64_t>(i) * 100000,
+                0x123456 + static_cast<int>(i % 1000), weight(i), clock);
+        }));
+
+    report("rollup",
+        run([&](size_t i, uint8_t* buf, size_t len) {
+            return static_cast<size_t>(snprintf(reinterpret_cast<char*>(buf), len,
+                "{\"boot\":%lu,\"seq\":%lu,\"tier\":\"%s\",\"start\":%lu,\"n\":%lu,\"min\":%.3f,\"max\":%.3f,\"mean\":%.3f,\"sd\":%.3f}",
+                static_cast<unsigned long>(BOOT), static_cast<unsigned long>(i), TIER_NAMES[2], static_cast<unsigned long>(clock.toUtcMs(static_cast<int64_t>(i) * 3600000000) / 1000), 240UL,
+                weight(i) - 0.1F, weight(i) + 0.1F, weight(i), 0.012F));
+        }),
+        run([&](size_t i, uint8_t* buf, size_t len) {
+            const Rollup::Stats s = { static_cast<uint32_t>(i), static_cast<uint32_t>(i * 3600), 240, weight(i) - 0.1F, weight(i) + 0.1F, weight(i), 0.012F };
+            return Telemetry::encodeRollup(span<uint8_t>(buf, len), Rollup::Tier::HOUR_1, s, BOOT, clock);
+        }));
+
+    report("event",
+        run([&](size_t i, uint8_t* buf, size_t len) {
+            return static_cast<size_t>(snprintf(reinterpret_cast<char*>(buf), len,
+                "{\"type\":\"%s\",\"start\":%" PRId64 ",\"detect\":%" PRId64 ",\"size\":%.3f,\"conf\":%.2f}",
+                TYPE_NAMES[i % 6], clock.toUtcMs(static_cast<int64_t>(i) * 1000000),
+                clock.toUtcMs(static_cast<int64_t>(i) * 1000000 + 300000000),
+                -weight(i) / 20.0F, 0.93F));
+        }),
+        run([&](size_t i, uint8_t* buf, size_t len) {
+            const Detector::Event ev = { static_cast<Detector::Type>(i % 6), static_cast<int64_t>(i) * 1000000,
+                static_cast<int64_t>(i) * 1000000 + 300000000, -weight(i) / 20.0F, 0.93F };
+            return Telemetry::encodeEvent(span<uint8_t>(buf, len), ev, clock);
+        }));
+
+    report("link",
+        run([&](size_t i, uint8_t* buf, size_t len) {
+            return static_cast<size_t>(snprintf(reinterpret_cast<char*>(buf), len,
+                "{\"path\":\"%s\",\"ttc_ms\":%lu,\"fast\":%lu,\"fallback\":%lu,\"fail\":%lu,\"hs_ms\":%lu,\"hs\":%lu,\"resumed\":%lu}",
+                PATH_NAMES[1 + i % 2], 300UL + i % 100, i, i / 10, 2UL, 180UL + i % 50, i, i - i / 10));
+        }),
+        run([&](size_t i, uint8_t* buf, size_t len) {
+            const Wifi::Stats st = { static_cast<Wifi::Path>(1 + i % 2), static_cast<uint32_t>(300 + i % 100),
+                static_cast<uint32_t>(i), static_cast<uint32_t>(i / 10), 2 };
+            const Mqtt::Stats tls = { static_cast<uint32_t>(i), static_cast<uint32_t>(i - i / 10),
+                static_cast<uint32_t>(180 + i % 50), 0, 0, 0 };
+            return Telemetry::encodeLink(span<uint8_t>(buf, len), st, tls);
+        }));
+    return 0;
+}
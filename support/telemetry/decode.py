@@ -0,0 +1,171 @@
+#!/usr/bin/env python3
+"""
+Decode binary telemetry messages from the device into dicts.
+
+Messages are CBOR arrays, the first element is the schema ID, see
+main/Telemetry.hpp. Only the subset of CBOR the device writes is
+supported, so there's no dependency on a CBOR library.
+
+Usage: decode.py HEX...     decode hex-encoded messages, e.g. from the log
+"""
+
+import json
+import struct
+import sys
+
+ROLLUP_TIERS = ["1min", "15min", "1h", "1day"]
+EVENT_TYPES = ["swarm", "harvest", "addition", "visit", "flow_gain", "flow_loss"]
+LINK_PATHS = ["none", "fast", "full"]
+LOG_LEVELS = ["none", "error", "warn", "info", "debug", "verbose"]
+
+# Field names of each schema, in encoding order
+SCHEMAS = {
+    1: ("sample", ["time_ms", "raw", "weight_g"]),
+    2: ("rollup", ["tier", "start_s", "count", "min_g", "max_g", "mean_g", "sd_g"]),
+    3: ("event", ["type", "start_ms", "detect_ms", "size_g", "conf_pct"]),
+    4: ("link", ["path", "ttc_ms", "fast", "fallback", "fail", "hs_ms", "hs", "resumed"]),
+    5: ("hives", ["batches"]),
+    # Times in UTC, 0 if the device didn't know it
+    6: ("sample", ["utc_ms", "raw", "weight_g"]),
+    7: ("rollup", ["tier", "start_utc_s", "count", "min_g", "max_g", "mean_g", "sd_g"]),
+    8: ("event", ["type", "start_utc_ms", "detect_utc_ms", "size_g", "conf_pct"]),
+    9: ("hives", ["utc_batches"]),
+    10: ("log", ["boot", "time_ms", "level", "module", "suppressed", "text"]),
+    # Numbered buckets and the backfill protocol, see main/Backfill.hpp
+    11: ("rollup", ["boot", "seq", "tier", "start_utc_s", "count", "min_g", "max_g", "mean_g", "sd_g"]),
+    12: ("sync", ["boot", "tier", "oldest", "next", "batch"]),
+    13: ("backfill", ["boot", "tier", "first", "buckets"]),
+}
+ENUMS = {
+    ("rollup", "tier"): ROLLUP_TIERS,
+    ("event", "type"): EVENT_TYPES,
+    ("link", "path"): LINK_PATHS,
+    ("log", "level"): LOG_LEVELS,
+    ("sync", "tier"): ROLLUP_TIERS,
+    ("backfill", "tier"): ROLLUP_TIERS,
+}
+
+
+def _running(values):
+    """Undo the differences of a sequence"""
+    out, total = [], 0
+    for v in values:
+        total += v
+        out.append(total)
+    return out
+
+
+def _batches(batches):
+    """Samples of each hive node, with times and weights restored"""
+    out = []
+    for node, seq, start_s, intervals, weights in batches:
+        out.append({
+            "node": ":".join("%02x" % b for b in node.to_bytes(6, "big")),
+            "seq": seq,
+            "samples": [[start_s + t, g] for t, g in zip(_running(intervals), _running(weights))],
+        })
+    return out
+
+
+def _buckets(buckets):
+    """Buckets of a backfill, of consecutive seq from first"""
+    fields = SCHEMAS[11][1][3:]
+    return [dict(zip(fields, b)) for b in buckets]
+
+
+# Fields decoded further, by schema and field name
+CONVERT = {
+    ("hives", "batches"): _batches,
+    ("hives", "utc_batches"): _batches,
+    ("backfill", "buckets"): _buckets,
+}
+
+
+class CborError(ValueError):
+    pass
+
+
+def _item(buf, pos):
+    """Decode one CBOR item at pos, return (value, next pos)"""
+    if pos >= len(buf):
+        raise CborError("truncated")
+    initial = buf[pos]
+    major, info = initial >> 5, initial & 0x1F
+    pos += 1
+    if major == 7:
+        if initial == 0xF4:
+            return False, pos
+        if initial == 0xF5:
+            return True, pos
+        if initial == 0xF6:
+            return None, pos
+        if initial == 0xFA:
+            return struct.unpack(">f", buf[pos:pos + 4])[0], pos + 4
+        if initial == 0xFB:
+            return struct.unpack(">d", buf[pos:pos + 8])[0], pos + 8
+        raise CborError("unsupported simple value 0x%02x" % initial)
+    if info < 24:
+        arg = info
+    elif info <= 27:
+        n = 1 << (info - 24)
+        if pos + n > len(buf):
+            raise CborError("truncated")
+        arg = int.from_bytes(buf[pos:pos + n], "big")
+        pos += n
+    else:
+        raise CborError("indefinite lengths not supported")
+    if major == 0:
+        return arg, pos
+    if major == 1:
+        return -1 - arg, pos
+    if major in (2, 3):
+        data = bytes(buf[pos:pos + arg])
+        if len(data) != arg:
+            raise CborError("truncated")
+        return (data if major == 2 else data.decode("utf-8")), pos + arg
+    if major == 4:
+        items = []
+        for _ in range(arg):
+            val, pos = _item(buf, pos)
+            items.append(val)
+        return items, pos
+    if major == 5:
+        items = {}
+        for _ in range(arg):
+            key, pos = _item(buf, pos)
+            items[key], pos = _item(buf, pos)
+        return items, pos
+    raise CborError("unsupported major type %d" % major)
+
+
+def decode(buf):
+    """Decode one telemetry message into a dict with its schema name"""
+    val, pos = _item(buf, 0)
+    if pos != len(buf):
+        raise CborError("%d trailing bytes" % (len(buf) - pos))
+    if not isinstance(val, list) or not val or val[0] not in SCHEMAS:
+        raise CborError("unknown schema")
+    name, fields = SCHEMAS[val[0]]
+    if len(val) - 1 != len(fields):
+        raise CborError("schema %s expects %d fields, got %d" % (name, len(fields), len(val) - 1))
+    msg = {"schema": name}
+    for field, v in zip(fields, val[1:]):
+        names = ENUMS.get((name, field))
+        convert = CONVERT.get((name, field))
+        if convert:
+            v = convert(v)
+        msg[field] = names[v] if names and 0 <= v < len(names) else v
+    return msg
+
+
+def main(args):
+    if not args:
+        print(__doc__.strip())
+        return 1
+    for arg in args:
+        print(json.dumps(decode(bytes.fromhex(arg.replace(" ", "")))))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))